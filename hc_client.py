@@ -1,26 +1,44 @@
+import collections
 import numpy as np
 import socket
 import subprocess
+import threading
 import time
 import json
 import sys
 
+try:
+    import queue
+except ImportError:
+    import Queue as queue
+
 
 class HcClient(object):
     """RPC client for H*c with SHCI"""
 
-    def __init__(self, nProcs=1, runtimePath='.', shciPath='./shci', port=2018, verbose=True):
+    def __init__(self, nProcs=1, runtimePath='.', shciPath='./shci', port=2018, verbose=True,
+                 shmPath=None, shmVectors=1):
         self.nProcs = nProcs
         self.shciPath = shciPath
         self.port = port
         self.verbose = verbose
         self.runtimePath = runtimePath
+        self.shmPath = shmPath
+        self.shmVectors = shmVectors
+        self._pending = collections.deque()
+        self._sendQueue = queue.Queue()
 
     def startServer(self):
         print('Preparing SHCI Hc server...')
         config = open('config.json').read()
         config = json.loads(config)
         config['hc_server_mode'] = True
+        config['hc_server_port'] = self.port
+        if self.shmPath is not None:
+            config['hc_server_shm'] = self.shmPath
+            config['hc_server_shm_vectors'] = self.shmVectors
+        else:
+            config.pop('hc_server_shm', None)
         with open('config.json', 'w') as config_file:
             json.dump(config, config_file, indent=2)
         cmd = 'mpirun -n %d %s' % (self.nProcs, self.shciPath)
@@ -39,6 +57,14 @@ class HcClient(object):
                 self._server = socket.socket(
                     socket.AF_INET, socket.SOCK_STREAM)
                 self._server.connect(('127.0.0.1', self.port))
+                if self.shmPath is not None:
+                    self._shm = np.memmap(
+                        self.shmPath, dtype=np.float64, mode='r+',
+                        shape=(self.shmVectors * self._n,))
+                else:
+                    sender = threading.Thread(target=self._sendLoop)
+                    sender.daemon = True
+                    sender.start()
                 return
 
         raise RuntimeError('Server failed to start.')
@@ -47,36 +73,128 @@ class HcClient(object):
         return self._n
 
     def getCoefs(self):
-        self._server.send('getCoefs')
-        coefs = self._recvDoubleArr()
-        return coefs
+        return self._getVector('getCoefs')
+
+    def getDiag(self):
+        """Diagonal of the Hamiltonian as cached by the server"""
+        return self._getVector('getDiag')
 
     def Hc(self, arr):
-        self._server.send('Hc')
-        res = self._server.recv(32)
-        if res != 'ACK':
-            raise RuntimeError('Server does not ack.')
         if np.iscomplexobj(arr):
             resReal = self.Hc(arr.real)
             resImag = self.Hc(arr.imag)
             return resReal + resImag * 1j
-        else:
-            self._server.send(arr.tobytes())
-            res = self._recvDoubleArr()
-            return res
+        self._drain()
+        if self.shmPath is not None:
+            # c is written in place and replaced by Hc before the ack.
+            self._shm[:self._n] = arr
+            self._sendCmd('Hc')
+            self._recvAck()
+            return np.array(self._shm[:self._n])
+        self._sendCmd('Hc')
+        self._recvAck()
+        self._server.sendall(np.ascontiguousarray(arr, dtype=np.float64).tobytes())
+        res = self._recvDoubleArr()
+        return res
+
+    def HcBlock(self, arrs):
+        """H times each row of the 2D array arrs with one pass over the Hamiltonian"""
+        return self.submitHcBlock(arrs).result()
+
+    def submitHcBlock(self, arrs):
+        """Send the block without waiting for the result, the requests are served in order
+
+        Returns an HcRequest whose result() waits for H times the rows of arrs. Without shmPath,
+        several requests can be in flight while the client prepares the next ones.
+        """
+        arrs = np.atleast_2d(arrs)
+        if np.iscomplexobj(arrs):
+            request = self.submitHcBlock(np.vstack([arrs.real, arrs.imag]))
+            nVecs = arrs.shape[0]
+            return HcRequest(lambda: request.result()[:nVecs] + request.result()[nVecs:] * 1j)
+        arrs = np.ascontiguousarray(arrs, dtype=np.float64)
+        nVecs = arrs.shape[0]
+        cmd = 'HcBlock %d' % nVecs
+        if self.shmPath is not None:
+            self._drain()
+            self._shm[:nVecs * self._n] = arrs.ravel()
+            self._sendCmd(cmd)
+            self._recvAck()
+            res = np.array(self._shm[:nVecs * self._n]).reshape(nVecs, self._n)
+            return HcRequest(lambda: res)
+        request = HcRequest(lambda: self._waitFor(request))
+        request._nVecs = nVecs
+        self._pending.append(request)
+        self._sendQueue.put((cmd, arrs.tobytes()))
+        return request
 
     def exit(self):
-        self._server.send('exit')
+        self._drain()
+        self._sendCmd('exit')
         self._server.close()
 
+    def _getVector(self, cmd):
+        self._drain()
+        self._sendCmd(cmd)
+        if self.shmPath is not None:
+            self._recvAck()
+            return np.array(self._shm[:self._n])
+        return self._recvDoubleArr()
+
+    def _sendCmd(self, cmd):
+        # Commands are NUL padded frames of 32 bytes.
+        self._server.sendall(cmd.encode().ljust(32, b'\0'))
+
+    def _sendLoop(self):
+        # Sends the pipelined requests, so that the server can send results while we send.
+        while True:
+            cmd, data = self._sendQueue.get()
+            self._sendCmd(cmd)
+            self._server.sendall(data)
+            self._sendQueue.task_done()
+
+    def _waitFor(self, request):
+        # Results come back in the order of the requests.
+        while request._res is None:
+            pending = self._pending.popleft()
+            pending._res = self._recvExact(8 * pending._nVecs * self._n)
+        return np.frombuffer(request._res, dtype=np.float64).reshape(request._nVecs, self._n)
+
+    def _drain(self):
+        # The results of all pipelined requests are read before anything else.
+        if self._pending:
+            self._waitFor(self._pending[-1])
+        self._sendQueue.join()
+
+    def _recvAck(self):
+        if self._recvExact(3) != b'ACK':
+            raise RuntimeError('Server does not ack.')
+
+    def _recvExact(self, nBytes):
+        res = b''
+        while len(res) < nBytes:
+            chunk = self._server.recv(nBytes - len(res))
+            if not chunk:
+                raise RuntimeError('Server disconnected.')
+            res += chunk
+        return res
+
     def _recvDoubleArr(self):
-        res = self._server.recv(8 * self._n)
-        while len(res) < 8 * self._n:
-            res += self._server.recv(8 * self._n - len(res))
-        res = np.frombuffer(res, dtype=np.float64)
+        res = np.frombuffer(self._recvExact(8 * self._n), dtype=np.float64)
         return res
 
 
+class HcRequest(object):
+    """Pending result of HcClient.submitHcBlock"""
+
+    def __init__(self, getResult):
+        self._getResult = getResult
+        self._res = None
+
+    def result(self):
+        return self._getResult()
+
+
 if __name__ == '__main__':
     # Test Hc = lam * c
     client = HcClient(nProcs=1)
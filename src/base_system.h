@@ -2,6 +2,7 @@
 
 #include <fgpl/src/hash_map.h>
 #include <hps/src/hps.h>
+#include <array>
 #include <functional>
 #include <string>
 #include <vector>
@@ -66,6 +67,12 @@ class BaseSystem {
 
   virtual void update_diag_helper() = 0;
 
+  // Diagonal element of det_a from the diagonal element H_ii of a det_i it is connected to.
+  virtual double get_hamiltonian_diag_from_parent(
+      const Det& det_a, const Det&, const double) const {
+    return get_hamiltonian_elem(det_a, det_a, 0);
+  }
+
   virtual void post_variation(std::vector<std::vector<size_t>>&){};
 
   virtual void post_variation_optimization(
@@ -73,6 +80,12 @@ class BaseSystem {
 
   virtual void dump_integrals(const char*){};
 
+  // Changes whenever the Hamiltonian elements between the same dets may change.
+  virtual size_t get_integrals_hash() const { return 0; }
+
+  // Local bytes of the stored integrals, with hash tables of hash_overhead times their entries.
+  virtual size_t get_integrals_n_bytes(const double) const { return 0; }
+
   virtual void post_perturbation(){};
 
   double get_hamiltonian_elem_time_sym(
@@ -120,4 +133,51 @@ class BaseSystem {
   }
 
   virtual void variation_cleanup(){};
+
+ protected:
+  // Change of the diagonal element from det_i to det_a from the moved electrons only, in
+  // O(n_elecs). orb_energy(orb, is_up) is the one body energy of an electron plus its
+  // interaction with the electrons of det_i, pair_energy(orb1, is_up1, orb2, is_up2) the
+  // interaction of two electrons. Returns false if det_a is not connected to det_i.
+  template <class OrbEnergy, class PairEnergy>
+  bool get_diag_delta(
+      const Det& det_i,
+      const Det& det_a,
+      const OrbEnergy& orb_energy,
+      const PairEnergy& pair_energy,
+      double& delta) const {
+    const DiffResult& diff_up = det_i.up.diff(det_a.up);
+    if (diff_up.n_diffs > 2) return false;
+    const DiffResult& diff_dn = det_i.dn.diff(det_a.dn);
+    if (diff_up.n_diffs + diff_dn.n_diffs > 2) return false;
+
+    // Removed electrons count negative, added ones positive, and so do their pairs.
+    std::array<unsigned, 4> orbs;
+    std::array<bool, 4> is_ups;
+    std::array<double, 4> signs;
+    unsigned n_moves = 0;
+    const auto& add_moves = [&](const DiffResult& diff, const bool is_up) {
+      for (unsigned k = 0; k < diff.n_diffs; k++) {
+        orbs[n_moves] = diff.left_only[k];
+        is_ups[n_moves] = is_up;
+        signs[n_moves] = -1.0;
+        n_moves++;
+        orbs[n_moves] = diff.right_only[k];
+        is_ups[n_moves] = is_up;
+        signs[n_moves] = 1.0;
+        n_moves++;
+      }
+    };
+    add_moves(diff_up, true);
+    add_moves(diff_dn, false);
+
+    delta = 0.0;
+    for (unsigned m = 0; m < n_moves; m++) {
+      delta += signs[m] * orb_energy(orbs[m], is_ups[m]);
+      for (unsigned n = m + 1; n < n_moves; n++) {
+        delta += signs[m] * signs[n] * pair_energy(orbs[m], is_ups[m], orbs[n], is_ups[n]);
+      }
+    }
+    return true;
+  }
 };
@@ -0,0 +1,268 @@
+#include <chrono>
+#include <clocale>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <json/single_include/nlohmann/json.hpp>
+#include <stdexcept>
+#include "chem/chem_system.h"
+#include "config.h"
+#include "parallel.h"
+#include "result.h"
+#include "solver/davidson.h"
+#include "solver/solver.h"
+#include "util.h"
+
+// Throughputs of the hot paths on the wavefunction of bench_eps_var that shci saved in the
+// current directory, e.g. a run of examples/C or examples/Cr, written to bench_file as JSON so
+// that builds can be compared on the same wavefunction. The micro benchmarks keep the fastest of
+// bench_n_repeats runs, the stages are run once.
+class SolverBench {
+ public:
+  void run();
+
+ private:
+  Solver<ChemSystem> solver;
+
+  size_t n_repeats;
+
+  nlohmann::json benchmarks;
+
+  // Wall time of the fastest of n_calls calls of f on all the procs, in seconds.
+  template <class F>
+  static double time_best(const F& f, const size_t n_calls);
+
+  void put(const std::string& name, const double seconds, const nlohmann::json& entry);
+
+  void bench_half_det();
+
+  void bench_find_connected_dets(const double eps_var);
+
+  void bench_hamiltonian();
+
+  void bench_mul();
+
+  void bench_davidson();
+
+  void bench_pt_dtm(const double eps_var);
+};
+
+template <class F>
+double SolverBench::time_best(const F& f, const size_t n_calls) {
+  double best = Util::INF;
+  for (size_t i = 0; i < n_calls; i++) {
+    Parallel::barrier();
+    const auto& begin = std::chrono::high_resolution_clock::now();
+    f();
+    Parallel::barrier();
+    const auto& end = std::chrono::high_resolution_clock::now();
+    best = std::min(best, std::chrono::duration<double>(end - begin).count());
+  }
+  return best;
+}
+
+void SolverBench::put(const std::string& name, const double seconds, const nlohmann::json& entry) {
+  benchmarks[name] = entry;
+  benchmarks[name]["seconds"] = seconds;
+  if (Parallel::is_master()) {
+    printf("BENCH %s: %s\n", name.c_str(), benchmarks[name].dump().c_str());
+  }
+}
+
+void SolverBench::run() {
+  if (Config::get<std::string>("system") != "chem") {
+    throw std::invalid_argument("shci_bench only supports chem");
+  }
+  n_repeats = Config::get<size_t>("bench_n_repeats", 3);
+  const double eps_var =
+      Config::get<double>("bench_eps_var", Config::get<std::vector<double>>("eps_vars").back());
+
+  auto& system = solver.system;
+  system.setup();
+  const auto& filename = solver.get_wf_filename(eps_var);
+  if (!solver.load_variation_result(filename)) {
+    throw std::runtime_error("cannot load " + filename + ", run shci in this directory first");
+  }
+
+  bench_half_det();
+  bench_find_connected_dets(eps_var);
+  bench_hamiltonian();
+  bench_mul();
+  bench_davidson();
+  solver.hamiltonian.clear();
+  bench_pt_dtm(eps_var);
+
+  if (!Parallel::is_master()) return;
+  nlohmann::json res;
+  res["n_procs"] = Parallel::get_n_procs();
+  res["n_threads"] = Parallel::get_n_threads();
+  res["n_orbs"] = system.n_orbs;
+  res["n_elecs"] = system.n_elecs;
+  res["n_dets"] = system.get_n_dets();
+  res["eps_var"] = eps_var;
+  res["benchmarks"] = benchmarks;
+  const auto& bench_filename = Config::get<std::string>("bench_file", "bench.json");
+  std::ofstream bench_file(bench_filename);
+  bench_file << res.dump(2) << std::endl;
+  printf("Benchmarks saved to: %s\n", bench_filename.c_str());
+}
+
+void SolverBench::bench_half_det() {
+  const auto& dets = solver.system.dets;
+  const size_t n_dets = dets.size();
+
+  // Neighboring dets, which differ by a few orbitals or by many like most pairs.
+  unsigned long long n_diffs = 0;
+  const double diff_time = time_best(
+      [&]() {
+        n_diffs = 0;
+#pragma omp parallel for schedule(static) reduction(+ : n_diffs)
+        for (size_t i = 1; i < n_dets; i++) {
+          n_diffs += dets[i - 1].up.diff(dets[i].up).n_diffs;
+          n_diffs += dets[i - 1].dn.diff(dets[i].dn).n_diffs;
+        }
+      },
+      n_repeats);
+  const double n_half_det_pairs = 2.0 * (n_dets - 1);
+  put("half_det_diff",
+      diff_time,
+      {{"half_dets_per_second", n_half_det_pairs / diff_time}, {"checksum", n_diffs}});
+
+  size_t hash_sum = 0;
+  const double hash_time = time_best(
+      [&]() {
+        size_t sum = 0;
+#pragma omp parallel for schedule(static) reduction(^ : sum)
+        for (size_t i = 0; i < n_dets; i++) {
+          sum ^= dets[i].up.get_hash_value() + dets[i].dn.get_hash_value();
+        }
+        hash_sum = sum;
+      },
+      n_repeats);
+  put("half_det_get_hash_value",
+      hash_time,
+      {{"half_dets_per_second", 2.0 * n_dets / hash_time}, {"checksum", hash_sum}});
+}
+
+void SolverBench::bench_find_connected_dets(const double eps_var) {
+  const auto& system = solver.system;
+  const size_t n_dets = system.get_n_dets();
+  const size_t proc_id = Parallel::get_proc_id();
+  const size_t n_procs = Parallel::get_n_procs();
+
+  // The connections of the first variational iteration at eps_var, split over the procs.
+  unsigned long long n_connections = 0;
+  const double time = time_best(
+      [&]() {
+        unsigned long long n_connections_local = 0;
+#pragma omp parallel for schedule(dynamic, 64) reduction(+ : n_connections_local)
+        for (size_t i = proc_id; i < n_dets; i += n_procs) {
+          const double eps_min = eps_var / std::abs(system.coefs[0][i]);
+          static_cast<void>(system.find_connected_dets(
+              system.dets[i], Util::INF, eps_min, [&](const Det&, const int) {
+                n_connections_local++;
+              }));
+        }
+        MPI_Allreduce(
+            &n_connections_local,
+            &n_connections,
+            1,
+            MPI_UNSIGNED_LONG_LONG,
+            MPI_SUM,
+            MPI_COMM_WORLD);
+      },
+      n_repeats);
+  put("find_connected_dets",
+      time,
+      {{"dets_per_second", n_dets / time},
+       {"connections_per_second", n_connections / time},
+       {"n_connections", n_connections}});
+}
+
+void SolverBench::bench_hamiltonian() {
+  const double time = time_best([&]() { solver.hamiltonian.update(solver.system); }, 1);
+  const auto& matrix = solver.hamiltonian.matrix;
+  const size_t n_elems = matrix.count_n_elems();
+  put("hamiltonian_update",
+      time,
+      {{"dets_per_second", solver.system.get_n_dets() / time},
+       {"nonzeros_per_second", n_elems / time},
+       {"n_nonzeros", n_elems}});
+}
+
+void SolverBench::bench_mul() {
+  const auto& matrix = solver.hamiltonian.matrix;
+  const size_t n_elems = matrix.count_n_elems();
+  const size_t n_bytes = matrix.count_n_bytes();
+  const auto& vec = solver.system.coefs[0];
+  double checksum = 0.0;
+  const double time = time_best(
+      [&]() {
+        const auto& res = matrix.mul(vec);
+        checksum = Util::dot_omp(res, vec);
+      },
+      n_repeats);
+  put("sparse_matrix_mul",
+      time,
+      {{"nonzeros_per_second", n_elems / time},
+       {"matrix_gb_per_second", n_bytes * 1.0e-9 / time},
+       {"checksum", checksum}});
+}
+
+void SolverBench::bench_davidson() {
+  auto& system = solver.system;
+  const size_t n_dets = system.get_n_dets();
+
+  // From the first dets instead of the converged coefs, so that it takes the usual iterations.
+  std::vector<std::vector<double>> initial_vectors(system.n_states);
+  for (unsigned i_state = 0; i_state < system.n_states; i_state++) {
+    initial_vectors[i_state].assign(n_dets, 0.0);
+    initial_vectors[i_state][i_state] = 1.0;
+  }
+  const double target_error = Config::get<double>("target_error", 5.0e-5) / 500000;
+  Davidson davidson(system.n_states);
+  const double time = time_best(
+      [&]() { davidson.diagonalize(solver.hamiltonian.matrix, initial_vectors, target_error); },
+      1);
+  put("davidson_diagonalize",
+      time,
+      {{"dets_per_second", n_dets / time},
+       {"energy", davidson.get_lowest_eigenvalues()[0]},
+       {"converged", davidson.converged}});
+}
+
+void SolverBench::bench_pt_dtm(const double eps_var) {
+  // The whole deterministic PT in one batch.
+  Config::set<size_t>("n_batches_pt_dtm", 1);
+  solver.bytes_per_det = sizeof(Det);
+  solver.set_eps_pt(eps_var);
+  solver.setup_perturbation();
+  std::array<double, 1> energy_pt_dtm;
+  const double time =
+      time_best([&]() { energy_pt_dtm = solver.get_energy_pt_dtm<1>(eps_var, 0); }, 1);
+  const auto& counters_key =
+      Util::str_printf("counters/pt_dtm/%#.2e/%#.2e/", eps_var, solver.eps_pt_dtm);
+  const auto n_candidates = Result::get<unsigned long long>(counters_key + "candidates");
+  const auto n_inserts = Result::get<unsigned long long>(counters_key + "hc_sums_inserts");
+  put("pt_dtm_batch",
+      time,
+      {{"eps_pt_dtm", solver.eps_pt_dtm},
+       {"var_dets_per_second", solver.n_var_dets_global / time},
+       {"connections_per_second", n_candidates / time},
+       {"n_connections", n_candidates},
+       {"n_hc_sums_inserts", n_inserts},
+       {"energy", energy_pt_dtm[0]}});
+}
+
+int main() {
+  MPI_Init(nullptr, nullptr);
+  std::setlocale(LC_ALL, "en_US.UTF-8");
+
+  Result::init();
+
+  SolverBench().run();
+
+  MPI_Finalize();
+
+  return 0;
+}
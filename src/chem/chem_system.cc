@@ -3,6 +3,7 @@
 #include <fgpl/src/concurrent_hash_map.h>
 #include <cfloat>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include "../parallel.h"
 #include "../result.h"
@@ -39,13 +40,23 @@ void ChemSystem::setup(const bool load_integrals_from_file) {
 
   setup_sym_orbs();
 
-  Timer::start("setup hci queue");
-  setup_hci_queue();
-  Timer::end();
+  // The integrals of the later optimization iterations are only used once, so only the queues of
+  // the loaded integrals are cached.
+  const std::string& queue_cache_filename = "hci_queue_cache.dat";
+  const bool use_queue_cache =
+      load_integrals_from_file && Config::get<bool>("hci_queue_cache", false);
+  const size_t queue_cache_key = use_queue_cache ? get_queue_cache_key() : 0;
+  if (!use_queue_cache || !load_queue_cache(queue_cache_filename, queue_cache_key)) {
+    Timer::start("setup hci queue");
+    setup_hci_queue();
+    Timer::end();
 
-  Timer::start("setup singles_queue");
-  setup_singles_queue();
-  Timer::end();
+    Timer::start("setup singles_queue");
+    setup_singles_queue();
+    Timer::end();
+
+    if (use_queue_cache) save_queue_cache(queue_cache_filename, queue_cache_key);
+  }
 
   dets.push_back(integrals.det_hf);
 
@@ -120,14 +131,27 @@ void ChemSystem::setup_hci_queue() {
   std::vector<size_t> n_entries_local(n_threads, 0);
   std::vector<double> max_hci_queue_elem_local(n_threads, 0.0);
 
+  // The orbitals of the opposite spin excitations go up to 2 * n_orbs.
+  if (2 * n_orbs > 0x10000) throw std::invalid_argument("too many orbitals for the hci queue");
+  std::vector<std::vector<Hrs>> pair_entries(Integrals::combine2(n_orbs, 2 * n_orbs));
+
+  // Only the node masters compute the entries of shared queues.
+  const bool share_on_node = Config::get<bool>("share_on_node", false);
+  const unsigned n_orbs_p = share_on_node && !Parallel::is_node_master() ? 0 : n_orbs;
+
+  // The factorized integrals of each pq come from one matrix product, (pr|qs) at r * n_orbs + s.
+  const bool factorized = integrals.is_factorized();
+  std::vector<std::vector<double>> blocks(n_threads);
+
   // Same spin.
-  hci_queue.resize(Integrals::combine2(n_orbs, 2 * n_orbs));
 #pragma omp parallel for schedule(dynamic, 5)
-  for (unsigned p = 0; p < n_orbs; p++) {
+  for (unsigned p = 0; p < n_orbs_p; p++) {
     const int thread_id = omp_get_thread_num();
     const unsigned sym_p = orb_sym[p];
+    auto& block = blocks[thread_id];
     for (unsigned q = p + 1; q < n_orbs; q++) {
       const size_t pq = Integrals::combine2(p, q);
+      if (factorized) integrals.get_2b_block(p, q, block);
       const unsigned sym_q = product_table.get_product(sym_p, orb_sym[q]);
       for (unsigned r = 0; r < n_orbs; r++) {
         unsigned sym_r = orb_sym[r];
@@ -136,29 +160,38 @@ void ChemSystem::setup_hci_queue() {
         if (sym_r >= sym_orbs.size()) continue;
         for (const unsigned s : sym_orbs[sym_r]) {
           if (s < r) continue;
-          const double H = get_hci_queue_elem(p, q, r, s);
+          double H;
+          if (!factorized) {
+            H = get_hci_queue_elem(p, q, r, s);
+          } else if (r == s || p == r || q == s || p == s || q == r) {
+            H = 0.0;
+          } else {
+            H = std::abs(block[r * n_orbs + s] - block[s * n_orbs + r]);
+          }
           if (H == 0.0) continue;
-          hci_queue.at(pq).push_back(Hrs(H, r, s));
+          pair_entries.at(pq).push_back(Hrs(H, r, s));
         }
       }
-      if (hci_queue.at(pq).size() > 0) {
-        std::sort(hci_queue.at(pq).begin(), hci_queue.at(pq).end(), [](const Hrs& a, const Hrs& b) {
+      if (pair_entries.at(pq).size() > 0) {
+        std::sort(pair_entries.at(pq).begin(), pair_entries.at(pq).end(), [](const Hrs& a, const Hrs& b) {
           return a.H > b.H;
         });
-        n_entries_local[thread_id] += hci_queue.at(pq).size();
+        n_entries_local[thread_id] += pair_entries.at(pq).size();
         max_hci_queue_elem_local[thread_id] =
-            std::max(max_hci_queue_elem_local[thread_id], hci_queue.at(pq).front().H);
+            std::max(max_hci_queue_elem_local[thread_id], pair_entries.at(pq).front().H);
       }
     }
   }
 
 // Opposite spin.
 #pragma omp parallel for schedule(dynamic, 5)
-  for (unsigned p = 0; p < n_orbs; p++) {
+  for (unsigned p = 0; p < n_orbs_p; p++) {
     const int thread_id = omp_get_thread_num();
     const unsigned sym_p = orb_sym[p];
+    auto& block = blocks[thread_id];
     for (unsigned q = n_orbs + p; q < n_orbs * 2; q++) {
       const size_t pq = Integrals::combine2(p, q);
+      if (factorized) integrals.get_2b_block(p, q - n_orbs, block);
       const unsigned sym_q = product_table.get_product(sym_p, orb_sym[q - n_orbs]);
       for (unsigned r = 0; r < n_orbs; r++) {
         unsigned sym_r = orb_sym[r];
@@ -166,18 +199,25 @@ void ChemSystem::setup_hci_queue() {
         sym_r = product_table.get_product(sym_q, sym_r);
         if (sym_r >= sym_orbs.size()) continue;
         for (const unsigned s : sym_orbs[sym_r]) {
-          const double H = get_hci_queue_elem(p, q, r, s + n_orbs);
+          double H;
+          if (!factorized) {
+            H = get_hci_queue_elem(p, q, r, s + n_orbs);
+          } else if (p == r || q == s + n_orbs) {
+            H = 0.0;
+          } else {
+            H = std::abs(block[r * n_orbs + s]);
+          }
           if (H == 0.0) continue;
-          hci_queue.at(pq).push_back(Hrs(H, r, s + n_orbs));
+          pair_entries.at(pq).push_back(Hrs(H, r, s + n_orbs));
         }
       }
-      if (hci_queue.at(pq).size() > 0) {
-        std::sort(hci_queue.at(pq).begin(), hci_queue.at(pq).end(), [](const Hrs& a, const Hrs& b) {
+      if (pair_entries.at(pq).size() > 0) {
+        std::sort(pair_entries.at(pq).begin(), pair_entries.at(pq).end(), [](const Hrs& a, const Hrs& b) {
           return a.H > b.H;
         });
-        n_entries_local[thread_id] += hci_queue.at(pq).size();
+        n_entries_local[thread_id] += pair_entries.at(pq).size();
         max_hci_queue_elem_local[thread_id] =
-            std::max(max_hci_queue_elem_local[thread_id], hci_queue.at(pq).front().H);
+            std::max(max_hci_queue_elem_local[thread_id], pair_entries.at(pq).front().H);
       }
     }
   }
@@ -187,12 +227,160 @@ void ChemSystem::setup_hci_queue() {
     max_hci_queue_elem = std::max(max_hci_queue_elem, max_hci_queue_elem_local[i]);
   }
 
+  hci_queue.build(pair_entries, share_on_node);
+  if (share_on_node) {
+    unsigned long long n_entries_master = n_entries;
+    MPI_Bcast(&n_entries_master, 1, MPI_UNSIGNED_LONG_LONG, 0, Parallel::get_node_comm());
+    MPI_Bcast(&max_hci_queue_elem, 1, MPI_DOUBLE, 0, Parallel::get_node_comm());
+    n_entries = n_entries_master;
+  }
+
   const int proc_id = Parallel::get_proc_id();
   if (proc_id == 0) {
     printf("Max hci queue elem: " ENERGY_FORMAT "\n", max_hci_queue_elem);
     printf("Number of entries in hci queue: %'zu\n", n_entries);
+    printf("Memory hci queue: %.1fMB\n", hci_queue.get_n_bytes() * 1.0e-6);
   }
-  helper_size += n_entries * 16 * 2;  // vector size <= 2 * number of elements
+  helper_size += hci_queue.get_n_bytes();
+}
+
+namespace {
+// Header of the queue cache, followed by the hci queue arrays and then the offsets, S and r
+// arrays of the singles queue, each padded to a multiple of 8 bytes.
+struct QueueCacheHeader {
+  uint64_t magic;
+
+  uint64_t key;
+
+  uint64_t n_orbs;
+
+  uint64_t n_hci_offsets;
+
+  uint64_t n_hci_entries;
+
+  uint64_t n_singles_entries;
+
+  double max_hci_queue_elem;
+
+  double max_singles_queue_elem;
+};
+
+// Changes with the layout or the definition of the queues.
+constexpr uint64_t QUEUE_CACHE_MAGIC = 0x3165756575716963ull;
+
+size_t get_padded(const size_t n_bytes) { return (n_bytes + 7) / 8 * 8; }
+}  // namespace
+
+size_t ChemSystem::get_queue_cache_key() const {
+  Util::HashBuf hash_buf;
+  std::ostream stream(&hash_buf);
+  hps::to_stream(integrals, stream);
+  const uint64_t inputs[3] = {static_cast<uint64_t>(point_group), n_orbs, n_elecs};
+  stream.write(reinterpret_cast<const char*>(inputs), sizeof(inputs));
+  stream.flush();
+  return hash_buf.get_hash();
+}
+
+bool ChemSystem::load_queue_cache(const std::string& filename, const size_t key) {
+  Timer::start("load queue cache");
+  SegmentFile file(filename);
+  const QueueCacheHeader* header = reinterpret_cast<const QueueCacheHeader*>(file.get_data());
+  int loaded = file.is_mapped() && file.get_n_bytes() >= sizeof(QueueCacheHeader) &&
+               header->magic == QUEUE_CACHE_MAGIC && header->key == key &&
+               header->n_orbs == n_orbs &&
+               header->n_hci_offsets == Integrals::combine2(n_orbs, 2 * n_orbs) + 1;
+  size_t hci_bytes = 0;
+  size_t singles_bytes = 0;
+  if (loaded) {
+    hci_bytes = HciQueue::get_n_bytes_written(header->n_hci_offsets, header->n_hci_entries);
+    singles_bytes = (n_orbs + 1) * sizeof(uint64_t) +
+                    header->n_singles_entries * sizeof(double) +
+                    get_padded(header->n_singles_entries * sizeof(uint32_t));
+    loaded = file.get_n_bytes() == sizeof(QueueCacheHeader) + hci_bytes + singles_bytes;
+  }
+  int loaded_all = 0;
+  MPI_Allreduce(&loaded, &loaded_all, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+  if (!loaded_all) {
+    Timer::end();
+    return false;
+  }
+
+  const char* data = file.get_data() + sizeof(QueueCacheHeader);
+  hci_queue.view(data, header->n_hci_offsets, header->n_hci_entries);
+  max_hci_queue_elem = header->max_hci_queue_elem;
+  data += hci_bytes;
+  const uint64_t* singles_offsets = reinterpret_cast<const uint64_t*>(data);
+  const double* singles_S = reinterpret_cast<const double*>(singles_offsets + n_orbs + 1);
+  const uint32_t* singles_r =
+      reinterpret_cast<const uint32_t*>(singles_S + header->n_singles_entries);
+  singles_queue.assign(n_orbs, std::vector<Sr>());
+  for (unsigned p = 0; p < n_orbs; p++) {
+    singles_queue[p].reserve(singles_offsets[p + 1] - singles_offsets[p]);
+    for (size_t k = singles_offsets[p]; k < singles_offsets[p + 1]; k++) {
+      singles_queue[p].push_back(Sr(singles_S[k], singles_r[k]));
+    }
+  }
+  max_singles_queue_elem = header->max_singles_queue_elem;
+
+  if (Parallel::is_master()) {
+    printf("Loaded hci queue cache from: %s\n", filename.c_str());
+    printf("Max hci queue elem: " ENERGY_FORMAT "\n", max_hci_queue_elem);
+    printf("Number of entries in hci queue: %'zu\n", hci_queue.get_n_entries());
+    printf("Max singles_queue elem: " ENERGY_FORMAT "\n", max_singles_queue_elem);
+    printf("Number of entries in singles_queue: %'zu\n", (size_t)header->n_singles_entries);
+  }
+  helper_size += hci_queue.get_n_bytes() + header->n_singles_entries * 16 * 2;
+  queue_cache = std::move(file);
+  Timer::end();
+  return true;
+}
+
+void ChemSystem::save_queue_cache(const std::string& filename, const size_t key) const {
+  if (!Parallel::is_master()) return;
+  QueueCacheHeader header;
+  header.magic = QUEUE_CACHE_MAGIC;
+  header.key = key;
+  header.n_orbs = n_orbs;
+  header.n_hci_offsets = hci_queue.get_n_offsets();
+  header.n_hci_entries = hci_queue.get_n_entries();
+  header.max_hci_queue_elem = max_hci_queue_elem;
+  header.max_singles_queue_elem = max_singles_queue_elem;
+  std::vector<uint64_t> singles_offsets(n_orbs + 1, 0);
+  for (unsigned p = 0; p < n_orbs; p++) {
+    singles_offsets[p + 1] = singles_offsets[p] + singles_queue[p].size();
+  }
+  header.n_singles_entries = singles_offsets[n_orbs];
+  std::vector<double> singles_S;
+  std::vector<uint32_t> singles_r;
+  singles_S.reserve(header.n_singles_entries);
+  singles_r.reserve(header.n_singles_entries);
+  for (const auto& sr_entries : singles_queue) {
+    for (const auto& sr : sr_entries) {
+      singles_S.push_back(sr.S);
+      singles_r.push_back(sr.r);
+    }
+  }
+
+  // Written under another name first, so that an interrupted write never leaves a partial cache.
+  const std::string& tmp_filename = filename + ".tmp";
+  std::ofstream file(tmp_filename, std::ofstream::binary | std::ofstream::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  hci_queue.write(file);
+  file.write(
+      reinterpret_cast<const char*>(singles_offsets.data()), (n_orbs + 1) * sizeof(uint64_t));
+  file.write(reinterpret_cast<const char*>(singles_S.data()), singles_S.size() * sizeof(double));
+  file.write(
+      reinterpret_cast<const char*>(singles_r.data()), singles_r.size() * sizeof(uint32_t));
+  const char padding[8] = {};
+  const size_t r_bytes = singles_r.size() * sizeof(uint32_t);
+  file.write(padding, get_padded(r_bytes) - r_bytes);
+  file.close();
+  if (!file || std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    std::remove(tmp_filename.c_str());
+    printf("Cannot save hci queue cache to: %s\n", filename.c_str());
+    return;
+  }
+  printf("Hci queue cache saved to: %s\n", filename.c_str());
 }
 
 PointGroup ChemSystem::get_point_group(const std::string& str) const {
@@ -292,105 +480,8 @@ double ChemSystem::find_connected_dets(
     const double eps_min,
     const std::function<void(const Det&, const int n_excite)>& handler,
     const bool second_rejection) const {
-  if (eps_max < eps_min) return eps_min;
-
-  auto occ_orbs_up = det.up.get_occupied_orbs();
-  auto occ_orbs_dn = det.dn.get_occupied_orbs();
-
-  double diff_from_hf = - energy_hf_1b;
-  if (second_rejection) {
-    // Find approximate energy difference of spawning det from HF det.
-    // Later the energy difference of the spawned det from the HF det requires at most 4 1-body energies.
-    // Note: Using 1-body energies as a proxy for det energies
-    for (const auto p: occ_orbs_up) diff_from_hf += integrals.get_1b(p, p);
-    for (const auto p: occ_orbs_dn) diff_from_hf += integrals.get_1b(p, p);
-  }
-
-  double max_rejection = 0.;
-
-  // Filter such that S < epsilon not allowed
-  if (eps_min <= max_singles_queue_elem) {
-    for (unsigned p_id = 0; p_id < n_elecs; p_id++) {
-      const unsigned p = p_id < n_up ? occ_orbs_up[p_id] : occ_orbs_dn[p_id - n_up];
-      for (const auto& connected_sr : singles_queue.at(p)) {
-        auto S = connected_sr.S;
-        if (S < eps_min) break;
-//      if (S >= eps_max) continue; // This line is incorrect because for single excitations we compute H_ij and have some additional rejections.
-        unsigned r = connected_sr.r;
-        if (second_rejection) {
-          double denominator = diff_from_hf - integrals.get_1b(p, p) + integrals.get_1b(r, r);
-          if (denominator > 0. && S * S / denominator < second_rejection_factor * eps_min * eps_min) {
-            max_rejection = std::max(max_rejection, S);
-            continue;
-          }
-        }
-        Det connected_det(det);
-        if (p_id < n_up) {
-          if (det.up.has(r)) continue;
-          connected_det.up.unset(p).set(r);
-          handler(connected_det, 1);
-        } else {
-          if (det.dn.has(r)) continue;
-          connected_det.dn.unset(p).set(r);
-          handler(connected_det, 1);
-        }
-      }
-    }
-  }
-
-  // Add double excitations.
-  if (!has_double_excitation) return eps_min;
-  if (eps_min > max_hci_queue_elem) return eps_min;
-  for (unsigned p_id = 0; p_id < n_elecs; p_id++) {
-    for (unsigned q_id = p_id + 1; q_id < n_elecs; q_id++) {
-      const unsigned p = p_id < n_up ? occ_orbs_up[p_id] : occ_orbs_dn[p_id - n_up] + n_orbs;
-      const unsigned q = q_id < n_up ? occ_orbs_up[q_id] : occ_orbs_dn[q_id - n_up] + n_orbs;
-      double p2 = p;
-      double q2 = q;
-      if (p >= n_orbs && q >= n_orbs) {
-        p2 -= n_orbs;
-        q2 -= n_orbs;
-      } else if (p < n_orbs && q >= n_orbs && p > q - n_orbs) {
-        p2 = q - n_orbs;
-        q2 = p + n_orbs;
-      }
-      const unsigned pq = Integrals::combine2(p2, q2);
-      for (const auto& hrs : hci_queue.at(pq)) {
-        const double H = hrs.H;
-        if (H < eps_min) break;
-        if (H >= eps_max) continue;
-        unsigned r = hrs.r;
-        unsigned s = hrs.s;
-        if (p >= n_orbs && q >= n_orbs) {
-          r += n_orbs;
-          s += n_orbs;
-        } else if (p < n_orbs && q >= n_orbs && p > q - n_orbs) {
-          const unsigned tmp_r = s - n_orbs;
-          s = r + n_orbs;
-          r = tmp_r;
-        }
-        if (second_rejection) {
-          double denominator = diff_from_hf - integrals.get_1b(p%n_orbs, p%n_orbs) - integrals.get_1b(q%n_orbs, q%n_orbs)
-                                            + integrals.get_1b(r%n_orbs, r%n_orbs) + integrals.get_1b(s%n_orbs, s%n_orbs);
-          if (denominator > 0. && H * H / denominator < second_rejection_factor * eps_min * eps_min) {
-            max_rejection = std::max(max_rejection, H);
-            continue;
-          }
-        }
-        const bool occ_r = r < n_orbs ? det.up.has(r) : det.dn.has(r - n_orbs);
-        if (occ_r) continue;
-        const bool occ_s = s < n_orbs ? det.up.has(s) : det.dn.has(s - n_orbs);
-        if (occ_s) continue;
-        Det connected_det(det);
-        p < n_orbs ? connected_det.up.unset(p) : connected_det.dn.unset(p - n_orbs);
-        q < n_orbs ? connected_det.up.unset(q) : connected_det.dn.unset(q - n_orbs);
-        r < n_orbs ? connected_det.up.set(r) : connected_det.dn.set(r - n_orbs);
-        s < n_orbs ? connected_det.up.set(s) : connected_det.dn.set(s - n_orbs);
-        handler(connected_det, 2);
-      }
-    }
-  }
-  return std::max(max_rejection, eps_min);
+  return find_connected_dets<std::function<void(const Det&, const int)>>(
+      det, eps_max, eps_min, handler, second_rejection);
 }
 
 double ChemSystem::get_hamiltonian_elem(
@@ -435,13 +526,13 @@ double ChemSystem::get_hamiltonian_elem_no_time_sym(
 
 double ChemSystem::get_one_body_diag(const Det& det) const {
   double energy = 0.0;
-  for (const auto& orb : det.up.get_occupied_orbs()) {
+  for (const auto& orb : det.up.get_occ_orbs()) {
     energy += integrals.get_1b(orb, orb);
   }
   if (det.up == det.dn) {
     energy *= 2;
   } else {
-    for (const auto& orb : det.dn.get_occupied_orbs()) {
+    for (const auto& orb : det.dn.get_occ_orbs()) {
       energy += integrals.get_1b(orb, orb);
     }
   }
@@ -451,7 +542,7 @@ double ChemSystem::get_one_body_diag(const Det& det) const {
 void ChemSystem::update_diag_helper() {
   const size_t n_dets = get_n_dets();
   const auto& get_two_body = [&](const HalfDet& half_det) {
-    const auto& occ_orbs_up = half_det.get_occupied_orbs();
+    const auto& occ_orbs_up = half_det.get_occ_orbs();
     double direct_energy = 0.0;
     double exchange_energy = 0.0;
     for (unsigned i = 0; i < occ_orbs_up.size(); i++) {
@@ -485,8 +576,8 @@ void ChemSystem::update_diag_helper() {
 }
 
 double ChemSystem::get_two_body_diag(const Det& det) const {
-  const auto& occ_orbs_up = det.up.get_occupied_orbs();
-  const auto& occ_orbs_dn = det.dn.get_occupied_orbs();
+  const auto& occ_orbs_up = det.up.get_occ_orbs();
+  const auto& occ_orbs_dn = det.dn.get_occ_orbs();
   double direct_energy = 0.0;
   double exchange_energy = 0.0;
   // up to up.
@@ -533,6 +624,35 @@ double ChemSystem::get_two_body_diag(const Det& det) const {
   return direct_energy + exchange_energy;
 }
 
+double ChemSystem::get_hamiltonian_diag_from_parent(
+    const Det& det_a, const Det& det_i, const double H_ii) const {
+  const auto& occ_orbs_up = det_i.up.get_occ_orbs();
+  const auto& occ_orbs_dn = det_i.dn.get_occ_orbs();
+  const auto& orb_energy = [&](const unsigned orb, const bool is_up) {
+    double energy = integrals.get_1b(orb, orb);
+    for (const unsigned orb_j : occ_orbs_up) {
+      energy += integrals.get_2b(orb, orb, orb_j, orb_j);
+      if (is_up) energy -= integrals.get_2b(orb, orb_j, orb_j, orb);
+    }
+    for (const unsigned orb_j : occ_orbs_dn) {
+      energy += integrals.get_2b(orb, orb, orb_j, orb_j);
+      if (!is_up) energy -= integrals.get_2b(orb, orb_j, orb_j, orb);
+    }
+    return energy;
+  };
+  const auto& pair_energy =
+      [&](const unsigned orb1, const bool is_up1, const unsigned orb2, const bool is_up2) {
+        double energy = integrals.get_2b(orb1, orb1, orb2, orb2);
+        if (is_up1 == is_up2) energy -= integrals.get_2b(orb1, orb2, orb2, orb1);
+        return energy;
+      };
+  double delta;
+  if (!get_diag_delta(det_i, det_a, orb_energy, pair_energy, delta)) {
+    return get_hamiltonian_elem(det_a, det_a, 0);
+  }
+  return H_ii + delta;
+}
+
 double ChemSystem::get_one_body_single(const DiffResult& diff_up, const DiffResult& diff_dn) const {
   const bool is_up_single = diff_up.n_diffs == 1;
   const auto& diff = is_up_single ? diff_up : diff_dn;
@@ -550,7 +670,7 @@ double ChemSystem::get_two_body_single(
   const auto& same_spin_half_det = is_up_single ? det_i.up : det_i.dn;
   auto oppo_spin_half_det = is_up_single ? det_i.dn : det_i.up;
   double energy = 0.0;
-  for (const unsigned orb : same_spin_half_det.get_occupied_orbs()) {
+  for (const unsigned orb : same_spin_half_det.get_occ_orbs()) {
     if (orb == orb_i || orb == orb_j) continue;
     energy -= integrals.get_2b(orb_i, orb, orb, orb_j);  // Exchange.
     const double direct = integrals.get_2b(orb_i, orb_j, orb, orb);  // Direct.
@@ -561,7 +681,7 @@ double ChemSystem::get_two_body_single(
       energy += direct;
     }
   }
-  for (const unsigned orb : oppo_spin_half_det.get_occupied_orbs()) {
+  for (const unsigned orb : oppo_spin_half_det.get_occ_orbs()) {
     energy += integrals.get_2b(orb_i, orb_j, orb, orb);  // Direct.
   }
   energy *= diff.permutation_factor;
@@ -601,17 +721,30 @@ double ChemSystem::get_two_body_double(const DiffResult& diff_up, const DiffResu
 }
 
 void ChemSystem::post_variation(std::vector<std::vector<size_t>>& connections) {
+  const std::string& rdm_format = Config::get<std::string>("rdm_format", "text");
+  const bool rdm_sparse = Util::str_equals_ci("sparse", rdm_format);
+  const bool rdm_binary = rdm_sparse || Util::str_equals_ci("dense", rdm_format);
+  if (!rdm_binary && !Util::str_equals_ci("text", rdm_format)) {
+    throw std::invalid_argument("unknown rdm_format");
+  }
+
   if (Config::get<bool>("get_1rdm_csv", false)) {
     RDM rdm(integrals, dets, coefs);
     rdm.get_1rdm();
-    rdm.dump_1rdm();
+    rdm.dump_1rdm(rdm_binary);
   }
 
   if (Config::get<bool>("2rdm", false) || Config::get<bool>("get_2rdm_csv", false)) {
     RDM rdm(integrals, dets, coefs);
-    rdm.get_2rdm(connections);
-    connections.clear();
-    rdm.dump_2rdm(Config::get<bool>("get_2rdm_csv", false));
+    if (rdm_binary) {
+      rdm.get_2rdm(connections, RDM::Reduction::BY_BLOCK);
+      connections.clear();
+      rdm.dump_2rdm_binary(rdm_sparse);
+    } else {
+      rdm.get_2rdm(connections, RDM::Reduction::MASTER);
+      connections.clear();
+      rdm.dump_2rdm(Config::get<bool>("get_2rdm_csv", false));
+    }
   }
 
   bool unpacked = false;
@@ -664,7 +797,7 @@ void ChemSystem::post_variation_optimization(
     }
     Timer::end();
    
-    hamiltonian_matrix.clear(); 
+    if (!Config::get<bool>("optimization/revalue_hamiltonian", false)) hamiltonian_matrix.clear();
     variation_cleanup();
 
     rotation_matrix *= optorb_optimizer.rotation_matrix();
@@ -685,10 +818,18 @@ void ChemSystem::variation_cleanup() {
   max_hci_queue_elem = 0.;
   max_singles_queue_elem = 0.;
   hci_queue.clear();
+  queue_cache = SegmentFile();
   singles_queue.clear();
   sym_orbs.clear();
 }
 
+size_t ChemSystem::get_integrals_hash() const {
+  Util::HashBuf hash_buf;
+  std::ostream stream(&hash_buf);
+  hps::to_stream(integrals, stream);
+  return hash_buf.get_hash();
+}
+
 void ChemSystem::dump_integrals(const char* filename) {
   integrals.dump_integrals(filename);
   if (Config::get<bool>("optimization/rotation_matrix", false)) {
@@ -724,7 +865,7 @@ double ChemSystem::get_s2(std::vector<double> state_coefs) const {
   for (size_t i_det = 0; i_det < dets.size(); i_det++) {
     Det this_det = dets[i_det];
 
-    const auto& occ_orbs = this_det.up.get_occupied_orbs();
+    const auto& occ_orbs = this_det.up.get_occ_orbs();
     unsigned num_db_occ = 0;  // number of doubly occupied orbs
     for (unsigned i = 0; i < occ_orbs.size(); i++) {
       if (this_det.dn.has(occ_orbs[i])) num_db_occ++;
@@ -774,12 +915,12 @@ double ChemSystem::get_s2(std::vector<double> state_coefs) const {
 
 double ChemSystem::get_e_hf_1b() const {
   double e_hf_1b = 0.;
-  auto occ_orbs_up = dets[0].up.get_occupied_orbs();
+  auto occ_orbs_up = dets[0].up.get_occ_orbs();
   for (const auto p : occ_orbs_up) e_hf_1b += integrals.get_1b(p, p);
   if (Config::get<bool>("time_sym", false)) {
     e_hf_1b *= 2.;
   } else {
-    auto occ_orbs_dn = dets[0].dn.get_occupied_orbs();
+    auto occ_orbs_dn = dets[0].dn.get_occ_orbs();
     for (const auto p : occ_orbs_dn) e_hf_1b += integrals.get_1b(p, p);
   }
   return e_hf_1b;
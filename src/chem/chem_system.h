@@ -3,8 +3,11 @@
 #include <string>
 #include "../base_system.h"
 #include "../config.h"
+#include "../counters.h"
+#include "../det/excitation_batch.h"
+#include "../solver/segment_file.h"
 #include "../solver/sparse_matrix.h"
-#include "hrs.h"
+#include "hci_queue.h"
 #include "integrals.h"
 #include "point_group.h"
 #include "product_table.h"
@@ -22,11 +25,35 @@ class ChemSystem : public BaseSystem {
       const std::function<void(const Det&, const int n_excite)>& handler,
       const bool second_rejection = false) const override;
 
+  // Same as above with the handler called directly instead of through std::function, so that it
+  // can be inlined into the loops over the excitations.
+  template <class Handler>
+  double find_connected_dets(
+      const Det& det,
+      const double eps_max,
+      const double eps_min,
+      const Handler& handler,
+      const bool second_rejection = false) const;
+
+  // Same as above with the connected dets collected into batch, which is passed to
+  // batch_handler and cleared each time it is full and once at the end.
+  template <class BatchHandler>
+  double find_connected_dets_batched(
+      const Det& det,
+      const double eps_max,
+      const double eps_min,
+      ExcitationBatch& batch,
+      const BatchHandler& batch_handler,
+      const bool second_rejection = false) const;
+
   double get_hamiltonian_elem(
       const Det& det_i, const Det& det_j, const int n_excite) const override;
 
   void update_diag_helper() override;
 
+  double get_hamiltonian_diag_from_parent(
+      const Det& det_a, const Det& det_i, const double H_ii) const override;
+
   void post_variation(std::vector<std::vector<size_t>>& connections) override;
 
   void post_variation_optimization(
@@ -37,9 +64,25 @@ class ChemSystem : public BaseSystem {
 
   void dump_integrals(const char* filename) override;
 
+  size_t get_integrals_hash() const override;
+
+  size_t get_integrals_n_bytes(const double hash_overhead) const override {
+    return integrals.get_n_bytes(hash_overhead);
+  }
+
   double get_e_hf_1b() const override;
 
  private:
+  // Call emit(connected_det, n_excite, p, q, r, s, H) for each excitation, with the spin orbitals
+  // and bound of ExcitationBatch.
+  template <class Emit>
+  double for_each_excitation(
+      const Det& det,
+      const double eps_max,
+      const double eps_min,
+      const Emit& emit,
+      const bool second_rejection) const;
+
   std::vector<unsigned> orb_sym;
 
   double max_hci_queue_elem;
@@ -55,11 +98,14 @@ class ChemSystem : public BaseSystem {
 
   ProductTable product_table;
 
-  std::vector<std::vector<Hrs>> hci_queue;
+  HciQueue hci_queue;
 
   // singles queue
   std::vector<std::vector<Sr>> singles_queue;
 
+  // Mapping of the queue cache the hci queue views when loaded from it.
+  SegmentFile queue_cache;
+
   Eigen::MatrixXd rotation_matrix;
 
   // setup sym orbs
@@ -70,6 +116,14 @@ class ChemSystem : public BaseSystem {
   // setup singles queue
   void setup_singles_queue();
 
+  // Checksum of the integrals and of the other inputs of the queues.
+  size_t get_queue_cache_key() const;
+
+  // Only succeeds if all the procs load the cache. Collective.
+  bool load_queue_cache(const std::string& filename, const size_t key);
+
+  void save_queue_cache(const std::string& filename, const size_t key) const;
+
   PointGroup get_point_group(const std::string& str) const;
 
   void check_group_elements() const;
@@ -94,3 +148,190 @@ class ChemSystem : public BaseSystem {
 
   double get_s2(std::vector<double>) const;
 };
+
+template <class Handler>
+double ChemSystem::find_connected_dets(
+    const Det& det,
+    const double eps_max,
+    const double eps_min,
+    const Handler& handler,
+    const bool second_rejection) const {
+  return for_each_excitation(
+      det,
+      eps_max,
+      eps_min,
+      [&](const Det& connected_det,
+          const int n_excite,
+          const unsigned,
+          const unsigned,
+          const unsigned,
+          const unsigned,
+          const double) { handler(connected_det, n_excite); },
+      second_rejection);
+}
+
+template <class BatchHandler>
+double ChemSystem::find_connected_dets_batched(
+    const Det& det,
+    const double eps_max,
+    const double eps_min,
+    ExcitationBatch& batch,
+    const BatchHandler& batch_handler,
+    const bool second_rejection) const {
+  batch.clear();
+  const double max_rejection = for_each_excitation(
+      det,
+      eps_max,
+      eps_min,
+      [&](const Det& connected_det,
+          const int n_excite,
+          const unsigned p,
+          const unsigned q,
+          const unsigned r,
+          const unsigned s,
+          const double H) {
+        batch.push_back(connected_det, n_excite, p, q, r, s, H);
+        if (batch.is_full()) {
+          batch_handler(batch);
+          batch.clear();
+        }
+      },
+      second_rejection);
+  if (batch.size() > 0) {
+    batch_handler(batch);
+    batch.clear();
+  }
+  return max_rejection;
+}
+
+template <class Emit>
+double ChemSystem::for_each_excitation(
+    const Det& det,
+    const double eps_max,
+    const double eps_min,
+    const Emit& emit,
+    const bool second_rejection) const {
+  if (eps_max < eps_min) return eps_min;
+
+  auto occ_orbs_up = det.up.get_occ_orbs();
+  auto occ_orbs_dn = det.dn.get_occ_orbs();
+
+  double diff_from_hf = - energy_hf_1b;
+  if (second_rejection) {
+    // Find approximate energy difference of spawning det from HF det.
+    // Later the energy difference of the spawned det from the HF det requires at most 4 1-body energies.
+    // Note: Using 1-body energies as a proxy for det energies
+    for (const auto p: occ_orbs_up) diff_from_hf += integrals.get_1b(p, p);
+    for (const auto p: occ_orbs_dn) diff_from_hf += integrals.get_1b(p, p);
+  }
+
+  double max_rejection = 0.;
+  size_t n_candidates = 0;
+  size_t n_heat_bath_rejections = 0;
+  size_t n_second_rejections = 0;
+
+  // Filter such that S < epsilon not allowed
+  if (eps_min <= max_singles_queue_elem) {
+    for (unsigned p_id = 0; p_id < n_elecs; p_id++) {
+      const unsigned p = p_id < n_up ? occ_orbs_up[p_id] : occ_orbs_dn[p_id - n_up];
+      const auto& p_singles = singles_queue.at(p);
+      for (const auto& connected_sr : p_singles) {
+        auto S = connected_sr.S;
+        if (S < eps_min) {
+          n_heat_bath_rejections += p_singles.data() + p_singles.size() - &connected_sr;
+          break;
+        }
+//      if (S >= eps_max) continue; // This line is incorrect because for single excitations we compute H_ij and have some additional rejections.
+        unsigned r = connected_sr.r;
+        if (second_rejection) {
+          double denominator = diff_from_hf - integrals.get_1b(p, p) + integrals.get_1b(r, r);
+          if (denominator > 0. && S * S / denominator < second_rejection_factor * eps_min * eps_min) {
+            max_rejection = std::max(max_rejection, S);
+            n_second_rejections++;
+            continue;
+          }
+        }
+        Det connected_det(det);
+        if (p_id < n_up) {
+          if (det.up.has(r)) continue;
+          connected_det.up.unset(p).set(r);
+          n_candidates++;
+          emit(connected_det, 1, p, p, r, r, S);
+        } else {
+          if (det.dn.has(r)) continue;
+          connected_det.dn.unset(p).set(r);
+          n_candidates++;
+          emit(connected_det, 1, p + n_orbs, p + n_orbs, r + n_orbs, r + n_orbs, S);
+        }
+      }
+    }
+  }
+
+  // Add double excitations.
+  const auto& add_counts = [&]() {
+    Counters::add(Counters::CANDIDATES, n_candidates);
+    Counters::add(Counters::HEAT_BATH_REJECTIONS, n_heat_bath_rejections);
+    Counters::add(Counters::SECOND_REJECTIONS, n_second_rejections);
+  };
+  if (!has_double_excitation || eps_min > max_hci_queue_elem) {
+    add_counts();
+    return eps_min;
+  }
+  for (unsigned p_id = 0; p_id < n_elecs; p_id++) {
+    for (unsigned q_id = p_id + 1; q_id < n_elecs; q_id++) {
+      const unsigned p = p_id < n_up ? occ_orbs_up[p_id] : occ_orbs_dn[p_id - n_up] + n_orbs;
+      const unsigned q = q_id < n_up ? occ_orbs_up[q_id] : occ_orbs_dn[q_id - n_up] + n_orbs;
+      double p2 = p;
+      double q2 = q;
+      if (p >= n_orbs && q >= n_orbs) {
+        p2 -= n_orbs;
+        q2 -= n_orbs;
+      } else if (p < n_orbs && q >= n_orbs && p > q - n_orbs) {
+        p2 = q - n_orbs;
+        q2 = p + n_orbs;
+      }
+      const unsigned pq = Integrals::combine2(p2, q2);
+      const size_t pq_end = hci_queue.get_end(pq);
+      for (size_t k = hci_queue.get_begin(pq); k < pq_end; k++) {
+        const double H = hci_queue.get_H(k);
+        if (H < eps_min) {
+          n_heat_bath_rejections += pq_end - k;
+          break;
+        }
+        if (H >= eps_max) continue;
+        unsigned r = hci_queue.get_r(k);
+        unsigned s = hci_queue.get_s(k);
+        if (p >= n_orbs && q >= n_orbs) {
+          r += n_orbs;
+          s += n_orbs;
+        } else if (p < n_orbs && q >= n_orbs && p > q - n_orbs) {
+          const unsigned tmp_r = s - n_orbs;
+          s = r + n_orbs;
+          r = tmp_r;
+        }
+        if (second_rejection) {
+          double denominator = diff_from_hf - integrals.get_1b(p%n_orbs, p%n_orbs) - integrals.get_1b(q%n_orbs, q%n_orbs)
+                                            + integrals.get_1b(r%n_orbs, r%n_orbs) + integrals.get_1b(s%n_orbs, s%n_orbs);
+          if (denominator > 0. && H * H / denominator < second_rejection_factor * eps_min * eps_min) {
+            max_rejection = std::max(max_rejection, H);
+            n_second_rejections++;
+            continue;
+          }
+        }
+        const bool occ_r = r < n_orbs ? det.up.has(r) : det.dn.has(r - n_orbs);
+        if (occ_r) continue;
+        const bool occ_s = s < n_orbs ? det.up.has(s) : det.dn.has(s - n_orbs);
+        if (occ_s) continue;
+        Det connected_det(det);
+        p < n_orbs ? connected_det.up.unset(p) : connected_det.dn.unset(p - n_orbs);
+        q < n_orbs ? connected_det.up.unset(q) : connected_det.dn.unset(q - n_orbs);
+        r < n_orbs ? connected_det.up.set(r) : connected_det.dn.set(r - n_orbs);
+        s < n_orbs ? connected_det.up.set(s) : connected_det.dn.set(s - n_orbs);
+        n_candidates++;
+        emit(connected_det, 2, p, q, r, s, H);
+      }
+    }
+  }
+  add_counts();
+  return std::max(max_rejection, eps_min);
+}
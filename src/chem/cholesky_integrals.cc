@@ -0,0 +1,171 @@
+#include "cholesky_integrals.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <eigen/Eigen/Dense>
+#include <fstream>
+#include <stdexcept>
+#include "../parallel.h"
+#include "../util.h"
+
+namespace {
+constexpr uint64_t CHOLESKY_MAGIC = 0x594b53454c4f4843ull;  // "CHOLESKY"
+
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+}  // namespace
+
+void CholeskyIntegrals::decompose(
+    const unsigned n_orbs,
+    const std::function<double(unsigned, unsigned, unsigned, unsigned)>& get_2b,
+    const double threshold) {
+  const size_t n_pairs = get_pair(n_orbs, 0);
+  std::vector<unsigned> pair_p(n_pairs);
+  std::vector<unsigned> pair_q(n_pairs);
+  for (unsigned p = 0; p < n_orbs; p++) {
+    for (unsigned q = 0; q <= p; q++) {
+      pair_p[get_pair(p, q)] = p;
+      pair_q[get_pair(p, q)] = q;
+    }
+  }
+  std::vector<double> diag(n_pairs);
+#pragma omp parallel for schedule(static)
+  for (size_t pq = 0; pq < n_pairs; pq++) {
+    diag[pq] = get_2b(pair_p[pq], pair_q[pq], pair_p[pq], pair_q[pq]);
+  }
+
+  // The vectors of each pair so far, so that the projections of a new column are dot products.
+  std::vector<std::vector<double>> rows(n_pairs);
+  size_t n_vecs = 0;
+  while (n_vecs < n_pairs) {
+    const size_t pivot = std::max_element(diag.begin(), diag.end()) - diag.begin();
+    if (!(diag[pivot] >= threshold)) break;
+    const double pivot_diag = diag[pivot];
+    const double norm = std::sqrt(pivot_diag);
+    const std::vector<double> pivot_row = rows[pivot];
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t pq = 0; pq < n_pairs; pq++) {
+      double value = get_2b(pair_p[pq], pair_q[pq], pair_p[pivot], pair_q[pivot]);
+      const std::vector<double>& row = rows[pq];
+      for (size_t P = 0; P < n_vecs; P++) value -= row[P] * pivot_row[P];
+      diag[pq] -= value * value / pivot_diag;
+      rows[pq].push_back(value / norm);
+    }
+    diag[pivot] = 0.0;
+    n_vecs++;
+  }
+
+  std::vector<double> vecs_new(n_pairs * n_vecs);
+  for (size_t pq = 0; pq < n_pairs; pq++) {
+    std::copy(rows[pq].begin(), rows[pq].end(), vecs_new.begin() + pq * n_vecs);
+    Util::free(rows[pq]);
+  }
+  set_vecs(std::move(vecs_new), n_orbs, n_vecs);
+}
+
+void CholeskyIntegrals::load(const std::string& filename, const unsigned n_orbs) {
+  std::ifstream file(filename, std::ifstream::binary);
+  if (!file) throw std::runtime_error("cannot open " + filename);
+  uint64_t header[3];
+  file.read(reinterpret_cast<char*>(header), sizeof(header));
+  if (!file || header[0] != CHOLESKY_MAGIC) {
+    throw std::runtime_error(filename + " is not a file of cholesky vectors");
+  }
+  if (header[1] != n_orbs) {
+    throw std::runtime_error(filename + " has vectors of another number of orbitals");
+  }
+  const size_t n_pairs = get_pair(n_orbs, 0);
+  const size_t n_vecs = header[2];
+  std::vector<double> vecs_file(n_pairs);
+  std::vector<double> vecs_new(n_pairs * n_vecs);
+  for (size_t P = 0; P < n_vecs; P++) {
+    file.read(reinterpret_cast<char*>(vecs_file.data()), n_pairs * sizeof(double));
+    if (!file) throw std::runtime_error(filename + " is truncated");
+    for (size_t pq = 0; pq < n_pairs; pq++) vecs_new[pq * n_vecs + P] = vecs_file[pq];
+  }
+  set_vecs(std::move(vecs_new), n_orbs, n_vecs);
+}
+
+void CholeskyIntegrals::reorder(const std::vector<unsigned>& orb_order_inv) {
+  std::vector<double> vecs_new(n_pairs * n_vecs);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (unsigned p = 0; p < n_orbs; p++) {
+    for (unsigned q = 0; q <= p; q++) {
+      const double* vec = vecs + get_pair(p, q) * n_vecs;
+      const size_t pq_new = get_pair(orb_order_inv[p], orb_order_inv[q]);
+      std::copy(vec, vec + n_vecs, vecs_new.begin() + pq_new * n_vecs);
+    }
+  }
+  set_vecs(std::move(vecs_new), n_orbs, n_vecs);
+}
+
+void CholeskyIntegrals::set_vecs(
+    std::vector<double>&& vecs_new, const unsigned n_orbs_new, const size_t n_vecs_new) {
+  shared.free();
+  own_vecs = std::move(vecs_new);
+  vecs = own_vecs.data();
+  n_orbs = n_orbs_new;
+  n_pairs = get_pair(n_orbs, 0);
+  n_vecs = n_vecs_new;
+  n_cache_orbs = 0;
+  cache.clear();
+}
+
+void CholeskyIntegrals::share_on_node() {
+  unsigned long long sizes[2] = {n_orbs, n_vecs};
+  MPI_Bcast(sizes, 2, MPI_UNSIGNED_LONG_LONG, 0, Parallel::get_node_comm());
+  if (sizes[0] == 0) return;
+  n_orbs = sizes[0];
+  n_pairs = get_pair(n_orbs, 0);
+  n_vecs = sizes[1];
+  shared.allocate(n_pairs * n_vecs);
+  if (Parallel::is_node_master()) std::copy(vecs, vecs + n_pairs * n_vecs, shared.data());
+  shared.publish();
+  Util::free(own_vecs);
+  vecs = shared.data();
+}
+
+void CholeskyIntegrals::setup_cache(const unsigned n_cache_orbs) {
+  this->n_cache_orbs = 0;
+  const unsigned n_orbs_cache = std::min(n_cache_orbs, n_orbs);
+  const size_t n_cache_pairs = get_pair(n_orbs_cache, 0);
+  std::vector<double> cache_new(get_pair(n_cache_pairs, 0));
+#pragma omp parallel for schedule(dynamic, 16)
+  for (size_t ab = 0; ab < n_cache_pairs; ab++) {
+    for (size_t cd = 0; cd <= ab; cd++) {
+      double value = 0.0;
+      for (size_t P = 0; P < n_vecs; P++) value += vecs[ab * n_vecs + P] * vecs[cd * n_vecs + P];
+      cache_new[get_pair(ab, cd)] = value;
+    }
+  }
+  cache = std::move(cache_new);
+  this->n_cache_orbs = n_orbs_cache;
+}
+
+double CholeskyIntegrals::get(
+    const unsigned p, const unsigned q, const unsigned r, const unsigned s) const {
+  const size_t pq = get_pair(p, q);
+  const size_t rs = get_pair(r, s);
+  if (std::max(std::max(p, q), std::max(r, s)) < n_cache_orbs) return cache[get_pair(pq, rs)];
+  const double* vec_pq = vecs + pq * n_vecs;
+  const double* vec_rs = vecs + rs * n_vecs;
+  double value = 0.0;
+  for (size_t P = 0; P < n_vecs; P++) value += vec_pq[P] * vec_rs[P];
+  return value;
+}
+
+void CholeskyIntegrals::get_block(
+    const unsigned p, const unsigned q, std::vector<double>& block) const {
+  RowMatrix vecs_p(n_orbs, n_vecs);
+  RowMatrix vecs_q(n_orbs, n_vecs);
+  for (unsigned r = 0; r < n_orbs; r++) {
+    vecs_p.row(r) = Eigen::Map<const Eigen::RowVectorXd>(vecs + get_pair(p, r) * n_vecs, n_vecs);
+    vecs_q.row(r) = Eigen::Map<const Eigen::RowVectorXd>(vecs + get_pair(q, r) * n_vecs, n_vecs);
+  }
+  block.resize(static_cast<size_t>(n_orbs) * n_orbs);
+  Eigen::Map<RowMatrix>(block.data(), n_orbs, n_orbs).noalias() = vecs_p * vecs_q.transpose();
+}
+
+size_t CholeskyIntegrals::get_n_bytes() const {
+  return (n_pairs * n_vecs + cache.capacity()) * sizeof(double);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "../shared_array.h"
+
+// Two body integrals (pq|rs) = sum_P L_pq^P L_rs^P from the three index vectors of a Cholesky
+// decomposition or a density fitting, which take n_orbs^2 / 2 * n_vecs doubles instead of the
+// n_orbs^4 / 8 of the four index integrals. The integrals of the lowest orbitals, the most used
+// ones, are also cached densely.
+class CholeskyIntegrals {
+ public:
+  bool is_loaded() const { return n_orbs > 0; }
+
+  size_t get_n_vecs() const { return n_vecs; }
+
+  // Pivoted Cholesky of the supermatrix (pq|rs) of get_2b until the largest remaining diagonal
+  // is below threshold.
+  void decompose(
+      const unsigned n_orbs,
+      const std::function<double(unsigned, unsigned, unsigned, unsigned)>& get_2b,
+      const double threshold);
+
+  // Reads the vectors L[P][pq] of the pairs pq = p * (p + 1) / 2 + q, p >= q, of the 1 based
+  // orbitals p + 1 and q + 1 of the FCIDUMP, as doubles after a header of the magic "CHOLESKY",
+  // n_orbs and n_vecs as uint64.
+  void load(const std::string& filename, const unsigned n_orbs);
+
+  // Moves orbital p to orb_order_inv[p].
+  void reorder(const std::vector<unsigned>& orb_order_inv);
+
+  // Collective over the node. The other procs of a node map the vectors of the node master.
+  void share_on_node();
+
+  // Caches the integrals of the orbitals below n_cache_orbs. Call again after changing the
+  // vectors.
+  void setup_cache(const unsigned n_cache_orbs);
+
+  double get(const unsigned p, const unsigned q, const unsigned r, const unsigned s) const;
+
+  // (pr|qs) of all the r and s at block[r * n_orbs + s].
+  void get_block(const unsigned p, const unsigned q, std::vector<double>& block) const;
+
+  size_t get_n_bytes() const;
+
+  template <class B>
+  void serialize(B& buf) const;
+
+  template <class B>
+  void parse(B& buf);
+
+ private:
+  unsigned n_orbs = 0;
+
+  size_t n_pairs = 0;
+
+  size_t n_vecs = 0;
+
+  // L_pq^P at [pq * n_vecs + P], in either own_vecs or shared.
+  std::vector<double> own_vecs;
+
+  const double* vecs = nullptr;
+
+  SharedArray<double> shared;
+
+  unsigned n_cache_orbs = 0;
+
+  // (pq|rs) of the cached orbitals at get_pair(pq, rs).
+  std::vector<double> cache;
+
+  static size_t get_pair(const size_t a, const size_t b) {
+    return a > b ? a * (a + 1) / 2 + b : b * (b + 1) / 2 + a;
+  }
+
+  void set_vecs(std::vector<double>&& vecs_new, const unsigned n_orbs_new, const size_t n_vecs_new);
+};
+
+template <class B>
+void CholeskyIntegrals::serialize(B& buf) const {
+  buf << n_orbs << n_vecs;
+  for (size_t i = 0; i < n_pairs * n_vecs; i++) buf << vecs[i];
+}
+
+template <class B>
+void CholeskyIntegrals::parse(B& buf) {
+  unsigned n_orbs_buf;
+  size_t n_vecs_buf;
+  buf >> n_orbs_buf >> n_vecs_buf;
+  std::vector<double> vecs_buf(get_pair(n_orbs_buf, 0) * n_vecs_buf);
+  for (auto& value : vecs_buf) buf >> value;
+  set_vecs(std::move(vecs_buf), n_orbs_buf, n_vecs_buf);
+}
@@ -0,0 +1,86 @@
+#include "cholesky_integrals.h"
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+const unsigned N_ORBS = 7;
+
+const size_t N_VECS = 5;
+
+size_t get_pair(const size_t a, const size_t b) {
+  return a > b ? a * (a + 1) / 2 + b : b * (b + 1) / 2 + a;
+}
+
+// Integrals of rank N_VECS, positive semidefinite as those of a real basis.
+double get_vec(const size_t P, const size_t pq) {
+  return std::sin(0.3 + (P + 1) * (0.37 * pq + 0.11));
+}
+
+double get_2b(const unsigned p, const unsigned q, const unsigned r, const unsigned s) {
+  double value = 0.0;
+  for (size_t P = 0; P < N_VECS; P++) {
+    value += get_vec(P, get_pair(p, q)) * get_vec(P, get_pair(r, s));
+  }
+  return value;
+}
+
+void expect_all_2b(const CholeskyIntegrals& cholesky) {
+  for (unsigned p = 0; p < N_ORBS; p++) {
+    for (unsigned q = 0; q < N_ORBS; q++) {
+      for (unsigned r = 0; r < N_ORBS; r++) {
+        for (unsigned s = 0; s < N_ORBS; s++) {
+          EXPECT_NEAR(cholesky.get(p, q, r, s), get_2b(p, q, r, s), 1.0e-10);
+        }
+      }
+    }
+  }
+}
+}  // namespace
+
+TEST(CholeskyIntegralsTest, Decompose) {
+  CholeskyIntegrals cholesky;
+  cholesky.decompose(N_ORBS, get_2b, 1.0e-12);
+  EXPECT_EQ(cholesky.get_n_vecs(), N_VECS);
+  expect_all_2b(cholesky);
+  cholesky.setup_cache(4);
+  expect_all_2b(cholesky);
+
+  std::vector<double> block;
+  cholesky.get_block(2, 5, block);
+  for (unsigned r = 0; r < N_ORBS; r++) {
+    for (unsigned s = 0; s < N_ORBS; s++) {
+      EXPECT_NEAR(block[r * N_ORBS + s], get_2b(2, r, 5, s), 1.0e-10);
+    }
+  }
+}
+
+TEST(CholeskyIntegralsTest, LoadAndReorder) {
+  const std::string filename = "cholesky_integrals_test.dat";
+  {
+    std::ofstream file(filename, std::ofstream::binary);
+    const uint64_t header[3] = {0x594b53454c4f4843ull, N_ORBS, N_VECS};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    for (size_t P = 0; P < N_VECS; P++) {
+      for (size_t pq = 0; pq < get_pair(N_ORBS, 0); pq++) {
+        const double value = get_vec(P, pq);
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+      }
+    }
+  }
+  CholeskyIntegrals cholesky;
+  EXPECT_THROW(cholesky.load(filename, N_ORBS + 1), std::runtime_error);
+  cholesky.load(filename, N_ORBS);
+  std::remove(filename.c_str());
+  EXPECT_EQ(cholesky.get_n_vecs(), N_VECS);
+  expect_all_2b(cholesky);
+
+  const std::vector<unsigned> orb_order_inv({3, 0, 6, 1, 5, 2, 4});
+  cholesky.reorder(orb_order_inv);
+  const auto& o = orb_order_inv;
+  EXPECT_NEAR(cholesky.get(o[1], o[4], o[6], o[2]), get_2b(1, 4, 6, 2), 1.0e-10);
+  EXPECT_NEAR(cholesky.get(o[0], o[0], o[3], o[5]), get_2b(0, 0, 3, 5), 1.0e-10);
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include "../parallel.h"
+#include "../shared_array.h"
+#include "../util.h"
+#include "hrs.h"
+
+// Heat bath queues of the double excitations of each orbital pair pq, in decreasing |H|, as flat
+// arrays. |H| is kept as a float rounded up, so screening by it keeps every excitation that
+// screening by the exact value does, and r, s as 16 bit orbitals packed together.
+class HciQueue {
+ public:
+  // Takes the sorted entries of each pair, with orbitals below 2^16. When shared on the node,
+  // collective over the node: only the entries of the node master are used and the arrays are
+  // in shared memory.
+  void build(std::vector<std::vector<Hrs>>& pair_entries, const bool share_on_node = false);
+
+  // Use arrays laid out as by write() at data, which must outlive the queue or its clear().
+  void view(const char* data, const size_t n_offsets, const size_t n_entries);
+
+  // Write the offsets, H and rs arrays, each padded to a multiple of 8 bytes.
+  void write(std::ostream& stream) const;
+
+  static size_t get_n_bytes_written(const size_t n_offsets, const size_t n_entries) {
+    return n_offsets * sizeof(size_t) + get_padded(n_entries * sizeof(float)) +
+           get_padded(n_entries * sizeof(uint32_t));
+  }
+
+  size_t get_n_offsets() const { return n_offsets; }
+
+  // The entries of pair pq are [get_begin(pq), get_end(pq)).
+  size_t get_begin(const size_t pq) const { return offsets_data[pq]; }
+
+  size_t get_end(const size_t pq) const { return offsets_data[pq + 1]; }
+
+  double get_H(const size_t k) const { return H_data[k]; }
+
+  unsigned get_r(const size_t k) const { return rs_data[k] & 0xffff; }
+
+  unsigned get_s(const size_t k) const { return rs_data[k] >> 16; }
+
+  size_t get_n_entries() const { return n_entries; }
+
+  // Share of this proc when shared on the node.
+  size_t get_n_bytes() const {
+    const size_t n_bytes =
+        n_offsets * sizeof(size_t) + n_entries * (sizeof(float) + sizeof(uint32_t));
+    return shared_H.is_allocated() ? n_bytes / Parallel::get_n_node_procs() : n_bytes;
+  }
+
+  // Collective over the node when shared on the node.
+  void clear();
+
+ private:
+  std::vector<size_t> offsets;
+
+  std::vector<float> H;
+
+  std::vector<uint32_t> rs;
+
+  SharedArray<size_t> shared_offsets;
+
+  SharedArray<float> shared_H;
+
+  SharedArray<uint32_t> shared_rs;
+
+  // The arrays in either the vectors, the shared arrays or a view.
+  const size_t* offsets_data = nullptr;
+
+  const float* H_data = nullptr;
+
+  const uint32_t* rs_data = nullptr;
+
+  size_t n_offsets = 0;
+
+  size_t n_entries = 0;
+
+  static size_t get_padded(const size_t n_bytes) { return (n_bytes + 7) / 8 * 8; }
+};
+
+inline void HciQueue::build(std::vector<std::vector<Hrs>>& pair_entries, const bool share_on_node) {
+  const size_t n_pairs = pair_entries.size();
+  offsets.assign(n_pairs + 1, 0);
+  for (size_t pq = 0; pq < n_pairs; pq++) offsets[pq + 1] = offsets[pq] + pair_entries[pq].size();
+  n_offsets = n_pairs + 1;
+  n_entries = offsets[n_pairs];
+  size_t* offsets_out;
+  float* H_out;
+  uint32_t* rs_out;
+  if (share_on_node) {
+    shared_offsets.allocate(n_offsets);
+    shared_H.allocate(n_entries);
+    shared_rs.allocate(n_entries);
+    offsets_out = shared_offsets.data();
+    H_out = shared_H.data();
+    rs_out = shared_rs.data();
+    if (Parallel::is_node_master()) std::copy(offsets.begin(), offsets.end(), offsets_out);
+  } else {
+    H.resize(n_entries);
+    rs.resize(n_entries);
+    offsets_out = offsets.data();
+    H_out = H.data();
+    rs_out = rs.data();
+  }
+
+  if (!share_on_node || Parallel::is_node_master()) {
+#pragma omp parallel for schedule(dynamic, 5)
+    for (size_t pq = 0; pq < n_pairs; pq++) {
+      size_t k = offsets[pq];
+      for (const auto& hrs : pair_entries[pq]) {
+        float H_rounded = static_cast<float>(hrs.H);
+        if (H_rounded < hrs.H) H_rounded = std::nextafter(H_rounded, HUGE_VALF);
+        H_out[k] = H_rounded;
+        rs_out[k] = hrs.r | (hrs.s << 16);
+        k++;
+      }
+      Util::free(pair_entries[pq]);
+    }
+  }
+  Util::free(pair_entries);
+
+  if (share_on_node) {
+    shared_offsets.publish();
+    shared_H.publish();
+    shared_rs.publish();
+    Util::free(offsets);
+    n_offsets = shared_offsets.size();
+    n_entries = shared_H.size();
+  }
+  offsets_data = offsets_out;
+  H_data = H_out;
+  rs_data = rs_out;
+}
+
+inline void HciQueue::view(const char* data, const size_t n_offsets, const size_t n_entries) {
+  clear();
+  this->n_offsets = n_offsets;
+  this->n_entries = n_entries;
+  offsets_data = reinterpret_cast<const size_t*>(data);
+  data += n_offsets * sizeof(size_t);
+  H_data = reinterpret_cast<const float*>(data);
+  data += get_padded(n_entries * sizeof(float));
+  rs_data = reinterpret_cast<const uint32_t*>(data);
+}
+
+inline void HciQueue::write(std::ostream& stream) const {
+  const char padding[8] = {};
+  stream.write(reinterpret_cast<const char*>(offsets_data), n_offsets * sizeof(size_t));
+  stream.write(reinterpret_cast<const char*>(H_data), n_entries * sizeof(float));
+  stream.write(padding, get_padded(n_entries * sizeof(float)) - n_entries * sizeof(float));
+  stream.write(reinterpret_cast<const char*>(rs_data), n_entries * sizeof(uint32_t));
+  stream.write(padding, get_padded(n_entries * sizeof(uint32_t)) - n_entries * sizeof(uint32_t));
+}
+
+inline void HciQueue::clear() {
+  Util::free(offsets);
+  Util::free(H);
+  Util::free(rs);
+  shared_offsets.free();
+  shared_H.free();
+  shared_rs.free();
+  offsets_data = nullptr;
+  H_data = nullptr;
+  rs_data = nullptr;
+  n_offsets = 0;
+  n_entries = 0;
+}
@@ -1,7 +1,12 @@
 #include "integrals.h"
 
+#include <sys/stat.h>
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
@@ -10,17 +15,199 @@
 #include <string>
 #include "../config.h"
 #include "../parallel.h"
+#include "../solver/segment_file.h"
 #include "../timer.h"
 #include "../util.h"
 #include "dooh_util.h"
 
+namespace {
+// Header of FCIDUMP.bin, followed by the raw orbital symmetries as int32, padded to a multiple of
+// 8 bytes, and the integrals as Hpqrs.
+struct FcidumpBinaryHeader {
+  uint64_t magic;
+
+  uint64_t n_orbs;
+
+  uint64_t n_elecs;
+
+  uint64_t n_integrals;
+
+  // Of the FCIDUMP it was converted from, to detect a changed FCIDUMP.
+  uint64_t fcidump_n_bytes;
+
+  int64_t fcidump_mtime;
+};
+
+constexpr uint64_t FCIDUMP_BINARY_MAGIC = 0x31504d5544494346ull;
+
+static_assert(sizeof(Hpqrs) == 16, "Hpqrs is written to FCIDUMP.bin as is");
+
+bool is_space(const char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+bool is_digit(const char c) { return c >= '0' && c <= '9'; }
+
+// Parses the number in [begin, end) as strtod does. Numbers of at most 19 significant digits with
+// a mantissa below 2^53 and a small enough decimal exponent are exact with one multiplication or
+// division by an exact power of ten, which covers the usual 16 digit FCIDUMP values.
+bool parse_double(const char* begin, const char* end, double& value) {
+  static const double POW10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                 1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char* ptr = begin;
+  const bool negative = ptr < end && *ptr == '-';
+  if (ptr < end && (*ptr == '-' || *ptr == '+')) ptr++;
+  uint64_t mantissa = 0;
+  int n_digits = 0;
+  int exponent = 0;
+  bool has_digits = false;
+  bool fast = true;
+  for (bool after_point = false; ptr < end; ptr++) {
+    if (*ptr == '.' && !after_point) {
+      after_point = true;
+      continue;
+    }
+    if (!is_digit(*ptr)) break;
+    has_digits = true;
+    if (mantissa == 0 && *ptr == '0') {
+      if (after_point) exponent--;
+      continue;
+    }
+    if (++n_digits > 19) fast = false;
+    if (fast) mantissa = mantissa * 10 + (*ptr - '0');
+    if (after_point) exponent--;
+  }
+  if (!has_digits) return false;
+  if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+    ptr++;
+    const bool negative_exponent = ptr < end && *ptr == '-';
+    if (ptr < end && (*ptr == '-' || *ptr == '+')) ptr++;
+    if (ptr == end || !is_digit(*ptr)) return false;
+    int exponent_part = 0;
+    for (; ptr < end && is_digit(*ptr); ptr++) {
+      if (exponent_part < 10000) exponent_part = exponent_part * 10 + (*ptr - '0');
+    }
+    exponent += negative_exponent ? -exponent_part : exponent_part;
+  }
+  if (ptr != end) return false;
+
+  while (fast && mantissa != 0 && mantissa % 10 == 0) {
+    mantissa /= 10;
+    exponent++;
+  }
+  if (fast && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+    value = static_cast<double>(mantissa);
+    value = exponent < 0 ? value / POW10[-exponent] : value * POW10[exponent];
+    if (negative) value = -value;
+    return true;
+  }
+  char buf[128];
+  const size_t n_chars = end - begin;
+  if (n_chars >= sizeof(buf)) return false;
+  std::memcpy(buf, begin, n_chars);
+  buf[n_chars] = '\0';
+  value = std::strtod(buf, nullptr);
+  return true;
+}
+
+bool parse_orb(const char* begin, const char* end, uint16_t& orb) {
+  if (begin == end) return false;
+  unsigned value = 0;
+  for (const char* ptr = begin; ptr < end; ptr++) {
+    if (!is_digit(*ptr)) return false;
+    value = value * 10 + (*ptr - '0');
+    if (value > 0xffff) return false;
+  }
+  orb = value;
+  return true;
+}
+
+// Appends the integrals of the lines in [begin, end) with |H| >= 1e-9 to res.
+void parse_fcidump_lines(const char* begin, const char* end, std::vector<Hpqrs>& res) {
+  const char* ptr = begin;
+  const char* tokens[5][2];
+  while (true) {
+    int n_tokens = 0;
+    while (n_tokens < 5) {
+      while (ptr < end && is_space(*ptr)) ptr++;
+      if (ptr == end) break;
+      tokens[n_tokens][0] = ptr;
+      while (ptr < end && !is_space(*ptr)) ptr++;
+      tokens[n_tokens][1] = ptr;
+      n_tokens++;
+    }
+    if (n_tokens == 0) return;
+    double integral;
+    uint16_t orbs[4];
+    bool valid = n_tokens == 5 && parse_double(tokens[0][0], tokens[0][1], integral);
+    for (int i = 0; valid && i < 4; i++) {
+      valid = parse_orb(tokens[i + 1][0], tokens[i + 1][1], orbs[i]);
+    }
+    if (!valid) {
+      const char* line_end = tokens[0][0];
+      while (line_end < end && *line_end != '\n') line_end++;
+      throw std::runtime_error("bad FCIDUMP line: " + std::string(tokens[0][0], line_end));
+    }
+    if (std::abs(integral) < 1.0e-9) continue;
+    res.push_back(Hpqrs(integral, orbs[0], orbs[1], orbs[2], orbs[3]));
+  }
+}
+
+// Keeps the one body integrals and the core energy.
+void erase_2b(std::vector<Hpqrs>& raw_integrals) {
+  raw_integrals.erase(
+      std::remove_if(
+          raw_integrals.begin(),
+          raw_integrals.end(),
+          [](const Hpqrs& item) { return item.r != 0 || item.s != 0; }),
+      raw_integrals.end());
+  raw_integrals.shrink_to_fit();
+}
+}  // namespace
+
 void Integrals::load() {
+  dense_1b = nullptr;
+  dense_2b = nullptr;
   integrals_1b.set_storage(Config::get<bool>("hash_integrals", true));
   integrals_2b.set_storage(Config::get<bool>("hash_integrals", true));
+  if (!Config::get<bool>("share_on_node", false)) {
+    load_from_files();
+    setup_dense_lookup();
+    return;
+  }
+  // Only the node masters read the integrals.
+  if (Parallel::is_node_master()) load_from_files();
+  share_on_node();
+  Timer::checkpoint("share integrals on node");
+  setup_dense_lookup();
+}
+
+void Integrals::checkpoint_stage(const std::string& event) const {
+  if (!Config::get<bool>("share_on_node", false)) Timer::checkpoint(event);
+}
+
+void Integrals::share_on_node() {
+  if (Parallel::get_n_node_procs() == 1) return;
+  // Padded for the dense lookup before the values become shared.
+  if (Parallel::is_node_master()) {
+    const size_t n_pairs = combine2(n_orbs, 0);
+    integrals_1b.get_dense_values(n_pairs);
+    if (!is_factorized()) integrals_2b.get_dense_values(combine2(n_pairs, 0));
+  }
+  Head head = {this};
+  std::string serialized;
+  if (Parallel::is_node_master()) serialized = hps::to_string(head);
+  Parallel::broadcast_on_node(serialized);
+  if (!Parallel::is_node_master()) hps::from_string<Head>(serialized, head);
+  integrals_2b.share_on_node();
+  cholesky.share_on_node();
+}
+
+void Integrals::load_from_files() {
   const std::string& cache_filename = "integrals_cache.dat";
   if (Config::get<bool>("load_integrals_cache", false) && load_from_cache(cache_filename)) return;
   read_fcidump();
-  Timer::checkpoint("load fcidump");
+  checkpoint_stage("load fcidump");
+  load_cholesky();
   if (!Config::get<bool>("hash_integrals", true)) {
     printf("Vector storage in use.\n");
     size_t num_filled = integrals_2b.num_elements() + integrals_1b.num_elements();
@@ -30,12 +217,71 @@ void Integrals::load() {
   generate_det_hf();
   const auto& orb_energies = get_orb_energies();
   reorder_orbs(orb_energies);
-  Timer::checkpoint("reorder orbitals");
+  checkpoint_stage("reorder orbitals");
   save_to_cache(cache_filename);
 }
 
 void Integrals::read_fcidump() {
-  std::ifstream fcidump("FCIDUMP");
+  std::vector<int> orb_syms_raw;
+  const bool use_binary = Config::get<bool>("binary_fcidump", false);
+  if (!use_binary || !read_fcidump_binary("FCIDUMP.bin", orb_syms_raw)) {
+    read_fcidump_text("FCIDUMP", orb_syms_raw);
+    if (use_binary) write_fcidump_binary("FCIDUMP.bin", "FCIDUMP", orb_syms_raw);
+  }
+  orb_sym = get_adams_syms(orb_syms_raw);
+
+  // The two body integrals of the FCIDUMP are replaced by those of the vectors.
+  if (!Config::get<std::string>("cholesky_file", "").empty()) erase_2b(raw_integrals);
+
+  energy_core = 0.0;
+  for (const auto& item : raw_integrals) {
+    const unsigned p = item.p;
+    const unsigned q = item.q;
+    const unsigned r = item.r;
+    const unsigned s = item.s;
+    const double integral = item.H;
+    if (p == q && q == r && r == s && s == 0) {
+      energy_core = integral;
+    } else if (r == s && s == 0) {
+      integrals_1b.set(combine2(p - 1, q - 1), integral, [&](double& a, const double& b) {
+        if (std::abs(a) < std::abs(b)) a = b;
+      });
+    } else {
+      integrals_2b.set(
+          combine4(p - 1, q - 1, r - 1, s - 1), integral, [&](double& a, const double& b) {
+            if (std::abs(a) < std::abs(b)) a = b;
+          });
+    }
+  }
+}
+
+void Integrals::load_cholesky() {
+  const auto& filename = Config::get<std::string>("cholesky_file", "");
+  if (!filename.empty()) {
+    cholesky.load(filename, n_orbs);
+  } else if (Config::get<bool>("cholesky_integrals", false)) {
+    cholesky.decompose(
+        n_orbs,
+        [&](const unsigned p, const unsigned q, const unsigned r, const unsigned s) {
+          return integrals_2b.get(combine4(p, q, r, s), 0.0);
+        },
+        Config::get<double>("cholesky_threshold", 1.0e-8));
+    integrals_2b.clear();
+    erase_2b(raw_integrals);
+  } else {
+    return;
+  }
+  if (Parallel::is_master()) {
+    printf(
+        "Cholesky vectors: %zu (%.2fGB)\n",
+        cholesky.get_n_vecs(),
+        cholesky.get_n_bytes() * 1.0e-9);
+  }
+  checkpoint_stage("load cholesky vectors");
+}
+
+void Integrals::read_fcidump_text(const std::string& filename, std::vector<int>& orb_syms_raw) {
+  std::ifstream fcidump(filename);
   if (!fcidump.good()) {
     throw new std::runtime_error("cannot open FCIDUMP");
   }
@@ -45,7 +291,6 @@ void Integrals::read_fcidump() {
   std::string line;
   enum class State { NONE, ORBSYM, END };
   State state = State::NONE;
-  std::vector<int> orb_syms_raw;
   while (!fcidump.eof()) {
     std::getline(fcidump, line);
     const auto& words_begin = std::sregex_iterator(line.begin(), line.end(), words);
@@ -78,39 +323,114 @@ void Integrals::read_fcidump() {
     }
     if (state == State::END) break;
   }
-  orb_sym = get_adams_syms(orb_syms_raw);
+  const std::streamoff body_begin = state == State::END ? std::streamoff(fcidump.tellg()) : -1;
+  fcidump.close();
+  if (body_begin < 0) return;
+
+  // Read integrals, in parallel over chunks of whole lines of the mapped file.
+  const SegmentFile file(filename);
+  if (!file.is_mapped()) throw std::runtime_error("cannot map " + filename);
+  file.prefetch();
+  const char* const data = file.get_data();
+  const size_t n_bytes = file.get_n_bytes();
+  const size_t n_chunks = std::max<size_t>(1, std::min<size_t>(
+      Parallel::get_n_threads() * 4, (n_bytes - body_begin) / (1 << 20)));
+  std::vector<size_t> chunk_begins(n_chunks + 1, n_bytes);
+  for (size_t i = 0; i < n_chunks; i++) {
+    size_t pos = body_begin + (n_bytes - body_begin) * i / n_chunks;
+    if (i > 0) {
+      while (pos < n_bytes && data[pos - 1] != '\n') pos++;
+    }
+    chunk_begins[i] = pos;
+  }
+  std::vector<std::vector<Hpqrs>> chunk_integrals(n_chunks);
+  std::vector<std::string> errors(n_chunks);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t i = 0; i < n_chunks; i++) {
+    const size_t chunk_end = std::max(chunk_begins[i], chunk_begins[i + 1]);
+    try {
+      parse_fcidump_lines(data + chunk_begins[i], data + chunk_end, chunk_integrals[i]);
+    } catch (const std::runtime_error& error) {
+      errors[i] = error.what();
+    }
+  }
+  for (const auto& error : errors) {
+    if (!error.empty()) throw std::runtime_error(error);
+  }
+  size_t n_integrals = 0;
+  for (const auto& integrals : chunk_integrals) n_integrals += integrals.size();
+  raw_integrals.reserve(n_integrals);
+  for (auto& integrals : chunk_integrals) {
+    raw_integrals.insert(raw_integrals.end(), integrals.begin(), integrals.end());
+    Util::free(integrals);
+  }
+}
 
-  // Read integrals.
-  double integral;
-  unsigned p, q, r, s;
-  while (true) {
-    fcidump >> integral >> p >> q >> r >> s;
-    if (fcidump.eof()) break;
-    if (std::abs(integral) < 1.0e-9) continue;
-    raw_integrals.push_back(Hpqrs(integral, p, q, r, s));
+bool Integrals::read_fcidump_binary(const std::string& filename, std::vector<int>& orb_syms_raw) {
+  const SegmentFile file(filename);
+  if (!file.is_mapped() || file.get_n_bytes() < sizeof(FcidumpBinaryHeader)) return false;
+  const auto* header = reinterpret_cast<const FcidumpBinaryHeader*>(file.get_data());
+  const size_t syms_n_bytes = (header->n_orbs * sizeof(int32_t) + 7) / 8 * 8;
+  if (header->magic != FCIDUMP_BINARY_MAGIC ||
+      file.get_n_bytes() !=
+          sizeof(FcidumpBinaryHeader) + syms_n_bytes + header->n_integrals * sizeof(Hpqrs)) {
+    return false;
   }
-  fcidump.close();
 
-  energy_core = 0.0;
-  for (const auto& item : raw_integrals) {
-    const unsigned p = item.p;
-    const unsigned q = item.q;
-    const unsigned r = item.r;
-    const unsigned s = item.s;
-    const double integral = item.H;
-    if (p == q && q == r && r == s && s == 0) {
-      energy_core = integral;
-    } else if (r == s && s == 0) {
-      integrals_1b.set(combine2(p - 1, q - 1), integral, [&](double& a, const double& b) {
-        if (std::abs(a) < std::abs(b)) a = b;
-      });
-    } else {
-      integrals_2b.set(
-          combine4(p - 1, q - 1, r - 1, s - 1), integral, [&](double& a, const double& b) {
-            if (std::abs(a) < std::abs(b)) a = b;
-          });
-    }
+  // A binary converted from another FCIDUMP is stale, but it can be used without the FCIDUMP.
+  struct stat fcidump_stat;
+  if (stat("FCIDUMP", &fcidump_stat) == 0 &&
+      (static_cast<uint64_t>(fcidump_stat.st_size) != header->fcidump_n_bytes ||
+       static_cast<int64_t>(fcidump_stat.st_mtime) != header->fcidump_mtime)) {
+    return false;
   }
+
+  n_orbs = header->n_orbs;
+  n_elecs = header->n_elecs;
+  const auto* syms = reinterpret_cast<const int32_t*>(file.get_data() + sizeof(FcidumpBinaryHeader));
+  orb_syms_raw.assign(syms, syms + n_orbs);
+  const auto* integrals = reinterpret_cast<const Hpqrs*>(
+      file.get_data() + sizeof(FcidumpBinaryHeader) + syms_n_bytes);
+  raw_integrals.assign(integrals, integrals + header->n_integrals);
+  if (Parallel::is_master()) {
+    printf("Loaded FCIDUMP binary from: %s\n", filename.c_str());
+    printf("n_orbs: %u\n", n_orbs);
+    printf("n_elecs (from FCIDUMP): %u\n", n_elecs);
+  }
+  return true;
+}
+
+void Integrals::write_fcidump_binary(
+    const std::string& filename,
+    const std::string& fcidump_filename,
+    const std::vector<int>& orb_syms_raw) const {
+  if (!Parallel::is_master()) return;
+  FcidumpBinaryHeader header;
+  header.magic = FCIDUMP_BINARY_MAGIC;
+  header.n_orbs = n_orbs;
+  header.n_elecs = n_elecs;
+  header.n_integrals = raw_integrals.size();
+  struct stat fcidump_stat;
+  if (stat(fcidump_filename.c_str(), &fcidump_stat) != 0) return;
+  header.fcidump_n_bytes = fcidump_stat.st_size;
+  header.fcidump_mtime = fcidump_stat.st_mtime;
+  std::vector<int32_t> syms(orb_syms_raw.begin(), orb_syms_raw.end());
+  syms.resize((n_orbs + 1) / 2 * 2, 0);
+
+  // Written under another name first, so that an interrupted write never leaves a partial binary.
+  const std::string& tmp_filename = filename + ".tmp";
+  std::ofstream file(tmp_filename, std::ofstream::binary | std::ofstream::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(syms.data()), syms.size() * sizeof(int32_t));
+  file.write(
+      reinterpret_cast<const char*>(raw_integrals.data()), raw_integrals.size() * sizeof(Hpqrs));
+  file.close();
+  if (!file || std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    std::remove(tmp_filename.c_str());
+    printf("Cannot save FCIDUMP binary to: %s\n", filename.c_str());
+    return;
+  }
+  printf("FCIDUMP binary saved to: %s\n", filename.c_str());
 }
 
 std::vector<unsigned> Integrals::get_adams_syms(const std::vector<int>& orb_syms_raw) const {
@@ -340,18 +660,43 @@ void Integrals::reorder_orbs(const std::vector<double>& orb_energies) {
   }
   raw_integrals.clear();
   raw_integrals.shrink_to_fit();
+  if (is_factorized()) cholesky.reorder(orb_order_inv);
+}
+
+size_t Integrals::get_n_bytes(const double hash_overhead) const {
+  return integrals_1b.get_n_bytes(hash_overhead) + integrals_2b.get_n_bytes(hash_overhead) +
+         cholesky.get_n_bytes() + pair_ids.capacity() * sizeof(uint32_t) +
+         pair_offsets.capacity() * sizeof(size_t);
 }
 
 void Integrals::set_point_group(const PointGroup& group_name) {
   point_group = group_name;
 }
 
+void Integrals::setup_dense_lookup() {
+  const size_t n_pairs = combine2(n_orbs, 0);
+  dense_1b = integrals_1b.get_dense_values(n_pairs);
+  if (is_factorized()) {
+    dense_2b = nullptr;
+    cholesky.setup_cache(Config::get<unsigned>("cholesky_cache_orbs", 64));
+  } else {
+    dense_2b = integrals_2b.get_dense_values(combine2(n_pairs, 0));
+  }
+  pair_ids.resize(n_orbs * n_orbs);
+  for (unsigned p = 0; p < n_orbs; p++) {
+    for (unsigned q = 0; q < n_orbs; q++) pair_ids[p * n_orbs + q] = combine2(p, q);
+  }
+  pair_offsets.resize(n_pairs);
+  for (size_t ab = 0; ab < n_pairs; ab++) pair_offsets[ab] = combine2(ab, 0);
+}
+
 double Integrals::get_1b(const unsigned p, const unsigned q) const {
+  if (dense_1b) return dense_1b[pair_ids[p * n_orbs + q]];
   const size_t combined = combine2(p, q);
   return integrals_1b.get(combined, 0.0);
 }
 
-double Integrals::get_2b(
+bool Integrals::is_lz_forbidden(
     const unsigned p, const unsigned q, const unsigned r, const unsigned s) const {
   unsigned p_sym = orb_sym[p];
   unsigned q_sym = orb_sym[q];
@@ -360,12 +705,34 @@ double Integrals::get_2b(
   int gu;
   if ((point_group == PointGroup::Dooh) || (point_group == PointGroup::Coov)) {
     if ((DoohUtil::get_lz(p_sym, gu) + DoohUtil::get_lz(r_sym, gu)) != (DoohUtil::get_lz(q_sym, gu) + DoohUtil::get_lz(s_sym, gu))) 
-    return 0.;
+    return true;
+  }
+  return false;
+}
+
+double Integrals::get_2b(
+    const unsigned p, const unsigned q, const unsigned r, const unsigned s) const {
+  if (is_lz_forbidden(p, q, r, s)) return 0.;
+  if (is_factorized()) return cholesky.get(p, q, r, s);
+  if (dense_2b) {
+    const size_t ab = pair_ids[p * n_orbs + q];
+    const size_t cd = pair_ids[r * n_orbs + s];
+    return dense_2b[pair_offsets[std::max(ab, cd)] + std::min(ab, cd)];
   }
   const size_t combined = combine4(p, q, r, s);
   return integrals_2b.get(combined, 0.0);
 }
 
+void Integrals::get_2b_block(const unsigned p, const unsigned q, std::vector<double>& block) const {
+  cholesky.get_block(p, q, block);
+  if ((point_group != PointGroup::Dooh) && (point_group != PointGroup::Coov)) return;
+  for (unsigned r = 0; r < n_orbs; r++) {
+    for (unsigned s = 0; s < n_orbs; s++) {
+      if (is_lz_forbidden(p, r, q, s)) block[r * n_orbs + s] = 0.;
+    }
+  }
+}
+
 size_t Integrals::combine2(const size_t a, const size_t b) {
   if (a > b) {
     return (a * (a + 1)) / 2 + b;
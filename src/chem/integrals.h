@@ -1,9 +1,12 @@
 #pragma once
 
 #include <fgpl/src/hash_map.h>
+#include <cstdint>
+#include <string>
 #include <unordered_map>
 #include <vector>
 #include "../det/det.h"
+#include "cholesky_integrals.h"
 #include "hpqrs.h"
 #include "integrals_hasher.h"
 #include "point_group.h"
@@ -35,12 +38,33 @@ class Integrals {
 
   void load();
 
+  // Collective over the node. The other procs of a node take the integrals of the node master,
+  // the two body ones in shared memory with the vector storage.
+  void share_on_node();
+
+  // The stored integrals and lookup tables, with hash tables of hash_overhead times the bytes of
+  // their entries.
+  size_t get_n_bytes(const double hash_overhead) const;
+
   void set_point_group(const PointGroup& group_name);
 
+  PointGroup get_point_group() const { return point_group; }
+
+  // With the vector storage, the gets read its values directly from then on, indexed through
+  // precomputed pair tables. Call again after changing the integrals.
+  void setup_dense_lookup();
+
   double get_1b(const unsigned p, const unsigned q) const;
 
   double get_2b(const unsigned p, const unsigned q, const unsigned r, const unsigned s) const;
 
+  // The two body integrals are computed from three index vectors, see cholesky_integrals.
+  bool is_factorized() const { return cholesky.is_loaded(); }
+
+  // With the factorized integrals, get_2b(p, r, q, s) of all the r and s at
+  // block[r * n_orbs + s], for one matrix product instead of n_orbs^2 dot products.
+  void get_2b_block(const unsigned p, const unsigned q, std::vector<double>& block) const;
+
   static size_t combine2(const size_t a, const size_t b);
 
   static size_t combine4(const size_t a, const size_t b, const size_t c, const size_t d);
@@ -61,8 +85,40 @@ class Integrals {
 
   std::vector<Hpqrs> raw_integrals;
 
+  CholeskyIntegrals cholesky;
+
+  // combine2(p, q) at p * n_orbs + q.
+  std::vector<uint32_t> pair_ids;
+
+  // combine2(ab, 0) of each pair ab, so that combine4 is pair_offsets[max(ab, cd)] + min(ab, cd)
+  // and the integrals of the larger pair are contiguous.
+  std::vector<size_t> pair_offsets;
+
+  // The values of the vector storage indexed by combine2 and combine4, nullptr with the hash
+  // storage.
+  const double* dense_1b = nullptr;
+
+  const double* dense_2b = nullptr;
+
   void read_fcidump();
 
+  // Reads or decomposes the vectors, after which the two body integrals are only kept in them.
+  void load_cholesky();
+
+  // The integrals whose orbitals p, q, r, s of Dooh or Coov do not conserve lz vanish.
+  bool is_lz_forbidden(
+      const unsigned p, const unsigned q, const unsigned r, const unsigned s) const;
+
+  void read_fcidump_text(const std::string& filename, std::vector<int>& orb_syms_raw);
+
+  // Fails if missing, malformed or converted from a different FCIDUMP than the present one.
+  bool read_fcidump_binary(const std::string& filename, std::vector<int>& orb_syms_raw);
+
+  void write_fcidump_binary(
+      const std::string& filename,
+      const std::string& fcidump_filename,
+      const std::vector<int>& orb_syms_raw) const;
+
   std::vector<unsigned> get_adams_syms(const std::vector<int>& orb_syms_raw) const;
 
   void generate_det_hf();
@@ -71,19 +127,58 @@ class Integrals {
 
   void reorder_orbs(const std::vector<double>& orb_energies);
 
+  void load_from_files();
+
+  // Checkpoint of a stage of load_from_files, skipped with share_on_node, where only the node
+  // masters load and a checkpoint, which waits for all the procs, would hang.
+  void checkpoint_stage(const std::string& event) const;
+
   bool load_from_cache(const std::string& filename);
 
   void save_to_cache(const std::string& filename) const;
+
+  // Everything but the two body integrals.
+  struct Head {
+    Integrals* integrals;
+
+    template <class B>
+    void serialize(B& buf) const {
+      integrals->serialize_head(buf);
+    }
+
+    template <class B>
+    void parse(B& buf) {
+      integrals->parse_head(buf);
+    }
+  };
+
+  template <class B>
+  void serialize_head(B& buf) const;
+
+  template <class B>
+  void parse_head(B& buf);
 };
 
 template <class B>
 void Integrals::serialize(B& buf) const {
-  buf << energy_core << n_orbs << n_elecs << n_up << n_dn << orb_sym << orb_order << orb_order_inv << det_hf;
-  buf << integrals_1b << integrals_2b;
+  serialize_head(buf);
+  buf << integrals_2b << cholesky;
 }
 
 template <class B>
 void Integrals::parse(B& buf) {
+  parse_head(buf);
+  buf >> integrals_2b >> cholesky;
+}
+
+template <class B>
+void Integrals::serialize_head(B& buf) const {
+  buf << energy_core << n_orbs << n_elecs << n_up << n_dn << orb_sym << orb_order << orb_order_inv << det_hf;
+  buf << integrals_1b;
+}
+
+template <class B>
+void Integrals::parse_head(B& buf) {
   buf >> energy_core >> n_orbs >> n_elecs >> n_up >> n_dn >> orb_sym >> orb_order >> orb_order_inv >> det_hf;
-  buf >> integrals_1b >> integrals_2b;
+  buf >> integrals_1b;
 }
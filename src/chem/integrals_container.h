@@ -1,15 +1,22 @@
 #pragma once
 #include <fgpl/src/hash_map.h>
+#include <hps/src/hps.h>
+#include <mpi.h>
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <stdexcept>
+#include <string>
 #include <vector>
+#include "../parallel.h"
+#include "../shared_array.h"
+#include "../util.h"
 #include "integrals_hasher.h"
 
 class VectorStorage {
  public:
   double get(const size_t key, const double default_value) const {
-    if (key < vectr.size()) return vectr[key];
+    if (key < n_values) return values[key];
     return default_value;
   }
 
@@ -17,7 +24,12 @@ class VectorStorage {
       const size_t key,
       const double integral,
       const std::function<void(double&, const double&)>& reducer) {
-    if (key >= vectr.size()) vectr.resize(key + 1, 0.0);
+    if (is_shared) unshare();
+    if (key >= vectr.size()) {
+      vectr.resize(key + 1, 0.0);
+      values = vectr.data();
+      n_values = vectr.size();
+    }
     if (vectr[key] == 0.0) {
       vectr[key] = integral;
       num_vectr_elems++;
@@ -26,22 +38,40 @@ class VectorStorage {
   }
 
   void clear() {
+    is_shared = false;
     vectr.clear();
+    values = nullptr;
+    n_values = 0;
     num_vectr_elems = 0;
   }
 
+  // Collective over the node. Moves the values of the node master to shared memory, which the
+  // other procs map instead of their own values.
+  void share_on_node() {
+    unsigned long long n_elems = num_vectr_elems;
+    MPI_Bcast(&n_elems, 1, MPI_UNSIGNED_LONG_LONG, 0, Parallel::get_node_comm());
+    num_vectr_elems = n_elems;
+    shared.allocate(n_values);
+    if (Parallel::is_node_master()) std::copy(values, values + n_values, shared.data());
+    shared.publish();
+    Util::free(vectr);
+    values = shared.data();
+    n_values = shared.size();
+    is_shared = true;
+  }
+
   template <class B>
   void serialize(B& buf) const {
     buf << num_vectr_elems;
-    for (size_t key = 0; key < vectr.size(); key++) {
-      double value = vectr[key];
+    for (size_t key = 0; key < n_values; key++) {
+      double value = values[key];
       if (value != 0.0) buf << key << value;
     }
   }
 
   template <class B>
   void parse(B& buf) {
-    vectr.clear();
+    clear();
     auto keep = [](double&, const double&) {};
     size_t n_keys_buf;
     buf >> n_keys_buf;
@@ -55,9 +85,40 @@ class VectorStorage {
 
   size_t num_elements() const { return num_vectr_elems; }
 
+  size_t get_n_bytes() const { return n_values * sizeof(double); }
+
+  // Zero filled up to n_keys values, so that all the keys below it can be read without a bounds
+  // check. Call before share_on_node.
+  void pad(const size_t n_keys) {
+    if (n_keys <= n_values) return;
+    if (is_shared) unshare();
+    vectr.resize(n_keys, 0.0);
+    values = vectr.data();
+    n_values = vectr.size();
+  }
+
+  // Invalidated by the next set, clear or share_on_node.
+  const double* data() const { return values; }
+
  private:
   size_t num_vectr_elems = 0;
   std::vector<double> vectr;
+
+  // The values in either vectr or shared.
+  const double* values = nullptr;
+  size_t n_values = 0;
+
+  SharedArray<double> shared;
+
+  bool is_shared = false;
+
+  // Back to a copy of the shared values of its own, e.g. for rewriting them. Not collective,
+  // the window is freed with the next share_on_node.
+  void unshare() {
+    vectr.assign(values, values + n_values);
+    values = vectr.data();
+    is_shared = false;
+  }
 };
 
 class IntegralsContainer {
@@ -100,6 +161,19 @@ class IntegralsContainer {
       vec.parse(buf);
   }
 
+  // Collective over the node. The node master passes its integrals to the other procs of the
+  // node, in shared memory with the vector storage, as copies with the hash storage.
+  void share_on_node() {
+    if (!hash_integrals) {
+      vec.share_on_node();
+      return;
+    }
+    std::string serialized;
+    if (Parallel::is_node_master()) serialized = hps::to_string(*this);
+    Parallel::broadcast_on_node(serialized);
+    if (!Parallel::is_node_master()) hps::from_string<IntegralsContainer>(serialized, *this);
+  }
+
   size_t num_elements() const {
     if (hash_integrals)
       throw std::runtime_error("HashMap doesn't have a public num_elements() implementation\n");
@@ -109,6 +183,20 @@ class IntegralsContainer {
 
   void set_storage(bool bval) { hash_integrals = bval; }
 
+  // With the hash storage, hash_overhead times the bytes of the entries.
+  size_t get_n_bytes(const double hash_overhead) const {
+    if (!hash_integrals) return vec.get_n_bytes();
+    return hash.get_n_keys() * hash_overhead * (sizeof(size_t) + sizeof(double));
+  }
+
+  // The values of the keys below n_keys as a dense array, nullptr with the hash storage.
+  // Invalidated by the next set, clear or share_on_node.
+  const double* get_dense_values(const size_t n_keys) {
+    if (hash_integrals) return nullptr;
+    vec.pad(n_keys);
+    return vec.data();
+  }
+
  private:
   bool hash_integrals = false;
 
@@ -1,7 +1,9 @@
 #include "optimization.h"
 
 #include "../parallel.h"
+#include "../solver/minres.h"
 #include "../timer.h"
+#include "../util.h"
 #include "cg_solver.h"
 #include "davidson_solver.h"
 #include "lanczos_solver.h"
@@ -83,6 +85,9 @@ void Optimization::get_natorb_rotation_matrix() {
 }
 
 void Optimization::rotate_and_rewrite_integrals() {
+  if (integrals.is_factorized()) {
+    throw std::invalid_argument("orbital optimization is not supported with cholesky integrals");
+  }
   rotate_integrals();
   rewrite_integrals();
 }
@@ -90,119 +95,78 @@ void Optimization::rotate_and_rewrite_integrals() {
 void Optimization::rotate_integrals() {
   Timer::start("rotate integrals");
   new_integrals.allocate(n_orbs);
-  IntegralsArray tmp_integrals;
-  tmp_integrals.allocate(n_orbs);
-
-// Two-body integrals
-#pragma omp parallel for collapse(2)
-  for (unsigned p = 0; p < n_orbs; p++) {
-    for (unsigned q = 0; q < n_orbs; q++) {
-      for (unsigned r = 0; r < n_orbs; r++) {
-        for (unsigned s = 0; s < n_orbs; s++) {
-          tmp_integrals.get_2b(p, q, r, s) = integrals.get_2b(p, q, r, s);
-        } // s
-      }   // r
-    }     // q
-  }       // p
-
-#pragma omp parallel for collapse(2)
-  for (unsigned p = 0; p < n_orbs; p++) {
-    for (unsigned q = 0; q < n_orbs; q++) {
-      for (unsigned r = 0; r < n_orbs; r++) {
-        for (unsigned s = 0; s < n_orbs; s++) {
-          double new_val = 0.;
-          for (unsigned i = 0; i < n_orbs; i++) {
-            new_val += rot(i, p) * tmp_integrals.get_2b(i, q, r, s);
-          }
-          new_integrals.get_2b(p, q, r, s) = new_val;
-        } // s
-      }   // r
-    }     // q
-  }       // p
-
-  tmp_integrals = new_integrals;
-
-#pragma omp parallel for collapse(2)
-  for (unsigned p = 0; p < n_orbs; p++) {
-    for (unsigned q = 0; q < n_orbs; q++) {
-      for (unsigned r = 0; r < n_orbs; r++) {
-        for (unsigned s = 0; s < n_orbs; s++) {
-          double new_val = 0.;
-          for (unsigned i = 0; i < n_orbs; i++) {
-            new_val += rot(i, q) * tmp_integrals.get_2b(p, i, r, s);
-          }
-          new_integrals.get_2b(p, q, r, s) = new_val;
-        } // s
-      }   // r
-    }     // q
-  }       // p
+  const size_t n_pairs = Integrals::combine2(n_orbs, 0);
 
-  tmp_integrals = new_integrals;
-
-#pragma omp parallel for collapse(2)
-  for (unsigned p = 0; p < n_orbs; p++) {
-    for (unsigned q = 0; q < n_orbs; q++) {
-      for (unsigned r = 0; r < n_orbs; r++) {
-        for (unsigned s = 0; s < n_orbs; s++) {
-          double new_val = 0.;
-          for (unsigned i = 0; i < n_orbs; i++) {
-            new_val += rot(i, r) * tmp_integrals.get_2b(p, q, i, s);
-          }
-          new_integrals.get_2b(p, q, r, s) = new_val;
-        } // s
-      }   // r
-    }     // q
-  }       // p
-
-  tmp_integrals = new_integrals;
-
-#pragma omp parallel for collapse(2)
-  for (unsigned p = 0; p < n_orbs; p++) {
-    for (unsigned q = 0; q < n_orbs; q++) {
-      for (unsigned r = 0; r < n_orbs; r++) {
-        for (unsigned s = 0; s < n_orbs; s++) {
-          double new_val = 0.;
-          for (unsigned i = 0; i < n_orbs; i++) {
-            new_val += rot(i, s) * tmp_integrals.get_2b(p, q, r, i);
-          }
-          new_integrals.get_2b(p, q, r, s) = new_val;
-        } // s
-      }   // r
-    }     // q
-  }       // p
-
-// One-body integrals
-#pragma omp parallel for collapse(2)
-  for (unsigned p = 0; p < n_orbs; p++) {
-    for (unsigned q = 0; q < n_orbs; q++) {
-      tmp_integrals.get_1b(p, q) = integrals.get_1b(p, q);
+  // Two-body integrals, packed by the pq and rs symmetries. Rotating the row pairs and
+  // transposing twice rotates all four orbitals.
+  MatrixXd packed(n_pairs, n_pairs);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (unsigned r = 0; r < n_orbs; r++) {
+    for (unsigned s = 0; s <= r; s++) {
+      const size_t rs = Integrals::combine2(r, s);
+      for (unsigned p = 0; p < n_orbs; p++) {
+        for (unsigned q = 0; q <= p; q++) {
+          packed(Integrals::combine2(p, q), rs) = integrals.get_2b(p, q, r, s);
+        }
+      }
     }
   }
+  MatrixXd half_rotated = rotate_row_pairs(packed, rot);
+  packed.resize(0, 0);
+  new_integrals.packed_2b() = rotate_row_pairs(half_rotated, rot);
 
-#pragma omp parallel for collapse(2)
+  // One-body integrals
+  MatrixXd one_body(n_orbs, n_orbs);
   for (unsigned p = 0; p < n_orbs; p++) {
-    for (unsigned q = 0; q < n_orbs; q++) {
-      double new_val = 0.;
-      for (unsigned i = 0; i < n_orbs; i++) {
-        new_val += rot(i, p) * tmp_integrals.get_1b(i, q);
-      }
-      new_integrals.get_1b(p, q) = new_val;
-    }
+    for (unsigned q = 0; q < n_orbs; q++) one_body(p, q) = integrals.get_1b(p, q);
   }
+  const MatrixXd rotated_one_body = rot.transpose() * one_body * rot;
+  for (unsigned p = 0; p < n_orbs; p++) {
+    for (unsigned q = 0; q < n_orbs; q++) new_integrals.get_1b(p, q) = rotated_one_body(p, q);
+  }
+  Timer::end();
+}
 
-  tmp_integrals = new_integrals;
+MatrixXd Optimization::rotate_row_pairs(const MatrixXd& packed, const MatrixXd& rot) {
+  const size_t n = rot.rows();
+  const size_t n_pairs = packed.rows();
+  const size_t n_cols = packed.cols();
+  // About 2 MB of unpacked columns per block.
+  const size_t block_size = std::max<size_t>(1, (1 << 18) / (n * n));
+  MatrixXd rotated(n_cols, n_pairs);
+#pragma omp parallel
+  {
+    MatrixXd unpacked(n, n * block_size);
+    MatrixXd half(n, n * block_size);
+    MatrixXd full(n, n);
+#pragma omp for schedule(dynamic, 1)
+    for (size_t begin = 0; begin < n_cols; begin += block_size) {
+      const size_t n_block_cols = std::min(block_size, n_cols - begin);
+      for (size_t c = 0; c < n_block_cols; c++) {
+        for (size_t p = 0; p < n; p++) {
+          for (size_t q = 0; q <= p; q++) {
+            const double value = packed(Integrals::combine2(p, q), begin + c);
+            unpacked(p, c * n + q) = value;
+            unpacked(q, c * n + p) = value;
+          }
+        }
+      }
 
-#pragma omp parallel for collapse(2)
-  for (unsigned p = 0; p < n_orbs; p++) {
-    for (unsigned q = 0; q < n_orbs; q++) {
-      double new_val = 0.;
-      for (unsigned i = 0; i < n_orbs; i++) {
-        new_val += rot(i, q) * tmp_integrals.get_1b(p, i);
+      // The first index of all the columns of the block in one product, then the second index of
+      // each column.
+      half.leftCols(n * n_block_cols).noalias() =
+          rot.transpose() * unpacked.leftCols(n * n_block_cols);
+      for (size_t c = 0; c < n_block_cols; c++) {
+        full.noalias() = half.middleCols(c * n, n) * rot;
+        for (size_t p = 0; p < n; p++) {
+          for (size_t q = 0; q <= p; q++) {
+            rotated(begin + c, Integrals::combine2(p, q)) = full(p, q);
+          }
+        }
       }
-      new_integrals.get_1b(p, q) = new_val;
     }
   }
-  Timer::end();
+  return rotated;
 }
 
 void Optimization::rewrite_integrals() {
@@ -212,24 +176,27 @@ void Optimization::rewrite_integrals() {
   integrals.integrals_2b.clear();
   integrals.integrals_1b.clear();
 
+  // Each (pq|rs) once, from the pairs pq >= rs.
+  const MatrixXd& packed = new_integrals.packed_2b();
   unsigned p, q, r, s;
-  const double* integrals_ptr = new_integrals.data_2b();
   for (p = 0; p < n_orbs; p++) {
-    for (q = 0; q < n_orbs; q++) {
-      for (r = 0; r < n_orbs; r++) {
-        for (s = 0; s < n_orbs; s++) {
-          integrals.integrals_2b.set(Integrals::combine4(p, q, r, s), *integrals_ptr,
+    for (q = 0; q <= p; q++) {
+      const size_t pq = Integrals::combine2(p, q);
+      for (r = 0; r <= p; r++) {
+        for (s = 0; s <= r; s++) {
+          const size_t rs = Integrals::combine2(r, s);
+          if (rs > pq) continue;
+          integrals.integrals_2b.set(Integrals::combine4(p, q, r, s), packed(pq, rs),
                                         [&](double &a, const double &b) {
                                           if (std::abs(a) < std::abs(b))
                                             a = b;
                                         });
-          integrals_ptr++;
         }
       }
     }
   }
 
-  integrals_ptr = new_integrals.data_1b();
+  const double* integrals_ptr = new_integrals.data_1b();
   for (p = 0; p < n_orbs; p++) {
     for (q = 0; q < n_orbs; q++) {
       integrals.integrals_1b.set(Integrals::combine2(p, q), *integrals_ptr,
@@ -240,21 +207,61 @@ void Optimization::rewrite_integrals() {
       integrals_ptr++;
     }
   }
+  if (Config::get<bool>("share_on_node", false)) integrals.share_on_node();
+  integrals.setup_dense_lookup();
   Timer::end();
 }
 
-void Optimization::get_optorb_rotation_matrix_from_newton() {
-  rdm.get_2rdm(hamiltonian_matrix);
+void Optimization::get_rdms() {
+  static bool first_iteration = true;
+  const std::string& rdm_file = Config::get<std::string>("optimization/rdm_file", "");
+  if (first_iteration && !rdm_file.empty()) {
+    rdm.load_2rdm(rdm_file);
+  } else {
+    rdm.get_2rdm(hamiltonian_matrix);
+  }
+  first_iteration = false;
   rdm.get_1rdm_from_2rdm();
+}
+
+void Optimization::get_optorb_rotation_matrix_from_newton() {
+  get_rdms();
   std::vector<index_t> param_indices = parameter_indices();
   VectorXd grad = gradient(param_indices);
-  MatrixXdR hess = hessian(param_indices);
-  rdm.clear();
   size_t dim = param_indices.size();
 
   // rotation matrix
-  // VectorXd new_param = hess.fullPivLu().solve(-1 * grad);
-  VectorXd new_param = hess.householderQr().solve(-1 * grad);
+  const std::string& newton_solver =
+      Config::get<std::string>("optimization/newton_solver", "dense");
+  VectorXd new_param, hess_diag;
+  if (Util::str_equals_ci("dense", newton_solver)) {
+    MatrixXdR hess = hessian(param_indices);
+    // VectorXd new_param = hess.fullPivLu().solve(-1 * grad);
+    new_param = hess.householderQr().solve(-1 * grad);
+    hess_diag = hess.diagonal();
+  } else if (Util::str_equals_ci("minres", newton_solver)) {
+    hess_diag = hessian_diagonal(param_indices);
+    VectorXd preconditioner(dim);
+    for (size_t i = 0; i < dim; i++) preconditioner(i) = std::max(std::abs(hess_diag(i)), 1e-5);
+    Minres minres;
+    new_param = minres.solve(
+        [&](const VectorXd& x) { return hessian_vector_product(param_indices, x); },
+        -1 * grad,
+        preconditioner,
+        1e-8,
+        Config::get<size_t>("optimization/newton_max_iterations", 200));
+    if (Parallel::is_master()) {
+      printf(
+          "MINRES %s after %zu iterations, residual: %.3e.\n",
+          minres.converged ? "converged" : "stopped",
+          minres.n_iterations,
+          minres.residual);
+    }
+    Timer::checkpoint("solve newton equations");
+  } else {
+    throw std::invalid_argument("unknown optimization/newton_solver");
+  }
+  rdm.clear();
 
   static double eps = 0.05;
   static bool is_first_iter = true;
@@ -275,9 +282,9 @@ void Optimization::get_optorb_rotation_matrix_from_newton() {
       double new_norm = 0., old_norm = 0., inner_prod = 0.;
 
       for (size_t i = 0; i < dim; i++) {
-        inner_prod += old_update(i) * new_update(i) * hess(i, i);
-        new_norm += new_update(i) * new_update(i) * hess(i, i);
-        old_norm += old_update(i) * old_update(i) * hess(i, i);
+        inner_prod += old_update(i) * new_update(i) * hess_diag(i);
+        new_norm += new_update(i) * new_update(i) * hess_diag(i);
+        old_norm += old_update(i) * old_update(i) * hess_diag(i);
       }
       new_norm = std::sqrt(new_norm);
       old_norm = std::sqrt(old_norm);
@@ -305,8 +312,7 @@ void Optimization::get_optorb_rotation_matrix_from_newton() {
 }
 
 void Optimization::get_optorb_rotation_matrix_from_approximate_newton() {
-  rdm.get_2rdm(hamiltonian_matrix);
-  rdm.get_1rdm_from_2rdm();
+  get_rdms();
   std::vector<index_t> param_indices = parameter_indices();
   VectorXd grad = gradient(param_indices);
   MatrixXd hess_diag = hessian_diagonal(param_indices);
@@ -369,8 +375,7 @@ void Optimization::get_optorb_rotation_matrix_from_approximate_newton() {
 }
 
 void Optimization::get_optorb_rotation_matrix_from_grad_descent() {
-  rdm.get_2rdm(hamiltonian_matrix);
-  rdm.get_1rdm_from_2rdm();
+  get_rdms();
   std::vector<index_t> param_indices = parameter_indices();
 
   VectorXd grad = gradient(param_indices);
@@ -381,8 +386,7 @@ void Optimization::get_optorb_rotation_matrix_from_grad_descent() {
 }
 
 void Optimization::get_optorb_rotation_matrix_from_amsgrad() {
-  rdm.get_2rdm(hamiltonian_matrix);
-  rdm.get_1rdm_from_2rdm();
+  get_rdms();
   std::vector<index_t> param_indices = parameter_indices();
   unsigned dim = param_indices.size();
 
@@ -419,8 +423,7 @@ void Optimization::get_optorb_rotation_matrix_from_amsgrad() {
 }
 
 void Optimization::generate_optorb_integrals_from_bfgs() {
-  rdm.get_2rdm(hamiltonian_matrix);
-  rdm.get_1rdm_from_2rdm();
+  get_rdms();
   std::vector<index_t> param_indices = parameter_indices();
   unsigned dim = param_indices.size();
 
@@ -593,6 +596,79 @@ VectorXd Optimization::hessian_diagonal(
   return hessian_diagonal;
 }
 
+VectorXd Optimization::hessian_vector_product(
+    const std::vector<index_t>& param_indices, const VectorXd& x) const {
+  // With kappa the antisymmetric matrix of x, (H x)_pq = G_pq - G_qp for
+  // G_pq = sum_rs kappa_rs [...]_pqrs of Helgaker (10.8.53), where the Y term is computed from
+  // the integrals with the last index rotated by kappa, one orbital q at a time.
+  const unsigned n = n_orbs;
+  const size_t n_param = param_indices.size();
+  MatrixXd kappa = MatrixXd::Zero(n, n);
+  std::vector<std::vector<unsigned>> partners(n);
+  for (size_t i = 0; i < n_param; i++) {
+    const unsigned p = param_indices[i].first;
+    const unsigned q = param_indices[i].second;
+    kappa(p, q) = x(i);
+    kappa(q, p) = -x(i);
+    partners[q].push_back(p);
+    partners[p].push_back(q);
+  }
+  MatrixXd one_rdm(n, n), one_body(n, n);
+  for (unsigned p = 0; p < n; p++) {
+    for (unsigned q = 0; q < n; q++) {
+      one_rdm(p, q) = rdm.one_rdm_elem(p, q);
+      one_body(p, q) = integrals.get_1b(p, q);
+    }
+  }
+  MatrixXd G = 2 * one_rdm * kappa * one_body -
+               (generalized_Fock_matrix + generalized_Fock_matrix.transpose()) * kappa;
+
+#pragma omp parallel
+  {
+    // For the current q and m, A(n, r) = sum_s (qm|ns) kappa_rs and
+    // B(n, r) = sum_s (mn|qs) kappa_rs.
+    MatrixXd integrals_qm(n, n), integrals_mq(n, n), A(n, n), B(n, n);
+    std::vector<double> Y_kappa;
+#pragma omp for schedule(dynamic, 1)
+    for (unsigned q = 0; q < n; q++) {
+      const auto& ps = partners[q];
+      if (ps.empty()) continue;
+      Y_kappa.assign(ps.size(), 0.);
+      for (unsigned m = 0; m < n; m++) {
+        for (unsigned n_ = 0; n_ < n; n_++) {
+          for (unsigned s = 0; s < n; s++) {
+            integrals_qm(n_, s) = integrals.get_2b(q, m, n_, s);
+            integrals_mq(n_, s) = integrals.get_2b(m, n_, q, s);
+          }
+        }
+        A.noalias() = integrals_qm * kappa.transpose();
+        B.noalias() = integrals_mq * kappa.transpose();
+        for (unsigned n_ = 0; n_ < n; n_++) {
+          for (unsigned r = 0; r < n; r++) {
+            const double A_nr = A(n_, r);
+            const double B_nr = B(n_, r);
+            if (A_nr == 0. && B_nr == 0.) continue;
+            for (size_t k = 0; k < ps.size(); k++) {
+              const unsigned p = ps[k];
+              Y_kappa[k] += (rdm.two_rdm_elem(p, r, n_, m) + rdm.two_rdm_elem(p, n_, r, m)) * A_nr +
+                            rdm.two_rdm_elem(p, m, n_, r) * B_nr;
+            }
+          }
+        }
+      }
+      for (size_t k = 0; k < ps.size(); k++) G(ps[k], q) += 2 * Y_kappa[k];
+    }
+  }
+
+  VectorXd product(n_param);
+  for (size_t i = 0; i < n_param; i++) {
+    const unsigned p = param_indices[i].first;
+    const unsigned q = param_indices[i].second;
+    product(i) = G(p, q) - G(q, p);
+  }
+  return product;
+}
+
 void Optimization::get_generalized_Fock() {
   generalized_Fock_matrix.resize(n_orbs, n_orbs);
 #pragma omp parallel for
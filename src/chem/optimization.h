@@ -10,30 +10,33 @@ class IntegralsArray {
 public:
   void allocate(const unsigned n_orbs_) {
     n_orbs = n_orbs_;
-    n_orbs_2 = n_orbs * n_orbs;
-    n_orbs_3 = n_orbs_2 * n_orbs;
-    array_2b.resize(n_orbs_3 * n_orbs);
-    array_1b.resize(n_orbs_2);
+    n_pairs = n_orbs * (n_orbs + 1) / 2;
+    array_2b.resize(n_pairs, n_pairs);
+    array_1b.resize(n_orbs * n_orbs);
   }
 
-  double& get_2b(const unsigned p, const unsigned q, const unsigned r, const unsigned s) {
-    const size_t ind = p * n_orbs_3 + q * n_orbs_2 + r * n_orbs + s;
-    return array_2b[ind];
+  double get_2b(const unsigned p, const unsigned q, const unsigned r, const unsigned s) const {
+    return array_2b(Integrals::combine2(p, q), Integrals::combine2(r, s));
   }
-  
+
+  // (pq|rs) at row combine2(p, q) and column combine2(r, s).
+  MatrixXd& packed_2b() { return array_2b; }
+
+  const MatrixXd& packed_2b() const { return array_2b; }
+
   double& get_1b(const unsigned p, const unsigned q) {
     const size_t ind = p * n_orbs + q;
     return array_1b[ind];
   }
 
-  const double* data_2b() const { return array_2b.data(); }
-
   const double* data_1b() const { return array_1b.data(); }
 
 private:
-  size_t n_orbs, n_orbs_2, n_orbs_3;
+  size_t n_orbs, n_pairs;
 
-  std::vector<double> array_2b, array_1b;
+  MatrixXd array_2b;
+
+  std::vector<double> array_1b;
 };
 
 class Optimization {
@@ -97,8 +100,16 @@ private:
 
   void rotate_integrals();
 
+  // Rotate the orbitals of the row pairs of packed (pq|rs) by rot, a block of columns at a time
+  // as two products per quarter transformation, and return the result transposed.
+  static MatrixXd rotate_row_pairs(const MatrixXd& packed, const MatrixXd& rot);
+
   void rewrite_integrals();
 
+  // The 2RDM and the 1RDM from it, the 2RDM read from optimization/rdm_file in the first
+  // optorb iteration if given.
+  void get_rdms();
+
   std::vector<index_t> parameter_indices() const;
   
   std::vector<index_t> get_most_important_parameter_indices(
@@ -122,7 +133,14 @@ private:
   VectorXd
   hessian_diagonal(const std::vector<std::pair<unsigned, unsigned>> &);
 
+  // The hessian times x without forming the hessian, from the generalized Fock matrix, the RDMs
+  // and the integrals with one index rotated by x.
+  VectorXd hessian_vector_product(
+      const std::vector<index_t>& param_indices, const VectorXd& x) const;
+
   double Y_matrix(const unsigned p, const  unsigned q, const unsigned r, const unsigned s) const;
 
   double hessian_part(const unsigned p, const unsigned q, const unsigned r, const unsigned s) const;
+
+  friend class OptimizationTest;
 };
@@ -0,0 +1,118 @@
+#include "optimization.h"
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <vector>
+
+// A wavefunction of random coefs over all the dets of N_UP and N_DN electrons in N_ORBS orbitals
+// of C2, whose RDMs have the symmetries of the real ones, and random integrals of C2.
+class OptimizationTest : public ::testing::Test {
+ protected:
+  static constexpr unsigned N_ORBS = 5;
+
+  static constexpr unsigned N_UP = 2;
+
+  static constexpr unsigned N_DN = 2;
+
+  Integrals integrals;
+
+  SparseMatrix hamiltonian_matrix;
+
+  std::vector<Det> dets;
+
+  std::vector<std::vector<double>> coefs;
+
+  std::mt19937 rng{7};
+
+  // Written for the test when missing, since the RDM reads time_sym from the config.
+  bool writes_config = false;
+
+  void SetUp() override {
+    writes_config = !std::ifstream("config.json");
+    if (writes_config) std::ofstream("config.json") << "{}";
+
+    integrals.n_orbs = N_ORBS;
+    integrals.n_up = N_UP;
+    integrals.n_dn = N_DN;
+    integrals.n_elecs = N_UP + N_DN;
+    integrals.orb_sym = {1, 1, 2, 1, 2};
+    integrals.set_point_group(PointGroup::C2);
+    std::uniform_real_distribution<double> value(-1.0, 1.0);
+    const auto& keep = [](double& a, const double& b) { a = b; };
+    for (unsigned p = 0; p < N_ORBS; p++) {
+      for (unsigned q = 0; q <= p; q++) {
+        if (!is_symmetric(p, q)) continue;
+        integrals.integrals_1b.set(Integrals::combine2(p, q), value(rng), keep);
+      }
+    }
+    for (unsigned p = 0; p < N_ORBS; p++) {
+      for (unsigned q = 0; q <= p; q++) {
+        for (unsigned r = 0; r < N_ORBS; r++) {
+          for (unsigned s = 0; s <= r; s++) {
+            if (Integrals::combine2(r, s) > Integrals::combine2(p, q)) continue;
+            if (is_symmetric(p, q) != is_symmetric(r, s)) continue;
+            integrals.integrals_2b.set(Integrals::combine4(p, q, r, s), value(rng), keep);
+          }
+        }
+      }
+    }
+
+    std::vector<HalfDet> half_dets;
+    for (unsigned i = 0; i < N_ORBS; i++) {
+      for (unsigned j = i + 1; j < N_ORBS; j++) half_dets.push_back(HalfDet().set(i).set(j));
+    }
+    for (const auto& up : half_dets) {
+      for (const auto& dn : half_dets) {
+        Det det;
+        det.up = up;
+        det.dn = dn;
+        dets.push_back(det);
+      }
+    }
+    coefs.assign(1, std::vector<double>(dets.size()));
+    for (auto& coef : coefs[0]) coef = value(rng);
+  }
+
+  void TearDown() override {
+    if (writes_config) std::remove("config.json");
+  }
+
+  bool is_symmetric(const unsigned p, const unsigned q) const {
+    return integrals.orb_sym[p] == integrals.orb_sym[q];
+  }
+
+  // The dets j >= i at most two electrons apart from each det i, as the upper triangular
+  // hamiltonian connects them.
+  std::vector<std::vector<size_t>> get_connections() const {
+    std::vector<std::vector<size_t>> connections(dets.size());
+    for (size_t i = 0; i < dets.size(); i++) {
+      for (size_t j = i; j < dets.size(); j++) {
+        const unsigned n_excites =
+            dets[i].up.n_diffs(dets[j].up) + dets[i].dn.n_diffs(dets[j].dn);
+        if (n_excites <= 2) connections[i].push_back(j);
+      }
+    }
+    return connections;
+  }
+
+  void expect_products_match_hessian() {
+    Optimization optimization(integrals, hamiltonian_matrix, dets, coefs);
+    optimization.rdm.get_2rdm(get_connections());
+    optimization.rdm.get_1rdm_from_2rdm();
+    const auto& param_indices = optimization.parameter_indices();
+    ASSERT_EQ(param_indices.size(), 4u);
+    const Eigen::MatrixXd hessian = optimization.hessian(param_indices);
+    EXPECT_GT(hessian.norm(), 1.0);
+    std::uniform_real_distribution<double> value(-1.0, 1.0);
+    for (int k = 0; k < 3; k++) {
+      Eigen::VectorXd x(param_indices.size());
+      for (int i = 0; i < x.size(); i++) x(i) = value(rng);
+      const Eigen::VectorXd& expected = hessian * x;
+      const Eigen::VectorXd& product = optimization.hessian_vector_product(param_indices, x);
+      EXPECT_LT((product - expected).norm(), 1.0e-10 * expected.norm());
+    }
+  }
+};
+
+TEST_F(OptimizationTest, HessianVectorProductMatchesHessian) { expect_products_match_hessian(); }
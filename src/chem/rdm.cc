@@ -2,11 +2,96 @@
 
 #include <fgpl/src/hash_map.h>
 #include <math.h>
+#include <omp.h>
 #include <stdio.h>
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
 #include <eigen/Eigen/Dense>
+#include "../det/compressed_dets.h"
 #include "../parallel.h"
+#include "../solver/segment_file.h"
 #include "../timer.h"
 #include "../util.h"
+#include "product_table.h"
+
+namespace {
+// Header of 1rdm.bin and 2rdm.bin, followed by integrals.orb_order as uint32 and, for the 2RDM,
+// the class of each pair p * n_orbs + s as uint32, each padded to a multiple of 8 bytes. Then come
+// the row major 1RDM or the packed 2RDM as n_elems doubles, or as n_entries SparseEntry of its
+// nonzero elements by index when sparse. Orbitals are in the internal order.
+struct RdmBinaryHeader {
+  uint64_t magic;
+
+  uint64_t n_orbs;
+
+  uint64_t n_elems;
+
+  uint64_t n_entries;
+
+  uint64_t sparse;
+};
+
+struct SparseEntry {
+  uint64_t index;
+
+  double value;
+};
+
+constexpr uint64_t ONE_RDM_BINARY_MAGIC = 0x4d44523149434853ull;
+
+constexpr uint64_t TWO_RDM_BINARY_MAGIC = 0x4d44523249434853ull;
+
+static_assert(sizeof(SparseEntry) == 16, "SparseEntry is written to 2rdm.bin as is");
+
+size_t get_padded(const size_t n_bytes) { return (n_bytes + 7) / 8 * 8; }
+
+// Non-collective write, in chunks below the int count limit of MPI.
+void write_at(MPI_File file, size_t offset, const void* data, size_t n_bytes) {
+  const size_t CHUNK_SIZE = 1 << 30;
+  const char* ptr = static_cast<const char*>(data);
+  while (n_bytes > 0) {
+    const int n_chunk_bytes = std::min(CHUNK_SIZE, n_bytes);
+    if (MPI_File_write_at(file, offset, ptr, n_chunk_bytes, MPI_BYTE, MPI_STATUS_IGNORE) !=
+        MPI_SUCCESS) {
+      throw std::runtime_error("cannot write 2rdm.bin");
+    }
+    offset += n_chunk_bytes;
+    ptr += n_chunk_bytes;
+    n_bytes -= n_chunk_bytes;
+  }
+}
+
+// Index of each of dets, from a hash map, or with compress_var_dets from a CompressedDets of them,
+// which takes a fraction of its memory.
+class DetIds {
+ public:
+  explicit DetIds(const std::vector<Det>& dets)
+      : compressed(Config::get<bool>("compress_var_dets", false)) {
+    if (compressed) {
+      store.build(dets);
+    } else {
+      for (size_t i = 0; i < dets.size(); i++) det2ind[dets[i]] = i;
+    }
+  }
+
+  size_t count(const Det& det) const { return compressed ? store.has(det) : det2ind.count(det); }
+
+  size_t operator[](const Det& det) const {
+    return compressed ? store.get_source_id(store.find(det)) : det2ind.find(det)->second;
+  }
+
+ private:
+  bool compressed;
+
+  CompressedDets store;
+
+  std::unordered_map<Det, size_t, DetHasher> det2ind;
+};
+}  // namespace
 
 
 void RDM::get_1rdm() {
@@ -20,18 +105,15 @@ void RDM::get_1rdm() {
 
   one_rdm = MatrixXd::Zero(n_orbs, n_orbs);
 
-  // Create hash table; used for looking up the index of a det
-  std::unordered_map<Det, size_t, DetHasher> det2ind;
-  for (size_t i = 0; i < dets.size(); i++) {
-    det2ind[dets[i]] = i;
-  }
+  // Used for looking up the index of a det
+  const DetIds det2ind(dets);
 
 #pragma omp parallel for schedule(dynamic, 10)
   for (size_t i_det = 0; i_det < dets.size(); i_det++) {
     const Det& this_det = dets[i_det];
 
-    const std::vector<unsigned> occ_up = this_det.up.get_occupied_orbs();
-    const std::vector<unsigned> occ_dn = this_det.dn.get_occupied_orbs();
+    const auto& occ_up = this_det.up.get_occ_orbs();
+    const auto& occ_dn = this_det.dn.get_occ_orbs();
 
     // up electrons
     for (unsigned i_elec = 0; i_elec < n_up; i_elec++) {
@@ -142,18 +224,15 @@ void RDM::get_1rdm_unpacked() {
 
   one_rdm = MatrixXd::Zero(n_orbs, n_orbs);
 
-  // Create hash table; used for looking up the index of a det
-  std::unordered_map<Det, size_t, DetHasher> det2ind;
-  for (size_t i = 0; i < dets.size(); i++) {
-    det2ind[dets[i]] = i;
-  }
+  // Used for looking up the index of a det
+  const DetIds det2ind(dets);
 
 #pragma omp parallel for
   for (size_t i_det = 0; i_det < dets.size(); i_det++) {
     const Det& this_det = dets[i_det];
 
-    const std::vector<unsigned> occ_up = this_det.up.get_occupied_orbs();
-    const std::vector<unsigned> occ_dn = this_det.dn.get_occupied_orbs();
+    const auto& occ_up = this_det.up.get_occ_orbs();
+    const auto& occ_dn = this_det.dn.get_occ_orbs();
 
     // up electrons
     for (unsigned i_elec = 0; i_elec < n_up; i_elec++) {
@@ -202,8 +281,28 @@ void RDM::get_1rdm_unpacked() {
   Timer::checkpoint("computing 1RDM");
 }
 
-void RDM::dump_1rdm() const {
-  if (Parallel::is_master()) {
+void RDM::dump_1rdm(const bool binary) const {
+  if (binary && Parallel::is_master()) {
+    RdmBinaryHeader header;
+    header.magic = ONE_RDM_BINARY_MAGIC;
+    header.n_orbs = n_orbs;
+    header.n_elems = static_cast<size_t>(n_orbs) * n_orbs;
+    header.n_entries = header.n_elems;
+    header.sparse = 0;
+    std::vector<uint32_t> orb_order(integrals.orb_order.begin(), integrals.orb_order.end());
+    orb_order.resize((n_orbs + 1) / 2 * 2, 0);
+    std::vector<double> elems;
+    elems.reserve(header.n_elems);
+    for (unsigned p = 0; p < n_orbs; p++) {
+      for (unsigned r = 0; r < n_orbs; r++) elems.push_back(one_rdm(p, r));
+    }
+    std::ofstream file("1rdm.bin", std::ofstream::binary | std::ofstream::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(
+        reinterpret_cast<const char*>(orb_order.data()), orb_order.size() * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char*>(elems.data()), elems.size() * sizeof(double));
+    if (!file) throw std::runtime_error("cannot write 1rdm.bin");
+  } else if (Parallel::is_master()) {
     FILE* pFile;
     pFile = fopen("1rdm.csv", "w");
     fprintf(pFile, "p,r,1rdm\n");
@@ -233,14 +332,50 @@ void RDM::write_in_1rdm(const unsigned p, const unsigned q, const double factor,
   one_rdm(p, q) += value;
 }
 
-inline size_t RDM::combine4_2rdm(const unsigned p, const unsigned q, const unsigned r, const unsigned s) const {
-  const size_t a = p * n_orbs + s;
-  const size_t b = q * n_orbs + r;
-  if (a > b) {
-    return (a * (a + 1)) / 2 + b;
-  } else {
-    return (b * (b + 1)) / 2 + a;
+void RDM::setup_2rdm() {
+  // The symmetry products are only tabulated for the abelian groups, take a single class for
+  // the others.
+  const PointGroup point_group = integrals.get_point_group();
+  const bool abelian = point_group != PointGroup::Dooh && point_group != PointGroup::Coov;
+  ProductTable product_table;
+  if (abelian) product_table.set_point_group(point_group);
+  const unsigned n_classes = abelian ? product_table.get_n_syms() : 1;
+
+  const size_t n_pairs = static_cast<size_t>(n_orbs) * n_orbs;
+  pair_classes.resize(n_pairs);
+  pair_positions.resize(n_pairs);
+  std::vector<size_t> class_sizes(n_classes, 0);
+  for (unsigned p = 0; p < n_orbs; p++) {
+    for (unsigned s = 0; s < n_orbs; s++) {
+      const size_t ps = static_cast<size_t>(p) * n_orbs + s;
+      const unsigned pair_class =
+          abelian ? product_table.get_product(integrals.orb_sym[p], integrals.orb_sym[s]) - 1 : 0;
+      pair_classes[ps] = pair_class;
+      pair_positions[ps] = class_sizes[pair_class]++;
+    }
+  }
+  class_offsets.assign(n_classes + 1, 0);
+  for (unsigned c = 0; c < n_classes; c++) {
+    class_offsets[c + 1] = class_offsets[c] + class_sizes[c] * (class_sizes[c] + 1) / 2;
   }
+  two_rdm.assign(class_offsets[n_classes], 0.);
+}
+
+std::pair<size_t, size_t> RDM::get_block(const int proc_id) const {
+  const size_t n_procs = Parallel::get_n_procs();
+  const size_t block_size = (two_rdm.size() + n_procs - 1) / n_procs;
+  const size_t begin = std::min(two_rdm.size(), proc_id * block_size);
+  return std::make_pair(begin, std::min(two_rdm.size(), begin + block_size));
+}
+
+inline size_t RDM::combine4_2rdm(const unsigned p, const unsigned q, const unsigned r, const unsigned s) const {
+  const size_t a = static_cast<size_t>(p) * n_orbs + s;
+  const size_t b = static_cast<size_t>(q) * n_orbs + r;
+  const unsigned pair_class = pair_classes[a];
+  if (pair_classes[b] != pair_class) return NO_ELEM;
+  const size_t hi = std::max(pair_positions[a], pair_positions[b]);
+  const size_t lo = std::min(pair_positions[a], pair_positions[b]);
+  return class_offsets[pair_class] + (hi * (hi + 1)) / 2 + lo;
 }
 
 int RDM::permfac_ccaa(HalfDet halfket, const unsigned p, const unsigned q, const unsigned r, const unsigned s) const {
@@ -333,7 +468,144 @@ void RDM::dump_2rdm(const bool dump_csv) const {
   }
 }
 
-void RDM::get_2rdm(const std::vector<std::vector<size_t>>& connections) {
+void RDM::dump_2rdm_binary(const bool sparse) const {
+  Timer::start("dump 2rdm binary");
+  const auto& block = get_block(Parallel::get_proc_id());
+  std::vector<SparseEntry> entries;
+  if (sparse) {
+    for (size_t index = block.first; index < block.second; index++) {
+      if (two_rdm[index] != 0.) entries.push_back(SparseEntry{index, two_rdm[index]});
+    }
+  }
+  unsigned long long n_local_entries = sparse ? entries.size() : block.second - block.first;
+  unsigned long long n_entries_before = 0;
+  unsigned long long n_entries = 0;
+  MPI_Exscan(
+      &n_local_entries, &n_entries_before, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  if (Parallel::is_master()) n_entries_before = 0;
+  MPI_Allreduce(&n_local_entries, &n_entries, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+  const size_t n_pairs = static_cast<size_t>(n_orbs) * n_orbs;
+  const size_t orb_order_offset = sizeof(RdmBinaryHeader);
+  const size_t pair_classes_offset = orb_order_offset + get_padded(n_orbs * sizeof(uint32_t));
+  const size_t data_offset = pair_classes_offset + get_padded(n_pairs * sizeof(uint32_t));
+  const size_t entry_size = sparse ? sizeof(SparseEntry) : sizeof(double);
+
+  MPI_File file;
+  char filename[] = "2rdm.bin";
+  if (MPI_File_open(
+          MPI_COMM_WORLD, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) !=
+      MPI_SUCCESS) {
+    throw std::runtime_error("cannot open 2rdm.bin");
+  }
+  MPI_File_set_size(file, data_offset + n_entries * entry_size);
+  if (Parallel::is_master()) {
+    RdmBinaryHeader header;
+    header.magic = TWO_RDM_BINARY_MAGIC;
+    header.n_orbs = n_orbs;
+    header.n_elems = two_rdm.size();
+    header.n_entries = n_entries;
+    header.sparse = sparse;
+    const std::vector<uint32_t> orb_order(integrals.orb_order.begin(), integrals.orb_order.end());
+    const std::vector<uint32_t> pair_classes_out(pair_classes.begin(), pair_classes.end());
+    write_at(file, 0, &header, sizeof(header));
+    write_at(file, orb_order_offset, orb_order.data(), n_orbs * sizeof(uint32_t));
+    write_at(file, pair_classes_offset, pair_classes_out.data(), n_pairs * sizeof(uint32_t));
+  }
+  const void* local_data = sparse ? static_cast<const void*>(entries.data())
+                                  : static_cast<const void*>(two_rdm.data() + block.first);
+  write_at(
+      file, data_offset + n_entries_before * entry_size, local_data, n_local_entries * entry_size);
+  MPI_File_close(&file);
+
+  if (Parallel::is_master()) {
+    printf(
+        "2RDM binary saved to: 2rdm.bin, %s, %'llu entries\n",
+        sparse ? "sparse" : "dense",
+        n_entries);
+  }
+  Timer::end();
+}
+
+void RDM::load_2rdm(const std::string& filename) {
+  setup_2rdm();
+  const SegmentFile file(filename);
+  if (!file.is_mapped() || file.get_n_bytes() < sizeof(RdmBinaryHeader)) {
+    throw std::runtime_error("cannot read 2RDM from " + filename);
+  }
+  const auto* header = reinterpret_cast<const RdmBinaryHeader*>(file.get_data());
+  const size_t n_pairs = static_cast<size_t>(n_orbs) * n_orbs;
+  const size_t orb_order_offset = sizeof(RdmBinaryHeader);
+  const size_t pair_classes_offset = orb_order_offset + get_padded(n_orbs * sizeof(uint32_t));
+  const size_t data_offset = pair_classes_offset + get_padded(n_pairs * sizeof(uint32_t));
+  const size_t entry_size = header->sparse ? sizeof(SparseEntry) : sizeof(double);
+  if (header->magic != TWO_RDM_BINARY_MAGIC || header->n_orbs != n_orbs ||
+      header->n_elems != two_rdm.size() ||
+      (!header->sparse && header->n_entries != header->n_elems) ||
+      file.get_n_bytes() != data_offset + header->n_entries * entry_size) {
+    throw std::runtime_error(filename + " is not a 2RDM binary of these orbitals");
+  }
+  const auto* orb_order = reinterpret_cast<const uint32_t*>(file.get_data() + orb_order_offset);
+  const auto* pair_classes_in =
+      reinterpret_cast<const uint32_t*>(file.get_data() + pair_classes_offset);
+  if (!std::equal(integrals.orb_order.begin(), integrals.orb_order.end(), orb_order) ||
+      !std::equal(pair_classes.begin(), pair_classes.end(), pair_classes_in)) {
+    throw std::runtime_error(filename + " is not a 2RDM binary of these orbitals");
+  }
+
+  if (header->sparse) {
+    const auto* entries = reinterpret_cast<const SparseEntry*>(file.get_data() + data_offset);
+    for (size_t k = 0; k < header->n_entries; k++) {
+      if (entries[k].index >= two_rdm.size()) {
+        throw std::runtime_error(filename + " has an entry out of range");
+      }
+      two_rdm[entries[k].index] = entries[k].value;
+    }
+  } else {
+    const auto* elems = reinterpret_cast<const double*>(file.get_data() + data_offset);
+    std::copy(elems, elems + two_rdm.size(), two_rdm.begin());
+  }
+  if (Parallel::is_master()) printf("Loaded 2RDM from: %s\n", filename.c_str());
+}
+
+template <class ForEachConnection>
+void RDM::accumulate_2rdm(const size_t n_rows, const ForEachConnection& for_each_connection) {
+#pragma omp parallel
+  {
+#pragma omp single
+    {
+      n_write_threads = omp_get_num_threads();
+      write_block_size =
+          std::max<size_t>(1, (two_rdm.size() + n_write_threads - 1) / n_write_threads);
+      write_buffers.assign(
+          n_write_threads * n_write_threads, std::vector<std::pair<size_t, double>>());
+    }
+
+    const size_t thread_id = omp_get_thread_num();
+    const size_t rows_per_round = 64 * n_write_threads;
+    for (size_t round_begin = 0; round_begin < n_rows; round_begin += rows_per_round) {
+      const size_t round_end = std::min(n_rows, round_begin + rows_per_round);
+#pragma omp for schedule(dynamic, 1)
+      for (size_t i_det = round_begin; i_det < round_end; i_det++) {
+        const Det& this_det = dets[i_det];
+        for_each_connection(i_det, [&](const size_t connected_ind) {
+          get_2rdm_pair(dets[connected_ind], connected_ind, this_det, i_det);
+        });
+      }
+
+      for (size_t t = 0; t < n_write_threads; t++) {
+        auto& buffer = write_buffers[t * n_write_threads + thread_id];
+        for (const auto& write : buffer) two_rdm[write.first] += write.second;
+        buffer.clear();
+      }
+#pragma omp barrier
+    }
+  }
+  Util::free(write_buffers);
+}
+
+void RDM::get_2rdm(
+    const std::vector<std::vector<size_t>>& connections, const Reduction reduction) {
   //=====================================================
   // Create spatial 2RDM using the variational wavefunction
   // and Hamiltonian connections.
@@ -354,21 +626,14 @@ void RDM::get_2rdm(const std::vector<std::vector<size_t>>& connections) {
   // Modified: Y. Yao, October 2018: MPI compatibility
   //=====================================================
   Timer::start("get 2rdm");
-  const size_t size_two_rdm = n_orbs * n_orbs * (n_orbs * n_orbs + 1) / 2;
-  two_rdm.resize(size_two_rdm, 0.);
+  setup_2rdm();
 
-#pragma omp parallel for schedule(dynamic, 10)
-  for (size_t i_det = 0; i_det < connections.size(); i_det++) {
-    Det this_det = dets[i_det];
+  accumulate_2rdm(
+      connections.size(), [&](const size_t i_det, const std::function<void(size_t)>& handler) {
+        for (const size_t connected_ind : connections[i_det]) handler(connected_ind);
+      });
 
-    for (size_t j_det = 0; j_det < connections[i_det].size(); j_det++) {
-      size_t connected_ind = connections[i_det][j_det];
-      Det connected_det = dets[connected_ind];
-      get_2rdm_pair(connected_det, connected_ind, this_det, i_det);
-    }
-  }
-      
-  MPI_Allreduce_2rdm();
+  reduce_2rdm(reduction);
   Timer::end();
 }
 
@@ -376,22 +641,18 @@ void RDM::get_2rdm(const std::vector<std::vector<size_t>>& connections) {
 void RDM::get_2rdm(const SparseMatrix& hamiltonian_matrix) {
   // This overloaded version takes SparseMatrix as connections type.
   Timer::start("get 2rdm");
-  const size_t size_two_rdm = n_orbs * n_orbs * (n_orbs * n_orbs + 1) / 2;
-  two_rdm.resize(size_two_rdm, 0.);
+  setup_2rdm();
+
+  accumulate_2rdm(
+      hamiltonian_matrix.count_n_rows(),
+      [&](const size_t i_det, const std::function<void(size_t)>& handler) {
+        const auto& hamiltonian_row = hamiltonian_matrix.get_row(i_det);
+        for (size_t j_det = 0; j_det < hamiltonian_row.size(); j_det++) {
+          handler(hamiltonian_row.get_index(j_det));
+        }
+      });
 
-#pragma omp parallel for schedule(dynamic, 10)
-  for (size_t i_det = 0; i_det < hamiltonian_matrix.count_n_rows(); i_det++) {
-    Det this_det = dets[i_det];
-    auto hamiltonian_row = hamiltonian_matrix.get_row(i_det);
-    
-    for (size_t j_det = 0; j_det < hamiltonian_row.size(); j_det++) {
-      size_t connected_ind = hamiltonian_row.get_index(j_det);
-      Det connected_det = dets[connected_ind];
-      get_2rdm_pair(connected_det, connected_ind, this_det, i_det);
-    }
-  }
-      
-  MPI_Allreduce_2rdm();
+  reduce_2rdm(Reduction::ALL);
   Timer::end();
 }
 
@@ -454,8 +715,8 @@ void RDM::get_2rdm_elements(
   // Created: Y. Yao, August 2018
   //=====================================================
 
-  std::vector<unsigned> occ_up = this_det.up.get_occupied_orbs();
-  std::vector<unsigned> occ_dn = this_det.dn.get_occupied_orbs();
+  const auto& occ_up = this_det.up.get_occ_orbs();
+  const auto& occ_dn = this_det.dn.get_occ_orbs();
 
   // 0 alpha excitation apart
   if (this_det.up == connected_det.up) {
@@ -646,43 +907,49 @@ void RDM::write_in_2rdm(const unsigned p, const unsigned q, const unsigned r, co
 		const size_t i_det, const size_t j_det) {
   // <psi_{i_det}| c^+_p c^+_q c_r c_s | psi_{j_det}>
   // By symmetry (p,s)<->(q,r) only half of the 2RDM needs storing.
-  size_t a = p * n_orbs + s;
-  size_t b = q * n_orbs + r;
+  const size_t a = static_cast<size_t>(p) * n_orbs + s;
+  const size_t b = static_cast<size_t>(q) * n_orbs + r;
   if (a >= b) {
+    const size_t index = combine4_2rdm(p, q, r, s);
+    if (index == NO_ELEM) return;
     double value = 0.;
     for (unsigned i_state=0; i_state<n_states; i_state++) value += coefs[i_state][i_det] * coefs[i_state][j_det];
     value *= factor;
-#pragma omp atomic
-    two_rdm[(a * (a + 1)) / 2 + b] += value;
+    write_buffers[omp_get_thread_num() * n_write_threads + index / write_block_size].push_back(
+        std::make_pair(index, value));
   }    
 }
 
-void RDM::MPI_Allreduce_2rdm() {
-  // MPI_Allreduce after computing on mutiple nodes
+void RDM::reduce_2rdm(const Reduction reduction) {
+  // MPI reduction after computing on mutiple nodes
   if (Parallel::get_n_procs() > 1) {
-    std::vector<double> global_two_rdm(two_rdm.size());
-
-    double* src_ptr = two_rdm.data();
-    double* dest_ptr = global_two_rdm.data();
-
     const size_t CHUNK_SIZE = 1 << 27;
-    unsigned n_elems_left = two_rdm.size();
-
-    while (n_elems_left > CHUNK_SIZE) {
-      MPI_Allreduce(src_ptr, dest_ptr, CHUNK_SIZE, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-      n_elems_left -= CHUNK_SIZE;
-      src_ptr += CHUNK_SIZE;
-      dest_ptr += CHUNK_SIZE;
+    const int proc_id = Parallel::get_proc_id();
+    const int n_procs = Parallel::get_n_procs();
+    for (int root = 0; root < (reduction == Reduction::BY_BLOCK ? n_procs : 1); root++) {
+      std::pair<size_t, size_t> block(0, two_rdm.size());
+      if (reduction == Reduction::BY_BLOCK) block = get_block(root);
+      for (size_t begin = block.first; begin < block.second; begin += CHUNK_SIZE) {
+        const int n_elems = std::min(CHUNK_SIZE, block.second - begin);
+        double* ptr = two_rdm.data() + begin;
+        if (reduction == Reduction::ALL) {
+          MPI_Allreduce(MPI_IN_PLACE, ptr, n_elems, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        } else if (proc_id == root) {
+          MPI_Reduce(MPI_IN_PLACE, ptr, n_elems, MPI_DOUBLE, MPI_SUM, root, MPI_COMM_WORLD);
+        } else {
+          MPI_Reduce(ptr, nullptr, n_elems, MPI_DOUBLE, MPI_SUM, root, MPI_COMM_WORLD);
+        }
+      }
     }
-    MPI_Allreduce(src_ptr, dest_ptr, n_elems_left, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    two_rdm = global_two_rdm;
+    if (reduction == Reduction::MASTER && !Parallel::is_master()) Util::free(two_rdm);
   }
 }
 
 double RDM::one_rdm_elem(const unsigned p, const unsigned q) const { return one_rdm(p, q); }
 
 double RDM::two_rdm_elem(const unsigned p, const unsigned q, const unsigned r, const unsigned s) const {
-  return two_rdm[combine4_2rdm(p, q, r, s)];
+  const size_t index = combine4_2rdm(p, q, r, s);
+  return index == NO_ELEM ? 0. : two_rdm[index];
 }
 
 void RDM::get_1rdm_from_2rdm() {
@@ -701,8 +968,10 @@ void RDM::get_1rdm_from_2rdm() {
 
 void RDM::clear() {
   one_rdm.resize(0, 0);
-  two_rdm.clear();
-  two_rdm.shrink_to_fit();
+  Util::free(two_rdm);
+  Util::free(pair_classes);
+  Util::free(pair_positions);
+  Util::free(class_offsets);
 }
 
 void RDM::compute_energy_from_rdm() const {
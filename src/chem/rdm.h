@@ -24,22 +24,36 @@ class RDM {
     time_sym(Config::get<bool>("time_sym", false)) {
   }
 
+  // How the 2RDM is summed over the procs: onto all of them, onto the master only, enough for
+  // dump_2rdm, or each block onto the proc that owns it, enough for dump_2rdm_binary.
+  enum class Reduction { ALL, MASTER, BY_BLOCK };
+
   void get_1rdm();
   
   void get_1rdm_unpacked();
 
   void get_2rdm(
-      const std::vector<std::vector<size_t>>& connections);
+      const std::vector<std::vector<size_t>>& connections,
+      const Reduction reduction = Reduction::ALL);
 
   void get_2rdm(
       const SparseMatrix& hamiltonian_matrix);
 
   void get_1rdm_from_2rdm();
   
-  void dump_1rdm() const;
+  // Binary as 1rdm.bin, else as 1rdm.csv.
+  void dump_1rdm(const bool binary = false) const;
 
   void dump_2rdm(const bool dump_csv = false) const;
 
+  // Write 2rdm.bin, each proc its own block through MPI-IO, either as the packed array or, when
+  // sparse, as the (index, value) pairs of its nonzero elements. Collective.
+  void dump_2rdm_binary(const bool sparse) const;
+
+  // Read the 2RDM of a 2rdm.bin of the same orbitals on each proc, as get_2rdm(hamiltonian_matrix)
+  // would compute it.
+  void load_2rdm(const std::string& filename);
+
   double one_rdm_elem(const unsigned, const unsigned) const;
 
   double two_rdm_elem(const unsigned, const unsigned, const unsigned, const unsigned) const;
@@ -59,10 +73,41 @@ class RDM {
 
   MatrixXd one_rdm;
 
+  // D_pqrs with (p,s) >= (q,r) as pairs, for the pairs whose symmetry products are the same,
+  // since the others vanish. Each class of pairs with the same product is a packed triangle.
   std::vector<double> two_rdm;
 
+  // Class and position within its class of each pair p * n_orbs + s.
+  std::vector<unsigned> pair_classes;
+
+  std::vector<size_t> pair_positions;
+
+  std::vector<size_t> class_offsets;
+
+  // Writes buffered per thread and by the block of two_rdm of the thread that adds them up,
+  // indexed by thread id * n_write_threads + block id.
+  std::vector<std::vector<std::pair<size_t, double>>> write_buffers;
+
+  size_t n_write_threads = 1;
+
+  size_t write_block_size = 1;
+
+  static constexpr size_t NO_ELEM = static_cast<size_t>(-1);
+
+  void setup_2rdm();
+
+  // Range of two_rdm owned by the proc when reduced by block.
+  std::pair<size_t, size_t> get_block(const int proc_id) const;
+
+  // Index in two_rdm, NO_ELEM for the elements forbidden by symmetry.
   inline size_t combine4_2rdm(const unsigned p, const unsigned q, const unsigned r, const unsigned s) const;
 
+  // Accumulate the 2RDM over the rows i_det < n_rows, where for_each_connection(i_det, handler)
+  // calls handler(j_det) for each connection of i_det. Threads take rounds of rows and add up
+  // the writes to their own blocks in between, without atomics.
+  template <class ForEachConnection>
+  void accumulate_2rdm(const size_t n_rows, const ForEachConnection& for_each_connection);
+
   int permfac_ccaa(HalfDet halfket, const unsigned p, const unsigned q, const unsigned r, const unsigned s) const;
 
   void compute_energy_from_rdm() const;
@@ -76,7 +121,8 @@ class RDM {
       const size_t i_det,
       const double tr_factor);
 
-  void MPI_Allreduce_2rdm();
+  // Sum over the procs, in place and in chunks.
+  void reduce_2rdm(const Reduction reduction);
 
   void write_in_1rdm(const unsigned p, const unsigned q, const double factor, const size_t i_det, const size_t j_det);
 
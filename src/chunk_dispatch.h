@@ -0,0 +1,90 @@
+#pragma once
+
+#include <unistd.h>
+#include <cstdlib>
+#include <fstream>
+#include <regex>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "det/half_det.h"
+#include "solver/wf_file.h"
+
+// Hands a chemistry run over to the build with the fewest orbital chunks that still holds all the
+// orbitals, among the builds of make chunk_variants next to this executable. Fewer chunks make
+// every det smaller and every det operation shorter, enough chunks avoid the INF_ORBS path. Runs
+// stay on this build when the wavefunction files they would load have dets of another layout.
+class ChunkDispatch {
+ public:
+  // Call before MPI_Init. Returns when this build is the one to run.
+  static void exec_best_build(char* argv[]);
+
+ private:
+  // The default build, the others are named <exe>_chunks_<n_chunks>.
+  static constexpr unsigned DEFAULT_N_CHUNKS = 2;
+
+  // Set for the handed over run, so that builds that disagree on their names never loop.
+  static constexpr const char* DISPATCHED_ENV = "SHCI_CHUNK_DISPATCHED";
+
+  // From the FCIDUMP header, 0 if not found.
+  static unsigned get_n_orbs();
+
+  static std::string get_exe_path(const char* argv0);
+
+  // Whether a wavefunction file of eps_vars or of the checkpoint holds dets of other than n_chunks.
+  static bool has_files_of_other_n_chunks(const unsigned n_chunks);
+};
+
+inline void ChunkDispatch::exec_best_build(char* argv[]) {
+  if (getenv(DISPATCHED_ENV)) return;
+  if (Config::get<std::string>("system", std::string()) != "chem") return;
+  if (!Config::get<bool>("chunk_dispatch", true)) return;
+  const unsigned n_orbs = get_n_orbs();
+  if (n_orbs == 0) return;
+  unsigned n_chunks = 8;
+  while (n_chunks > 1 && (n_chunks / 2) * 64 >= n_orbs) n_chunks /= 2;
+  if (n_chunks == N_CHUNKS) return;
+  if (has_files_of_other_n_chunks(n_chunks)) return;
+
+  std::string exe = get_exe_path(argv[0]);
+  const std::regex variant_suffix("_chunks_[0-9]+$");
+  exe = std::regex_replace(exe, variant_suffix, "");
+  if (n_chunks != DEFAULT_N_CHUNKS) exe += "_chunks_" + std::to_string(n_chunks);
+  if (access(exe.c_str(), X_OK) != 0) return;
+  setenv(DISPATCHED_ENV, "1", 1);
+  execv(exe.c_str(), argv);
+  unsetenv(DISPATCHED_ENV);  // Only returns if the exec failed.
+}
+
+inline unsigned ChunkDispatch::get_n_orbs() {
+  std::ifstream fcidump("FCIDUMP");
+  const std::regex norb("NORBS?\\s*=\\s*([0-9]+)");
+  std::string line;
+  while (std::getline(fcidump, line)) {
+    std::smatch match;
+    if (std::regex_search(line, match, norb)) return std::stoul(match[1].str());
+    if (line.find("&END") != std::string::npos || line.find('/') != std::string::npos) break;
+  }
+  return 0;
+}
+
+inline std::string ChunkDispatch::get_exe_path(const char* argv0) {
+  char path[4096];
+  const ssize_t n_chars = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (n_chars <= 0) return argv0;
+  return std::string(path, n_chars);
+}
+
+inline bool ChunkDispatch::has_files_of_other_n_chunks(const unsigned n_chunks) {
+  std::vector<std::string> filenames;
+  for (const double eps_var : Config::get<std::vector<double>>("eps_vars", {})) {
+    filenames.push_back(WfFile::get_filename(eps_var));
+  }
+  // Checkpoint::get_wf_filename(), which would read the checkpoint before MPI_Init.
+  filenames.push_back(Config::get<std::string>("checkpoint_file", "checkpoint.dat") + ".wf");
+  for (const auto& filename : filenames) {
+    const unsigned file_n_chunks = WfFile::get_n_chunks(filename);
+    if (file_n_chunks != 0 && file_n_chunks != n_chunks) return true;
+  }
+  return false;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <mpi.h>
+#include <omp.h>
+#include <algorithm>
+#include <json/single_include/nlohmann/json.hpp>
+#include <string>
+#include <vector>
+#include "config.h"
+#include "parallel.h"
+#include "result.h"
+
+// Counts of the work of the screening steps, kept per thread and summed over the threads and procs
+// into result.json at the end of each phase. The hot loops count into locals and add them once per
+// det or batch.
+class Counters {
+ public:
+  enum Counter {
+    // Connected dets generated by find_connected_dets.
+    CANDIDATES,
+    // Queue entries below eps_min skipped by the heat bath break.
+    HEAT_BATH_REJECTIONS,
+    // Excitations rejected by second_rejection.
+    SECOND_REJECTIONS,
+    // Single excitations whose H_ai falls below eps after passing the queue bound.
+    SINGLE_REJECTIONS,
+    // Connected dets found among the var dets.
+    VAR_DET_HITS,
+    // Contributions sent to the hc sums of PT.
+    HC_SUMS_INSERTS,
+    // Bytes of the reduced contributions the sort engine sends to the other procs.
+    HC_SUMS_BYTES_SENT,
+    // Elements traversed by the Hamiltonian times vector products, once per vector.
+    MATVEC_NONZEROS,
+    N_COUNTERS
+  };
+
+  static Counters& get_instance() {
+    static Counters instance;
+    return instance;
+  }
+
+  static void add(const Counter counter, const size_t n) {
+    get_instance().counts[omp_get_thread_num() * STRIDE + counter] += n;
+  }
+
+  static void reset() {
+    auto& instance = get_instance();
+    std::fill(instance.counts.begin(), instance.counts.end(), 0);
+  }
+
+  // Collective. Puts the totals since the last reset under counters/<phase> and resets.
+  static void report(const std::string& phase);
+
+ private:
+  // Counters of different threads are a cache line apart.
+  static constexpr size_t STRIDE = N_COUNTERS + 8;
+
+  std::vector<unsigned long long> counts;
+
+  Counters() { counts.assign(Parallel::get_n_threads() * STRIDE, 0); }
+};
+
+inline void Counters::report(const std::string& phase) {
+  static const char* names[] = {"candidates",
+                                "heat_bath_rejections",
+                                "second_rejections",
+                                "single_rejections",
+                                "var_det_hits",
+                                "hc_sums_inserts",
+                                "hc_sums_bytes_sent",
+                                "matvec_nonzeros"};
+  auto& instance = get_instance();
+  std::vector<unsigned long long> totals(N_COUNTERS, 0);
+  for (int thread_id = 0; thread_id < Parallel::get_n_threads(); thread_id++) {
+    for (size_t i = 0; i < N_COUNTERS; i++) totals[i] += instance.counts[thread_id * STRIDE + i];
+  }
+  MPI_Allreduce(
+      MPI_IN_PLACE, totals.data(), N_COUNTERS, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  nlohmann::json res;
+  for (size_t i = 0; i < N_COUNTERS; i++) res[names[i]] = totals[i];
+  Result::put("counters/" + phase, res);
+  reset();
+}
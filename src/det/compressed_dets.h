@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../util.h"
+#include "det.h"
+#include "det_codec.h"
+
+// Read-only set of dets sorted by up and then dn half det, in a few bytes per det instead of
+// sizeof(Det) plus a hash table, for the phases after the variation. The distinct up and dn half
+// dets are stored once each, in order. The dets of an up half det are contiguous, and a bit per
+// det marks the first of them, so that the up half det of an index is a rank query. The dn half
+// dets are their indices as the varint gaps from the previous det, or the index itself for the
+// first det of an up half det or of a block of BLOCK_SIZE dets, from where a det is decoded.
+class CompressedDets {
+ public:
+  static constexpr size_t NOT_FOUND = static_cast<size_t>(-1);
+
+  // The det at sorted index k is dets[get_source_id(k)] until free_source_ids.
+  void build(const std::vector<Det>& dets);
+
+  size_t size() const { return n_dets; }
+
+  bool empty() const { return n_dets == 0; }
+
+  Det get(const size_t k) const;
+
+  // Sorted index of det, or NOT_FOUND.
+  size_t find(const Det& det) const;
+
+  bool has(const Det& det) const { return find(det) != NOT_FOUND; }
+
+  size_t get_source_id(const size_t k) const { return source_ids[k]; }
+
+  void free_source_ids() { Util::free(source_ids); }
+
+  size_t get_n_bytes() const;
+
+  void clear();
+
+ private:
+  static constexpr size_t BLOCK_SIZE = 16;
+
+  size_t n_dets = 0;
+
+  std::vector<HalfDet> ups;
+
+  std::vector<HalfDet> dns;
+
+  // Index of the first det of each up half det, then n_dets.
+  std::vector<size_t> up_begins;
+
+  // Bit k is set when det k is the first of its up half det.
+  std::vector<uint64_t> up_first_bits;
+
+  // Number of set bits in the words before each word.
+  std::vector<size_t> up_first_ranks;
+
+  std::string dn_codes;
+
+  // Start of each block in dn_codes.
+  std::vector<size_t> block_offsets;
+
+  std::vector<size_t> source_ids;
+
+  bool is_up_first(const size_t k) const { return (up_first_bits[k / 64] >> (k % 64)) & 1; }
+
+  size_t get_up_id(const size_t k) const {
+    const size_t word = k / 64;
+    const unsigned bit = k % 64;
+    const uint64_t mask = bit == 63 ? ~0ull : (1ull << (bit + 1)) - 1;
+    return up_first_ranks[word] + __builtin_popcountll(up_first_bits[word] & mask) - 1;
+  }
+
+  // Reads the dn index of det k from pos, given the one of det k - 1.
+  size_t get_next_dn_id(const size_t k, const size_t dn_id, size_t& pos) const {
+    const size_t code = DetCodec::get_varint(dn_codes, pos);
+    return k % BLOCK_SIZE == 0 || is_up_first(k) ? code : dn_id + code;
+  }
+};
+
+inline void CompressedDets::build(const std::vector<Det>& dets) {
+  clear();
+  n_dets = dets.size();
+  source_ids.resize(n_dets);
+  std::iota(source_ids.begin(), source_ids.end(), 0);
+  std::sort(source_ids.begin(), source_ids.end(), [&](const size_t a, const size_t b) {
+    return dets[a] < dets[b];
+  });
+  dns.reserve(n_dets);
+  for (const auto& det : dets) dns.push_back(det.dn);
+  std::sort(dns.begin(), dns.end());
+  dns.erase(std::unique(dns.begin(), dns.end()), dns.end());
+  dns.shrink_to_fit();
+
+  up_first_bits.assign((n_dets + 63) / 64, 0);
+  block_offsets.reserve((n_dets + BLOCK_SIZE - 1) / BLOCK_SIZE);
+  size_t dn_id_prev = 0;
+  for (size_t k = 0; k < n_dets; k++) {
+    const Det& det = dets[source_ids[k]];
+    const Det* prev = k > 0 ? &dets[source_ids[k - 1]] : nullptr;
+    if (prev && *prev == det) throw std::invalid_argument("duplicate dets in CompressedDets");
+    if (!prev || prev->up != det.up) {
+      ups.push_back(det.up);
+      up_begins.push_back(k);
+      up_first_bits[k / 64] |= 1ull << (k % 64);
+    }
+    if (k % BLOCK_SIZE == 0) block_offsets.push_back(dn_codes.size());
+    const size_t dn_id = std::lower_bound(dns.begin(), dns.end(), det.dn) - dns.begin();
+    const bool is_absolute = k % BLOCK_SIZE == 0 || is_up_first(k);
+    DetCodec::put_varint(is_absolute ? dn_id : dn_id - dn_id_prev, dn_codes);
+    dn_id_prev = dn_id;
+  }
+  up_begins.push_back(n_dets);
+  up_first_ranks.resize(up_first_bits.size());
+  size_t rank = 0;
+  for (size_t word = 0; word < up_first_bits.size(); word++) {
+    up_first_ranks[word] = rank;
+    rank += __builtin_popcountll(up_first_bits[word]);
+  }
+  ups.shrink_to_fit();
+  up_begins.shrink_to_fit();
+  dn_codes.shrink_to_fit();
+}
+
+inline Det CompressedDets::get(const size_t k) const {
+  Det det;
+  det.up = ups[get_up_id(k)];
+  const size_t block_id = k / BLOCK_SIZE;
+  size_t pos = block_offsets[block_id];
+  size_t dn_id = 0;
+  for (size_t j = block_id * BLOCK_SIZE; j <= k; j++) dn_id = get_next_dn_id(j, dn_id, pos);
+  det.dn = dns[dn_id];
+  return det;
+}
+
+inline size_t CompressedDets::find(const Det& det) const {
+  const auto& up_it = std::lower_bound(ups.begin(), ups.end(), det.up);
+  if (up_it == ups.end() || *up_it != det.up) return NOT_FOUND;
+  const auto& dn_it = std::lower_bound(dns.begin(), dns.end(), det.dn);
+  if (dn_it == dns.end() || *dn_it != det.dn) return NOT_FOUND;
+  const size_t target = dn_it - dns.begin();
+  const size_t begin = up_begins[up_it - ups.begin()];
+  const size_t end = up_begins[up_it - ups.begin() + 1];
+
+  // The last block starting after begin at or before det, or else the block of begin. The first
+  // dn index of a block is stored as is.
+  size_t lo = begin / BLOCK_SIZE;
+  size_t hi = (end - 1) / BLOCK_SIZE;
+  while (lo < hi) {
+    const size_t mid = (lo + hi + 1) / 2;
+    size_t pos = block_offsets[mid];
+    if (target < DetCodec::get_varint(dn_codes, pos)) {
+      hi = mid - 1;
+    } else {
+      lo = mid;
+    }
+  }
+
+  size_t pos = block_offsets[lo];
+  size_t dn_id = 0;
+  const size_t block_end = std::min(end, (lo + 1) * BLOCK_SIZE);
+  for (size_t k = lo * BLOCK_SIZE; k < block_end; k++) {
+    dn_id = get_next_dn_id(k, dn_id, pos);
+    if (k < begin) continue;
+    if (dn_id == target) return k;
+    if (dn_id > target) break;
+  }
+  return NOT_FOUND;
+}
+
+inline size_t CompressedDets::get_n_bytes() const {
+  return (ups.capacity() + dns.capacity()) * sizeof(HalfDet) +
+         (up_begins.capacity() + up_first_ranks.capacity() + block_offsets.capacity() +
+          source_ids.capacity()) *
+             sizeof(size_t) +
+         up_first_bits.capacity() * sizeof(uint64_t) + dn_codes.capacity();
+}
+
+inline void CompressedDets::clear() {
+  n_dets = 0;
+  Util::free(ups);
+  Util::free(dns);
+  Util::free(up_begins);
+  Util::free(up_first_bits);
+  Util::free(up_first_ranks);
+  Util::free(dn_codes);
+  Util::free(block_offsets);
+  Util::free(source_ids);
+}
@@ -0,0 +1,84 @@
+#include "compressed_dets.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include <unordered_set>
+
+namespace {
+// Up to double excitations of each half det of a reference of 10 up and 10 dn electrons, and
+// about half of their pairs as the dets, which share their half dets as those of a wavefunction.
+std::vector<Det> get_test_dets(const Det& reference) {
+  std::mt19937 gen(11);
+  std::uniform_int_distribution<unsigned> orb_dist(0, 39);
+  const auto& get_half_dets = [&](const HalfDet& reference_half_det) {
+    std::unordered_set<HalfDet, HalfDetHasher> seen({reference_half_det});
+    std::vector<HalfDet> half_dets({reference_half_det});
+    while (half_dets.size() < 80) {
+      HalfDet half_det = half_dets[gen() % half_dets.size()];
+      const unsigned orb_from = orb_dist(gen);
+      const unsigned orb_to = orb_dist(gen);
+      if (!half_det.has(orb_from) || half_det.has(orb_to)) continue;
+      half_det.unset(orb_from).set(orb_to);
+      if (reference_half_det.n_diffs(half_det) > 4) continue;
+      if (seen.insert(half_det).second) half_dets.push_back(half_det);
+    }
+    return half_dets;
+  };
+  const auto& ups = get_half_dets(reference.up);
+  const auto& dns = get_half_dets(reference.dn);
+  std::vector<Det> dets({reference});
+  for (const auto& up : ups) {
+    for (const auto& dn : dns) {
+      if (gen() % 2 == 0 || (up == reference.up && dn == reference.dn)) continue;
+      Det det;
+      det.up = up;
+      det.dn = dn;
+      dets.push_back(det);
+    }
+  }
+  std::shuffle(dets.begin() + 1, dets.end(), gen);
+  return dets;
+}
+}  // namespace
+
+TEST(CompressedDetsTest, GetAndFind) {
+  Det reference;
+  for (unsigned orb = 0; orb < 10; orb++) {
+    reference.up.set(orb);
+    reference.dn.set(orb);
+  }
+  const auto& dets = get_test_dets(reference);
+  CompressedDets compressed;
+  compressed.build(dets);
+  EXPECT_EQ(compressed.size(), dets.size());
+
+  for (size_t k = 0; k < compressed.size(); k++) {
+    const Det& det = compressed.get(k);
+    EXPECT_EQ(det, dets[compressed.get_source_id(k)]);
+    if (k > 0) {
+      EXPECT_TRUE(compressed.get(k - 1) < det);
+    }
+    EXPECT_EQ(compressed.find(det), k);
+  }
+
+  Det missing = reference;
+  missing.up.unset(0).set(50);
+  EXPECT_FALSE(compressed.has(missing));
+  missing = dets[100];
+  missing.dn.set(60);
+  EXPECT_FALSE(compressed.has(missing));
+  EXPECT_FALSE(compressed.has(Det()));
+
+  compressed.free_source_ids();
+  EXPECT_LT(compressed.get_n_bytes() * 4, dets.size() * sizeof(Det));
+  compressed.clear();
+  EXPECT_TRUE(compressed.empty());
+  EXPECT_FALSE(compressed.has(reference));
+}
+
+TEST(CompressedDetsTest, DuplicateDetsThrow) {
+  Det det;
+  det.up.set(0);
+  CompressedDets compressed;
+  EXPECT_THROW(compressed.build({det, det}), std::invalid_argument);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include "det.h"
+
+// Compact wire encoding of dets as the orbitals where they differ from a reference det, such as
+// HF. Each half det is the number of differing orbitals followed by the gaps between them, all
+// as varints, so that a det a few excitations away from the reference takes a few bytes.
+class DetCodec {
+ public:
+  DetCodec(const Det& reference = Det()) : reference(reference) {}
+
+  void encode(const Det& det, std::string& buf) const {
+    encode(det.up, reference.up, buf);
+    encode(det.dn, reference.dn, buf);
+  }
+
+  // Reads the det at pos and moves pos past it.
+  Det decode(const std::string& buf, size_t& pos) const {
+    Det det;
+    det.up = decode(buf, pos, reference.up);
+    det.dn = decode(buf, pos, reference.dn);
+    return det;
+  }
+
+  // 7 bits per byte, low bits first.
+  static void put_varint(size_t value, std::string& buf) {
+    while (value >= 0x80) {
+      buf.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    buf.push_back(static_cast<char>(value));
+  }
+
+  static size_t get_varint(const std::string& buf, size_t& pos) {
+    size_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      if (pos >= buf.size()) throw std::runtime_error("truncated det encoding");
+      const unsigned char byte = buf[pos++];
+      value |= static_cast<size_t>(byte & 0x7f) << shift;
+      if (byte < 0x80) return value;
+    }
+  }
+
+ private:
+  Det reference;
+
+  static void encode(const HalfDet& half_det, const HalfDet& reference, std::string& buf) {
+    const OccOrbs& orbs = half_det.get_occ_orbs();
+    const OccOrbs& reference_orbs = reference.get_occ_orbs();
+    // Merge the sorted orbitals into the symmetric difference.
+    unsigned diffs[OccOrbs::CAPACITY * 2];
+    unsigned n_diffs = 0;
+    unsigned i = 0;
+    unsigned j = 0;
+    while (i < orbs.size() || j < reference_orbs.size()) {
+      if (j == reference_orbs.size() || (i < orbs.size() && orbs[i] < reference_orbs[j])) {
+        diffs[n_diffs++] = orbs[i++];
+      } else if (i == orbs.size() || reference_orbs[j] < orbs[i]) {
+        diffs[n_diffs++] = reference_orbs[j++];
+      } else {
+        i++;
+        j++;
+      }
+    }
+    put_varint(n_diffs, buf);
+    unsigned next = 0;
+    for (unsigned k = 0; k < n_diffs; k++) {
+      put_varint(diffs[k] - next, buf);
+      next = diffs[k] + 1;
+    }
+  }
+
+  static HalfDet decode(const std::string& buf, size_t& pos, const HalfDet& reference) {
+    HalfDet half_det = reference;
+    const size_t n_diffs = get_varint(buf, pos);
+    size_t next = 0;
+    for (size_t k = 0; k < n_diffs; k++) {
+      const unsigned orb = next + get_varint(buf, pos);
+      if (half_det.has(orb)) {
+        half_det.unset(orb);
+      } else {
+        half_det.set(orb);
+      }
+      next = orb + 1;
+    }
+    return half_det;
+  }
+};
@@ -0,0 +1,59 @@
+#include "det_codec.h"
+#include <gtest/gtest.h>
+#include <random>
+
+TEST(DetCodecTest, RoundTripsAroundReference) {
+  Det reference;
+  for (unsigned orb = 0; orb < 10; orb++) {
+    reference.up.set(orb);
+    reference.dn.set(orb);
+  }
+  const DetCodec codec(reference);
+  std::mt19937 gen(7);
+  std::uniform_int_distribution<unsigned> orb_dist(0, N_CHUNKS * 64 - 1);
+  std::vector<Det> dets;
+  dets.push_back(reference);
+  dets.push_back(Det());
+  for (int i = 0; i < 100; i++) {
+    Det det = reference;
+    for (int k = 0; k < i % 8; k++) {
+      const unsigned orb = orb_dist(gen);
+      if (det.up.has(orb)) {
+        det.up.unset(orb);
+      } else {
+        det.up.set(orb);
+      }
+      det.dn.set(orb_dist(gen));
+    }
+    dets.push_back(det);
+  }
+  std::string buf;
+  for (const auto& det : dets) codec.encode(det, buf);
+  size_t pos = 0;
+  for (const auto& det : dets) EXPECT_EQ(codec.decode(buf, pos), det);
+  EXPECT_EQ(pos, buf.size());
+}
+
+TEST(DetCodecTest, SingleExcitationIsCompact) {
+  Det reference;
+  for (unsigned orb = 0; orb < 10; orb++) {
+    reference.up.set(orb);
+    reference.dn.set(orb);
+  }
+  Det det = reference;
+  det.up.unset(9).set(N_CHUNKS * 64 - 1);
+  std::string buf;
+  DetCodec(reference).encode(det, buf);
+  // The counts and the gaps of the two differing up orbitals, one byte each.
+  EXPECT_EQ(buf.size(), 4);
+}
+
+TEST(DetCodecTest, TruncatedBufferThrows) {
+  Det det;
+  det.up.set(3);
+  std::string buf;
+  DetCodec().encode(det, buf);
+  buf.pop_back();
+  size_t pos = 0;
+  EXPECT_THROW(DetCodec().decode(buf, pos), std::runtime_error);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "../util.h"
+#include "det.h"
+
+// Blocked Bloom filter of a set of dets. All the bits of a det are in one 64 byte block, so a
+// lookup touches a single cache line. No false negatives, about 0.2% false positives.
+class DetFilter {
+ public:
+  void build(const std::vector<Det>& dets);
+
+  // False means the det is surely not in the set.
+  bool may_have(const Det& det) const { return may_have_hash(DetHasher()(det)); }
+
+  // Same as above from the DetHasher value of the det.
+  bool may_have_hash(const size_t det_hash) const {
+    if (words.empty()) return false;
+    const size_t hash = mix(det_hash);
+    const uint64_t* block = &words[(get_block_id(hash)) * WORDS_PER_BLOCK];
+    size_t bits = hash;
+    for (unsigned k = 0; k < N_PROBES; k++) {
+      const unsigned bit = bits & (BITS_PER_BLOCK - 1);
+      if (!(block[bit >> 6] & (1ull << (bit & 63)))) return false;
+      bits >>= 9;
+    }
+    return true;
+  }
+
+  // Fetch the block of the det with this DetHasher value ahead of a lookup.
+  void prefetch_hash(const size_t det_hash) const {
+    if (!words.empty()) __builtin_prefetch(&words[get_block_id(mix(det_hash)) * WORDS_PER_BLOCK]);
+  }
+
+  size_t get_n_bytes() const { return words.capacity() * sizeof(uint64_t); }
+
+  void clear() { Util::free(words); }
+
+ private:
+  static constexpr unsigned WORDS_PER_BLOCK = 8;
+
+  static constexpr unsigned BITS_PER_BLOCK = WORDS_PER_BLOCK * 64;
+
+  static constexpr size_t BITS_PER_DET = 16;
+
+  // Each probe takes 9 bits of the hash value, the block id takes the top bits.
+  static constexpr unsigned N_PROBES = 5;
+
+  unsigned shift = 64;
+
+  std::vector<uint64_t> words;
+
+  // Mixed differently from Util::rehash, which already selects the dets of a PT batch.
+  static size_t get_hash(const Det& det) { return mix(DetHasher()(det)); }
+
+  static size_t mix(size_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  size_t get_block_id(const size_t hash) const {
+    return shift == 64 ? 0 : (hash * 11400714819323198485ull) >> shift;
+  }
+};
+
+inline void DetFilter::build(const std::vector<Det>& dets) {
+  const size_t n_dets = dets.size();
+  size_t n_blocks = 1;
+  shift = 64;
+  while (n_blocks * BITS_PER_BLOCK < n_dets * BITS_PER_DET) {
+    n_blocks *= 2;
+    shift--;
+  }
+  words.assign(n_blocks * WORDS_PER_BLOCK, 0);
+
+#pragma omp parallel for schedule(static, 1024)
+  for (size_t i = 0; i < n_dets; i++) {
+    const size_t hash = get_hash(dets[i]);
+    uint64_t* block = &words[get_block_id(hash) * WORDS_PER_BLOCK];
+    size_t bits = hash;
+    for (unsigned k = 0; k < N_PROBES; k++) {
+      const unsigned bit = bits & (BITS_PER_BLOCK - 1);
+#pragma omp atomic
+      block[bit >> 6] |= 1ull << (bit & 63);
+      bits >>= 9;
+    }
+  }
+}
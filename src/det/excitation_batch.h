@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include "det.h"
+
+// Connected dets of one det with their excitations, as arrays filled by the batched
+// find_connected_dets of the systems. Spin orbitals are numbered up first, then dn from n_orbs.
+// Single excitations move p to r and have q and s equal to p and r.
+class ExcitationBatch {
+ public:
+  static constexpr size_t CAPACITY = 2048;
+
+  std::vector<Det> dets;
+
+  std::vector<int> n_excites;
+
+  std::vector<unsigned> p;
+
+  std::vector<unsigned> q;
+
+  std::vector<unsigned> r;
+
+  std::vector<unsigned> s;
+
+  // Heat bath bound of |H| the excitation passed.
+  std::vector<double> H;
+
+  // Per entry scratch for the caller, such as the hash values of the dets.
+  std::vector<size_t> hashes;
+
+  ExcitationBatch() {
+    dets.reserve(CAPACITY);
+    n_excites.reserve(CAPACITY);
+    p.reserve(CAPACITY);
+    q.reserve(CAPACITY);
+    r.reserve(CAPACITY);
+    s.reserve(CAPACITY);
+    H.reserve(CAPACITY);
+    hashes.reserve(CAPACITY);
+  }
+
+  size_t size() const { return dets.size(); }
+
+  bool is_full() const { return dets.size() >= CAPACITY; }
+
+  void push_back(
+      const Det& det,
+      const int n_excite,
+      const unsigned p_k,
+      const unsigned q_k,
+      const unsigned r_k,
+      const unsigned s_k,
+      const double H_k) {
+    dets.push_back(det);
+    n_excites.push_back(n_excite);
+    p.push_back(p_k);
+    q.push_back(q_k);
+    r.push_back(r_k);
+    s.push_back(s_k);
+    H.push_back(H_k);
+  }
+
+  // Keeps the capacity.
+  void clear() {
+    dets.clear();
+    n_excites.clear();
+    p.clear();
+    q.clear();
+    r.clear();
+    s.clear();
+    H.clear();
+    hashes.clear();
+  }
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+
+// Default capacity for the occupied orbitals past the chunks of an INF_ORBS build, set with
+// -DN_EXTRAS.
+#ifndef N_EXTRAS
+#define N_EXTRAS 7
+#endif
+
+// Occupied orbitals past the chunks of a half det in INF_ORBS builds, in increasing order and
+// packed inline with the unused entries zero, so that dets stay trivially copyable and compare and
+// hash as a few words. Has the parts of the std::set interface the half dets use.
+class ExtraOrbs {
+ public:
+  static constexpr unsigned CAPACITY = N_EXTRAS;
+
+  typedef const uint16_t* const_iterator;
+
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  ExtraOrbs() : orbs(), n_orbs(0) {}
+
+  size_t size() const { return n_orbs; }
+
+  bool empty() const { return n_orbs == 0; }
+
+  size_t count(const unsigned orb) const {
+    for (unsigned i = 0; i < n_orbs; i++) {
+      if (orbs[i] == orb) return 1;
+    }
+    return 0;
+  }
+
+  void insert(const unsigned orb) {
+    unsigned pos = 0;
+    while (pos < n_orbs && orbs[pos] < orb) pos++;
+    if (pos < n_orbs && orbs[pos] == orb) return;
+    if (n_orbs == CAPACITY) throw std::length_error("too many orbitals past the chunks");
+    if (orb > 0xffff) throw std::invalid_argument("orbital past the extra orbitals range");
+    for (unsigned i = n_orbs; i > pos; i--) orbs[i] = orbs[i - 1];
+    orbs[pos] = orb;
+    n_orbs++;
+  }
+
+  void erase(const unsigned orb) {
+    unsigned pos = 0;
+    while (pos < n_orbs && orbs[pos] != orb) pos++;
+    if (pos == n_orbs) return;
+    for (unsigned i = pos + 1; i < n_orbs; i++) orbs[i - 1] = orbs[i];
+    n_orbs--;
+    orbs[n_orbs] = 0;
+  }
+
+  const_iterator begin() const { return orbs.data(); }
+
+  const_iterator end() const { return orbs.data() + n_orbs; }
+
+  const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+
+  const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+  friend bool operator==(const ExtraOrbs& a, const ExtraOrbs& b) {
+    return a.n_orbs == b.n_orbs && a.orbs == b.orbs;
+  }
+
+  template <class B>
+  void serialize(B& buf) const {
+    buf << n_orbs;
+    for (unsigned i = 0; i < n_orbs; i++) buf << orbs[i];
+  }
+
+  template <class B>
+  void parse(B& buf) {
+    *this = ExtraOrbs();
+    uint16_t n_orbs_buf;
+    buf >> n_orbs_buf;
+    if (n_orbs_buf > CAPACITY) throw std::length_error("too many orbitals past the chunks");
+    for (unsigned i = 0; i < n_orbs_buf; i++) buf >> orbs[i];
+    n_orbs = n_orbs_buf;
+  }
+
+ private:
+  std::array<uint16_t, CAPACITY> orbs;
+
+  uint16_t n_orbs;
+};
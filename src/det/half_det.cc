@@ -68,6 +68,27 @@ std::vector<unsigned> HalfDet::get_occupied_orbs() const {
   return res;
 }
 
+OccOrbs HalfDet::get_occ_orbs() const {
+  OccOrbs res;
+  for (int chunk_id = 0; chunk_id < N_CHUNKS; chunk_id++) {
+    uint64_t chunk = chunks[chunk_id];
+    while (chunk != 0) {
+      const auto tz = Util::ctz(chunk);
+      chunk &= chunk - 1;
+      res.orbs[res.n_orbs++] = tz + (chunk_id << 6);
+    }
+  }
+#ifdef INF_ORBS
+  if (res.n_orbs + extras.size() > OccOrbs::CAPACITY) {
+    throw std::length_error("too many occupied orbitals for OccOrbs");
+  }
+  for (unsigned orb : extras) {
+    res.orbs[res.n_orbs++] = orb;
+  }
+#endif
+  return res;
+}
+
 size_t HalfDet::get_hash_value() const {
   size_t hash = 0;
   for (int chunk_id = 0; chunk_id < N_CHUNKS; chunk_id++) {
@@ -103,11 +124,7 @@ void HalfDet::print() const {
 unsigned HalfDet::n_diffs(const HalfDet& rhs) const {
   unsigned n_diffs = 0;
   for (int chunk_id = 0; chunk_id < N_CHUNKS; chunk_id++) {
-    uint64_t chunk_left = chunks[chunk_id];
-    uint64_t chunk_right = rhs.chunks[chunk_id];
-    if (chunk_left == chunk_right) continue;
-    uint64_t chunk_left_only = chunk_left & (~chunk_right);
-    n_diffs += Util::popcnt(chunk_left_only);
+    n_diffs += Util::popcnt(chunks[chunk_id] & ~rhs.chunks[chunk_id]);
   }
 #ifdef INF_ORBS
   for (unsigned orb : extras) {
@@ -118,6 +135,53 @@ unsigned HalfDet::n_diffs(const HalfDet& rhs) const {
 }
 
 DiffResult HalfDet::diff(const HalfDet& rhs) const {
+#ifdef INF_ORBS
+  if (!extras.empty() || !rhs.extras.empty()) return diff_general(rhs);
+#endif
+  DiffResult res;
+  std::array<uint64_t, N_CHUNKS> left_only;
+  std::array<uint64_t, N_CHUNKS> right_only;
+  unsigned n_left_only = 0;
+  unsigned n_right_only = 0;
+  for (int chunk_id = 0; chunk_id < N_CHUNKS; chunk_id++) {
+    left_only[chunk_id] = chunks[chunk_id] & ~rhs.chunks[chunk_id];
+    right_only[chunk_id] = rhs.chunks[chunk_id] & ~chunks[chunk_id];
+    n_left_only += Util::popcnt(left_only[chunk_id]);
+    n_right_only += Util::popcnt(right_only[chunk_id]);
+  }
+  if (n_left_only > 2 || n_right_only > 2) {
+    res.n_diffs = 3;
+    return res;
+  }
+
+  // The sign is the parity of the electrons of the same side below each orbital that differs,
+  // at most two such orbitals on each side.
+  unsigned n_elecs_left = 0;
+  unsigned n_elecs_right = 0;
+  unsigned permutation_factor_helper = 0;
+  unsigned i_left = 0;
+  unsigned i_right = 0;
+  for (int chunk_id = 0; chunk_id < N_CHUNKS; chunk_id++) {
+    for (uint64_t bits = left_only[chunk_id]; bits != 0; bits &= bits - 1) {
+      const uint64_t below = (bits & (~bits + 1)) - 1;
+      res.left_only[i_left++] = Util::ctz(bits) + (chunk_id << 6);
+      permutation_factor_helper += n_elecs_left + Util::popcnt(chunks[chunk_id] & below);
+    }
+    for (uint64_t bits = right_only[chunk_id]; bits != 0; bits &= bits - 1) {
+      const uint64_t below = (bits & (~bits + 1)) - 1;
+      res.right_only[i_right++] = Util::ctz(bits) + (chunk_id << 6);
+      permutation_factor_helper += n_elecs_right + Util::popcnt(rhs.chunks[chunk_id] & below);
+    }
+    n_elecs_left += Util::popcnt(chunks[chunk_id]);
+    n_elecs_right += Util::popcnt(rhs.chunks[chunk_id]);
+  }
+  res.n_diffs = n_left_only;
+  if ((permutation_factor_helper & 1) != 0) res.permutation_factor = -1;
+  return res;
+}
+
+#ifdef INF_ORBS
+DiffResult HalfDet::diff_general(const HalfDet& rhs) const {
   DiffResult res;
   unsigned n_left_only = 0;
   unsigned n_right_only = 0;
@@ -204,6 +268,7 @@ DiffResult HalfDet::diff(const HalfDet& rhs) const {
   }
   return res;
 }
+#endif
 
 unsigned HalfDet::bit_till(unsigned p) const {
   // WARNING: Not working for n_elecs > N_CHUNKS * 64
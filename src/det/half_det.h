@@ -2,12 +2,41 @@
 
 #include <hps/src/hps.h>
 #include <array>
-#include <set>
+#include <type_traits>
 #include <vector>
 #include "diff_result.h"
+#include "extra_orbs.h"
 
-//#define INF_ORBS      // Unlimited norbs, but will use bit representation if norbs <= 64*N_CHUNKS
+// Orbitals past 64 * N_CHUNKS as up to N_EXTRAS extras per half det.
+//#define INF_ORBS
+// 64 orbitals per chunk, set with -DN_CHUNKS for the builds of make chunk_variants.
+#ifndef N_CHUNKS
 #define N_CHUNKS 2
+#endif
+
+// Occupied orbitals in increasing order, in a fixed capacity array so that listing them needs no
+// heap allocation.
+class OccOrbs {
+ public:
+  static constexpr unsigned CAPACITY = N_CHUNKS * 64;
+
+  unsigned size() const { return n_orbs; }
+
+  bool empty() const { return n_orbs == 0; }
+
+  unsigned operator[](const size_t i) const { return orbs[i]; }
+
+  const unsigned* begin() const { return orbs.data(); }
+
+  const unsigned* end() const { return orbs.data() + n_orbs; }
+
+ private:
+  std::array<unsigned, CAPACITY> orbs;
+
+  unsigned n_orbs = 0;
+
+  friend class HalfDet;
+};
 
 class HalfDet {
  public:
@@ -21,6 +50,9 @@ class HalfDet {
 
   std::vector<unsigned> get_occupied_orbs() const;
 
+  // Same as above without a heap allocation, for the per det loops.
+  OccOrbs get_occ_orbs() const;
+
   unsigned n_diffs(const HalfDet& rhs) const;
 
   DiffResult diff(const HalfDet& rhs) const;
@@ -43,7 +75,10 @@ class HalfDet {
   std::array<uint64_t, N_CHUNKS> chunks;
 
 #ifdef INF_ORBS
-  std::set<unsigned> extras;
+  ExtraOrbs extras;
+
+  // Orbital by orbital, for dets with extras.
+  DiffResult diff_general(const HalfDet& rhs) const;
 #endif
 
   friend bool operator==(const HalfDet& a, const HalfDet& b);
@@ -55,24 +90,26 @@ class HalfDet {
   friend bool operator>(const HalfDet& a, const HalfDet& b);
 };
 
+static_assert(std::is_trivially_copyable<HalfDet>::value, "dets are copied as plain words");
+
 template <class B>
 void HalfDet::serialize(B& buf) const {
   for (int chunk_id = 0; chunk_id < N_CHUNKS; chunk_id++) {
     buf << chunks[chunk_id];
+  }
 #ifdef INF_ORBS
-    buf << extras;
+  buf << extras;
 #endif
-  }
 }
 
 template <class B>
 void HalfDet::parse(B& buf) {
   for (int chunk_id = 0; chunk_id < N_CHUNKS; chunk_id++) {
     buf >> chunks[chunk_id];
+  }
 #ifdef INF_ORBS
-    buf >> extras;
+  buf >> extras;
 #endif
-  }
 }
 
 class HalfDetHasher {
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "half_det.h"
+
+// Open addressing hash map from HalfDet, with the keys, their hash values and the values stored
+// in flat arrays and linear probing. Concurrent lookups are safe as long as nobody inserts.
+template <class V>
+class HalfDetMap {
+ public:
+  size_t size() const { return n_keys; }
+
+  bool empty() const { return n_keys == 0; }
+
+  size_t count(const HalfDet& key) const { return find_slot(key, get_hash(key)) != NOT_FOUND; }
+
+  // Returns nullptr if the key is absent.
+  V* find(const HalfDet& key) {
+    const size_t slot = find_slot(key, get_hash(key));
+    return slot == NOT_FOUND ? nullptr : &values[slot];
+  }
+
+  const V* find(const HalfDet& key) const {
+    const size_t slot = find_slot(key, get_hash(key));
+    return slot == NOT_FOUND ? nullptr : &values[slot];
+  }
+
+  // Inserts a default value if the key is absent.
+  V& operator[](const HalfDet& key);
+
+  void reserve(const size_t n_keys_target);
+
+  // Releases the memory too.
+  void clear();
+
+  size_t get_n_bytes() const {
+    return hashes.capacity() * sizeof(size_t) + keys.capacity() * sizeof(HalfDet) +
+           values.capacity() * sizeof(V);
+  }
+
+ private:
+  static constexpr size_t NOT_FOUND = static_cast<size_t>(-1);
+
+  static constexpr double MAX_LOAD_FACTOR = 0.7;
+
+  size_t n_keys = 0;
+
+  // Power of two capacity minus one.
+  size_t mask = 0;
+
+  unsigned shift = 64;
+
+  // Zero marks an empty slot, the stored hash values always have the lowest bit set.
+  std::vector<size_t> hashes;
+
+  std::vector<HalfDet> keys;
+
+  std::vector<V> values;
+
+  static size_t get_hash(const HalfDet& key) { return key.get_hash_value() | 1; }
+
+  // Fibonacci hashing, takes the high bits so that weak low bits of the hash do not matter.
+  size_t get_home_slot(const size_t hash) const {
+    return (hash * 11400714819323198485ull) >> shift;
+  }
+
+  size_t find_slot(const HalfDet& key, const size_t hash) const;
+
+  void rehash(const size_t n_slots);
+};
+
+template <class V>
+constexpr size_t HalfDetMap<V>::NOT_FOUND;
+
+template <class V>
+constexpr double HalfDetMap<V>::MAX_LOAD_FACTOR;
+
+template <class V>
+size_t HalfDetMap<V>::find_slot(const HalfDet& key, const size_t hash) const {
+  if (n_keys == 0) return NOT_FOUND;
+  size_t slot = get_home_slot(hash);
+  while (hashes[slot] != 0) {
+    if (hashes[slot] == hash && keys[slot] == key) return slot;
+    slot = (slot + 1) & mask;
+  }
+  return NOT_FOUND;
+}
+
+template <class V>
+V& HalfDetMap<V>::operator[](const HalfDet& key) {
+  // Existing keys never trigger a rehash, so looking them up this way is also thread safe.
+  const size_t hash = get_hash(key);
+  const size_t found_slot = find_slot(key, hash);
+  if (found_slot != NOT_FOUND) return values[found_slot];
+
+  if (n_keys + 1 > hashes.size() * MAX_LOAD_FACTOR) {
+    rehash(hashes.empty() ? 16 : hashes.size() * 2);
+  }
+  size_t slot = get_home_slot(hash);
+  while (hashes[slot] != 0) slot = (slot + 1) & mask;
+  hashes[slot] = hash;
+  keys[slot] = key;
+  n_keys++;
+  return values[slot];
+}
+
+template <class V>
+void HalfDetMap<V>::reserve(const size_t n_keys_target) {
+  size_t n_slots = hashes.empty() ? 16 : hashes.size();
+  while (n_keys_target > n_slots * MAX_LOAD_FACTOR) n_slots *= 2;
+  if (n_slots > hashes.size()) rehash(n_slots);
+}
+
+template <class V>
+void HalfDetMap<V>::clear() {
+  n_keys = 0;
+  mask = 0;
+  shift = 64;
+  std::vector<size_t>().swap(hashes);
+  std::vector<HalfDet>().swap(keys);
+  std::vector<V>().swap(values);
+}
+
+template <class V>
+void HalfDetMap<V>::rehash(const size_t n_slots) {
+  std::vector<size_t> old_hashes(n_slots, 0);
+  std::vector<HalfDet> old_keys(n_slots);
+  std::vector<V> old_values(n_slots);
+  hashes.swap(old_hashes);
+  keys.swap(old_keys);
+  values.swap(old_values);
+  mask = n_slots - 1;
+  shift = 64;
+  for (size_t n = n_slots; n > 1; n >>= 1) shift--;
+
+  for (size_t old_slot = 0; old_slot < old_hashes.size(); old_slot++) {
+    const size_t hash = old_hashes[old_slot];
+    if (hash == 0) continue;
+    size_t slot = get_home_slot(hash);
+    while (hashes[slot] != 0) slot = (slot + 1) & mask;
+    hashes[slot] = hash;
+    keys[slot] = std::move(old_keys[old_slot]);
+    values[slot] = std::move(old_values[old_slot]);
+  }
+}
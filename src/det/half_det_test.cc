@@ -1,5 +1,35 @@
 #include "half_det.h"
 #include <gtest/gtest.h>
+#include <random>
+
+namespace {
+// Orbital by orbital, the sign from the electrons of the same side below each differing orbital.
+DiffResult get_diff_reference(const HalfDet& a, const HalfDet& b) {
+  DiffResult res;
+  unsigned n_left_only = 0;
+  unsigned n_right_only = 0;
+  unsigned permutation_factor_helper = 0;
+  unsigned n_elecs_a = 0;
+  unsigned n_elecs_b = 0;
+  for (unsigned orb = 0; orb < N_CHUNKS * 64; orb++) {
+    if (a.has(orb) && !b.has(orb)) {
+      if (n_left_only < 2) res.left_only[n_left_only] = orb;
+      n_left_only++;
+      permutation_factor_helper += n_elecs_a;
+    }
+    if (b.has(orb) && !a.has(orb)) {
+      if (n_right_only < 2) res.right_only[n_right_only] = orb;
+      n_right_only++;
+      permutation_factor_helper += n_elecs_b;
+    }
+    if (a.has(orb)) n_elecs_a++;
+    if (b.has(orb)) n_elecs_b++;
+  }
+  res.n_diffs = n_left_only > 2 || n_right_only > 2 ? 3 : n_left_only;
+  res.permutation_factor = permutation_factor_helper % 2 == 0 ? 1 : -1;
+  return res;
+}
+}  // namespace
 
 TEST(HalfDetTest, SetAndGetOrbitals) {
   HalfDet half_det;
@@ -14,6 +44,18 @@ TEST(HalfDetTest, SetAndGetOrbitals) {
   EXPECT_EQ(orbs_2.size(), 2);
 }
 
+TEST(HalfDetTest, OccOrbsMatchOccupiedOrbs) {
+  HalfDet half_det;
+  EXPECT_TRUE(half_det.get_occ_orbs().empty());
+  for (const unsigned orb : {0, 5, 63, 64, 100}) {
+    if (orb < N_CHUNKS * 64) half_det.set(orb);
+  }
+  const auto& orbs = half_det.get_occupied_orbs();
+  const auto& occ_orbs = half_det.get_occ_orbs();
+  ASSERT_EQ(occ_orbs.size(), orbs.size());
+  for (unsigned i = 0; i < orbs.size(); i++) EXPECT_EQ(occ_orbs[i], orbs[i]);
+}
+
 TEST(HalfDetTest, DISABLED_SetAndGetOrbitalsLarge) {
   HalfDet half_det;
   EXPECT_FALSE(half_det.has(0));
@@ -45,6 +87,36 @@ TEST(HalfDetTest, Diff) {
   EXPECT_EQ(diff.right_only[0], 3);
 }
 
+TEST(HalfDetTest, DiffMatchesReference) {
+  std::mt19937 rng(3);
+  std::uniform_int_distribution<unsigned> orb_dist(0, N_CHUNKS * 64 - 1);
+  for (int i = 0; i < 10000; i++) {
+    HalfDet a;
+    for (int j = 0; j < 20; j++) a.set(orb_dist(rng));
+    HalfDet b = a;
+    const int n_excites = i % 4;
+    for (int j = 0; j < n_excites; j++) {
+      unsigned from;
+      unsigned to;
+      do from = orb_dist(rng); while (!b.has(from));
+      do to = orb_dist(rng); while (b.has(to));
+      b.unset(from).set(to);
+    }
+    const auto& diff = a.diff(b);
+    const auto& expected = get_diff_reference(a, b);
+    ASSERT_EQ(diff.n_diffs, expected.n_diffs);
+    unsigned n_left_only = 0;
+    for (unsigned orb = 0; orb < N_CHUNKS * 64; orb++) n_left_only += a.has(orb) && !b.has(orb);
+    EXPECT_EQ(a.n_diffs(b), n_left_only);
+    if (expected.n_diffs > 2) continue;
+    for (unsigned k = 0; k < expected.n_diffs; k++) {
+      EXPECT_EQ(diff.left_only[k], expected.left_only[k]);
+      EXPECT_EQ(diff.right_only[k], expected.right_only[k]);
+    }
+    EXPECT_EQ(diff.permutation_factor, expected.permutation_factor);
+  }
+}
+
 TEST(HalfDetTest, DISABLED_iffLarge) {
   HalfDet a;
   HalfDet b;
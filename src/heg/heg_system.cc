@@ -41,10 +41,15 @@ void HegSystem::setup(const bool) {
   Timer::end();
 }
 
-void HegSystem::setup_hci_queue() {
-  hci_queue.clear();
-  hci_queue.clear();
+size_t HegSystem::get_integrals_hash() const {
+  Util::HashBuf hash_buf;
+  std::ostream stream(&hash_buf);
+  hps::to_stream(std::vector<double>({r_s, r_cut, k_unit, H_unit}), stream);
+  hps::to_stream(n_orbs, stream);
+  return hash_buf.get_hash();
+}
 
+void HegSystem::setup_hci_queue() {
   max_abs_H = 0.0;
 
   // Common dependencies.
@@ -53,10 +58,14 @@ void HegSystem::setup_hci_queue() {
       const std::pair<KPoint, double>& a, const std::pair<KPoint, double>& b) -> bool {
     return a.second > b.second;
   };
+  const size_t width = 4 * k_points.get_n_max() + 1;
+  const size_t n_queues = width * width * width;
+  std::vector<std::vector<std::pair<KPoint, double>>> queues(n_queues);
 
   // Same spin.
   const double diff_max_squared = 4.0 * r_cut * r_cut;
   for (const auto& diff_pq : k_diffs) {
+    auto& queue = queues[get_hci_queue_id(diff_pq)];
     for (const auto& diff_pr : k_diffs) {
       const auto& diff_sr = diff_pr + diff_pr - diff_pq;  // Momentum conservation.
       if (diff_sr == 0 || diff_sr.squared_norm() > diff_max_squared) continue;
@@ -68,35 +77,50 @@ void HegSystem::setup_hci_queue() {
       const double abs_H = std::abs(1.0 / diff_pr.squared_norm() - 1.0 / diff_ps.squared_norm());
       if (abs_H < std::numeric_limits<double>::epsilon()) continue;
       const auto& item = std::make_pair(diff_pr, abs_H * H_unit);
-      hci_queue[diff_pq].push_back(item);
+      queue.push_back(item);
     }
+    std::stable_sort(queue.begin(), queue.end(), sort_comparison);
+    max_abs_H = std::max(max_abs_H, queue.front().second);
   }
   unsigned long long n_same_spin = 0;
-  for (auto& kv : hci_queue) {
-    auto& items = kv.second;
-    std::stable_sort(items.begin(), items.end(), sort_comparison);
-    max_abs_H = std::max(max_abs_H, items.front().second);
-    n_same_spin += items.size();
-  }
+  for (const auto& queue : queues) n_same_spin += queue.size();
   if (Parallel::is_master()) {
     printf("Number of same spin hci queue items: %'llu\n", n_same_spin);
   }
 
   // Opposite spin.
-  const auto& key = KPoint(0, 0, 0);
+  auto& queue = queues[get_hci_queue_id(KPoint(0, 0, 0))];
   for (const auto& diff_pr : k_diffs) {
     const double abs_H = 1.0 / diff_pr.squared_norm();
     if (abs_H < Util::EPS) continue;
     const auto& item = std::make_pair(diff_pr, abs_H * H_unit);
-    hci_queue[key].push_back(item);
+    queue.push_back(item);
   }
-  std::stable_sort(hci_queue[key].begin(), hci_queue[key].end(), sort_comparison);
-  max_abs_H = std::max(max_abs_H, hci_queue[key].front().second);
+  std::stable_sort(queue.begin(), queue.end(), sort_comparison);
+  max_abs_H = std::max(max_abs_H, queue.front().second);
   if (Parallel::is_master()) {
-    printf("Number of opposite spin hci queue items: %'zu\n", hci_queue[key].size());
+    printf("Number of opposite spin hci queue items: %'zu\n", queue.size());
+  }
+
+  // Flatten.
+  hci_queue_offsets.assign(n_queues + 1, 0);
+  for (size_t id = 0; id < n_queues; id++) {
+    hci_queue_offsets[id + 1] = hci_queue_offsets[id] + queues[id].size();
+  }
+  const size_t n_entries = hci_queue_offsets[n_queues];
+  hci_queue_diffs.resize(n_entries);
+  hci_queue_H.resize(n_entries);
+  for (size_t id = 0; id < n_queues; id++) {
+    size_t k = hci_queue_offsets[id];
+    for (const auto& item : queues[id]) {
+      hci_queue_diffs[k] = item.first;
+      hci_queue_H[k] = item.second;
+      k++;
+    }
   }
 
-  helper_size = (n_same_spin + hci_queue[key].size()) * 16 * 2;
+  helper_size = hci_queue_offsets.size() * sizeof(size_t) +
+                n_entries * (sizeof(KPoint) + sizeof(double));
 }
 
 void HegSystem::setup_hf() {
@@ -146,66 +170,9 @@ double HegSystem::find_connected_dets(
     const double eps_max,
     const double eps_min,
     const std::function<void(const Det&, const int n_excite)>& handler,
-    const bool) const {
-  if (eps_max < eps_min) return eps_min;
-
-  const auto& occ_orbs_up = det.up.get_occupied_orbs();
-  const auto& occ_orbs_dn = det.dn.get_occupied_orbs();
-
-  // Add double excitations.
-  if (eps_min > max_abs_H) return eps_min;
-  for (unsigned p_id = 0; p_id < n_elecs; p_id++) {
-    for (unsigned q_id = p_id + 1; q_id < n_elecs; q_id++) {
-      const unsigned p = p_id < n_up ? occ_orbs_up[p_id] : occ_orbs_dn[p_id - n_up] + n_orbs;
-      const unsigned q = q_id < n_up ? occ_orbs_up[q_id] : occ_orbs_dn[q_id - n_up] + n_orbs;
-      double p2 = p;
-      double q2 = q;
-      if (p >= n_orbs && q >= n_orbs) {
-        p2 -= n_orbs;
-        q2 -= n_orbs;
-      } else if (p < n_orbs && q >= n_orbs && p > q - n_orbs) {
-        p2 = q - n_orbs;
-        q2 = p + n_orbs;
-      }
-      const bool same_spin = p2 < n_orbs && q2 < n_orbs;
-      const auto& key = same_spin ? k_points[q2] - k_points[p2] : KPoint(0, 0, 0);
-      const int qs_offset = same_spin ? 0 : n_orbs;
-      for (const auto& item : hci_queue.at(key)) {
-        const double H = item.second;
-        if (H < eps_min) break;
-        if (H >= eps_max) continue;
-        const auto& diff_pr = item.first;
-        const int r2 = k_points.find(diff_pr + k_points[p2]);
-        if (r2 < 0) continue;
-        unsigned r = r2;
-        const int s2 = k_points.find(k_points[p2] + k_points[q2 - qs_offset] - k_points[r]);
-        if (s2 < 0) continue;
-        unsigned s = s2;
-        if (same_spin && s < r) continue;
-        s += qs_offset;
-        if (p >= n_orbs && q >= n_orbs) {
-          r += n_orbs;
-          s += n_orbs;
-        } else if (p < n_orbs && q >= n_orbs && p > q - n_orbs) {
-          const int tmp = s;
-          s = r + n_orbs;
-          r = tmp - n_orbs;
-        }
-
-        const bool occ_r = r < n_orbs ? det.up.has(r) : det.dn.has(r - n_orbs);
-        if (occ_r) continue;
-        const bool occ_s = s < n_orbs ? det.up.has(s) : det.dn.has(s - n_orbs);
-        if (occ_s) continue;
-        Det connected_det(det);
-        p < n_orbs ? connected_det.up.unset(p) : connected_det.dn.unset(p - n_orbs);
-        q < n_orbs ? connected_det.up.unset(q) : connected_det.dn.unset(q - n_orbs);
-        r < n_orbs ? connected_det.up.set(r) : connected_det.dn.set(r - n_orbs);
-        s < n_orbs ? connected_det.up.set(s) : connected_det.dn.set(s - n_orbs);
-        handler(connected_det, 2);
-      }
-    }
-  }
-  return eps_min;
+    const bool second_rejection) const {
+  return find_connected_dets<std::function<void(const Det&, const int)>>(
+      det, eps_max, eps_min, handler, second_rejection);
 }
 
 double HegSystem::get_hamiltonian_elem(
@@ -245,14 +212,14 @@ double HegSystem::get_hamiltonian_elem_no_time_sym(
 double HegSystem::get_one_body_diag(const Det& det) const {
   double energy = 0.0;
 
-  for (const auto& orb : det.up.get_occupied_orbs()) {
+  for (const auto& orb : det.up.get_occ_orbs()) {
     energy += k_points[orb].squared_norm();
   }
 
   if (det.up == det.dn) {
     energy *= 2;
   } else {
-    for (const auto& orb : det.dn.get_occupied_orbs()) {
+    for (const auto& orb : det.dn.get_occ_orbs()) {
       energy += k_points[orb].squared_norm();
     }
   }
@@ -263,8 +230,8 @@ double HegSystem::get_one_body_diag(const Det& det) const {
 }
 
 double HegSystem::get_two_body_diag(const Det& det) const {
-  const auto& occ_orbs_up = det.up.get_occupied_orbs();
-  const auto& occ_orbs_dn = det.dn.get_occupied_orbs();
+  const auto& occ_orbs_up = det.up.get_occ_orbs();
+  const auto& occ_orbs_dn = det.dn.get_occ_orbs();
   double energy = 0.0;
 
   // up to up.
@@ -300,6 +267,30 @@ double HegSystem::get_two_body_diag(const Det& det) const {
   return energy;
 }
 
+double HegSystem::get_hamiltonian_diag_from_parent(
+    const Det& det_a, const Det& det_i, const double H_ii) const {
+  const auto& occ_orbs_up = det_i.up.get_occ_orbs();
+  const auto& occ_orbs_dn = det_i.dn.get_occ_orbs();
+  // Only electrons of the same spin interact on the diagonal.
+  const auto& orb_energy = [&](const unsigned orb, const bool is_up) {
+    double energy = k_points[orb].squared_norm() * k_unit * k_unit * 0.5;
+    for (const unsigned orb_j : is_up ? occ_orbs_up : occ_orbs_dn) {
+      if (orb_j != orb) energy -= H_unit / (k_points[orb] - k_points[orb_j]).squared_norm();
+    }
+    return energy;
+  };
+  const auto& pair_energy =
+      [&](const unsigned orb1, const bool is_up1, const unsigned orb2, const bool is_up2) {
+        if (is_up1 != is_up2) return 0.0;
+        return -H_unit / (k_points[orb1] - k_points[orb2]).squared_norm();
+      };
+  double delta;
+  if (!get_diag_delta(det_i, det_a, orb_energy, pair_energy, delta)) {
+    return get_hamiltonian_elem(det_a, det_a, 0);
+  }
+  return H_ii + delta;
+}
+
 double HegSystem::get_two_body_double(const DiffResult& diff_up, const DiffResult& diff_dn) const {
   double energy = 0.0;
   if (diff_up.n_diffs == 0) {
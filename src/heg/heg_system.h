@@ -1,6 +1,8 @@
 #pragma once
 
 #include "../base_system.h"
+#include "../counters.h"
+#include "../det/excitation_batch.h"
 #include "k_points.h"
 
 class HegSystem : public BaseSystem {
@@ -14,11 +16,47 @@ class HegSystem : public BaseSystem {
       const std::function<void(const Det&, const int)>&,
       const bool second_rejection = false) const override;
 
+  // Same as above with the handler called directly instead of through std::function, so that it
+  // can be inlined into the loops over the excitations.
+  template <class Handler>
+  double find_connected_dets(
+      const Det& det,
+      const double eps_max,
+      const double eps_min,
+      const Handler& handler,
+      const bool second_rejection = false) const;
+
+  // Same as above with the connected dets collected into batch, which is passed to
+  // batch_handler and cleared each time it is full and once at the end.
+  template <class BatchHandler>
+  double find_connected_dets_batched(
+      const Det& det,
+      const double eps_max,
+      const double eps_min,
+      ExcitationBatch& batch,
+      const BatchHandler& batch_handler,
+      const bool second_rejection = false) const;
+
   double get_hamiltonian_elem(const Det&, const Det&, const int) const override;
 
   void update_diag_helper() override {}
 
+  double get_hamiltonian_diag_from_parent(
+      const Det& det_a, const Det& det_i, const double H_ii) const override;
+
+  size_t get_integrals_hash() const override;
+
  private:
+  // Call emit(connected_det, n_excite, p, q, r, s, H) for each excitation, with the spin orbitals
+  // and bound of ExcitationBatch.
+  template <class Emit>
+  double for_each_excitation(
+      const Det& det,
+      const double eps_max,
+      const double eps_min,
+      const Emit& emit,
+      const bool second_rejection) const;
+
   double r_cut;
 
   double r_s;
@@ -31,7 +69,18 @@ class HegSystem : public BaseSystem {
 
   double max_abs_H;
 
-  std::unordered_map<KPoint, std::vector<std::pair<KPoint, double>>, KPointHasher> hci_queue;
+  // Heat bath queues of the differences pr in decreasing |H|, for each difference pq indexed by
+  // its place in the lattice cube of the differences, as flat arrays. The entries of the queue
+  // of pq are [hci_queue_offsets[id], hci_queue_offsets[id + 1]). Opposite spin uses pq = 0.
+  std::vector<size_t> hci_queue_offsets;
+
+  std::vector<KPoint> hci_queue_diffs;
+
+  std::vector<double> hci_queue_H;
+
+  size_t get_hci_queue_id(const KPoint& diff_pq) const {
+    return KPoints::get_lattice_index(diff_pq, 2 * k_points.get_n_max());
+  }
 
   void setup_hci_queue();
 
@@ -45,3 +94,138 @@ class HegSystem : public BaseSystem {
 
   double get_two_body_double(const DiffResult& diff_up, const DiffResult& diff_dn) const;
 };
+
+template <class Handler>
+double HegSystem::find_connected_dets(
+    const Det& det,
+    const double eps_max,
+    const double eps_min,
+    const Handler& handler,
+    const bool second_rejection) const {
+  return for_each_excitation(
+      det,
+      eps_max,
+      eps_min,
+      [&](const Det& connected_det,
+          const int n_excite,
+          const unsigned,
+          const unsigned,
+          const unsigned,
+          const unsigned,
+          const double) { handler(connected_det, n_excite); },
+      second_rejection);
+}
+
+template <class BatchHandler>
+double HegSystem::find_connected_dets_batched(
+    const Det& det,
+    const double eps_max,
+    const double eps_min,
+    ExcitationBatch& batch,
+    const BatchHandler& batch_handler,
+    const bool second_rejection) const {
+  batch.clear();
+  const double max_rejection = for_each_excitation(
+      det,
+      eps_max,
+      eps_min,
+      [&](const Det& connected_det,
+          const int n_excite,
+          const unsigned p,
+          const unsigned q,
+          const unsigned r,
+          const unsigned s,
+          const double H) {
+        batch.push_back(connected_det, n_excite, p, q, r, s, H);
+        if (batch.is_full()) {
+          batch_handler(batch);
+          batch.clear();
+        }
+      },
+      second_rejection);
+  if (batch.size() > 0) {
+    batch_handler(batch);
+    batch.clear();
+  }
+  return max_rejection;
+}
+
+template <class Emit>
+double HegSystem::for_each_excitation(
+    const Det& det,
+    const double eps_max,
+    const double eps_min,
+    const Emit& emit,
+    const bool) const {
+  if (eps_max < eps_min) return eps_min;
+
+  const auto& occ_orbs_up = det.up.get_occ_orbs();
+  const auto& occ_orbs_dn = det.dn.get_occ_orbs();
+
+  // Add double excitations.
+  if (eps_min > max_abs_H) return eps_min;
+  size_t n_candidates = 0;
+  size_t n_heat_bath_rejections = 0;
+  for (unsigned p_id = 0; p_id < n_elecs; p_id++) {
+    for (unsigned q_id = p_id + 1; q_id < n_elecs; q_id++) {
+      const unsigned p = p_id < n_up ? occ_orbs_up[p_id] : occ_orbs_dn[p_id - n_up] + n_orbs;
+      const unsigned q = q_id < n_up ? occ_orbs_up[q_id] : occ_orbs_dn[q_id - n_up] + n_orbs;
+      double p2 = p;
+      double q2 = q;
+      if (p >= n_orbs && q >= n_orbs) {
+        p2 -= n_orbs;
+        q2 -= n_orbs;
+      } else if (p < n_orbs && q >= n_orbs && p > q - n_orbs) {
+        p2 = q - n_orbs;
+        q2 = p + n_orbs;
+      }
+      const bool same_spin = p2 < n_orbs && q2 < n_orbs;
+      const int qs_offset = same_spin ? 0 : n_orbs;
+      const KPoint k_p = k_points[p2];
+      const KPoint k_pq = k_p + k_points[q2 - qs_offset];
+      const auto& key = same_spin ? k_points[q2] - k_p : KPoint(0, 0, 0);
+      const size_t queue_id = get_hci_queue_id(key);
+      const size_t queue_end = hci_queue_offsets[queue_id + 1];
+      for (size_t k = hci_queue_offsets[queue_id]; k < queue_end; k++) {
+        const double H = hci_queue_H[k];
+        if (H < eps_min) {
+          n_heat_bath_rejections += queue_end - k;
+          break;
+        }
+        if (H >= eps_max) continue;
+        const auto& diff_pr = hci_queue_diffs[k];
+        const int r2 = k_points.find(diff_pr + k_p);
+        if (r2 < 0) continue;
+        unsigned r = r2;
+        const int s2 = k_points.find(k_pq - k_points[r]);
+        if (s2 < 0) continue;
+        unsigned s = s2;
+        if (same_spin && s < r) continue;
+        s += qs_offset;
+        if (p >= n_orbs && q >= n_orbs) {
+          r += n_orbs;
+          s += n_orbs;
+        } else if (p < n_orbs && q >= n_orbs && p > q - n_orbs) {
+          const int tmp = s;
+          s = r + n_orbs;
+          r = tmp - n_orbs;
+        }
+
+        const bool occ_r = r < n_orbs ? det.up.has(r) : det.dn.has(r - n_orbs);
+        if (occ_r) continue;
+        const bool occ_s = s < n_orbs ? det.up.has(s) : det.dn.has(s - n_orbs);
+        if (occ_s) continue;
+        Det connected_det(det);
+        p < n_orbs ? connected_det.up.unset(p) : connected_det.dn.unset(p - n_orbs);
+        q < n_orbs ? connected_det.up.unset(q) : connected_det.dn.unset(q - n_orbs);
+        r < n_orbs ? connected_det.up.set(r) : connected_det.dn.set(r - n_orbs);
+        s < n_orbs ? connected_det.up.set(s) : connected_det.dn.set(s - n_orbs);
+        n_candidates++;
+        emit(connected_det, 2, p, q, r, s, H);
+      }
+    }
+  }
+  Counters::add(Counters::CANDIDATES, n_candidates);
+  Counters::add(Counters::HEAT_BATH_REJECTIONS, n_heat_bath_rejections);
+  return eps_min;
+}
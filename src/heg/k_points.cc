@@ -5,7 +5,7 @@
 #include <unordered_set>
 
 void KPoints::init(const double r_cut) {
-  const int8_t n_max = static_cast<int8_t>(std::floor(r_cut));
+  n_max = static_cast<int>(std::floor(r_cut));
   const double r_cut_square = r_cut * r_cut;
   for (int i = -n_max; i <= n_max; i++) {
     for (int j = -n_max; j <= n_max; j++) {
@@ -20,8 +20,10 @@ void KPoints::init(const double r_cut) {
     return a.squared_norm() < b.squared_norm();
   });
 
+  const size_t width = 2 * n_max + 1;
+  lut.assign(width * width * width, -1);
   for (size_t i = 0; i < points.size(); i++) {
-    lut[points[i]] = i;
+    lut[get_lattice_index(points[i], n_max)] = i;
   }
 }
 
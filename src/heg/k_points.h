@@ -1,6 +1,6 @@
 #pragma once
 
-#include <unordered_map>
+#include <cstdlib>
 #include <vector>
 
 #include "k_point.h"
@@ -15,15 +15,30 @@ class KPoints {
 
   std::vector<KPoint> get_k_diffs() const;
 
-  KPoint operator[](const size_t i) const { return points.at(i); }
+  KPoint operator[](const size_t i) const { return points[i]; }
 
+  // Points within the cutoff have coordinates in [-n_max, n_max].
+  int get_n_max() const { return n_max; }
+
+  // Orbital of the point, or -1 if it is not within the cutoff.
   int find(const KPoint& point) const {
-    if (lut.count(point) == 1) return lut.at(point);
-    return -1;
+    if (std::abs(point.x) > n_max || std::abs(point.y) > n_max || std::abs(point.z) > n_max) {
+      return -1;
+    }
+    return lut[get_lattice_index(point, n_max)];
+  }
+
+  // Index of the point in the cube of the lattice with coordinates in [-half_width, half_width].
+  static size_t get_lattice_index(const KPoint& point, const int half_width) {
+    const size_t width = 2 * half_width + 1;
+    return ((point.x + half_width) * width + (point.y + half_width)) * width + point.z + half_width;
   }
 
  private:
+  int n_max = 0;
+
   std::vector<KPoint> points;
 
-  std::unordered_map<KPoint, size_t, KPointHasher> lut;
+  // Orbital of each point of the lattice cube, -1 outside the cutoff.
+  std::vector<int> lut;
 };
@@ -1,5 +1,6 @@
 #include <cstdio>
 #include <ctime>
+#include "chunk_dispatch.h"
 #include "config.h"
 #include "injector.h"
 #include "parallel.h"
@@ -16,15 +17,19 @@ void print_info(char executable[]) {
   const int n_procs = Parallel::get_n_procs();
   const int n_threads = Parallel::get_n_threads();
   printf("Infrastructure: %d nodes * %d threads\n", n_procs, n_threads);
+  printf("Orbital chunks: %d\n", N_CHUNKS);
   printf("Master node: %s\n", getenv("HOSTNAME"));
   printf("Configuration:\n");
   Config::print();
 }
 
 int main(int, char* argv[]) {
+  ChunkDispatch::exec_best_build(argv);
+
   MPI_Init(nullptr, nullptr);
 
   if (Parallel::is_master()) print_info(argv[0]);
+  Parallel::print_thread_binding();
 
   Result::init();
   
@@ -0,0 +1,152 @@
+#include "parallel.h"
+#include <dirent.h>
+#include <sched.h>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace {
+// NUMA node of the cpu from sysfs, -1 if unknown.
+int get_numa_node(const int cpu) {
+  if (cpu < 0) return -1;
+  const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR* dir = opendir(path.c_str());
+  if (!dir) return -1;
+  int node = -1;
+  while (const dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(0, 4, "node") == 0) {
+      node = std::atoi(name.c_str() + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+size_t count_numa_nodes() {
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (!dir) return 1;
+  size_t n_nodes = 0;
+  while (const dirent* entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(0, 4, "node") == 0 && name[4] >= '0' && name[4] <= '9') {
+      n_nodes++;
+    }
+  }
+  closedir(dir);
+  return std::max<size_t>(n_nodes, 1);
+}
+
+// Sorted values as ranges, e.g. 0-7,16-23.
+std::string get_ranges(const std::set<int>& values) {
+  std::string ranges;
+  for (auto it = values.begin(); it != values.end();) {
+    const int begin = *it;
+    int end = begin;
+    for (it++; it != values.end() && *it == end + 1; it++) end++;
+    if (!ranges.empty()) ranges += ",";
+    ranges += std::to_string(begin);
+    if (end > begin) ranges += "-" + std::to_string(end);
+  }
+  return ranges;
+}
+
+const char* get_proc_bind_name(const omp_proc_bind_t proc_bind) {
+  switch (proc_bind) {
+    case omp_proc_bind_false:
+      return "false";
+    case omp_proc_bind_true:
+      return "true";
+    case omp_proc_bind_master:
+      return "master";
+    case omp_proc_bind_close:
+      return "close";
+    case omp_proc_bind_spread:
+      return "spread";
+  }
+  return "unknown";
+}
+}  // namespace
+
+void Parallel::print_thread_binding() {
+  // Cpu and NUMA node pairs of the threads of this proc.
+  const int n_threads = get_n_threads();
+  std::vector<int> placements(n_threads * 2, -1);
+#pragma omp parallel num_threads(n_threads)
+  {
+    const int thread_id = omp_get_thread_num();
+    const int cpu = sched_getcpu();
+    placements[thread_id * 2] = cpu;
+    placements[thread_id * 2 + 1] = get_numa_node(cpu);
+  }
+  const int proc_bind = omp_get_proc_bind();
+  char host[MPI_MAX_PROCESSOR_NAME] = {0};
+  int host_size;
+  MPI_Get_processor_name(host, &host_size);
+
+  const int n_procs = get_n_procs();
+  const int n_placements = placements.size();
+  std::vector<int> counts(n_procs);
+  MPI_Gather(&n_placements, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+  std::vector<int> displs(n_procs, 0);
+  for (int p = 1; p < n_procs; p++) displs[p] = displs[p - 1] + counts[p - 1];
+  std::vector<int> all_placements(is_master() ? displs.back() + counts.back() : 0);
+  MPI_Gatherv(
+      placements.data(),
+      n_placements,
+      MPI_INT,
+      all_placements.data(),
+      counts.data(),
+      displs.data(),
+      MPI_INT,
+      0,
+      MPI_COMM_WORLD);
+  std::vector<int> proc_binds(n_procs);
+  MPI_Gather(&proc_bind, 1, MPI_INT, proc_binds.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+  std::vector<char> hosts(is_master() ? n_procs * MPI_MAX_PROCESSOR_NAME : 0);
+  MPI_Gather(
+      host,
+      MPI_MAX_PROCESSOR_NAME,
+      MPI_CHAR,
+      hosts.data(),
+      MPI_MAX_PROCESSOR_NAME,
+      MPI_CHAR,
+      0,
+      MPI_COMM_WORLD);
+  if (!is_master()) return;
+
+  printf("Thread binding:\n");
+  bool unbound = false;
+  for (int p = 0; p < n_procs; p++) {
+    std::set<int> cpus;
+    std::map<int, int> node_n_threads;
+    for (int k = displs[p]; k < displs[p] + counts[p]; k += 2) {
+      if (all_placements[k] >= 0) cpus.insert(all_placements[k]);
+      node_n_threads[all_placements[k + 1]]++;
+    }
+    std::string nodes;
+    for (const auto& kv : node_n_threads) {
+      if (!nodes.empty()) nodes += " ";
+      nodes += (kv.first < 0 ? std::string("?") : std::to_string(kv.first)) + ":" +
+               std::to_string(kv.second);
+    }
+    const omp_proc_bind_t bind = static_cast<omp_proc_bind_t>(proc_binds[p]);
+    printf(
+        "  proc %d on %s: %d threads, bind %s, cpus %s, threads per NUMA node %s\n",
+        p,
+        &hosts[p * MPI_MAX_PROCESSOR_NAME],
+        counts[p] / 2,
+        get_proc_bind_name(bind),
+        get_ranges(cpus).c_str(),
+        nodes.c_str());
+    if (bind == omp_proc_bind_false && counts[p] > 2) unbound = true;
+  }
+  if (unbound && count_numa_nodes() > 1) {
+    printf(
+        "  Warning: threads are not bound, set OMP_PROC_BIND=close and OMP_PLACES=cores to keep "
+        "the hamiltonian and the vectors local to them.\n");
+  }
+}
@@ -2,6 +2,9 @@
 
 #include <mpi.h>
 #include <omp.h>
+#include <algorithm>
+#include <climits>
+#include <string>
 
 class Parallel {
  public:
@@ -20,11 +23,28 @@ class Parallel {
 
   static void barrier() { MPI_Barrier(MPI_COMM_WORLD); }
 
+  // Procs of the same node, which can share memory.
+  static MPI_Comm get_node_comm() { return get_instance().node_comm; }
+
+  static int get_n_node_procs() { return get_instance().n_node_procs; }
+
+  static bool is_node_master() { return get_instance().node_proc_id == 0; }
+
+  // From the node master to the other procs of its node.
+  static void broadcast_on_node(std::string& str);
+
+  // Print the CPUs and NUMA nodes of the threads of each proc and warn if the threads are not
+  // bound, which the first touch placement of the large arrays relies on. Collective.
+  static void print_thread_binding();
+
  private:
   Parallel() {
     MPI_Comm_size(MPI_COMM_WORLD, &n_procs);
     MPI_Comm_rank(MPI_COMM_WORLD, &proc_id);
     n_threads = omp_get_max_threads();
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, proc_id, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_size(node_comm, &n_node_procs);
+    MPI_Comm_rank(node_comm, &node_proc_id);
   }
 
   int n_procs;
@@ -32,4 +52,22 @@ class Parallel {
   int proc_id;
 
   int n_threads;
+
+  MPI_Comm node_comm;
+
+  int n_node_procs;
+
+  int node_proc_id;
 };
+
+inline void Parallel::broadcast_on_node(std::string& str) {
+  const MPI_Comm comm = get_node_comm();
+  unsigned long long size = str.size();
+  MPI_Bcast(&size, 1, MPI_UNSIGNED_LONG_LONG, 0, comm);
+  str.resize(size);
+  const unsigned long long TRUNK_SIZE = INT_MAX;
+  for (unsigned long long begin = 0; begin < size; begin += TRUNK_SIZE) {
+    const int n_bytes = std::min(TRUNK_SIZE, size - begin);
+    MPI_Bcast(&str[begin], n_bytes, MPI_CHAR, 0, comm);
+  }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Counter based random numbers, Philox4x32-10 of Salmon et al., SC11. The same seed and counter
+// always give the same numbers, so any proc or thread can draw any part of a stream without
+// sharing a generator state.
+class Philox {
+ public:
+  typedef std::array<uint32_t, 4> Counter;
+
+  explicit Philox(const uint64_t seed) {
+    key[0] = static_cast<uint32_t>(seed);
+    key[1] = static_cast<uint32_t>(seed >> 32);
+  }
+
+  Counter operator()(Counter counter) const {
+    std::array<uint32_t, 2> round_key = key;
+    for (int i = 0; i < N_ROUNDS; i++) {
+      if (i > 0) {
+        round_key[0] += W0;
+        round_key[1] += W1;
+      }
+      const uint64_t product0 = static_cast<uint64_t>(M0) * counter[0];
+      const uint64_t product1 = static_cast<uint64_t>(M1) * counter[2];
+      counter = {{static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ round_key[0],
+                  static_cast<uint32_t>(product1),
+                  static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ round_key[1],
+                  static_cast<uint32_t>(product0)}};
+    }
+    return counter;
+  }
+
+  // Two uniform doubles in [0, 1) with 53 random bits each.
+  std::array<double, 2> get_uniforms(const Counter& counter) const {
+    const Counter& bits = (*this)(counter);
+    const double SCALE = 1.0 / 9007199254740992.0;  // 2^-53
+    std::array<double, 2> uniforms;
+    for (int i = 0; i < 2; i++) {
+      const uint64_t word = (static_cast<uint64_t>(bits[i * 2]) << 32) | bits[i * 2 + 1];
+      uniforms[i] = (word >> 11) * SCALE;
+    }
+    return uniforms;
+  }
+
+ private:
+  static constexpr int N_ROUNDS = 10;
+
+  static constexpr uint32_t M0 = 0xD2511F53;
+
+  static constexpr uint32_t M1 = 0xCD9E8D57;
+
+  static constexpr uint32_t W0 = 0x9E3779B9;
+
+  static constexpr uint32_t W1 = 0xBB67AE85;
+
+  std::array<uint32_t, 2> key;
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <mpi.h>
+#include "parallel.h"
+
+// Array in a shared memory window of the procs of a node. The node master allocates and fills
+// it, the other procs map the same memory.
+template <class T>
+class SharedArray {
+ public:
+  SharedArray() {}
+
+  SharedArray(const SharedArray&) = delete;
+
+  SharedArray& operator=(const SharedArray&) = delete;
+
+  ~SharedArray() { free(); }
+
+  // Collective over the node. n only matters on the node master, the others get its size.
+  void allocate(const size_t n);
+
+  // Collective over the node, after the node master has filled the array.
+  void publish() const { MPI_Win_fence(0, win); }
+
+  // Collective over the node.
+  void free();
+
+  T* data() { return array; }
+
+  const T* data() const { return array; }
+
+  size_t size() const { return n_elems; }
+
+  bool is_allocated() const { return win != MPI_WIN_NULL; }
+
+ private:
+  MPI_Win win = MPI_WIN_NULL;
+
+  T* array = nullptr;
+
+  size_t n_elems = 0;
+};
+
+template <class T>
+void SharedArray<T>::allocate(const size_t n) {
+  free();
+  const MPI_Aint n_bytes = Parallel::is_node_master() ? n * sizeof(T) : 0;
+  void* base;
+  MPI_Win_allocate_shared(
+      n_bytes, sizeof(T), MPI_INFO_NULL, Parallel::get_node_comm(), &base, &win);
+  MPI_Aint n_bytes_master;
+  int disp_unit;
+  MPI_Win_shared_query(win, 0, &n_bytes_master, &disp_unit, &base);
+  array = static_cast<T*>(base);
+  n_elems = n_bytes_master / sizeof(T);
+  MPI_Win_fence(0, win);
+}
+
+template <class T>
+void SharedArray<T>::free() {
+  if (win == MPI_WIN_NULL) return;
+  MPI_Win_free(&win);
+  array = nullptr;
+  n_elems = 0;
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <fgpl/src/broadcast.h>
+#include <hps/src/hps.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../config.h"
+#include "../parallel.h"
+
+// Progress inside the variation and the PT stages, written to checkpoint_file every
+// checkpoint_interval seconds, so that a preempted run resumes from the last one. Entries are
+// keyed by the stage and its parameters, and a run only resumes from those of the same ones.
+class Checkpoint {
+ public:
+  // State of a variation stage after an iteration. The dets and coefs are in get_wf_filename().
+  struct VarProgress {
+    double eps_var = 0.0;
+
+    bool until_converged = true;
+
+    // The stage has converged, only the results are left.
+    bool done = false;
+
+    size_t n_dets = 0;
+
+    size_t var_iteration_global = 0;
+
+    std::vector<double> eps_tried_prev;
+
+    template <class B>
+    void serialize(B& buf) const {
+      buf << eps_var << until_converged << done << n_dets << var_iteration_global
+          << eps_tried_prev;
+    }
+
+    template <class B>
+    void parse(B& buf) {
+      buf >> eps_var >> until_converged >> done >> n_dets >> var_iteration_global >>
+          eps_tried_prev;
+    }
+  };
+
+  // State of a PT stage after a batch or a sto iteration. The sums are per state of the pass.
+  struct PtProgress {
+    // The stage has finished with the values and uncerts.
+    bool done = false;
+
+    size_t n_batches = 0;
+
+    size_t n_batches_dtm = 0;
+
+    // Next batch or sto iteration.
+    size_t batch_id = 0;
+
+    size_t n_pt_dets_sum = 0;
+
+    bool psto_converged = false;
+
+    std::vector<double> energy_sum;
+
+    std::vector<double> energy_sq_sum;
+
+    std::vector<double> energy_dtm_sum;
+
+    std::vector<double> values;
+
+    std::vector<double> uncerts;
+
+    // Corrections of the sto iterations so far.
+    std::vector<std::vector<double>> loops;
+
+    template <class B>
+    void serialize(B& buf) const {
+      buf << done << n_batches << n_batches_dtm << batch_id << n_pt_dets_sum << psto_converged
+          << energy_sum << energy_sq_sum << energy_dtm_sum << values << uncerts << loops;
+    }
+
+    template <class B>
+    void parse(B& buf) {
+      buf >> done >> n_batches >> n_batches_dtm >> batch_id >> n_pt_dets_sum >> psto_converged >>
+          energy_sum >> energy_sq_sum >> energy_dtm_sum >> values >> uncerts >> loops;
+    }
+  };
+
+  static Checkpoint& get_instance() {
+    static Checkpoint instance;
+    return instance;
+  }
+
+  static bool is_enabled() { return get_instance().interval > 0.0; }
+
+  // Collective. Whether checkpoint_interval seconds have passed since the last write.
+  static bool is_due();
+
+  template <class T>
+  static bool get(const std::string& key, T& value);
+
+  // Kept in memory until the next write.
+  template <class T>
+  static void put(const std::string& key, const T& value) {
+    if (is_enabled()) get_instance().entries[key] = hps::to_string(value);
+  }
+
+  // Removes the entries whose keys start with prefix.
+  static void erase(const std::string& prefix);
+
+  // Collective. The master writes the entries under another name first and then renames it,
+  // so that an interrupted write leaves the previous checkpoint. Without entries, removes it.
+  static void write();
+
+  // Dets and coefs of the variation stage in progress.
+  static std::string get_wf_filename() { return get_instance().filename + ".wf"; }
+
+ private:
+  Checkpoint();
+
+  double interval = 0.0;
+
+  std::string filename;
+
+  std::map<std::string, std::string> entries;
+
+  std::chrono::steady_clock::time_point last_write;
+};
+
+inline Checkpoint::Checkpoint() {
+  interval = Config::get<double>("checkpoint_interval", 0.0);
+  filename = Config::get<std::string>("checkpoint_file", "checkpoint.dat");
+  last_write = std::chrono::steady_clock::now();
+  if (interval <= 0.0) return;
+  if (Parallel::is_master()) {
+    std::ifstream file(filename, std::ifstream::binary);
+    if (file) {
+      std::stringstream serialized;
+      serialized << file.rdbuf();
+      hps::from_string(serialized.str(), entries);
+      printf("Resuming from checkpoint %s (%zu entries)\n", filename.c_str(), entries.size());
+    }
+  }
+  fgpl::broadcast(entries);
+}
+
+inline bool Checkpoint::is_due() {
+  auto& instance = get_instance();
+  if (instance.interval <= 0.0) return false;
+  int due = 0;
+  if (Parallel::is_master()) {
+    const double elapsed =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - instance.last_write)
+            .count();
+    due = elapsed >= instance.interval;
+  }
+  MPI_Bcast(&due, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  return due != 0;
+}
+
+template <class T>
+bool Checkpoint::get(const std::string& key, T& value) {
+  const auto& entries = get_instance().entries;
+  const auto& it = entries.find(key);
+  if (it == entries.end()) return false;
+  hps::from_string(it->second, value);
+  return true;
+}
+
+inline void Checkpoint::erase(const std::string& prefix) {
+  auto& entries = get_instance().entries;
+  for (auto it = entries.begin(); it != entries.end();) {
+    if (it->first.compare(0, prefix.size(), prefix) == 0) {
+      it = entries.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+inline void Checkpoint::write() {
+  auto& instance = get_instance();
+  if (instance.interval <= 0.0) return;
+  if (Parallel::is_master() && instance.entries.empty()) {
+    std::remove(instance.filename.c_str());
+  } else if (Parallel::is_master()) {
+    const std::string& tmp_filename = instance.filename + ".tmp";
+    std::ofstream file(tmp_filename, std::ofstream::binary | std::ofstream::trunc);
+    hps::to_stream(instance.entries, file);
+    file.close();
+    if (!file || std::rename(tmp_filename.c_str(), instance.filename.c_str()) != 0) {
+      std::remove(tmp_filename.c_str());
+      throw std::runtime_error("cannot write checkpoint " + instance.filename);
+    }
+  }
+  Parallel::barrier();
+  instance.last_write = std::chrono::steady_clock::now();
+}
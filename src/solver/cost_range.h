@@ -0,0 +1,112 @@
+#pragma once
+
+#include <mpi.h>
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include "../parallel.h"
+
+// Indices start, start + step, ... < end distributed by estimated cost, for loops where the
+// cost varies by orders of magnitude between indices, unlike the round robin of fgpl::DistRange.
+// The indices are ranked by cost class and dealt to the procs in a zigzag, so each proc gets a
+// similar share of every class, and only the ranking of the estimates matters. Each proc starts
+// with its most expensive indices and its threads take the next index from a shared counter, so
+// the cheap ones fill in behind the stragglers.
+class CostRange {
+ public:
+  // cost(i) >= 0 must be the same on all procs, except with local, where all the indices stay on
+  // this proc, for loops over the part of the data held by each proc, and only their order is by
+  // cost.
+  template <class Cost>
+  CostRange(
+      const size_t start,
+      const size_t end,
+      const size_t step,
+      const Cost& cost,
+      const bool local = false);
+
+  // Returns the seconds this proc spent before waiting for the others. Collective.
+  template <class Handler>
+  double for_each(const Handler& handler) const;
+
+  // Max over the procs of their busy times over the average. Collective.
+  static double get_imbalance(const double busy_time);
+
+ private:
+  // Quarter octaves of the cost.
+  static constexpr unsigned N_CLASSES = 256;
+
+  // Indices of this proc in decreasing cost class.
+  std::vector<size_t> local_ids;
+
+  static unsigned get_cost_class(const double cost) {
+    const double cost_class = 4.0 * std::log2(1.0 + std::max(cost, 0.0));
+    return static_cast<unsigned>(std::min(cost_class, N_CLASSES - 1.0));
+  }
+};
+
+template <class Cost>
+CostRange::CostRange(
+    const size_t start, const size_t end, const size_t step, const Cost& cost, const bool local) {
+  if (start >= end) return;
+  const size_t n_ids = (end - start + step - 1) / step;
+  std::vector<unsigned char> cost_classes(n_ids);
+#pragma omp parallel for schedule(static, 1024)
+  for (size_t k = 0; k < n_ids; k++) cost_classes[k] = get_cost_class(cost(start + k * step));
+
+  // Rank of each index in decreasing cost class, ties by index, and the proc of that rank.
+  std::vector<size_t> class_offsets(N_CLASSES, 0);
+  for (const unsigned char cost_class : cost_classes) class_offsets[cost_class]++;
+  size_t offset = 0;
+  for (unsigned c = N_CLASSES; c-- > 0;) {
+    const size_t n_in_class = class_offsets[c];
+    class_offsets[c] = offset;
+    offset += n_in_class;
+  }
+  const size_t n_procs = Parallel::get_n_procs();
+  const size_t proc_id = Parallel::get_proc_id();
+  std::vector<size_t> n_local_in_class(N_CLASSES, 0);
+  for (size_t k = 0; k < n_ids; k++) {
+    const size_t rank = class_offsets[cost_classes[k]]++;
+    const size_t round = rank / n_procs;
+    const size_t owner = round % 2 == 0 ? rank % n_procs : n_procs - 1 - rank % n_procs;
+    if (!local && owner != proc_id) continue;
+    local_ids.push_back(start + k * step);
+    n_local_in_class[cost_classes[k]]++;
+  }
+
+  // Counting sort of the local indices, keeping the index order within a class.
+  offset = 0;
+  for (unsigned c = N_CLASSES; c-- > 0;) {
+    const size_t n_in_class = n_local_in_class[c];
+    n_local_in_class[c] = offset;
+    offset += n_in_class;
+  }
+  std::vector<size_t> sorted_ids(local_ids.size());
+  for (const size_t i : local_ids) {
+    sorted_ids[n_local_in_class[cost_classes[(i - start) / step]]++] = i;
+  }
+  local_ids.swap(sorted_ids);
+}
+
+template <class Handler>
+double CostRange::for_each(const Handler& handler) const {
+  const auto& begin = std::chrono::high_resolution_clock::now();
+  const size_t n_local_ids = local_ids.size();
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t k = 0; k < n_local_ids; k++) handler(local_ids[k]);
+  const auto& end = std::chrono::high_resolution_clock::now();
+  MPI_Barrier(MPI_COMM_WORLD);
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+inline double CostRange::get_imbalance(const double busy_time) {
+  double max_time = 0.0;
+  double sum_time = 0.0;
+  MPI_Allreduce(&busy_time, &max_time, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  MPI_Allreduce(&busy_time, &sum_time, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  const double avg_time = sum_time / Parallel::get_n_procs();
+  return avg_time > 0.0 ? max_time / avg_time : 1.0;
+}
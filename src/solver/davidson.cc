@@ -2,8 +2,218 @@
 #include <algorithm>
 #include <cmath>
 #include <eigen/Eigen/Dense>
+#include <memory>
+#include <stdexcept>
 #include "../config.h"
-#include <random>
+
+namespace {
+// Sum a local block over procs in place.
+void allreduce_sum(Eigen::MatrixXd& block) {
+  MPI_Allreduce(
+      MPI_IN_PLACE, block.data(), block.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+}
+
+// Orthonormalize the columns [n_basis, n_basis + n_block) of the distributed basis against the
+// previous columns and each other. Block Gram-Schmidt twice for stability, then the new columns
+// one by one. Returns false if a column becomes linearly dependent.
+bool orthonormalize(Eigen::MatrixXd& basis, const size_t n_basis, const size_t n_block) {
+  auto new_vecs = basis.middleCols(n_basis, n_block);
+  if (n_basis > 0) {
+    const auto& old_vecs = basis.leftCols(n_basis);
+    for (int pass = 0; pass < 2; pass++) {
+      Eigen::MatrixXd overlaps = old_vecs.transpose() * new_vecs;
+      allreduce_sum(overlaps);
+      new_vecs.noalias() -= old_vecs * overlaps;
+    }
+  }
+  for (size_t i = 0; i < n_block; i++) {
+    auto vec = new_vecs.col(i);
+    if (i > 0) {
+      const auto& prev_vecs = new_vecs.leftCols(i);
+      Eigen::MatrixXd overlaps = prev_vecs.transpose() * vec;
+      allreduce_sum(overlaps);
+      vec.noalias() -= prev_vecs * overlaps;
+    }
+    Eigen::MatrixXd norm_sq(1, 1);
+    norm_sq(0, 0) = vec.squaredNorm();
+    allreduce_sum(norm_sq);
+    const double norm = std::sqrt(norm_sq(0, 0));
+    if (norm < 1e-12) return false;
+    vec /= norm;
+  }
+  return true;
+}
+
+// Multiply the columns [begin, begin + n_block) of the basis into the same columns of H_basis.
+void mul_cols(
+    const SparseMatrix& matrix,
+    const Eigen::MatrixXd& basis,
+    const size_t begin,
+    const size_t n_block,
+    Eigen::MatrixXd& H_basis) {
+  const size_t n_local = basis.rows();
+  std::vector<std::vector<double>> slices(n_block);
+  for (size_t i = 0; i < n_block; i++) {
+    slices[i].assign(basis.col(begin + i).data(), basis.col(begin + i).data() + n_local);
+  }
+  const auto& H_slices = matrix.mul_slices(slices);
+  for (size_t i = 0; i < n_block; i++) {
+    H_basis.col(begin + i) = Eigen::Map<const Eigen::VectorXd>(H_slices[i].data(), n_local);
+  }
+}
+
+// H - E inverted exactly on the dense block of the dets of the largest initial coefs, whose
+// eigendecomposition is shared by all the E, and by its diagonal on the other dets. The
+// corrections are made orthogonal to the Ritz vectors (Olsen), since the exact inverse alone
+// would give back the Ritz vectors.
+class BlockPreconditioner {
+ public:
+  BlockPreconditioner(
+      const SparseMatrix& matrix,
+      const std::vector<std::vector<double>>& initial_vectors,
+      const size_t n_dets,
+      const Eigen::VectorXd& diag_local);
+
+  // Corrections of the Ritz pairs (w, Hw, E) of the states [begin, begin + n_block).
+  void get_corrections(
+      const Eigen::MatrixXd& w,
+      const Eigen::MatrixXd& Hw,
+      const std::vector<double>& eigenvalues,
+      const size_t begin,
+      Eigen::Ref<Eigen::MatrixXd> corrections) const;
+
+ private:
+  const Eigen::VectorXd& diag_local;
+
+  size_t slice_begin;
+
+  // Position in the block of each local row, -1 outside it.
+  std::vector<int> block_ids;
+
+  Eigen::VectorXd block_eigenvalues;
+
+  Eigen::MatrixXd block_eigenvectors;
+};
+
+BlockPreconditioner::BlockPreconditioner(
+    const SparseMatrix& matrix,
+    const std::vector<std::vector<double>>& initial_vectors,
+    const size_t n_dets,
+    const Eigen::VectorXd& diag_local)
+    : diag_local(diag_local) {
+  if (matrix.has_direct_mul()) {
+    throw std::invalid_argument("davidson_precond_dets needs all the elements stored");
+  }
+  const size_t dim = matrix.count_n_rows();
+  const size_t n_block = std::min(n_dets, dim);
+  std::vector<double> weights(dim, 0.0);
+  for (const auto& vec : initial_vectors) {
+    for (size_t i = 0; i < dim; i++) weights[i] = std::max(weights[i], std::abs(vec[i]));
+  }
+  std::vector<size_t> dets(dim);
+  for (size_t i = 0; i < dim; i++) dets[i] = i;
+  std::partial_sort(dets.begin(), dets.begin() + n_block, dets.end(), [&](size_t a, size_t b) {
+    return weights[a] > weights[b] || (weights[a] == weights[b] && a < b);
+  });
+  dets.resize(n_block);
+  std::sort(dets.begin(), dets.end());
+
+  slice_begin = matrix.get_slice_begin();
+  const size_t slice_end = matrix.get_slice_end();
+  block_ids.assign(slice_end - slice_begin, -1);
+  std::vector<int> ids(dim, -1);
+  for (size_t p = 0; p < n_block; p++) {
+    ids[dets[p]] = p;
+    if (dets[p] >= slice_begin && dets[p] < slice_end) block_ids[dets[p] - slice_begin] = p;
+  }
+
+  // Each proc fills the upper elements of its rows.
+  Eigen::MatrixXd block = Eigen::MatrixXd::Zero(n_block, n_block);
+  const size_t proc_id = Parallel::get_proc_id();
+  const size_t n_procs = Parallel::get_n_procs();
+  for (size_t p = 0; p < n_block; p++) {
+    const size_t i = dets[p];
+    if (i % n_procs != proc_id) continue;
+    block(p, p) = matrix.get_diag(i);
+    const SparseRow& row = matrix.get_row(i);
+    for (size_t k = 0; k < row.size(); k++) {
+      const size_t j = row.get_index(k);
+      if (j <= i || ids[j] < 0) continue;
+      block(p, ids[j]) = row.get_value(k);
+      block(ids[j], p) = row.get_value(k);
+    }
+  }
+  allreduce_sum(block);
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen_solver(block);
+  block_eigenvalues = eigen_solver.eigenvalues();
+  block_eigenvectors = eigen_solver.eigenvectors();
+}
+
+void BlockPreconditioner::get_corrections(
+    const Eigen::MatrixXd& w,
+    const Eigen::MatrixXd& Hw,
+    const std::vector<double>& eigenvalues,
+    const size_t begin,
+    Eigen::Ref<Eigen::MatrixXd> corrections) const {
+  const size_t n_local = w.rows();
+  const size_t n_block = block_eigenvalues.size();
+  const size_t n_vecs = corrections.cols();
+  // Residuals then Ritz vectors of each state, on the block and on the local rows.
+  Eigen::MatrixXd block_vecs = Eigen::MatrixXd::Zero(n_block, 2 * n_vecs);
+  for (size_t j = 0; j < n_local; j++) {
+    if (block_ids[j] < 0) continue;
+    for (size_t s = 0; s < n_vecs; s++) {
+      const double eigenvalue = eigenvalues[begin + s];
+      block_vecs(block_ids[j], s) = Hw(j, begin + s) - eigenvalue * w(j, begin + s);
+      block_vecs(block_ids[j], n_vecs + s) = w(j, begin + s);
+    }
+  }
+  allreduce_sum(block_vecs);
+  Eigen::MatrixXd projections = block_eigenvectors.transpose() * block_vecs;
+  for (size_t s = 0; s < n_vecs; s++) {
+    for (size_t k = 0; k < n_block; k++) {
+      const double diff = block_eigenvalues(k) - eigenvalues[begin + s];
+      const double inv = std::abs(diff) < 1.0e-8 ? 0.0 : 1.0 / diff;
+      projections(k, s) *= inv;
+      projections(k, n_vecs + s) *= inv;
+    }
+  }
+  block_vecs.noalias() = block_eigenvectors * projections;
+
+  // (H - E)^-1 of the residuals and of the Ritz vectors, and their overlaps with the latter.
+  Eigen::MatrixXd inv_r(n_local, n_vecs);
+  Eigen::MatrixXd inv_w(n_local, n_vecs);
+  Eigen::MatrixXd overlaps = Eigen::MatrixXd::Zero(2, n_vecs);
+  for (size_t s = 0; s < n_vecs; s++) {
+    const double eigenvalue = eigenvalues[begin + s];
+    double w_inv_r = 0.0;
+    double w_inv_w = 0.0;
+#pragma omp parallel for schedule(static) reduction(+ : w_inv_r, w_inv_w)
+    for (size_t j = 0; j < n_local; j++) {
+      const double w_j = w(j, begin + s);
+      if (block_ids[j] >= 0) {
+        inv_r(j, s) = block_vecs(block_ids[j], s);
+        inv_w(j, s) = block_vecs(block_ids[j], n_vecs + s);
+      } else {
+        const double diff = diag_local(j) - eigenvalue;
+        const double inv = std::abs(diff) < 1.0e-8 ? 0.0 : 1.0 / diff;
+        inv_r(j, s) = (Hw(j, begin + s) - eigenvalue * w_j) * inv;
+        inv_w(j, s) = w_j * inv;
+      }
+      w_inv_r += w_j * inv_r(j, s);
+      w_inv_w += w_j * inv_w(j, s);
+    }
+    overlaps(0, s) = w_inv_r;
+    overlaps(1, s) = w_inv_w;
+  }
+  allreduce_sum(overlaps);
+  for (size_t s = 0; s < n_vecs; s++) {
+    const double epsilon =
+        std::abs(overlaps(1, s)) < 1.0e-12 ? 0.0 : overlaps(0, s) / overlaps(1, s);
+    corrections.col(s) = epsilon * inv_w.col(s) - inv_r.col(s);
+  }
+}
+}  // namespace
 
 void Davidson::diagonalize(
     const SparseMatrix& matrix,
@@ -22,56 +232,70 @@ void Davidson::diagonalize(
     lowest_eigenvectors[0].resize(1);
     lowest_eigenvectors[0][0] = 1.0;
     converged = true;
+    n_matvecs = 0;
     return;
   }
 
-  const size_t n_iterations_store = std::min(dim, N_ITERATIONS_STORE);
-  std::vector<double> lowest_eigenvalues_prev(n_states, 0.0);
+  // Basis vectors are kept column major as the slices owned by this proc.
+  const size_t slice_begin = matrix.get_slice_begin();
+  const size_t n_local = matrix.get_slice_end() - slice_begin;
 
-  std::vector<std::vector<double>> v(n_states * n_iterations_store);
-  std::vector<std::vector<double>> Hv(n_states * n_iterations_store);
-  std::vector<std::vector<double>> w(n_states);
-  std::vector<std::vector<double>> Hw(n_states);
-  for (size_t i = 0; i < v.size(); i++) {
-    v[i].resize(dim);
-  }
+  const size_t n_store = n_states * std::min(dim, N_ITERATIONS_STORE);
+  // Same number of multiplications per call as collapsing to n_states vectors once.
+  const size_t n_new_vecs_max = n_store * 2 - n_states * 2;
+  std::vector<double> lowest_eigenvalues_prev(n_states, 0.0);
 
-  for (size_t i = 0; i < n_states; i++) {
-    w[i].resize(dim);
-    Hw[i].resize(dim);
+  Eigen::MatrixXd v(n_local, n_store);
+  Eigen::MatrixXd Hv(n_local, n_store);
+  Eigen::MatrixXd h_krylov = Eigen::MatrixXd::Zero(n_store, n_store);
+  Eigen::MatrixXd w(n_local, n_states);
+  Eigen::MatrixXd Hw(n_local, n_states);
+  Eigen::VectorXd diag_local(n_local);
+  // The rows of the vectors are worked on by the same threads in the static loops.
+  Util::first_touch(v.data(), v.size());
+  Util::first_touch(Hv.data(), Hv.size());
+  Util::first_touch(w.data(), w.size());
+  Util::first_touch(Hw.data(), Hw.size());
+  Util::first_touch(diag_local.data(), diag_local.size());
+  for (size_t j = 0; j < n_local; j++) diag_local(j) = matrix.get_diag(slice_begin + j);
+  std::unique_ptr<BlockPreconditioner> preconditioner;
+  if (n_precond_dets > 0) {
+    preconditioner.reset(
+        new BlockPreconditioner(matrix, initial_vectors, n_precond_dets, diag_local));
   }
 
   for (unsigned i_state = 0; i_state < n_states; i_state++) {
-    double norm = sqrt(Util::dot_omp(initial_vectors[i_state], initial_vectors[i_state]));
-#pragma omp parallel for
-    for (size_t j = 0; j < dim; j++) v[i_state][j] = initial_vectors[i_state][j] / norm;
-    if (i_state > 0) {
-      // Orthogonalize
-      double inner_prod;
-      for (unsigned k_state = 0; k_state < i_state; k_state++) {
-        inner_prod = Util::dot_omp(v[i_state], v[k_state]);
-        for (size_t j = 0; j < dim; j++) v[i_state][j] -= inner_prod * v[k_state][j];
-      }
-      // Normalize
-      norm = sqrt(Util::dot_omp(v[i_state], v[i_state]));
-      for (size_t j = 0; j < dim; j++) v[i_state][j] /= norm;
+    const auto& initial_vector = initial_vectors[i_state];
+    const double norm = std::sqrt(Util::dot_omp(initial_vector, initial_vector));
+    if (norm > 0.0) {
+      v.col(i_state) =
+          Eigen::Map<const Eigen::VectorXd>(initial_vector.data() + slice_begin, n_local) / norm;
+    } else {
+      v.col(i_state).setZero();
+    }
+    // Start from unit vectors instead of dependent guesses, e.g. of the excited states.
+    for (size_t k = 0; !orthonormalize(v, i_state, 1) && k < dim; k++) {
+      v.col(i_state).setZero();
+      if (k >= slice_begin && k < slice_begin + n_local) v(k - slice_begin, i_state) = 1.0;
     }
   }
-
-  Eigen::MatrixXd h_krylov =
-      Eigen::MatrixXd::Zero(n_states * n_iterations_store, n_states * n_iterations_store);
-  Eigen::MatrixXd eigenvector_krylov =
-      Eigen::MatrixXd::Zero(n_states * n_iterations_store, n_states * n_iterations_store);
   converged = false;
+  size_t n_basis = n_states;
   size_t n_converged = 0;
 
+  // The initial vectors are the first Ritz vectors.
+  mul_cols(matrix, v, 0, n_states, Hv);
+  n_matvecs = n_states;
+  {
+    Eigen::MatrixXd h_init = v.leftCols(n_states).transpose() * Hv.leftCols(n_states);
+    allreduce_sum(h_init);
+    h_krylov.topLeftCorner(n_states, n_states) = (h_init + h_init.transpose()) * 0.5;
+  }
   for (unsigned i_state = 0; i_state < n_states; i_state++) {
-    Hv[i_state] = matrix.mul(v[i_state]);
-    lowest_eigenvalues[i_state] = Util::dot_omp(v[i_state], Hv[i_state]);
-    h_krylov(i_state, i_state) = lowest_eigenvalues[i_state];
-    w[i_state] = v[i_state];
-    Hw[i_state] = Hv[i_state];
+    lowest_eigenvalues[i_state] = h_krylov(i_state, i_state);
   }
+  w = v.leftCols(n_states);
+  Hw = Hv.leftCols(n_states);
   if (verbose) {
     printf("Davidson #0:");
     for (const auto& eigenval : lowest_eigenvalues) printf("  %.10f", eigenval);
@@ -80,117 +304,99 @@ void Davidson::diagonalize(
   lowest_eigenvalues_prev = lowest_eigenvalues;
 
   size_t it_real = 1;
-  size_t i_state_precond = 0; // state preconditioning on
-  for (size_t it = n_states; it < n_iterations_store * n_states * 2; it++) {
-    size_t it_circ = it % (n_states * n_iterations_store);
-    if (it >= n_states * n_iterations_store) {
-      if (it_circ < n_states - 1) continue;
-      if (it_circ == n_states - 1) {
-        for (unsigned i_state = 0; i_state < n_states; i_state++) {
-          v[i_state] = w[i_state];
-          Hv[i_state] = Hw[i_state];
-        }
-        for (unsigned i_state = 0; i_state < n_states; i_state++) {
-          lowest_eigenvalues[i_state] = Util::dot_omp(v[i_state], Hv[i_state]);
-          h_krylov(i_state, i_state) = lowest_eigenvalues[i_state];
-          for (unsigned k_state = i_state + 1; k_state < n_states; k_state++) {
-            double element = Util::dot_omp(v[i_state], Hv[k_state]);
-            h_krylov(i_state, k_state) = element;
-            h_krylov(k_state, i_state) = element;
-          }
-        }
-        continue;
-      }
-    }
+  size_t n_new_vecs = 0;
+  while (!converged && n_new_vecs < n_new_vecs_max) {
+    // Correction vectors of the unconverged states share one matrix multiplication.
+    const size_t n_block = std::min(n_states - n_converged, n_new_vecs_max - n_new_vecs);
 
-#pragma omp parallel for
-    for (size_t j = 0; j < dim; j++) {
-      const double diff_to_diag = lowest_eigenvalues[i_state_precond] - matrix.get_diag(j);  // diag_elems[j];
-      if (std::abs(diff_to_diag) < 1.0e-8) {
-        v[it_circ][j] = 0.;
-      } else {
-        v[it_circ][j] = (Hw[i_state_precond][j] - lowest_eigenvalues[i_state_precond] * w[i_state_precond][j]) / diff_to_diag;
-      }
+    // Thick restart: keep the lowest Ritz vectors of the current subspace.
+    if (n_basis + n_block > n_store) {
+      const size_t n_keep = std::min(std::max<size_t>(n_states, n_store / 2), n_store - n_block);
+      Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen_solver(
+          h_krylov.topLeftCorner(n_basis, n_basis));
+      const auto& ritz_vecs = eigen_solver.eigenvectors().leftCols(n_keep);
+      Eigen::MatrixXd v_keep = v.leftCols(n_basis) * ritz_vecs;
+      v.leftCols(n_keep) = v_keep;
+      v_keep.noalias() = Hv.leftCols(n_basis) * ritz_vecs;
+      Hv.leftCols(n_keep) = v_keep;
+      h_krylov.setZero();
+      h_krylov.diagonal().head(n_keep) = eigen_solver.eigenvalues().head(n_keep);
+      n_basis = n_keep;
     }
 
-    // Orthogonalize and normalize.
-    for (size_t i = 0; i < it_circ; i++) {
-      double norm = Util::dot_omp(v[it_circ], v[i]);
-#pragma omp parallel for
-      for (size_t j = 0; j < dim; j++) {
-        v[it_circ][j] -= norm * v[i][j];
+    auto v_new = v.middleCols(n_basis, n_block);
+    if (preconditioner) {
+      preconditioner->get_corrections(w, Hw, lowest_eigenvalues, n_converged, v_new);
+    } else {
+#pragma omp parallel for schedule(static)
+      for (size_t j = 0; j < n_local; j++) {
+        for (size_t i_block = 0; i_block < n_block; i_block++) {
+          const size_t i_state = n_converged + i_block;
+          const double diff_to_diag = lowest_eigenvalues[i_state] - diag_local(j);
+          if (std::abs(diff_to_diag) < 1.0e-8) {
+            v_new(j, i_block) = 0.;
+          } else {
+            v_new(j, i_block) =
+                (Hw(j, i_state) - lowest_eigenvalues[i_state] * w(j, i_state)) / diff_to_diag;
+          }
+        }
       }
     }
-    double norm = sqrt(Util::dot_omp(v[it_circ], v[it_circ]));
-    if (norm<1e-12) { // corner case: norm gets small before eigenvalues converge
+    if (!orthonormalize(v, n_basis, n_block)) {
+      // corner case: norm gets small before eigenvalues converge
       converged = true;
       break;
     }
+    mul_cols(matrix, v, n_basis, n_block, Hv);
+    n_new_vecs += n_block;
+    n_matvecs += n_block;
 
-#pragma omp parallel for
-    for (size_t j = 0; j < dim; j++) {
-      v[it_circ][j] /= norm;
-    }
-
-    Hv[it_circ] = matrix.mul(v[it_circ]);
-
-    // Construct subspace matrix.
-    for (size_t i = 0; i <= it_circ; i++) {
-      h_krylov(it_circ, i) = Util::dot_omp(v[i], Hv[it_circ]);
-      //h_krylov(it_circ, i) = h_krylov(i, it_circ); // only lower trianguluar part is referenced
-    }
+    // Extend the subspace matrix with the new columns.
+    const size_t n_basis_new = n_basis + n_block;
+    Eigen::MatrixXd h_new = v.leftCols(n_basis_new).transpose() * Hv.middleCols(n_basis, n_block);
+    allreduce_sum(h_new);
+    h_krylov.block(0, n_basis, n_basis_new, n_block) = h_new;
+    h_krylov.block(n_basis, 0, n_block, n_basis_new) = h_new.transpose();
+    n_basis = n_basis_new;
 
     // Diagonalize subspace matrix.
-    if (i_state_precond + 1 == n_states) {
-      Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigenSolver(
-          h_krylov.leftCols(it_circ + 1).topRows(it_circ + 1));
-      const auto& eigenvals = eigenSolver.eigenvalues();  // in ascending order
-      const auto& eigenvecs = eigenSolver.eigenvectors();
-      for (unsigned i_state = 0; i_state < n_states; i_state++) {
-        lowest_eigenvalues[i_state] = eigenvals(i_state);
-        double factor = 1.0;
-        if (eigenvecs(0, i_state) < 0) factor = -1.0;
-        for (size_t i = 0; i < it_circ + 1; i++)
-          eigenvector_krylov(i, i_state) = eigenvecs(i, i_state) * factor;
-#pragma omp parallel for
-        for (size_t j = 0; j < dim; j++) {
-          double w_j = 0.0;
-          double Hw_j = 0.0;
-          for (size_t i = 0; i < it_circ + 1; i++) {
-            w_j += v[i][j] * eigenvector_krylov(i, i_state);
-            Hw_j += Hv[i][j] * eigenvector_krylov(i, i_state);
-          }
-          w[i_state][j] = w_j;
-          Hw[i_state][j] = Hw_j;
-        }
-      }
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen_solver(
+        h_krylov.topLeftCorner(n_basis, n_basis));
+    const auto& eigenvals = eigen_solver.eigenvalues();  // in ascending order
+    Eigen::MatrixXd eigenvecs = eigen_solver.eigenvectors().leftCols(n_states);
+    for (unsigned i_state = 0; i_state < n_states; i_state++) {
+      lowest_eigenvalues[i_state] = eigenvals(i_state);
+      if (eigenvecs(0, i_state) < 0) eigenvecs.col(i_state) *= -1.0;
+    }
+    w.noalias() = v.leftCols(n_basis) * eigenvecs;
+    Hw.noalias() = Hv.leftCols(n_basis) * eigenvecs;
 
-      if (verbose) {
-        printf("Davidson #%zu:", it_real);
-        for (const auto& eigenval : lowest_eigenvalues) printf("  %.10f", eigenval);
-        printf("\n");
-      }
-      it_real++;
-      for (unsigned i_state = n_converged; i_state < n_states; i_state++) {
-        if (std::abs(lowest_eigenvalues[i_state] - lowest_eigenvalues_prev[i_state]) > TOLERANCE) {
-          break;
-        } else {
-          n_converged++;
-        }
+    if (verbose) {
+      printf("Davidson #%zu:", it_real);
+      for (const auto& eigenval : lowest_eigenvalues) printf("  %.10f", eigenval);
+      printf("\n");
+    }
+    it_real++;
+    for (unsigned i_state = n_converged; i_state < n_states; i_state++) {
+      if (std::abs(lowest_eigenvalues[i_state] - lowest_eigenvalues_prev[i_state]) > TOLERANCE) {
+        break;
+      } else {
+        n_converged++;
       }
-      if (n_converged == n_states) converged = true;
-
-      if (!converged) lowest_eigenvalues_prev = lowest_eigenvalues;
-
-      if (converged) break;
     }
-    i_state_precond++;
-    if (i_state_precond >= n_states) i_state_precond = n_converged;
+    if (n_converged == n_states) converged = true;
+
+    if (!converged) lowest_eigenvalues_prev = lowest_eigenvalues;
+  }
+  if (verbose) printf("Davidson matvecs: %zu\n", n_matvecs);
+  lowest_eigenvectors.resize(n_states);
+  for (unsigned i_state = 0; i_state < n_states; i_state++) {
+    const std::vector<double> slice(w.col(i_state).data(), w.col(i_state).data() + n_local);
+    lowest_eigenvectors[i_state] = matrix.gather_slices(slice);
   }
-  lowest_eigenvectors = w;
   if (n_states < initial_vectors.size()) { // Corner case for excited states
     lowest_eigenvectors.resize(initial_vectors.size());
-    for (unsigned i = n_states; i < initial_vectors.size(); i++) 
+    for (unsigned i = n_states; i < initial_vectors.size(); i++)
       lowest_eigenvectors[i] = initial_vectors[i];
   }
 }
@@ -20,9 +20,18 @@ class Davidson {
 
   std::vector<std::vector<double>> get_lowest_eigenvectors() const { return lowest_eigenvectors; }
 
+  // Precondition with H - E solved exactly on the n dets of the largest initial coefs and
+  // approximated by its diagonal on the others, instead of the diagonal alone.
+  void set_n_precond_dets(const size_t n) { n_precond_dets = n; }
+
   bool converged;
 
+  // Vectors multiplied by the matrix in the last diagonalization.
+  size_t n_matvecs;
+
  private:
+  size_t n_precond_dets = 0;
+
   std::vector<double> lowest_eigenvalues;
 
   std::vector<std::vector<double>> lowest_eigenvectors;
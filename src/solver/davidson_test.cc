@@ -49,3 +49,24 @@ TEST(DavidsonTest, HilbertSystem) {
     EXPECT_NEAR(lowest_eigenvectors[0][i], expected_eigenvectors[0][i], 1.0e-4);
   }
 }
+
+TEST(DavidsonTest, BlockPreconditioner) {
+  const int N = 1000;
+  HilbertSystem hilbert_system(N);
+  std::vector<std::vector<double>> initial_vector(1);
+  initial_vector[0].resize(N, 0.0);
+  initial_vector[0][0] = 1.0;
+  initial_vector[0][1] = 0.1;
+
+  Davidson davidson(1);
+  davidson.diagonalize(hilbert_system.matrix, initial_vector, 1.0e-10);
+  const size_t n_matvecs_diag = davidson.n_matvecs;
+  const double eigenvalue_diag = davidson.get_lowest_eigenvalues()[0];
+
+  Davidson davidson_block(1);
+  davidson_block.set_n_precond_dets(50);
+  davidson_block.diagonalize(hilbert_system.matrix, initial_vector, 1.0e-10);
+  EXPECT_TRUE(davidson_block.converged);
+  EXPECT_NEAR(davidson_block.get_lowest_eigenvalues()[0], eigenvalue_diag, 1.0e-9);
+  EXPECT_LT(davidson_block.n_matvecs, n_matvecs_diag);
+}
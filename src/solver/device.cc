@@ -0,0 +1,190 @@
+#include "device.h"
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "../util.h"
+
+void Device::Matrix::get_local_rows(
+    const SparseMatrix& matrix,
+    std::vector<size_t>& offsets,
+    std::vector<size_t>& indices,
+    std::vector<double>& values) {
+  if (matrix.has_direct_mul()) {
+    throw std::invalid_argument("the device matrix needs all the elements stored");
+  }
+  const size_t dim = matrix.count_n_rows();
+  const size_t proc_id = Parallel::get_proc_id();
+  const size_t n_procs = Parallel::get_n_procs();
+  const size_t n_rows = dim > proc_id ? (dim - proc_id + n_procs - 1) / n_procs : 0;
+  offsets.assign(n_rows + 1, 0);
+  for (size_t r = 0; r < n_rows; r++) {
+    offsets[r + 1] = offsets[r] + matrix.get_row(r * n_procs + proc_id).size();
+  }
+  indices.resize(offsets[n_rows]);
+  values.resize(offsets[n_rows]);
+  const bool float_values = matrix.has_float_values();
+#pragma omp parallel for schedule(dynamic, 1024)
+  for (size_t r = 0; r < n_rows; r++) {
+    const size_t i = r * n_procs + proc_id;
+    const SparseRow& row = matrix.get_row(i);
+    for (size_t k = 0; k < row.size(); k++) {
+      const size_t j = row.get_index(k);
+      indices[offsets[r] + k] = j;
+      values[offsets[r] + k] = float_values && i == j ? matrix.get_diag(i) : row.get_value(k);
+    }
+  }
+}
+
+#ifndef SHCI_GPU
+
+struct Device::Matrix::Rows {
+  std::vector<size_t> offsets;
+
+  std::vector<size_t> indices;
+
+  std::vector<double> values;
+};
+
+bool Device::is_gpu() { return false; }
+
+Device::Buffer::~Buffer() { delete[] ptr; }
+
+void Device::Buffer::resize(const size_t n) {
+  delete[] ptr;
+  ptr = n > 0 ? new double[n] : nullptr;
+  Util::first_touch(ptr, n);
+  this->n = n;
+}
+
+void Device::Buffer::upload(const double* host, const size_t n, const size_t offset) {
+  std::copy(host, host + n, ptr + offset);
+}
+
+void Device::Buffer::download(double* host, const size_t n, const size_t offset) const {
+  std::copy(ptr + offset, ptr + offset + n, host);
+}
+
+void Device::set_zero(double* x, const size_t n) { std::fill(x, x + n, 0.0); }
+
+void Device::copy(const double* x, const size_t n, double* y) { std::copy(x, x + n, y); }
+
+void Device::scale(double* x, const size_t n, const double alpha) {
+#pragma omp parallel for schedule(static)
+  for (size_t j = 0; j < n; j++) x[j] *= alpha;
+}
+
+double Device::dot(const double* x, const double* y, const size_t n) {
+  double sum = 0.0;
+#pragma omp parallel for schedule(static) reduction(+ : sum)
+  for (size_t j = 0; j < n; j++) sum += x[j] * y[j];
+  return sum;
+}
+
+void Device::gemm(
+    const bool trans_a,
+    const bool trans_b,
+    const size_t m,
+    const size_t n,
+    const size_t k,
+    const double alpha,
+    const double* a,
+    const size_t lda,
+    const double* b,
+    const size_t ldb,
+    const double beta,
+    double* c,
+    const size_t ldc) {
+  // Products over the long dimension k are reduced per thread.
+  if (trans_a && !trans_b) {
+    std::vector<double> sums(m * n, 0.0);
+#pragma omp parallel
+    {
+      std::vector<double> sums_thread(m * n, 0.0);
+#pragma omp for schedule(static)
+      for (size_t l = 0; l < k; l++) {
+        for (size_t col = 0; col < n; col++) {
+          const double b_l = b[col * ldb + l];
+          for (size_t row = 0; row < m; row++) sums_thread[col * m + row] += a[row * lda + l] * b_l;
+        }
+      }
+#pragma omp critical
+      for (size_t i = 0; i < m * n; i++) sums[i] += sums_thread[i];
+    }
+    for (size_t col = 0; col < n; col++) {
+      for (size_t row = 0; row < m; row++) {
+        double& c_ij = c[col * ldc + row];
+        c_ij = alpha * sums[col * m + row] + (beta == 0.0 ? 0.0 : beta * c_ij);
+      }
+    }
+    return;
+  }
+  if (trans_a || trans_b) throw std::invalid_argument("unsupported device gemm");
+#pragma omp parallel for schedule(static)
+  for (size_t row = 0; row < m; row++) {
+    for (size_t col = 0; col < n; col++) {
+      double sum = 0.0;
+      for (size_t l = 0; l < k; l++) sum += a[l * lda + row] * b[col * ldb + l];
+      double& c_ij = c[col * ldc + row];
+      c_ij = alpha * sum + (beta == 0.0 ? 0.0 : beta * c_ij);
+    }
+  }
+}
+
+void Device::get_corrections(
+    const double* diag,
+    const double* w,
+    const double* Hw,
+    const std::vector<double>& eigenvalues,
+    const size_t n,
+    double* corrections) {
+#pragma omp parallel for schedule(static)
+  for (size_t j = 0; j < n; j++) {
+    for (size_t s = 0; s < eigenvalues.size(); s++) {
+      const double diff_to_diag = eigenvalues[s] - diag[j];
+      if (std::abs(diff_to_diag) < 1.0e-8) {
+        corrections[s * n + j] = 0.0;
+      } else {
+        corrections[s * n + j] = (Hw[s * n + j] - eigenvalues[s] * w[s * n + j]) / diff_to_diag;
+      }
+    }
+  }
+}
+
+Device::Matrix::Matrix() : rows(new Rows()) {}
+
+Device::Matrix::~Matrix() {}
+
+void Device::Matrix::upload(const SparseMatrix& matrix) {
+  get_local_rows(matrix, rows->offsets, rows->indices, rows->values);
+  dim = matrix.count_n_rows();
+  n_elems = rows->values.size();
+}
+
+void Device::Matrix::mul(const double* vec, const size_t n_vecs, double* res) const {
+  const size_t proc_id = Parallel::get_proc_id();
+  const size_t n_procs = Parallel::get_n_procs();
+  const size_t n_rows = rows->offsets.size() - 1;
+  for (size_t s = 0; s < n_vecs; s++) {
+    const double* x = vec + s * dim;
+    double* y = res + s * dim;
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t r = 0; r < n_rows; r++) {
+      const size_t i = r * n_procs + proc_id;
+      double diff_i = 0.0;
+      for (size_t k = rows->offsets[r]; k < rows->offsets[r + 1]; k++) {
+        const size_t j = rows->indices[k];
+        const double H_ij = rows->values[k];
+        diff_i += H_ij * x[j];
+        if (j != i) {
+#pragma omp atomic
+          y[j] += H_ij * x[i];
+        }
+      }
+#pragma omp atomic
+      y[i] += diff_i;
+    }
+  }
+}
+
+#endif
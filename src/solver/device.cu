@@ -0,0 +1,276 @@
+#include <cublas_v2.h>
+#include <cuda_runtime.h>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include "device.h"
+
+namespace {
+const int THREADS_PER_BLOCK = 256;
+
+const int WARP_SIZE = 32;
+
+void check(const cudaError_t error) {
+  if (error != cudaSuccess) {
+    throw std::runtime_error(std::string("cuda: ") + cudaGetErrorString(error));
+  }
+}
+
+void check(const cublasStatus_t status) {
+  if (status != CUBLAS_STATUS_SUCCESS) {
+    throw std::runtime_error("cublas: error " + std::to_string(static_cast<int>(status)));
+  }
+}
+
+// One handle for the process, on the device of its rank on the node.
+cublasHandle_t get_handle() {
+  static cublasHandle_t handle = nullptr;
+  if (!handle) {
+    int n_devices = 0;
+    check(cudaGetDeviceCount(&n_devices));
+    if (n_devices == 0) throw std::runtime_error("cuda: no device");
+    int node_proc_id;
+    MPI_Comm_rank(Parallel::get_node_comm(), &node_proc_id);
+    check(cudaSetDevice(node_proc_id % n_devices));
+    check(cublasCreate(&handle));
+  }
+  return handle;
+}
+
+size_t get_n_blocks(const size_t n_threads) {
+  return (n_threads + THREADS_PER_BLOCK - 1) / THREADS_PER_BLOCK;
+}
+
+template <class T>
+T* upload_array(const std::vector<T>& host) {
+  T* ptr = nullptr;
+  if (host.empty()) return ptr;
+  check(cudaMalloc(&ptr, host.size() * sizeof(T)));
+  check(cudaMemcpy(ptr, host.data(), host.size() * sizeof(T), cudaMemcpyHostToDevice));
+  return ptr;
+}
+
+__global__ void get_corrections_kernel(
+    const double* diag,
+    const double* w,
+    const double* Hw,
+    const double* eigenvalues,
+    const size_t n,
+    const size_t n_vecs,
+    double* corrections) {
+  const size_t k = blockIdx.x * static_cast<size_t>(blockDim.x) + threadIdx.x;
+  if (k >= n * n_vecs) return;
+  const size_t j = k % n;
+  const double eigenvalue = eigenvalues[k / n];
+  const double diff_to_diag = eigenvalue - diag[j];
+  corrections[k] = fabs(diff_to_diag) < 1.0e-8 ? 0.0 : (Hw[k] - eigenvalue * w[k]) / diff_to_diag;
+}
+
+// One warp per row: the row sum is reduced over the lanes and the transposed elements are
+// scattered with atomics, as in the atomic kernel of SparseMatrix.
+template <class Index>
+__global__ void mul_rows_kernel(
+    const size_t n_rows,
+    const size_t proc_id,
+    const size_t n_procs,
+    const size_t* offsets,
+    const Index* indices,
+    const double* values,
+    const double* vec,
+    const size_t n_vecs,
+    const size_t dim,
+    double* res) {
+  const size_t r = (blockIdx.x * static_cast<size_t>(blockDim.x) + threadIdx.x) / WARP_SIZE;
+  const unsigned lane = threadIdx.x % WARP_SIZE;
+  if (r >= n_rows) return;
+  const size_t i = r * n_procs + proc_id;
+  for (size_t s = 0; s < n_vecs; s++) {
+    const double* x = vec + s * dim;
+    double* y = res + s * dim;
+    const double x_i = x[i];
+    double diff_i = 0.0;
+    for (size_t k = offsets[r] + lane; k < offsets[r + 1]; k += WARP_SIZE) {
+      const size_t j = indices[k];
+      const double H_ij = values[k];
+      diff_i += H_ij * x[j];
+      if (j != i) atomicAdd(y + j, H_ij * x_i);
+    }
+    for (int offset = WARP_SIZE / 2; offset > 0; offset /= 2) {
+      diff_i += __shfl_down_sync(0xffffffff, diff_i, offset);
+    }
+    if (lane == 0) atomicAdd(y + i, diff_i);
+  }
+}
+}  // namespace
+
+struct Device::Matrix::Rows {
+  size_t n_rows = 0;
+
+  size_t* offsets = nullptr;
+
+  // 32 bit indices unless the dim exceeds them.
+  uint32_t* indices_32 = nullptr;
+
+  size_t* indices_64 = nullptr;
+
+  double* values = nullptr;
+
+  void clear() {
+    cudaFree(offsets);
+    cudaFree(indices_32);
+    cudaFree(indices_64);
+    cudaFree(values);
+    offsets = nullptr;
+    indices_32 = nullptr;
+    indices_64 = nullptr;
+    values = nullptr;
+    n_rows = 0;
+  }
+};
+
+bool Device::is_gpu() { return true; }
+
+Device::Buffer::~Buffer() { cudaFree(ptr); }
+
+void Device::Buffer::resize(const size_t n) {
+  get_handle();
+  check(cudaFree(ptr));
+  ptr = nullptr;
+  if (n > 0) check(cudaMalloc(&ptr, n * sizeof(double)));
+  this->n = n;
+}
+
+void Device::Buffer::upload(const double* host, const size_t n, const size_t offset) {
+  if (n == 0) return;
+  check(cudaMemcpy(ptr + offset, host, n * sizeof(double), cudaMemcpyHostToDevice));
+}
+
+void Device::Buffer::download(double* host, const size_t n, const size_t offset) const {
+  if (n == 0) return;
+  check(cudaMemcpy(host, ptr + offset, n * sizeof(double), cudaMemcpyDeviceToHost));
+}
+
+void Device::set_zero(double* x, const size_t n) {
+  if (n > 0) check(cudaMemset(x, 0, n * sizeof(double)));
+}
+
+void Device::copy(const double* x, const size_t n, double* y) {
+  if (n > 0) check(cudaMemcpy(y, x, n * sizeof(double), cudaMemcpyDeviceToDevice));
+}
+
+void Device::scale(double* x, const size_t n, const double alpha) {
+  if (n > 0) check(cublasDscal(get_handle(), n, &alpha, x, 1));
+}
+
+double Device::dot(const double* x, const double* y, const size_t n) {
+  double res = 0.0;
+  if (n > 0) check(cublasDdot(get_handle(), n, x, 1, y, 1, &res));
+  return res;
+}
+
+void Device::gemm(
+    const bool trans_a,
+    const bool trans_b,
+    const size_t m,
+    const size_t n,
+    const size_t k,
+    const double alpha,
+    const double* a,
+    const size_t lda,
+    const double* b,
+    const size_t ldb,
+    const double beta,
+    double* c,
+    const size_t ldc) {
+  if (m == 0 || n == 0) return;
+  // The leading dimensions must be positive even for empty slices.
+  check(cublasDgemm(
+      get_handle(),
+      trans_a ? CUBLAS_OP_T : CUBLAS_OP_N,
+      trans_b ? CUBLAS_OP_T : CUBLAS_OP_N,
+      m,
+      n,
+      k,
+      &alpha,
+      a,
+      lda > 0 ? lda : 1,
+      b,
+      ldb > 0 ? ldb : 1,
+      &beta,
+      c,
+      ldc));
+}
+
+void Device::get_corrections(
+    const double* diag,
+    const double* w,
+    const double* Hw,
+    const std::vector<double>& eigenvalues,
+    const size_t n,
+    double* corrections) {
+  const size_t n_elems = n * eigenvalues.size();
+  if (n_elems == 0) return;
+  Buffer eigenvalues_device(eigenvalues.size());
+  eigenvalues_device.upload(eigenvalues.data(), eigenvalues.size());
+  get_corrections_kernel<<<get_n_blocks(n_elems), THREADS_PER_BLOCK>>>(
+      diag, w, Hw, eigenvalues_device.data(), n, eigenvalues.size(), corrections);
+  check(cudaGetLastError());
+  check(cudaDeviceSynchronize());
+}
+
+Device::Matrix::Matrix() : rows(new Rows()) {}
+
+Device::Matrix::~Matrix() { rows->clear(); }
+
+void Device::Matrix::upload(const SparseMatrix& matrix) {
+  get_handle();
+  rows->clear();
+  std::vector<size_t> offsets;
+  std::vector<size_t> indices;
+  std::vector<double> values;
+  get_local_rows(matrix, offsets, indices, values);
+  dim = matrix.count_n_rows();
+  n_elems = values.size();
+  rows->n_rows = offsets.size() - 1;
+  rows->offsets = upload_array(offsets);
+  if (dim > UINT32_MAX) {
+    rows->indices_64 = upload_array(indices);
+  } else {
+    rows->indices_32 = upload_array(std::vector<uint32_t>(indices.begin(), indices.end()));
+  }
+  rows->values = upload_array(values);
+}
+
+void Device::Matrix::mul(const double* vec, const size_t n_vecs, double* res) const {
+  if (rows->n_rows == 0) return;
+  const size_t n_blocks = get_n_blocks(rows->n_rows * WARP_SIZE);
+  const size_t proc_id = Parallel::get_proc_id();
+  const size_t n_procs = Parallel::get_n_procs();
+  if (rows->indices_64) {
+    mul_rows_kernel<<<n_blocks, THREADS_PER_BLOCK>>>(
+        rows->n_rows,
+        proc_id,
+        n_procs,
+        rows->offsets,
+        rows->indices_64,
+        rows->values,
+        vec,
+        n_vecs,
+        dim,
+        res);
+  } else {
+    mul_rows_kernel<<<n_blocks, THREADS_PER_BLOCK>>>(
+        rows->n_rows,
+        proc_id,
+        n_procs,
+        rows->offsets,
+        rows->indices_32,
+        rows->values,
+        vec,
+        n_vecs,
+        dim,
+        res);
+  }
+  check(cudaGetLastError());
+  check(cudaDeviceSynchronize());
+}
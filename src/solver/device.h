@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "sparse_matrix.h"
+
+// Arrays of doubles and the operations of the Davidson on them, in the memory of a CUDA device
+// in the builds with make GPU=1 (device.cu), in host memory otherwise (device.cc), on which the
+// device code paths are tested. Blocks of vectors are column major with leading dimension ld.
+namespace Device {
+// Whether the arrays live on a GPU.
+bool is_gpu();
+
+class Buffer {
+ public:
+  Buffer() {}
+
+  explicit Buffer(const size_t n) { resize(n); }
+
+  Buffer(const Buffer&) = delete;
+
+  Buffer& operator=(const Buffer&) = delete;
+
+  ~Buffer();
+
+  // Discards the values.
+  void resize(const size_t n);
+
+  size_t size() const { return n; }
+
+  double* data() { return ptr; }
+
+  const double* data() const { return ptr; }
+
+  // n values from or to the host, starting at element offset of the buffer.
+  void upload(const double* host, const size_t n, const size_t offset = 0);
+
+  void download(double* host, const size_t n, const size_t offset = 0) const;
+
+ private:
+  double* ptr = nullptr;
+
+  size_t n = 0;
+};
+
+void set_zero(double* x, const size_t n);
+
+void copy(const double* x, const size_t n, double* y);
+
+void scale(double* x, const size_t n, const double alpha);
+
+double dot(const double* x, const double* y, const size_t n);
+
+// c = alpha * op(a) * op(b) + beta * c, with op(a) m x k, op(b) k x n and the transposes if
+// trans_a or trans_b.
+void gemm(
+    const bool trans_a,
+    const bool trans_b,
+    const size_t m,
+    const size_t n,
+    const size_t k,
+    const double alpha,
+    const double* a,
+    const size_t lda,
+    const double* b,
+    const size_t ldb,
+    const double beta,
+    double* c,
+    const size_t ldc);
+
+// Davidson corrections (Hw_s - e_s * w_s) / (e_s - diag) of the n_vecs columns s of length n,
+// zero where e_s is within 1.0e-8 of the diagonal.
+void get_corrections(
+    const double* diag,
+    const double* w,
+    const double* Hw,
+    const std::vector<double>& eigenvalues,
+    const size_t n,
+    double* corrections);
+
+// The local rows of a packed SparseMatrix, multiplied like its atomic kernel.
+class Matrix {
+ public:
+  Matrix();
+
+  Matrix(const Matrix&) = delete;
+
+  Matrix& operator=(const Matrix&) = delete;
+
+  ~Matrix();
+
+  // Replaces the previously uploaded rows.
+  void upload(const SparseMatrix& matrix);
+
+  // res += matrix * vec for the n_vecs columns of length dim, of this proc's elements only.
+  void mul(const double* vec, const size_t n_vecs, double* res) const;
+
+  size_t get_dim() const { return dim; }
+
+  size_t get_n_elems() const { return n_elems; }
+
+ private:
+  struct Rows;
+
+  std::unique_ptr<Rows> rows;
+
+  size_t dim = 0;
+
+  size_t n_elems = 0;
+
+  // The local rows as CSR with global column indices, the diagonal taken from the cached one
+  // for single precision values.
+  static void get_local_rows(
+      const SparseMatrix& matrix,
+      std::vector<size_t>& offsets,
+      std::vector<size_t>& indices,
+      std::vector<double>& values);
+};
+}  // namespace Device
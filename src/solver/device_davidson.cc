@@ -0,0 +1,292 @@
+#include "device_davidson.h"
+#include <algorithm>
+#include <cmath>
+#include <eigen/Eigen/Dense>
+#include <stdexcept>
+#include "../counters.h"
+
+namespace {
+// a^T b of the n_a and n_b distributed columns of length n_local, summed over procs.
+Eigen::MatrixXd get_overlaps(
+    const double* a,
+    const size_t n_a,
+    const double* b,
+    const size_t n_b,
+    const size_t n_local,
+    Device::Buffer& scratch) {
+  Eigen::MatrixXd overlaps(n_a, n_b);
+  if (scratch.size() < n_a * n_b) scratch.resize(n_a * n_b);
+  Device::gemm(
+      true, false, n_a, n_b, n_local, 1.0, a, n_local, b, n_local, 0.0, scratch.data(), n_a);
+  scratch.download(overlaps.data(), n_a * n_b);
+  MPI_Allreduce(
+      MPI_IN_PLACE, overlaps.data(), overlaps.size(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  return overlaps;
+}
+
+// c = a * m of the n_a distributed columns of a and the small n_a x n_c matrix m.
+void mul_small(
+    const double* a,
+    const size_t n_local,
+    const Eigen::MatrixXd& m,
+    double* c,
+    Device::Buffer& scratch,
+    const double alpha = 1.0,
+    const double beta = 0.0) {
+  if (scratch.size() < static_cast<size_t>(m.size())) scratch.resize(m.size());
+  scratch.upload(m.data(), m.size());
+  Device::gemm(
+      false,
+      false,
+      n_local,
+      m.cols(),
+      m.rows(),
+      alpha,
+      a,
+      n_local,
+      scratch.data(),
+      m.rows(),
+      beta,
+      c,
+      n_local);
+}
+
+// Orthonormalize the columns [n_basis, n_basis + n_block) of the distributed basis as in
+// davidson.cc. Returns false if a column becomes linearly dependent.
+bool orthonormalize(
+    Device::Buffer& basis,
+    const size_t n_local,
+    const size_t n_basis,
+    const size_t n_block,
+    Device::Buffer& scratch) {
+  double* new_vecs = basis.data() + n_basis * n_local;
+  if (n_basis > 0) {
+    for (int pass = 0; pass < 2; pass++) {
+      const Eigen::MatrixXd& overlaps =
+          get_overlaps(basis.data(), n_basis, new_vecs, n_block, n_local, scratch);
+      mul_small(basis.data(), n_local, overlaps, new_vecs, scratch, -1.0, 1.0);
+    }
+  }
+  for (size_t i = 0; i < n_block; i++) {
+    double* vec = new_vecs + i * n_local;
+    if (i > 0) {
+      const Eigen::MatrixXd& overlaps = get_overlaps(new_vecs, i, vec, 1, n_local, scratch);
+      mul_small(new_vecs, n_local, overlaps, vec, scratch, -1.0, 1.0);
+    }
+    double norm_sq = Device::dot(vec, vec, n_local);
+    MPI_Allreduce(MPI_IN_PLACE, &norm_sq, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    const double norm = std::sqrt(norm_sq);
+    if (norm < 1e-12) return false;
+    Device::scale(vec, n_local, 1.0 / norm);
+  }
+  return true;
+}
+}  // namespace
+
+void DeviceDavidson::mul_cols(
+    const SparseMatrix& matrix,
+    const Device::Buffer& basis,
+    const size_t begin,
+    const size_t n_block,
+    Device::Buffer& H_basis) const {
+  const size_t dim = matrix.count_n_rows();
+  const size_t n_local = matrix.get_slice_end() - matrix.get_slice_begin();
+  if (device_matrix.get_dim() != dim) throw std::runtime_error("device matrix is not uploaded");
+  Counters::add(Counters::MATVEC_NONZEROS, device_matrix.get_n_elems() * n_block);
+  double* H_cols = H_basis.data() + begin * n_local;
+  if (Parallel::get_n_procs() == 1) {
+    Device::set_zero(H_cols, n_block * n_local);
+    device_matrix.mul(basis.data() + begin * n_local, n_block, H_cols);
+    return;
+  }
+
+  // The slices of the other procs are gathered and the products summed back on the host.
+  std::vector<double> slice(n_local);
+  std::vector<double> block(dim * n_block);
+  for (size_t i = 0; i < n_block; i++) {
+    basis.download(slice.data(), n_local, (begin + i) * n_local);
+    matrix.allgather_slices(slice.data(), 1, block.data() + i * dim);
+  }
+  Device::Buffer vecs(dim * n_block);
+  Device::Buffer H_vecs(dim * n_block);
+  vecs.upload(block.data(), block.size());
+  Device::set_zero(H_vecs.data(), H_vecs.size());
+  device_matrix.mul(vecs.data(), n_block, H_vecs.data());
+  H_vecs.download(block.data(), block.size());
+  for (size_t i = 0; i < n_block; i++) {
+    matrix.reduce_scatter_slices(block.data() + i * dim, 1, slice.data());
+    H_basis.upload(slice.data(), n_local, (begin + i) * n_local);
+  }
+}
+
+void DeviceDavidson::diagonalize(
+    const SparseMatrix& matrix,
+    const std::vector<std::vector<double>>& initial_vectors,
+    const double target_error,
+    const bool verbose) {
+  const double TOLERANCE = target_error;
+  const size_t N_ITERATIONS_STORE = 5;  // storage per state.
+
+  const size_t dim = initial_vectors[0].size();
+  const unsigned n_states = std::min(dim, initial_vectors.size());
+  for (auto& eigenvec : lowest_eigenvectors) eigenvec.resize(dim);
+
+  if (dim == 1) {
+    lowest_eigenvalues[0] = matrix.get_diag(0);
+    lowest_eigenvectors[0].resize(1);
+    lowest_eigenvectors[0][0] = 1.0;
+    converged = true;
+    return;
+  }
+
+  // Basis vectors are kept column major as the slices owned by this proc.
+  const size_t slice_begin = matrix.get_slice_begin();
+  const size_t n_local = matrix.get_slice_end() - slice_begin;
+
+  const size_t n_store = n_states * std::min(dim, N_ITERATIONS_STORE);
+  // Same number of multiplications per call as collapsing to n_states vectors once.
+  const size_t n_new_vecs_max = n_store * 2 - n_states * 2;
+  std::vector<double> lowest_eigenvalues_prev(n_states, 0.0);
+
+  Device::Buffer v(n_local * n_store);
+  Device::Buffer Hv(n_local * n_store);
+  Device::Buffer w(n_local * n_states);
+  Device::Buffer Hw(n_local * n_states);
+  Device::Buffer v_restart(n_local * n_store);
+  Device::Buffer diag_local(n_local);
+  Device::Buffer scratch;
+  Eigen::MatrixXd h_krylov = Eigen::MatrixXd::Zero(n_store, n_store);
+  {
+    std::vector<double> diag(n_local);
+    for (size_t j = 0; j < n_local; j++) diag[j] = matrix.get_diag(slice_begin + j);
+    diag_local.upload(diag.data(), n_local);
+  }
+
+  std::vector<double> slice(n_local);
+  for (unsigned i_state = 0; i_state < n_states; i_state++) {
+    const auto& initial_vector = initial_vectors[i_state];
+    const double norm = std::sqrt(Util::dot_omp(initial_vector, initial_vector));
+    for (size_t j = 0; j < n_local; j++) {
+      slice[j] = norm > 0.0 ? initial_vector[slice_begin + j] / norm : 0.0;
+    }
+    v.upload(slice.data(), n_local, i_state * n_local);
+    // Start from unit vectors instead of dependent guesses, e.g. of the excited states.
+    for (size_t k = 0; !orthonormalize(v, n_local, i_state, 1, scratch) && k < dim; k++) {
+      Device::set_zero(v.data() + i_state * n_local, n_local);
+      const double one = 1.0;
+      if (k >= slice_begin && k < slice_begin + n_local) {
+        v.upload(&one, 1, i_state * n_local + k - slice_begin);
+      }
+    }
+  }
+  converged = false;
+  size_t n_basis = n_states;
+  size_t n_converged = 0;
+
+  // The initial vectors are the first Ritz vectors.
+  mul_cols(matrix, v, 0, n_states, Hv);
+  {
+    const Eigen::MatrixXd& h_init =
+        get_overlaps(v.data(), n_states, Hv.data(), n_states, n_local, scratch);
+    h_krylov.topLeftCorner(n_states, n_states) = (h_init + h_init.transpose()) * 0.5;
+  }
+  for (unsigned i_state = 0; i_state < n_states; i_state++) {
+    lowest_eigenvalues[i_state] = h_krylov(i_state, i_state);
+  }
+  Device::copy(v.data(), n_local * n_states, w.data());
+  Device::copy(Hv.data(), n_local * n_states, Hw.data());
+  if (verbose) {
+    printf("Davidson #0:");
+    for (const auto& eigenval : lowest_eigenvalues) printf("  %.10f", eigenval);
+    printf("\n");
+  }
+  lowest_eigenvalues_prev = lowest_eigenvalues;
+
+  size_t it_real = 1;
+  size_t n_new_vecs = 0;
+  while (!converged && n_new_vecs < n_new_vecs_max) {
+    // Correction vectors of the unconverged states share one matrix multiplication.
+    const size_t n_block = std::min(n_states - n_converged, n_new_vecs_max - n_new_vecs);
+
+    // Thick restart: keep the lowest Ritz vectors of the current subspace.
+    if (n_basis + n_block > n_store) {
+      const size_t n_keep = std::min(std::max<size_t>(n_states, n_store / 2), n_store - n_block);
+      Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen_solver(
+          h_krylov.topLeftCorner(n_basis, n_basis));
+      const Eigen::MatrixXd& ritz_vecs = eigen_solver.eigenvectors().leftCols(n_keep);
+      mul_small(v.data(), n_local, ritz_vecs, v_restart.data(), scratch);
+      Device::copy(v_restart.data(), n_local * n_keep, v.data());
+      mul_small(Hv.data(), n_local, ritz_vecs, v_restart.data(), scratch);
+      Device::copy(v_restart.data(), n_local * n_keep, Hv.data());
+      h_krylov.setZero();
+      h_krylov.diagonal().head(n_keep) = eigen_solver.eigenvalues().head(n_keep);
+      n_basis = n_keep;
+    }
+
+    const std::vector<double> block_eigenvalues(
+        lowest_eigenvalues.begin() + n_converged,
+        lowest_eigenvalues.begin() + n_converged + n_block);
+    Device::get_corrections(
+        diag_local.data(),
+        w.data() + n_converged * n_local,
+        Hw.data() + n_converged * n_local,
+        block_eigenvalues,
+        n_local,
+        v.data() + n_basis * n_local);
+    if (!orthonormalize(v, n_local, n_basis, n_block, scratch)) {
+      // corner case: norm gets small before eigenvalues converge
+      converged = true;
+      break;
+    }
+    mul_cols(matrix, v, n_basis, n_block, Hv);
+    n_new_vecs += n_block;
+
+    // Extend the subspace matrix with the new columns.
+    const size_t n_basis_new = n_basis + n_block;
+    const Eigen::MatrixXd& h_new = get_overlaps(
+        v.data(), n_basis_new, Hv.data() + n_basis * n_local, n_block, n_local, scratch);
+    h_krylov.block(0, n_basis, n_basis_new, n_block) = h_new;
+    h_krylov.block(n_basis, 0, n_block, n_basis_new) = h_new.transpose();
+    n_basis = n_basis_new;
+
+    // Diagonalize subspace matrix.
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen_solver(
+        h_krylov.topLeftCorner(n_basis, n_basis));
+    const auto& eigenvals = eigen_solver.eigenvalues();  // in ascending order
+    Eigen::MatrixXd eigenvecs = eigen_solver.eigenvectors().leftCols(n_states);
+    for (unsigned i_state = 0; i_state < n_states; i_state++) {
+      lowest_eigenvalues[i_state] = eigenvals(i_state);
+      if (eigenvecs(0, i_state) < 0) eigenvecs.col(i_state) *= -1.0;
+    }
+    mul_small(v.data(), n_local, eigenvecs, w.data(), scratch);
+    mul_small(Hv.data(), n_local, eigenvecs, Hw.data(), scratch);
+
+    if (verbose) {
+      printf("Davidson #%zu:", it_real);
+      for (const auto& eigenval : lowest_eigenvalues) printf("  %.10f", eigenval);
+      printf("\n");
+    }
+    it_real++;
+    for (unsigned i_state = n_converged; i_state < n_states; i_state++) {
+      if (std::abs(lowest_eigenvalues[i_state] - lowest_eigenvalues_prev[i_state]) > TOLERANCE) {
+        break;
+      } else {
+        n_converged++;
+      }
+    }
+    if (n_converged == n_states) converged = true;
+
+    if (!converged) lowest_eigenvalues_prev = lowest_eigenvalues;
+  }
+  lowest_eigenvectors.resize(n_states);
+  for (unsigned i_state = 0; i_state < n_states; i_state++) {
+    w.download(slice.data(), n_local, i_state * n_local);
+    lowest_eigenvectors[i_state] = matrix.gather_slices(slice);
+  }
+  if (n_states < initial_vectors.size()) {  // Corner case for excited states
+    lowest_eigenvectors.resize(initial_vectors.size());
+    for (unsigned i = n_states; i < initial_vectors.size(); i++) {
+      lowest_eigenvectors[i] = initial_vectors[i];
+    }
+  }
+}
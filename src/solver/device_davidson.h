@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include "device.h"
+#include "sparse_matrix.h"
+
+// The Davidson of davidson.cc with the basis vectors and the local rows of the matrix in device
+// memory, so that only the slices of the vectors multiplied on several procs, the small subspace
+// matrices and the eigenvectors are transferred. Upload the matrix after each update.
+class DeviceDavidson {
+ public:
+  DeviceDavidson(const unsigned n_states) {
+    lowest_eigenvalues.resize(n_states);
+    lowest_eigenvectors.resize(n_states);
+  }
+
+  void upload(const SparseMatrix& matrix) { device_matrix.upload(matrix); }
+
+  // The matrix provides the diagonal and the slices, its elements are those uploaded.
+  void diagonalize(
+      const SparseMatrix& matrix,
+      const std::vector<std::vector<double>>& initial_vectors,
+      const double target_error,
+      const bool verbose = false);
+
+  std::vector<double> get_lowest_eigenvalues() const { return lowest_eigenvalues; }
+
+  std::vector<std::vector<double>> get_lowest_eigenvectors() const { return lowest_eigenvectors; }
+
+  bool converged;
+
+ private:
+  Device::Matrix device_matrix;
+
+  std::vector<double> lowest_eigenvalues;
+
+  std::vector<std::vector<double>> lowest_eigenvectors;
+
+  // Multiply the columns [begin, begin + n_block) of the basis into the same columns of H_basis.
+  void mul_cols(
+      const SparseMatrix& matrix,
+      const Device::Buffer& basis,
+      const size_t begin,
+      const size_t n_block,
+      Device::Buffer& H_basis) const;
+};
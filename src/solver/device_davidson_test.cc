@@ -0,0 +1,68 @@
+#include "device_davidson.h"
+#include <gtest/gtest.h>
+#include "davidson.h"
+
+// Compare with the host Davidson on a Hilbert matrix.
+class DeviceHilbertSystem {
+ public:
+  SparseMatrix matrix;
+
+  DeviceHilbertSystem(int n) {
+    matrix.set_dim(n);
+    for (int i = 0; i < n; i++) {
+      for (int j = i; j < n; j++) {
+        matrix.append_elem(i, j, get_hamiltonian(i, j));
+      }
+    }
+    matrix.cache_diag();
+  }
+
+  double get_hamiltonian(int i, int j) {
+    const double GAMMA = 10.0;
+    if (i == j) return -1.0 / (2 * i + 1);
+    return -1.0 / GAMMA / (i + j + 1);
+  }
+};
+
+void check_device_davidson(const unsigned n_states) {
+  const int N = 1000;
+  DeviceHilbertSystem hilbert_system(N);
+  std::vector<std::vector<double>> initial_vectors(n_states);
+  for (unsigned i = 0; i < n_states; i++) {
+    initial_vectors[i].resize(N, 0.0);
+    initial_vectors[i][i] = 1.0;
+  }
+
+  Davidson davidson(n_states);
+  davidson.diagonalize(hilbert_system.matrix, initial_vectors, 1.0e-8);
+  DeviceDavidson device_davidson(n_states);
+  device_davidson.upload(hilbert_system.matrix);
+  device_davidson.diagonalize(hilbert_system.matrix, initial_vectors, 1.0e-8);
+  EXPECT_TRUE(device_davidson.converged);
+
+  const std::vector<double>& expected_eigenvalues = davidson.get_lowest_eigenvalues();
+  const std::vector<double>& eigenvalues = device_davidson.get_lowest_eigenvalues();
+  const std::vector<std::vector<double>>& expected_eigenvectors =
+      davidson.get_lowest_eigenvectors();
+  const std::vector<std::vector<double>>& eigenvectors = device_davidson.get_lowest_eigenvectors();
+  for (unsigned i = 0; i < n_states; i++) {
+    EXPECT_NEAR(eigenvalues[i], expected_eigenvalues[i], 1.0e-8);
+    for (int j = 0; j < 5; j++) {
+      EXPECT_NEAR(std::abs(eigenvectors[i][j]), std::abs(expected_eigenvectors[i][j]), 1.0e-4);
+    }
+  }
+}
+
+TEST(DeviceDavidsonTest, MatchesHostDavidson) { check_device_davidson(1); }
+
+TEST(DeviceDavidsonTest, MatchesHostDavidsonTwoStates) { check_device_davidson(2); }
+
+TEST(DeviceDavidsonTest, DiagonalizeNeedsUpload) {
+  DeviceHilbertSystem hilbert_system(10);
+  std::vector<std::vector<double>> initial_vectors(1, std::vector<double>(10, 0.0));
+  initial_vectors[0][0] = 1.0;
+  DeviceDavidson device_davidson(1);
+  EXPECT_THROW(
+      device_davidson.diagonalize(hilbert_system.matrix, initial_vectors, 1.0e-8),
+      std::runtime_error);
+}
@@ -1,6 +1,8 @@
 #include "../base_system.h"
 #include "hamiltonian.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <unordered_map>
 #include <vector>
@@ -24,6 +26,9 @@ class Green {
 
   double n;
 
+  // Real parts of the frequencies, w is the current one.
+  std::vector<double> ws;
+
   bool advanced;
 
   std::vector<Det> dets_store;
@@ -42,6 +47,21 @@ class Green {
 
   std::vector<double> construct_b(const unsigned orb);
 
+  void solve_cg();
+
+  // Lanczos on H from a block of right-hand sides at a time, with one multiplication per block and
+  // iteration, and the solutions at all the frequencies from the same tridiagonal matrices.
+  void solve_shifted();
+
+  // Solve (shift + sign * T) y = scale * e_1 for the tridiagonal T with diagonal alphas and off
+  // diagonal betas, without pivoting since the shift has a nonzero imaginary part.
+  static std::vector<std::complex<double>> solve_tridiagonal(
+      const std::complex<double>& shift,
+      const double sign,
+      const std::vector<double>& alphas,
+      const std::vector<double>& betas,
+      const double scale);
+
   std::vector<std::complex<double>> mul_green(const std::vector<std::complex<double>>& vec) const;
 
   std::vector<std::complex<double>> cg(
@@ -60,7 +80,8 @@ void Green<S>::run() {
   n_dets = dets_store.size();
   n_orbs = system.n_orbs;
 
-  w = Config::get<double>("w_green");
+  ws = Config::get<std::vector<double>>("w_green", std::vector<double>());
+  if (ws.empty()) ws.push_back(Config::get<double>("w_green"));
   n = Config::get<double>("n_green");
 
   // Construct new dets.
@@ -86,6 +107,22 @@ void Green<S>::run() {
     G[i].assign(n_orbs * 2, 0.0);
   }
 
+  const auto& solver = Config::get<std::string>("green_solver", "cg");
+  if (Util::str_equals_ci(solver, "shifted")) {
+    solve_shifted();
+  } else if (Util::str_equals_ci(solver, "cg")) {
+    for (const double w_i : ws) {
+      w = w_i;
+      solve_cg();
+      output_green();
+    }
+  } else {
+    throw std::invalid_argument("unknown green_solver");
+  }
+}
+
+template <class S>
+void Green<S>::solve_cg() {
   for (unsigned j = 0; j < n_orbs * 2; j++) {
     Timer::checkpoint(Util::str_printf("orb #%zu/%zu", j + 1, n_orbs * 2));
     // Construct bj
@@ -115,8 +152,6 @@ void Green<S>::run() {
       G[i][j] = Util::dot_omp(bi, x);
     }
   }
-
-  output_green();
 }
 
 template <class S>
@@ -258,6 +293,146 @@ std::vector<std::complex<double>> Green<S>::cg(
   return x;
 }
 
+template <class S>
+void Green<S>::solve_shifted() {
+  const unsigned n_rhs = n_orbs * 2;
+  const size_t block_size = Config::get<size_t>("green_block_size", 16);
+  const double tol = 1.0e-15;
+  const size_t max_iterations = 1000;
+  const double sign = advanced ? -1.0 : 1.0;
+  std::vector<std::complex<double>> shifts;
+  for (const double w_i : ws) {
+    shifts.push_back(w_i + n * Util::I - sign * system.energy_var[0]);
+  }
+
+  // The nonzero entries of each b, which has at most one per det.
+  std::vector<std::vector<std::pair<size_t, double>>> b_entries(n_rhs);
+  for (unsigned i = 0; i < n_rhs; i++) {
+    const auto& bi = construct_b(i);
+    for (size_t k = 0; k < n_pdets; k++) {
+      if (bi[k] != 0.0) b_entries[i].push_back(std::make_pair(k, bi[k]));
+    }
+  }
+
+  // Tridiagonal matrix of each right-hand side and projections[j][k][i] = b_i . v_k.
+  std::vector<double> b_norms(n_rhs, 0.0);
+  std::vector<std::vector<double>> alphas(n_rhs);
+  std::vector<std::vector<double>> betas(n_rhs);
+  std::vector<std::vector<std::vector<double>>> projections(n_rhs);
+  const auto& project = [&](const unsigned j, const std::vector<double>& v) {
+    std::vector<double> projection(n_rhs, 0.0);
+    for (unsigned i = 0; i < n_rhs; i++) {
+      for (const auto& entry : b_entries[i]) projection[i] += entry.second * v[entry.first];
+    }
+    projections[j].push_back(projection);
+  };
+
+  for (unsigned block_begin = 0; block_begin < n_rhs; block_begin += block_size) {
+    const unsigned block_end = std::min<size_t>(block_begin + block_size, n_rhs);
+    Timer::checkpoint(Util::str_printf("orbs #%u-%u/%u", block_begin + 1, block_end, n_rhs));
+    std::vector<unsigned> active;
+    std::vector<std::vector<double>> vs;
+    std::vector<std::vector<double>> vs_prev;
+    for (unsigned j = block_begin; j < block_end; j++) {
+      for (const auto& entry : b_entries[j]) b_norms[j] += entry.second * entry.second;
+      b_norms[j] = std::sqrt(b_norms[j]);
+      if (b_norms[j] == 0.0) continue;
+      std::vector<double> v(n_pdets, 0.0);
+      for (const auto& entry : b_entries[j]) v[entry.first] = entry.second / b_norms[j];
+      project(j, v);
+      active.push_back(j);
+      vs.push_back(v);
+      vs_prev.push_back(std::vector<double>(n_pdets, 0.0));
+    }
+
+    size_t iter = 0;
+    double max_residual = 0.0;
+    while (!active.empty()) {
+      if (iter >= max_iterations) throw std::runtime_error("shifted lanczos does not converge");
+      iter++;
+      auto Hvs = hamiltonian.matrix.mul(vs);
+      max_residual = 0.0;
+      std::vector<unsigned> still_active;
+      std::vector<std::vector<double>> vs_next;
+      std::vector<std::vector<double>> vs_next_prev;
+      for (size_t a = 0; a < active.size(); a++) {
+        const unsigned j = active[a];
+        const auto& v = vs[a];
+        auto& Hv = Hvs[a];
+        const double alpha = Util::dot_omp(v, Hv);
+        const double beta_prev = betas[j].empty() ? 0.0 : betas[j].back();
+        const auto& v_prev = vs_prev[a];
+#pragma omp parallel for
+        for (size_t k = 0; k < n_pdets; k++) Hv[k] -= alpha * v[k] + beta_prev * v_prev[k];
+        const double beta = std::sqrt(Util::dot_omp(Hv, Hv));
+        alphas[j].push_back(alpha);
+        betas[j].push_back(beta);
+
+        // The residual at each shift is beta times the last component of its solution.
+        double residual = 0.0;
+        for (const auto& shift : shifts) {
+          const auto& y = solve_tridiagonal(shift, sign, alphas[j], betas[j], b_norms[j]);
+          residual = std::max(residual, std::norm(beta * y.back()));
+        }
+        max_residual = std::max(max_residual, residual);
+        if (residual <= tol || beta == 0.0) continue;
+
+#pragma omp parallel for
+        for (size_t k = 0; k < n_pdets; k++) Hv[k] /= beta;
+        project(j, Hv);
+        still_active.push_back(j);
+        vs_next_prev.push_back(std::move(vs[a]));
+        vs_next.push_back(std::move(Hv));
+      }
+      active.swap(still_active);
+      vs.swap(vs_next);
+      vs_prev.swap(vs_next_prev);
+      if (Parallel::is_master() && iter % 10 == 0) {
+        printf("Iteration %zu: r = %g, %zu active\n", iter, max_residual, active.size());
+      }
+    }
+    if (Parallel::is_master()) printf("Final iteration %zu: r = %g\n", iter, max_residual);
+  }
+
+  for (size_t w_id = 0; w_id < ws.size(); w_id++) {
+    w = ws[w_id];
+    for (unsigned j = 0; j < n_rhs; j++) {
+      G[j].assign(n_rhs, 0.0);
+    }
+    for (unsigned j = 0; j < n_rhs; j++) {
+      if (b_norms[j] == 0.0) continue;
+      const auto& y = solve_tridiagonal(shifts[w_id], sign, alphas[j], betas[j], b_norms[j]);
+      for (size_t k = 0; k < y.size(); k++) {
+        for (unsigned i = 0; i < n_rhs; i++) G[i][j] += projections[j][k][i] * y[k];
+      }
+    }
+    output_green();
+  }
+}
+
+template <class S>
+std::vector<std::complex<double>> Green<S>::solve_tridiagonal(
+    const std::complex<double>& shift,
+    const double sign,
+    const std::vector<double>& alphas,
+    const std::vector<double>& betas,
+    const double scale) {
+  const size_t dim = alphas.size();
+  std::vector<std::complex<double>> upper(dim);
+  std::vector<std::complex<double>> y(dim, 0.0);
+  y[0] = scale;
+  std::complex<double> pivot = shift + sign * alphas[0];
+  for (size_t k = 1; k < dim; k++) {
+    upper[k - 1] = sign * betas[k - 1] / pivot;
+    y[k - 1] /= pivot;
+    pivot = shift + sign * alphas[k] - sign * betas[k - 1] * upper[k - 1];
+    y[k] = -sign * betas[k - 1] * y[k - 1];
+  }
+  y[dim - 1] /= pivot;
+  for (size_t k = dim - 1; k > 0; k--) y[k - 1] -= upper[k - 1] * y[k];
+  return y;
+}
+
 template <class S>
 std::vector<std::complex<double>> Green<S>::mul_green(
     const std::vector<std::complex<double>>& vec) const {
@@ -1,14 +1,19 @@
 #pragma once
 
 #include <fgpl/src/dist_range.h>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
 #include <string>
-#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include "../base_system.h"
+#include "../det/half_det_map.h"
 #include "../parallel.h"
+#include "../result.h"
 #include "../timer.h"
 #include "../util.h"
+#include "sorted_intersection.h"
 #include "sparse_matrix.h"
 
 template <class S>
@@ -22,6 +27,21 @@ class Hamiltonian {
 
   void clear();
 
+  // Recompute the stored elements for the current integrals of system, whose dets must be the
+  // ones of the matrix, keeping the connections instead of rebuilding them. Elements that were
+  // dropped as negligible for the previous integrals stay dropped.
+  void revalue(const S& system);
+
+  // Changing the precision of the stored elements rebuilds the matrix on the next update.
+  void set_float_values(const bool float_values);
+
+  // Write the matrix of the dets of system next to the wavefunction file.
+  void save(const S& system, const std::string& wf_filename) const;
+
+  // Use the matrix saved for exactly the dets and integrals of system if there is one.
+  // A loaded matrix is rebuilt from scratch on the next update with more dets.
+  bool load(const S& system, const std::string& wf_filename);
+
  private:
   size_t n_dets = 0;
 
@@ -35,16 +55,29 @@ class Hamiltonian {
 
   bool sort_by_det_id = false;
 
+  // Recompute the off-diagonal elements in each multiplication instead of storing them.
+  bool direct = false;
+
+  bool direct_cache_same_spin = false;
+
+  // Build the singles lists by sorting the minus one half dets instead of hashing them.
+  bool sorted_absingles = false;
+
+  // The matrix is mapped from a saved file, without the lists to extend it.
+  bool loaded = false;
+
   std::vector<HalfDet> unique_alphas;
 
   std::vector<HalfDet> unique_betas;
 
-  std::unordered_map<HalfDet, size_t, HalfDetHasher> alpha_to_id;
+  HalfDetMap<size_t> alpha_to_id;
+
+  HalfDetMap<size_t> beta_to_id;
 
-  std::unordered_map<HalfDet, size_t, HalfDetHasher> beta_to_id;
+  typedef std::pair<std::vector<size_t>, std::vector<size_t>> AbIds;
 
-  std::unordered_map<HalfDet, std::pair<std::vector<size_t>, std::vector<size_t>>, HalfDetHasher>
-      abm1_to_ab_ids;
+  // Split into shards by hash value so that the shards can be filled in parallel.
+  std::vector<HalfDetMap<AbIds>> abm1_to_ab_ids;
 
   std::vector<std::vector<size_t>> alpha_id_to_single_ids;
 
@@ -65,21 +98,112 @@ class Hamiltonian {
   // Augment unique alphas/betas and alpha/beta to det info.
   void update_abdet(const S& system);
 
+  // Look up the ids of n_keys half dets and give the missing ones new ids in the order of their
+  // first appearance, which keeps the ids independent of the number of threads.
+  template <class GetHalfDet>
+  std::vector<size_t> get_or_add_ids(
+      const size_t n_keys,
+      const GetHalfDet& get_half_det,
+      HalfDetMap<size_t>& half_det_to_id,
+      std::vector<HalfDet>& unique_half_dets);
+
+  // Append new det k to the lists of key_ids[k], in parallel over the owners of the lists.
+  void append_to_det_lists(
+      const std::vector<size_t>& key_ids,
+      const std::vector<size_t>& partner_ids,
+      std::vector<std::vector<size_t>>& key_id_to_partner_ids,
+      std::vector<std::vector<size_t>>& key_id_to_det_ids);
+
+  // Flag the unique alphas/betas of the new dets.
+  void mark_updated_ab(
+      const S& system, std::vector<char>& alpha_updated, std::vector<char>& beta_updated) const;
+
   // Update unique alpha/beta minus one.
   void update_abm1(const S& system);
 
+  // Add the minus one half dets of the given unique alphas / betas in parallel over the shards.
+  void add_abm1(
+      const std::vector<size_t>& ids,
+      const std::vector<HalfDet>& unique_half_dets,
+      const unsigned n_elecs,
+      const bool is_beta);
+
+  const AbIds* find_abm1(const HalfDet& abm1) const;
+
   // Update alpha/beta singles lists.
   void update_absingles(const S& system);
 
+  // A minus one half det as the unique alpha/beta it comes from and the removed orbital.
+  struct Abm1Entry {
+    size_t hash;
+
+    uint32_t id;
+
+    uint16_t orb;
+
+    uint16_t updated;
+  };
+
+  // Update alpha/beta singles lists from the minus one half dets sorted by hash value, without
+  // the abm1 map. Needs fewer than 2^32 unique alphas and betas.
+  void update_absingles_sorted(const S& system);
+
+  // Append the pairs of half dets sharing a minus one half det, at least one of them updated, to
+  // both of their singles lists.
+  void add_absingles_sorted(
+      const std::vector<HalfDet>& unique_half_dets,
+      const std::vector<char>& updated,
+      const unsigned n_elecs,
+      std::vector<std::vector<size_t>>& id_to_single_ids,
+      std::vector<omp_lock_t>& locks);
+
+  // Sort the singles lists and report their sizes.
+  void sort_absingles();
+
   void update_matrix(const S& system);
 
+  // Call handler(j, H_ij) for the connections j >= start_id of det_id.
+  template <class Handler>
+  void generate_row(
+      const S& system,
+      const size_t det_id,
+      const size_t start_id,
+      const bool same_spin,
+      const bool mixed,
+      const Handler& handler);
+
+  // Accumulate the off-diagonal elements not stored in the matrix into res_local.
+  void mul_direct(
+      const S& system,
+      const bool same_spin,
+      const double* vec,
+      const size_t n_vecs,
+      std::vector<double>& res_local);
+
   void sort_by_first(std::vector<size_t>& vec1, std::vector<size_t>& vec2);
+
+  std::string get_matrix_filename(const std::string& wf_filename) const;
+
+  // Identifies the dets, integrals and storage options the matrix is built from.
+  size_t get_matrix_tag(const S& system) const;
 };
 
 template <class S>
 Hamiltonian<S>::Hamiltonian() {
   n_up = Config::get<unsigned>("n_up");
   n_dn = Config::get<unsigned>("n_dn");
+  direct = Config::get<bool>("direct_hamiltonian", false);
+  direct_cache_same_spin = Config::get<bool>("direct_hamiltonian_cache_same_spin", false);
+  const auto& singles_engine = Config::get<std::string>("absingles_engine", "hash");
+  if (!Util::str_equals_ci(singles_engine, "hash") &&
+      !Util::str_equals_ci(singles_engine, "sort")) {
+    throw std::invalid_argument("unknown absingles_engine: " + singles_engine);
+  }
+  sorted_absingles = Util::str_equals_ci(singles_engine, "sort");
+  if (direct && (Config::get<bool>("2rdm", false) || Config::get<bool>("get_2rdm_csv", false) ||
+                 Config::get<bool>("optorb", false))) {
+    throw std::invalid_argument("direct_hamiltonian does not store the connections for 2rdm");
+  }
 }
 
 template <class S>
@@ -87,13 +211,23 @@ void Hamiltonian<S>::update(const S& system) {
   n_dets_prev = n_dets;
   n_dets = system.get_n_dets();
   if (n_dets_prev == n_dets) return;
+  if ((direct || loaded) && n_dets_prev > 0) {
+    // The singles lists are only complete when built from scratch.
+    clear();
+    n_dets = system.get_n_dets();
+  }
   time_sym = system.time_sym;
   sort_by_det_id = (n_dets < n_dets_prev * 1.15);
 
   update_abdet(system);
   Timer::checkpoint("update unique ab");
 
-  if (system.has_double_excitation) {
+  const size_t max_sorted_ids = std::numeric_limits<uint32_t>::max();
+  if (system.has_double_excitation && sorted_absingles && alpha_to_id.size() <= max_sorted_ids &&
+      beta_to_id.size() <= max_sorted_ids) {
+    update_absingles_sorted(system);
+    Timer::checkpoint("create absingles");
+  } else if (system.has_double_excitation) {
     update_abm1(system);
     Timer::checkpoint("create abm1");
     update_absingles(system);
@@ -102,10 +236,12 @@ void Hamiltonian<S>::update(const S& system) {
     Timer::checkpoint("create absingles");
   }
   update_matrix(system);
-  alpha_id_to_single_ids.clear();
-  alpha_id_to_single_ids.shrink_to_fit();
-  beta_id_to_single_ids.clear();
-  beta_id_to_single_ids.shrink_to_fit();
+  if (!direct) {
+    alpha_id_to_single_ids.clear();
+    alpha_id_to_single_ids.shrink_to_fit();
+    beta_id_to_single_ids.clear();
+    beta_id_to_single_ids.shrink_to_fit();
+  }
   Timer::checkpoint("generate sparse hamiltonian");
 }
 
@@ -113,14 +249,13 @@ template <class S>
 void Hamiltonian<S>::clear() {
   n_dets = 0;
   n_dets_prev = 0;
+  loaded = false;
   unique_alphas.clear();
   unique_alphas.shrink_to_fit();
   unique_betas.clear();
   unique_betas.shrink_to_fit();
   alpha_to_id.clear();
-  Util::free(alpha_to_id);
   beta_to_id.clear();
-  Util::free(beta_to_id);
   abm1_to_ab_ids.clear();
   Util::free(abm1_to_ab_ids);
   alpha_id_to_single_ids.clear();
@@ -138,156 +273,317 @@ void Hamiltonian<S>::clear() {
   matrix.clear();
 }
 
+template <class S>
+void Hamiltonian<S>::revalue(const S& system) {
+  if (n_dets != system.get_n_dets()) {
+    throw std::invalid_argument("revalue needs the dets the hamiltonian was built for");
+  }
+  matrix.revalue([&](const size_t i, const size_t j) {
+    const auto& det_i = system.dets[i];
+    const auto& det_j = system.dets[j];
+    const int n_excite = i == j ? 0 : -1;
+    return time_sym ? system.get_hamiltonian_elem_time_sym(det_i, det_j, n_excite)
+                    : system.get_hamiltonian_elem(det_i, det_j, n_excite);
+  });
+}
+
+template <class S>
+void Hamiltonian<S>::set_float_values(const bool float_values) {
+  if (float_values == matrix.has_float_values()) return;
+  clear();
+  matrix.set_float_values(float_values);
+}
+
+template <class S>
+void Hamiltonian<S>::save(const S& system, const std::string& wf_filename) const {
+  if (direct || n_dets != system.get_n_dets()) return;
+  Timer::start("save hamiltonian");
+  matrix.save(get_matrix_filename(wf_filename), get_matrix_tag(system));
+  if (Parallel::is_master()) printf("Saved hamiltonian to %s.*\n", wf_filename.c_str());
+  Timer::end();
+}
+
+template <class S>
+bool Hamiltonian<S>::load(const S& system, const std::string& wf_filename) {
+  if (direct) return false;
+  clear();
+  if (!matrix.load(get_matrix_filename(wf_filename), get_matrix_tag(system))) return false;
+  n_dets = n_dets_prev = system.get_n_dets();
+  time_sym = system.time_sym;
+  loaded = true;
+  if (Parallel::is_master()) printf("Loaded hamiltonian from %s.*\n", wf_filename.c_str());
+  return true;
+}
+
+template <class S>
+std::string Hamiltonian<S>::get_matrix_filename(const std::string& wf_filename) const {
+  return Util::str_printf("%s.hamiltonian_%d", wf_filename.c_str(), Parallel::get_proc_id());
+}
+
+template <class S>
+size_t Hamiltonian<S>::get_matrix_tag(const S& system) const {
+  const size_t n_dets = system.get_n_dets();
+  size_t dets_hash = 0;
+#pragma omp parallel for schedule(static) reduction(+ : dets_hash)
+  for (size_t i = 0; i < n_dets; i++) {
+    dets_hash += Util::rehash(DetHasher()(system.dets[i]) + i);
+  }
+  size_t tag = system.get_integrals_hash();
+  tag ^= Util::rehash(dets_hash + n_dets);
+  tag ^= Util::rehash(system.time_sym + 2 * matrix.has_float_values());
+  return tag;
+}
+
 template <class S>
 void Hamiltonian<S>::update_abdet(const S& system) {
-  std::unordered_set<size_t> updated_alphas;
-  std::unordered_set<size_t> updated_betas;
-  for (size_t i = n_dets_prev; i < n_dets; i++) {
-    const auto& det = system.dets[i];
+  const size_t n_new_dets = n_dets - n_dets_prev;
+  const auto& new_dets = system.dets.begin() + n_dets_prev;
 
-    // Obtain alpha id.
-    const auto& alpha = det.up;
-    size_t alpha_id;
-    if (alpha_to_id.count(alpha) == 0) {
-      alpha_id = alpha_to_id.size();
-      alpha_to_id[alpha] = alpha_id;
-      unique_alphas.push_back(alpha);
-      if (alpha_id_to_beta_ids.capacity() < alpha_id + 1) {
-        alpha_id_to_beta_ids.reserve(alpha_id_to_beta_ids.capacity() * 2);
-        alpha_id_to_det_ids.reserve(alpha_id_to_det_ids.capacity() * 2);
-      }
-      alpha_id_to_beta_ids.resize(alpha_id + 1);
-      alpha_id_to_det_ids.resize(alpha_id + 1);
-    } else {
-      alpha_id = alpha_to_id[alpha];
+  std::vector<size_t> alpha_ids;
+  std::vector<size_t> beta_ids;
+  if (time_sym) {
+    // Alphas and betas share the ids, with the alpha of each det coming first.
+    const auto& ids = get_or_add_ids(
+        n_new_dets * 2,
+        [&](const size_t k) -> const HalfDet& {
+          return k % 2 == 0 ? new_dets[k / 2].up : new_dets[k / 2].dn;
+        },
+        alpha_to_id,
+        unique_alphas);
+    alpha_ids.resize(n_new_dets);
+    beta_ids.resize(n_new_dets);
+#pragma omp parallel for
+    for (size_t k = 0; k < n_new_dets; k++) {
+      alpha_ids[k] = ids[k * 2];
+      beta_ids[k] = ids[k * 2 + 1];
     }
-    updated_alphas.insert(alpha_id);
+  } else {
+    alpha_ids = get_or_add_ids(
+        n_new_dets,
+        [&](const size_t k) -> const HalfDet& { return new_dets[k].up; },
+        alpha_to_id,
+        unique_alphas);
+    beta_ids = get_or_add_ids(
+        n_new_dets,
+        [&](const size_t k) -> const HalfDet& { return new_dets[k].dn; },
+        beta_to_id,
+        unique_betas);
+  }
 
-    // Obtain beta id.
-    const auto& beta = det.dn;
-    size_t beta_id;
-    if (time_sym) {
-      if (alpha_to_id.count(beta) == 0) {
-        beta_id = alpha_to_id.size();
-        alpha_to_id[beta] = beta_id;
-        unique_alphas.push_back(beta);
-        if (beta_id_to_alpha_ids.capacity() < beta_id + 1) {
-          beta_id_to_alpha_ids.reserve(beta_id_to_alpha_ids.capacity() * 2);
-          beta_id_to_det_ids.reserve(beta_id_to_det_ids.capacity() * 2);
-        }
-        beta_id_to_alpha_ids.resize(beta_id + 1);
-        beta_id_to_det_ids.resize(beta_id + 1);
-      } else {
-        beta_id = alpha_to_id[beta];
-      }
-    } else {
-      if (beta_to_id.count(beta) == 0) {
-        beta_id = beta_to_id.size();
-        beta_to_id[beta] = beta_id;
-        unique_betas.push_back(beta);
-        if (beta_id_to_alpha_ids.capacity() < beta_id + 1) {
-          beta_id_to_alpha_ids.reserve(beta_id_to_alpha_ids.capacity() * 2);
-          beta_id_to_det_ids.reserve(beta_id_to_det_ids.capacity() * 2);
-        }
-        beta_id_to_alpha_ids.resize(beta_id + 1);
-        beta_id_to_det_ids.resize(beta_id + 1);
+  size_t n_alpha_lists = alpha_id_to_beta_ids.size();
+  size_t n_beta_lists = beta_id_to_alpha_ids.size();
+  for (size_t k = 0; k < n_new_dets; k++) {
+    n_alpha_lists = std::max(n_alpha_lists, alpha_ids[k] + 1);
+    n_beta_lists = std::max(n_beta_lists, beta_ids[k] + 1);
+  }
+  alpha_id_to_beta_ids.resize(n_alpha_lists);
+  alpha_id_to_det_ids.resize(n_alpha_lists);
+  beta_id_to_alpha_ids.resize(n_beta_lists);
+  beta_id_to_det_ids.resize(n_beta_lists);
+
+  // Update alpha/beta to det info.
+  append_to_det_lists(alpha_ids, beta_ids, alpha_id_to_beta_ids, alpha_id_to_det_ids);
+  append_to_det_lists(beta_ids, alpha_ids, beta_id_to_alpha_ids, beta_id_to_det_ids);
+}
+
+template <class S>
+template <class GetHalfDet>
+std::vector<size_t> Hamiltonian<S>::get_or_add_ids(
+    const size_t n_keys,
+    const GetHalfDet& get_half_det,
+    HalfDetMap<size_t>& half_det_to_id,
+    std::vector<HalfDet>& unique_half_dets) {
+  const size_t NEW_ID = std::numeric_limits<size_t>::max();
+  std::vector<size_t> ids(n_keys);
+  std::vector<std::vector<HalfDet>> new_half_dets(Parallel::get_n_threads());
+
+  // Each thread collects the missing half dets of a contiguous range of keys in order.
+#pragma omp parallel
+  {
+    const size_t thread_id = omp_get_thread_num();
+    const size_t n_threads = omp_get_num_threads();
+    const size_t begin = n_keys * thread_id / n_threads;
+    const size_t end = n_keys * (thread_id + 1) / n_threads;
+    std::unordered_set<HalfDet, HalfDetHasher> found;
+    for (size_t k = begin; k < end; k++) {
+      const HalfDet& half_det = get_half_det(k);
+      const size_t* id = half_det_to_id.find(half_det);
+      if (id) {
+        ids[k] = *id;
       } else {
-        beta_id = beta_to_id[beta];
+        ids[k] = NEW_ID;
+        if (found.insert(half_det).second) new_half_dets[thread_id].push_back(half_det);
       }
     }
-    updated_betas.insert(beta_id);
+  }
 
-    if (time_sym) {
-      if (alpha_id_to_beta_ids.size() <= alpha_id) {
-        alpha_id_to_beta_ids.resize(alpha_id + 1);
-        alpha_id_to_det_ids.resize(alpha_id + 1);
-      }
-      if (beta_id_to_alpha_ids.size() <= beta_id) {
-        beta_id_to_alpha_ids.resize(beta_id + 1);
-        beta_id_to_det_ids.resize(beta_id + 1);
-      }
+  // Merging the ranges in order reproduces the order of first appearance.
+  size_t n_new_half_dets = 0;
+  for (const auto& half_dets : new_half_dets) n_new_half_dets += half_dets.size();
+  if (n_new_half_dets == 0) return ids;
+  half_det_to_id.reserve(half_det_to_id.size() + n_new_half_dets);
+  unique_half_dets.reserve(unique_half_dets.size() + n_new_half_dets);
+  for (auto& half_dets : new_half_dets) {
+    for (const auto& half_det : half_dets) {
+      if (half_det_to_id.count(half_det) == 1) continue;
+      const size_t id = half_det_to_id.size();
+      half_det_to_id[half_det] = id;
+      unique_half_dets.push_back(half_det);
     }
+    Util::free(half_dets);
+  }
 
-    // Update alpha/beta to det info.
-    alpha_id_to_beta_ids[alpha_id].push_back(beta_id);
-    alpha_id_to_det_ids[alpha_id].push_back(i);
-    beta_id_to_alpha_ids[beta_id].push_back(alpha_id);
-    beta_id_to_det_ids[beta_id].push_back(i);
+#pragma omp parallel for
+  for (size_t k = 0; k < n_keys; k++) {
+    if (ids[k] == NEW_ID) ids[k] = *half_det_to_id.find(get_half_det(k));
   }
+  return ids;
+}
 
-  // Sort updated alpha/beta to det info.
-  if (sort_by_det_id) {
-    for (const size_t alpha_id : updated_alphas) {
-      Util::sort_by_first<size_t, size_t>(
-          alpha_id_to_det_ids[alpha_id], alpha_id_to_beta_ids[alpha_id]);
-    }
-    for (const size_t beta_id : updated_betas) {
-      Util::sort_by_first<size_t, size_t>(
-          beta_id_to_det_ids[beta_id], beta_id_to_alpha_ids[beta_id]);
-    }
-  } else {
-    for (const size_t alpha_id : updated_alphas) {
-      Util::sort_by_first<size_t, size_t>(
-          alpha_id_to_beta_ids[alpha_id], alpha_id_to_det_ids[alpha_id]);
+template <class S>
+void Hamiltonian<S>::append_to_det_lists(
+    const std::vector<size_t>& key_ids,
+    const std::vector<size_t>& partner_ids,
+    std::vector<std::vector<size_t>>& key_id_to_partner_ids,
+    std::vector<std::vector<size_t>>& key_id_to_det_ids) {
+  const size_t n_new_dets = key_ids.size();
+  const size_t n_max_threads = Parallel::get_n_threads();
+  // buckets[t][owner]: new dets in the range of thread t whose lists belong to owner.
+  std::vector<std::vector<std::vector<size_t>>> buckets(
+      n_max_threads, std::vector<std::vector<size_t>>(n_max_threads));
+
+#pragma omp parallel
+  {
+    const size_t thread_id = omp_get_thread_num();
+    const size_t n_threads = omp_get_num_threads();
+    const size_t begin = n_new_dets * thread_id / n_threads;
+    const size_t end = n_new_dets * (thread_id + 1) / n_threads;
+    for (size_t k = begin; k < end; k++) buckets[thread_id][key_ids[k] % n_threads].push_back(k);
+
+#pragma omp barrier
+    // Dets are appended in increasing order, so the first new det of a list marks it updated.
+    std::vector<size_t> updated_key_ids;
+    for (size_t t = 0; t < n_threads; t++) {
+      for (const size_t k : buckets[t][thread_id]) {
+        const size_t key_id = key_ids[k];
+        auto& det_ids = key_id_to_det_ids[key_id];
+        if (det_ids.empty() || det_ids.back() < n_dets_prev) updated_key_ids.push_back(key_id);
+        key_id_to_partner_ids[key_id].push_back(partner_ids[k]);
+        det_ids.push_back(n_dets_prev + k);
+      }
+      Util::free(buckets[t][thread_id]);
     }
-    for (const size_t beta_id : updated_betas) {
-      Util::sort_by_first<size_t, size_t>(
-          beta_id_to_alpha_ids[beta_id], beta_id_to_det_ids[beta_id]);
+
+    // Sort updated alpha/beta to det info.
+    for (const size_t key_id : updated_key_ids) {
+      if (sort_by_det_id) {
+        Util::sort_by_first<size_t, size_t>(
+            key_id_to_det_ids[key_id], key_id_to_partner_ids[key_id]);
+      } else {
+        Util::sort_by_first<size_t, size_t>(
+            key_id_to_partner_ids[key_id], key_id_to_det_ids[key_id]);
+      }
     }
   }
 }
 
 template <class S>
-void Hamiltonian<S>::update_abm1(const S& system) {
-  std::unordered_set<size_t> updated_alphas;
-  std::unordered_set<size_t> updated_betas;
+void Hamiltonian<S>::mark_updated_ab(
+    const S& system, std::vector<char>& alpha_updated, std::vector<char>& beta_updated) const {
+  alpha_updated.assign(alpha_to_id.size(), 0);
+  beta_updated.assign(beta_to_id.size(), 0);
+#pragma omp parallel for
   for (size_t i = n_dets_prev; i < n_dets; i++) {
     const auto& det = system.dets[i];
+    const size_t alpha_id = *alpha_to_id.find(det.up);
+#pragma omp atomic write
+    alpha_updated[alpha_id] = 1;
+    if (time_sym) {
+      const size_t beta_id = *alpha_to_id.find(det.dn);
+#pragma omp atomic write
+      alpha_updated[beta_id] = 1;
+    } else {
+      const size_t beta_id = *beta_to_id.find(det.dn);
+#pragma omp atomic write
+      beta_updated[beta_id] = 1;
+    }
+  }
+}
 
-    // Update alpha m1.
-    const auto& alpha = det.up;
-    const size_t alpha_id = alpha_to_id[alpha];
-    if (updated_alphas.count(alpha_id) == 0) {
-      const auto& up_elecs = det.up.get_occupied_orbs();
-      HalfDet alpha_m1 = det.up;
-      for (unsigned j = 0; j < n_up; j++) {
-        alpha_m1.unset(up_elecs[j]);
-        abm1_to_ab_ids[alpha_m1].first.push_back(alpha_id);
-        alpha_m1.set(up_elecs[j]);
+template <class S>
+void Hamiltonian<S>::update_abm1(const S& system) {
+  abm1_to_ab_ids.resize(Parallel::get_n_threads());
+
+  std::vector<char> alpha_updated;
+  std::vector<char> beta_updated;
+  mark_updated_ab(system, alpha_updated, beta_updated);
+  std::vector<size_t> updated_alphas;
+  std::vector<size_t> updated_betas;
+  for (size_t alpha_id = 0; alpha_id < alpha_updated.size(); alpha_id++) {
+    if (alpha_updated[alpha_id]) updated_alphas.push_back(alpha_id);
+  }
+  for (size_t beta_id = 0; beta_id < beta_updated.size(); beta_id++) {
+    if (beta_updated[beta_id]) updated_betas.push_back(beta_id);
+  }
+
+  // In time_sym mode, the betas are among the alphas and n_up == n_dn.
+  add_abm1(updated_alphas, unique_alphas, n_up, false);
+  if (!time_sym) add_abm1(updated_betas, unique_betas, n_dn, true);
+}
+
+template <class S>
+void Hamiltonian<S>::add_abm1(
+    const std::vector<size_t>& ids,
+    const std::vector<HalfDet>& unique_half_dets,
+    const unsigned n_elecs,
+    const bool is_beta) {
+  const size_t n_ids = ids.size();
+  const size_t n_shards = abm1_to_ab_ids.size();
+  const size_t n_max_threads = Parallel::get_n_threads();
+  // buckets[t][shard]: minus one half dets generated by thread t that belong to shard.
+  std::vector<std::vector<std::vector<std::pair<HalfDet, size_t>>>> buckets(
+      n_max_threads, std::vector<std::vector<std::pair<HalfDet, size_t>>>(n_shards));
+  const HalfDetHasher hasher;
+
+#pragma omp parallel
+  {
+    const size_t thread_id = omp_get_thread_num();
+    const size_t n_threads = omp_get_num_threads();
+    const size_t begin = n_ids * thread_id / n_threads;
+    const size_t end = n_ids * (thread_id + 1) / n_threads;
+    for (size_t k = begin; k < end; k++) {
+      const size_t id = ids[k];
+      const auto& half_det = unique_half_dets[id];
+      const auto& elecs = half_det.get_occ_orbs();
+      HalfDet half_det_m1 = half_det;
+      for (unsigned j = 0; j < n_elecs; j++) {
+        half_det_m1.unset(elecs[j]);
+        buckets[thread_id][hasher(half_det_m1) % n_shards].push_back(
+            std::make_pair(half_det_m1, id));
+        half_det_m1.set(elecs[j]);
       }
-      updated_alphas.insert(alpha_id);
     }
 
-    // Update beta m1.
-    const auto& beta = det.dn;
-    if (time_sym) {
-      const size_t beta_id = alpha_to_id[beta];
-      if (updated_alphas.count(beta_id) == 0) {
-        const auto& dn_elecs = det.dn.get_occupied_orbs();
-        HalfDet beta_m1 = det.dn;
-        for (unsigned j = 0; j < n_dn; j++) {
-          beta_m1.unset(dn_elecs[j]);
-          abm1_to_ab_ids[beta_m1].first.push_back(beta_id);
-          beta_m1.set(dn_elecs[j]);
+#pragma omp barrier
+#pragma omp for schedule(dynamic, 1)
+    for (size_t shard = 0; shard < n_shards; shard++) {
+      auto& shard_map = abm1_to_ab_ids[shard];
+      for (size_t t = 0; t < n_threads; t++) {
+        for (const auto& item : buckets[t][shard]) {
+          auto& ab_ids = shard_map[item.first];
+          (is_beta ? ab_ids.second : ab_ids.first).push_back(item.second);
         }
-        updated_alphas.insert(beta_id);
-      }
-    } else {
-      const size_t beta_id = beta_to_id[beta];
-      if (updated_betas.count(beta_id) == 0) {
-        const auto& dn_elecs = det.dn.get_occupied_orbs();
-        HalfDet beta_m1 = det.dn;
-        for (unsigned j = 0; j < n_dn; j++) {
-          beta_m1.unset(dn_elecs[j]);
-          abm1_to_ab_ids[beta_m1].second.push_back(beta_id);
-          beta_m1.set(dn_elecs[j]);
-        }
-        updated_betas.insert(beta_id);
+        Util::free(buckets[t][shard]);
       }
     }
   }
 }
 
+template <class S>
+const typename Hamiltonian<S>::AbIds* Hamiltonian<S>::find_abm1(const HalfDet& abm1) const {
+  return abm1_to_ab_ids[HalfDetHasher()(abm1) % abm1_to_ab_ids.size()].find(abm1);
+}
+
 template <class S>
 void Hamiltonian<S>::update_absingles(const S& system) {
   std::unordered_set<size_t> updated_alphas;
@@ -324,11 +620,12 @@ void Hamiltonian<S>::update_absingles(const S& system) {
   for (size_t alpha_id = 0; alpha_id < n_unique_alphas; alpha_id++) {
     const auto& alpha = unique_alphas[alpha_id];
     HalfDet alpha_m1 = alpha;
-    const auto& up_elecs = alpha.get_occupied_orbs();
+    const auto& up_elecs = alpha.get_occ_orbs();
     for (unsigned j = 0; j < n_up; j++) {
       alpha_m1.unset(up_elecs[j]);
-      if (abm1_to_ab_ids.count(alpha_m1) == 1) {
-        for (const size_t alpha_single : abm1_to_ab_ids[alpha_m1].first) {
+      const AbIds* ab_ids = find_abm1(alpha_m1);
+      if (ab_ids) {
+        for (const size_t alpha_single : ab_ids->first) {
           if (alpha_single == alpha_id) continue;
           if (alpha_id > alpha_single && updated_alphas.count(alpha_id) &&
               updated_alphas.count(alpha_single)) {
@@ -350,11 +647,12 @@ void Hamiltonian<S>::update_absingles(const S& system) {
   for (size_t beta_id = 0; beta_id < n_unique_betas; beta_id++) {
     const auto& beta = unique_betas[beta_id];
     HalfDet beta_m1 = beta;
-    const auto& dn_elecs = beta.get_occupied_orbs();
+    const auto& dn_elecs = beta.get_occ_orbs();
     for (unsigned j = 0; j < n_dn; j++) {
       beta_m1.unset(dn_elecs[j]);
-      if (abm1_to_ab_ids.count(beta_m1) == 1) {
-        for (const size_t beta_single : abm1_to_ab_ids[beta_m1].second) {
+      const AbIds* ab_ids = find_abm1(beta_m1);
+      if (ab_ids) {
+        for (const size_t beta_single : ab_ids->second) {
           if (beta_single == beta_id) continue;
           if (beta_id > beta_single && updated_betas.count(beta_id) &&
               updated_betas.count(beta_single)) {
@@ -374,6 +672,141 @@ void Hamiltonian<S>::update_absingles(const S& system) {
 
   for (auto& lock : locks) omp_destroy_lock(&lock);
 
+  sort_absingles();
+}
+
+template <class S>
+void Hamiltonian<S>::update_absingles_sorted(const S& system) {
+  std::vector<char> alpha_updated;
+  std::vector<char> beta_updated;
+  mark_updated_ab(system, alpha_updated, beta_updated);
+  alpha_id_to_single_ids.resize(alpha_to_id.size());
+  beta_id_to_single_ids.resize(beta_to_id.size());
+
+  std::vector<omp_lock_t> locks(std::max(alpha_to_id.size(), beta_to_id.size()));
+  for (auto& lock : locks) omp_init_lock(&lock);
+  // In time_sym mode, the betas are among the alphas.
+  add_absingles_sorted(unique_alphas, alpha_updated, n_up, alpha_id_to_single_ids, locks);
+  if (!time_sym) {
+    add_absingles_sorted(unique_betas, beta_updated, n_dn, beta_id_to_single_ids, locks);
+  }
+  for (auto& lock : locks) omp_destroy_lock(&lock);
+
+  sort_absingles();
+}
+
+template <class S>
+void Hamiltonian<S>::add_absingles_sorted(
+    const std::vector<HalfDet>& unique_half_dets,
+    const std::vector<char>& updated,
+    const unsigned n_elecs,
+    std::vector<std::vector<size_t>>& id_to_single_ids,
+    std::vector<omp_lock_t>& locks) {
+  const size_t n_ids = unique_half_dets.size();
+  const size_t n_max_threads = Parallel::get_n_threads();
+  // Bucketed by rehashed hash value so that each bucket can be sorted on its own, with
+  // offsets[shard * n_max_threads + t] the start of the entries of thread t in the shard.
+  const size_t n_shards = n_max_threads * 16;
+  std::vector<size_t> offsets(n_shards * n_max_threads + 1, 0);
+  std::vector<Abm1Entry> entries;
+  const HalfDetHasher hasher;
+
+#pragma omp parallel
+  {
+    const size_t thread_id = omp_get_thread_num();
+    const size_t n_threads = omp_get_num_threads();
+    const size_t begin = n_ids * thread_id / n_threads;
+    const size_t end = n_ids * (thread_id + 1) / n_threads;
+    std::vector<size_t> cursors(n_shards, 0);
+    for (size_t id = begin; id < end; id++) {
+      HalfDet half_det_m1 = unique_half_dets[id];
+      const auto& elecs = unique_half_dets[id].get_occ_orbs();
+      for (unsigned j = 0; j < n_elecs; j++) {
+        half_det_m1.unset(elecs[j]);
+        cursors[Util::rehash(hasher(half_det_m1)) % n_shards]++;
+        half_det_m1.set(elecs[j]);
+      }
+    }
+    for (size_t shard = 0; shard < n_shards; shard++) {
+      offsets[shard * n_max_threads + thread_id + 1] = cursors[shard];
+    }
+
+#pragma omp barrier
+#pragma omp single
+    {
+      for (size_t i = 1; i < offsets.size(); i++) offsets[i] += offsets[i - 1];
+      entries.resize(offsets.back());
+    }
+
+    for (size_t shard = 0; shard < n_shards; shard++) {
+      cursors[shard] = offsets[shard * n_max_threads + thread_id];
+    }
+    for (size_t id = begin; id < end; id++) {
+      HalfDet half_det_m1 = unique_half_dets[id];
+      const auto& elecs = unique_half_dets[id].get_occ_orbs();
+      for (unsigned j = 0; j < n_elecs; j++) {
+        half_det_m1.unset(elecs[j]);
+        const size_t hash = hasher(half_det_m1);
+        Abm1Entry& entry = entries[cursors[Util::rehash(hash) % n_shards]++];
+        entry.hash = hash;
+        entry.id = id;
+        entry.orb = elecs[j];
+        entry.updated = updated[id];
+        half_det_m1.set(elecs[j]);
+      }
+    }
+
+#pragma omp barrier
+    std::vector<HalfDet> run_m1s;
+#pragma omp for schedule(dynamic, 1)
+    for (size_t shard = 0; shard < n_shards; shard++) {
+      const auto& shard_begin = entries.begin() + offsets[shard * n_max_threads];
+      const auto& shard_end = entries.begin() + offsets[(shard + 1) * n_max_threads];
+      std::sort(shard_begin, shard_end, [](const Abm1Entry& a, const Abm1Entry& b) {
+        return a.hash < b.hash;
+      });
+
+      // Equal hash values of different minus one half dets are rare, so the half dets of a run
+      // are compared pairwise.
+      auto run_begin = shard_begin;
+      while (run_begin != shard_end) {
+        auto run_end = run_begin + 1;
+        bool has_updated = run_begin->updated;
+        while (run_end != shard_end && run_end->hash == run_begin->hash) {
+          has_updated |= run_end->updated;
+          run_end++;
+        }
+        if (has_updated && run_end - run_begin > 1) {
+          run_m1s.clear();
+          for (auto it = run_begin; it != run_end; it++) {
+            run_m1s.push_back(unique_half_dets[it->id]);
+            run_m1s.back().unset(it->orb);
+          }
+          for (auto it = run_begin; it != run_end; it++) {
+            for (auto it2 = it + 1; it2 != run_end; it2++) {
+              if (!it->updated && !it2->updated) continue;
+              if (it->id == it2->id) continue;
+              if (run_m1s[it - run_begin] != run_m1s[it2 - run_begin]) continue;
+              omp_set_lock(&locks[it->id]);
+              id_to_single_ids[it->id].push_back(it2->id);
+              omp_unset_lock(&locks[it->id]);
+              omp_set_lock(&locks[it2->id]);
+              id_to_single_ids[it2->id].push_back(it->id);
+              omp_unset_lock(&locks[it2->id]);
+            }
+          }
+        }
+        run_begin = run_end;
+      }
+    }
+  }
+}
+
+template <class S>
+void Hamiltonian<S>::sort_absingles() {
+  const size_t n_unique_alphas = alpha_id_to_single_ids.size();
+  const size_t n_unique_betas = beta_id_to_single_ids.size();
+
   // Sort updated alpha/beta singles and keep uniques.
   unsigned long long singles_cnt = 0;
 #pragma omp parallel for schedule(static, 1) reduction(+ : singles_cnt)
@@ -400,6 +833,9 @@ template <class S>
 void Hamiltonian<S>::update_matrix(const S& system) {
   matrix.set_dim(system.get_n_dets());
 
+  // In the direct mode, only the diagonal and optionally the same spin excitations are stored.
+  const bool store_same_spin = !direct || direct_cache_same_spin;
+  const bool store_mixed = !direct;
   fgpl::DistRange<size_t>(0, n_dets).for_each(
       [&](const size_t det_id) {
         const auto& det = system.dets[det_id];
@@ -410,173 +846,234 @@ void Hamiltonian<S>::update_matrix(const S& system) {
           matrix.append_elem(det_id, det_id, H);
         }
         const size_t start_id = is_new_det ? det_id + 1 : n_dets_prev;
+        const auto& append = [&](const size_t j, const double H) {
+          matrix.append_elem(det_id, j, H);
+        };
+        generate_row(system, det_id, start_id, store_same_spin, store_mixed, append);
+      },
+      Parallel::is_master());
+
+  matrix.pack();
+  const size_t n_elems = matrix.count_n_elems();
+  const size_t n_bytes = matrix.count_n_bytes();
+  const size_t n_bytes_on_disk = matrix.count_n_bytes_on_disk();
+  if (Parallel::is_master()) {
+    printf("Number of %s elems: %'zu\n", direct ? "stored" : "nonzero", n_elems);
+    printf("Sparse hamiltonian size: %.1fGB\n", n_bytes * 1.0e-9);
+    if (n_bytes_on_disk > 0) {
+      printf("Sparse hamiltonian size on disk: %.1fGB\n", n_bytes_on_disk * 1.0e-9);
+    }
+  }
+  Result::put("hamiltonian_bytes/memory", n_bytes);
+  Result::put("hamiltonian_bytes/disk", n_bytes_on_disk);
+  matrix.cache_diag();
+
+  if (direct) {
+    matrix.set_direct_mul(
+        [this, &system, store_same_spin](
+            const double* vec, const size_t n_vecs, std::vector<double>& res_local) {
+          mul_direct(system, !store_same_spin, vec, n_vecs, res_local);
+        });
+  }
+}
 
-        // Single or double alpha excitations.
-        const auto& beta = det.dn;
-        const size_t beta_id = time_sym ? alpha_to_id[beta] : beta_to_id[beta];
-        const auto& alpha_dets = beta_id_to_det_ids[beta_id];
-        for (auto it = alpha_dets.begin(); it != alpha_dets.end(); it++) {
-          const size_t alpha_det_id = *it;
-          if (alpha_det_id < start_id) continue;
-          const auto& connected_det = system.dets[alpha_det_id];
-          const double H = time_sym ? system.get_hamiltonian_elem_time_sym(det, connected_det, -1)
-                                    : system.get_hamiltonian_elem(det, connected_det, -1);
+template <class S>
+template <class Handler>
+void Hamiltonian<S>::generate_row(
+    const S& system,
+    const size_t det_id,
+    const size_t start_id,
+    const bool same_spin,
+    const bool mixed,
+    const Handler& handler) {
+  const auto& det = system.dets[det_id];
+  const auto& beta = det.dn;
+  const size_t beta_id = time_sym ? alpha_to_id[beta] : beta_to_id[beta];
+  const auto& alpha = det.up;
+  const size_t alpha_id = alpha_to_id[alpha];
+
+  if (same_spin) {
+    // Single or double alpha excitations.
+    const auto& alpha_dets = beta_id_to_det_ids[beta_id];
+    for (auto it = alpha_dets.begin(); it != alpha_dets.end(); it++) {
+      const size_t alpha_det_id = *it;
+      if (alpha_det_id < start_id) continue;
+      const auto& connected_det = system.dets[alpha_det_id];
+      const double H = time_sym ? system.get_hamiltonian_elem_time_sym(det, connected_det, -1)
+                                : system.get_hamiltonian_elem(det, connected_det, -1);
+      if (std::abs(H) < Util::EPS) continue;
+      handler(alpha_det_id, H);
+    }
+    if (time_sym && alpha_id_to_det_ids.size() > beta_id && det.up != det.dn) {
+      const auto& alpha_dets = alpha_id_to_det_ids[beta_id];
+      for (auto it = alpha_dets.begin(); it != alpha_dets.end(); it++) {
+        const size_t alpha_det_id = *it;
+        if (alpha_det_id < start_id) continue;
+        const auto& connected_det = system.dets[alpha_det_id];
+        if (connected_det.up == connected_det.dn) continue;
+        const double H = system.get_hamiltonian_elem_time_sym(det, connected_det, -1);
+        if (std::abs(H) < Util::EPS) continue;
+        handler(alpha_det_id, H);
+      }
+    }
+
+    // Single or double beta excitations.
+    const auto& beta_dets = alpha_id_to_det_ids[alpha_id];
+    for (auto it = beta_dets.begin(); it != beta_dets.end(); it++) {
+      const size_t beta_det_id = *it;
+      if (beta_det_id < start_id) continue;
+      const auto& connected_det = system.dets[beta_det_id];
+      const double H = time_sym ? system.get_hamiltonian_elem_time_sym(det, connected_det, -1)
+                                : system.get_hamiltonian_elem(det, connected_det, -1);
+      if (std::abs(H) < Util::EPS) continue;
+      handler(beta_det_id, H);
+    }
+    if (time_sym && beta_id_to_det_ids.size() > alpha_id && det.up != det.dn) {
+      const auto& beta_dets = beta_id_to_det_ids[alpha_id];
+      for (auto it = beta_dets.begin(); it != beta_dets.end(); it++) {
+        const size_t beta_det_id = *it;
+        if (beta_det_id < start_id) continue;
+        const auto& connected_det = system.dets[beta_det_id];
+        if (connected_det.up == connected_det.dn) continue;
+        const double H = system.get_hamiltonian_elem_time_sym(det, connected_det, -1);
+        if (std::abs(H) < Util::EPS) continue;
+        handler(beta_det_id, H);
+      }
+    }
+  }
+
+  // Mixed double excitation.
+  if (!mixed) return;
+  if (!system.has_double_excitation && !system.time_sym) return;
+  const auto& alpha_singles = alpha_id_to_single_ids[alpha_id];
+  const auto& beta_singles =
+      time_sym ? alpha_id_to_single_ids[beta_id] : beta_id_to_single_ids[beta_id];
+  // Positions of the related dets whose betas are beta singles, found a batch at a time.
+  const size_t N_RELATED_IDS = 64;
+  size_t related_ids[N_RELATED_IDS];
+  for (const auto alpha_single : alpha_singles) {
+    if (alpha_id_to_beta_ids.size() <= alpha_single) continue;
+    if (time_sym && alpha_single == beta_id) continue;
+    const auto& related_beta_ids = alpha_id_to_beta_ids[alpha_single];
+    const auto& related_det_ids = alpha_id_to_det_ids[alpha_single];
+    const size_t n_related_dets = related_beta_ids.size();
+    if (sort_by_det_id) {
+      const auto& start_ptr =
+          std::lower_bound(related_det_ids.begin(), related_det_ids.end(), start_id);
+      const size_t start_related_id = start_ptr - related_det_ids.begin();
+      for (size_t related_id = start_related_id; related_id < n_related_dets; related_id++) {
+        const size_t related_beta = related_beta_ids[related_id];
+        if (time_sym && related_beta == alpha_id) continue;
+        if (std::binary_search(beta_singles.begin(), beta_singles.end(), related_beta)) {
+          const size_t related_det_id = related_det_ids[related_id];
+          const auto& connected_det = system.dets[related_det_id];
+          const double H = time_sym
+                               ? system.get_hamiltonian_elem_time_sym(det, connected_det, 2)
+                               : system.get_hamiltonian_elem(det, connected_det, 2);
           if (std::abs(H) < Util::EPS) continue;
-          matrix.append_elem(det_id, alpha_det_id, H);
-        }
-        if (time_sym && alpha_id_to_det_ids.size() > beta_id && det.up != det.dn) {
-          const auto& alpha_dets = alpha_id_to_det_ids[beta_id];
-          for (auto it = alpha_dets.begin(); it != alpha_dets.end(); it++) {
-            const size_t alpha_det_id = *it;
-            if (alpha_det_id < start_id) continue;
-            const auto& connected_det = system.dets[alpha_det_id];
-            if (connected_det.up == connected_det.dn) continue;
-            const double H = system.get_hamiltonian_elem_time_sym(det, connected_det, -1);
-            if (std::abs(H) < Util::EPS) continue;
-            matrix.append_elem(det_id, alpha_det_id, H);
-          }
+          handler(related_det_id, H);
         }
-
-        // Single or double beta excitations.
-        const auto& alpha = det.up;
-        const size_t alpha_id = alpha_to_id[alpha];
-        const auto& beta_dets = alpha_id_to_det_ids[alpha_id];
-        for (auto it = beta_dets.begin(); it != beta_dets.end(); it++) {
-          const size_t beta_det_id = *it;
-          if (beta_det_id < start_id) continue;
-          const auto& connected_det = system.dets[beta_det_id];
-          const double H = time_sym ? system.get_hamiltonian_elem_time_sym(det, connected_det, -1)
-                                    : system.get_hamiltonian_elem(det, connected_det, -1);
+      }
+    } else {
+      SortedIntersection<size_t> intersection(
+          beta_singles.data(), beta_singles.size(), related_beta_ids.data(), n_related_dets);
+      size_t n_matches;
+      while ((n_matches = intersection.next(related_ids, N_RELATED_IDS)) > 0) {
+        for (size_t k = 0; k < n_matches; k++) {
+          const size_t related_id = related_ids[k];
+          if (time_sym && related_beta_ids[related_id] == alpha_id) continue;
+          const size_t related_det_id = related_det_ids[related_id];
+          if (related_det_id < start_id) continue;
+          const auto& connected_det = system.dets[related_det_id];
+          const double H = time_sym
+                               ? system.get_hamiltonian_elem_time_sym(det, connected_det, 2)
+                               : system.get_hamiltonian_elem(det, connected_det, 2);
           if (std::abs(H) < Util::EPS) continue;
-          matrix.append_elem(det_id, beta_det_id, H);
+          handler(related_det_id, H);
         }
-        if (time_sym && beta_id_to_det_ids.size() > alpha_id && det.up != det.dn) {
-          const auto& beta_dets = beta_id_to_det_ids[alpha_id];
-          for (auto it = beta_dets.begin(); it != beta_dets.end(); it++) {
-            const size_t beta_det_id = *it;
-            if (beta_det_id < start_id) continue;
-            const auto& connected_det = system.dets[beta_det_id];
-            if (connected_det.up == connected_det.dn) continue;
-            const double H = system.get_hamiltonian_elem_time_sym(det, connected_det, -1);
+      }
+    }  // sort by det
+  }
+  if (time_sym && det.up != det.dn) {
+    Det det_rev = det;
+    det_rev.reverse_spin();
+    for (const auto alpha_single : alpha_singles) {
+      if (alpha_single == beta_id) continue;
+      if (beta_id_to_alpha_ids.size() <= alpha_single) continue;
+      const auto& related_beta_ids = beta_id_to_alpha_ids[alpha_single];
+      const auto& related_det_ids = beta_id_to_det_ids[alpha_single];
+      const size_t n_related_dets = related_beta_ids.size();
+      if (sort_by_det_id) {
+        const auto& start_ptr =
+            std::lower_bound(related_det_ids.begin(), related_det_ids.end(), start_id);
+        const size_t start_related_id = start_ptr - related_det_ids.begin();
+        for (size_t related_id = start_related_id; related_id < n_related_dets;
+             related_id++) {
+          const size_t related_beta = related_beta_ids[related_id];
+          if (related_beta == alpha_id) continue;
+          const size_t related_det_id = related_det_ids[related_id];
+          const auto& connected_det = system.dets[related_det_id];
+          if (connected_det.up == connected_det.dn) continue;
+          if (connected_det.up.diff(det.up).n_diffs == 1 &&
+              connected_det.dn.diff(det.dn).n_diffs == 1) {
+            continue;
+          }
+          if (std::binary_search(beta_singles.begin(), beta_singles.end(), related_beta)) {
+            const double H = system.get_hamiltonian_elem_time_sym(det_rev, connected_det, 2);
             if (std::abs(H) < Util::EPS) continue;
-            matrix.append_elem(det_id, beta_det_id, H);
+            handler(related_det_id, H);
           }
         }
-
-        // Mixed double excitation.
-        if (!system.has_double_excitation && !system.time_sym) return;
-        const auto& alpha_singles = alpha_id_to_single_ids[alpha_id];
-        const auto& beta_singles =
-            time_sym ? alpha_id_to_single_ids[beta_id] : beta_id_to_single_ids[beta_id];
-        for (const auto alpha_single : alpha_singles) {
-          if (alpha_id_to_beta_ids.size() <= alpha_single) continue;
-          if (time_sym && alpha_single == beta_id) continue;
-          const auto& related_beta_ids = alpha_id_to_beta_ids[alpha_single];
-          const auto& related_det_ids = alpha_id_to_det_ids[alpha_single];
-          const size_t n_related_dets = related_beta_ids.size();
-          if (sort_by_det_id) {
-            const auto& start_ptr =
-                std::lower_bound(related_det_ids.begin(), related_det_ids.end(), start_id);
-            const size_t start_related_id = start_ptr - related_det_ids.begin();
-            for (size_t related_id = start_related_id; related_id < n_related_dets; related_id++) {
-              const size_t related_beta = related_beta_ids[related_id];
-              if (time_sym && related_beta == alpha_id) continue;
-              if (std::binary_search(beta_singles.begin(), beta_singles.end(), related_beta)) {
-                const size_t related_det_id = related_det_ids[related_id];
-                const auto& connected_det = system.dets[related_det_id];
-                const double H = time_sym
-                                     ? system.get_hamiltonian_elem_time_sym(det, connected_det, 2)
-                                     : system.get_hamiltonian_elem(det, connected_det, 2);
-                if (std::abs(H) < Util::EPS) continue;
-                matrix.append_elem(det_id, related_det_id, H);
-              }
-            }
-          } else {
-            size_t ptr = 0;
-            for (auto it = beta_singles.begin(); it != beta_singles.end(); it++) {
-              const size_t beta_single = *it;
-              if (time_sym && beta_single == alpha_id) continue;
-              while (ptr < n_related_dets && related_beta_ids[ptr] < beta_single) {
-                ptr++;
-              }
-              if (ptr == n_related_dets) break;
-              if (related_beta_ids[ptr] == beta_single) {
-                const size_t related_det_id = related_det_ids[ptr];
-                ptr++;
-                if (related_det_id < start_id) continue;
-                const auto& connected_det = system.dets[related_det_id];
-                const double H = time_sym
-                                     ? system.get_hamiltonian_elem_time_sym(det, connected_det, 2)
-                                     : system.get_hamiltonian_elem(det, connected_det, 2);
-                if (std::abs(H) < Util::EPS) continue;
-                matrix.append_elem(det_id, related_det_id, H);
-              }
+      } else {
+        SortedIntersection<size_t> intersection(
+            beta_singles.data(), beta_singles.size(), related_beta_ids.data(), n_related_dets);
+        size_t n_matches;
+        while ((n_matches = intersection.next(related_ids, N_RELATED_IDS)) > 0) {
+          for (size_t k = 0; k < n_matches; k++) {
+            const size_t related_id = related_ids[k];
+            if (related_beta_ids[related_id] == alpha_id) continue;
+            const size_t related_det_id = related_det_ids[related_id];
+            if (related_det_id < start_id) continue;
+            const auto& connected_det = system.dets[related_det_id];
+            if (connected_det.up == connected_det.dn) continue;
+            if (connected_det.up.diff(det.up).n_diffs == 1 &&
+                connected_det.dn.diff(det.dn).n_diffs == 1) {
+              continue;
             }
-          }  // sort by det
+            const double H = system.get_hamiltonian_elem_time_sym(det_rev, connected_det, 2);
+            if (std::abs(H) < Util::EPS) continue;
+            handler(related_det_id, H);
+          }
         }
-        if (time_sym && det.up != det.dn) {
-          Det det_rev = det;
-          det_rev.reverse_spin();
-          for (const auto alpha_single : alpha_singles) {
-            if (alpha_single == beta_id) continue;
-            if (beta_id_to_alpha_ids.size() <= alpha_single) continue;
-            const auto& related_beta_ids = beta_id_to_alpha_ids[alpha_single];
-            const auto& related_det_ids = beta_id_to_det_ids[alpha_single];
-            const size_t n_related_dets = related_beta_ids.size();
-            if (sort_by_det_id) {
-              const auto& start_ptr =
-                  std::lower_bound(related_det_ids.begin(), related_det_ids.end(), start_id);
-              const size_t start_related_id = start_ptr - related_det_ids.begin();
-              for (size_t related_id = start_related_id; related_id < n_related_dets;
-                   related_id++) {
-                const size_t related_beta = related_beta_ids[related_id];
-                if (related_beta == alpha_id) continue;
-                const size_t related_det_id = related_det_ids[related_id];
-                const auto& connected_det = system.dets[related_det_id];
-                if (connected_det.up == connected_det.dn) continue;
-                if (connected_det.up.diff(det.up).n_diffs == 1 &&
-                    connected_det.dn.diff(det.dn).n_diffs == 1) {
-                  continue;
-                }
-                if (std::binary_search(beta_singles.begin(), beta_singles.end(), related_beta)) {
-                  const double H = system.get_hamiltonian_elem_time_sym(det_rev, connected_det, 2);
-                  if (std::abs(H) < Util::EPS) continue;
-                  matrix.append_elem(det_id, related_det_id, H);
-                }
-              }
-            } else {
-              size_t ptr = 0;
-              for (auto it = beta_singles.begin(); it != beta_singles.end(); it++) {
-                const size_t beta_single = *it;
-                if (beta_single == alpha_id) continue;
-                while (ptr < n_related_dets && related_beta_ids[ptr] < beta_single) {
-                  ptr++;
-                }
-                if (ptr == n_related_dets) break;
-                if (related_beta_ids[ptr] == beta_single) {
-                  const size_t related_det_id = related_det_ids[ptr];
-                  ptr++;
-                  if (related_det_id < start_id) continue;
-                  const auto& connected_det = system.dets[related_det_id];
-                  if (connected_det.up == connected_det.dn) continue;
-                  if (connected_det.up.diff(det.up).n_diffs == 1 &&
-                      connected_det.dn.diff(det.dn).n_diffs == 1) {
-                    continue;
-                  }
-                  const double H = system.get_hamiltonian_elem_time_sym(det_rev, connected_det, 2);
-                  if (std::abs(H) < Util::EPS) continue;
-                  matrix.append_elem(det_id, related_det_id, H);
-                }
-              }
-            }  // sort by det
-          }  // alpha single
-        }  // time sym
-      },
-      Parallel::is_master());
+      }  // sort by det
+    }  // alpha single
+  }  // time sym
+}
 
-  const size_t n_elems = matrix.count_n_elems();
-  if (Parallel::is_master()) {
-    printf("Number of nonzero elems: %'zu\n", n_elems);
-  }
-  matrix.cache_diag();
+template <class S>
+void Hamiltonian<S>::mul_direct(
+    const S& system,
+    const bool same_spin,
+    const double* vec,
+    const size_t n_vecs,
+    std::vector<double>& res_local) {
+  fgpl::DistRange<size_t>(0, n_dets).for_each([&](const size_t det_id) {
+    const double* vec_i = vec + det_id * n_vecs;
+    std::vector<double> diff_i(n_vecs, 0.0);
+    generate_row(system, det_id, det_id + 1, same_spin, true, [&](const size_t j, const double H) {
+      const double* vec_j = vec + j * n_vecs;
+      double* res_j = res_local.data() + j * n_vecs;
+      for (size_t s = 0; s < n_vecs; s++) {
+        diff_i[s] += H * vec_j[s];
+        const double diff_j = H * vec_i[s];
+#pragma omp atomic
+        res_j[s] += diff_j;
+      }
+    });
+    double* res_i = res_local.data() + det_id * n_vecs;
+    for (size_t s = 0; s < n_vecs; s++) {
+#pragma omp atomic
+      res_i[s] += diff_i[s];
+    }
+  });
 }
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <hps/src/hps.h>
+#include <omp.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../det/det.h"
+#include "../parallel.h"
+#include "../util.h"
+
+// Contributions H_ai * c_i of the PT dets of each batch of this proc with the var dets i they
+// come from, buffered per thread and appended in blocks to one file per batch. The files are
+// removed when destroyed.
+class HcBatchFiles {
+ public:
+  HcBatchFiles(const std::string& dir, const size_t n_batches);
+
+  HcBatchFiles(const HcBatchFiles&) = delete;
+
+  HcBatchFiles& operator=(const HcBatchFiles&) = delete;
+
+  ~HcBatchFiles();
+
+  // Thread safe.
+  void append(const size_t batch_id, const Det& det, const double hc, const size_t parent);
+
+  // Write out what is still buffered, call outside of parallel regions.
+  void flush();
+
+  // Call handler(dets, hcs, parents) for each block of the batch, in the order they were written.
+  template <class Handler>
+  void for_each_block(const size_t batch_id, const Handler& handler) const;
+
+  size_t get_n_bytes_written() const { return n_bytes_written; }
+
+ private:
+  // Entries per block, small enough for n_threads * n_batches buffers to stay in memory.
+  static constexpr size_t BLOCK_SIZE = 1 << 10;
+
+  struct Buffer {
+    std::vector<Det> dets;
+
+    std::vector<double> hcs;
+
+    std::vector<size_t> parents;
+  };
+
+  std::vector<std::string> filenames;
+
+  // Indexed by thread id * n_batches + batch id.
+  std::vector<Buffer> buffers;
+
+  std::vector<omp_lock_t> locks;
+
+  size_t n_bytes_written = 0;
+
+  void write_block(const size_t batch_id, Buffer& buffer);
+};
+
+inline HcBatchFiles::HcBatchFiles(const std::string& dir, const size_t n_batches) {
+  filenames.resize(n_batches);
+  for (size_t batch_id = 0; batch_id < n_batches; batch_id++) {
+    filenames[batch_id] = Util::str_printf(
+        "%s/dtm_batch_%d_%zu.dat", dir.c_str(), Parallel::get_proc_id(), batch_id);
+    std::ofstream file(filenames[batch_id], std::ofstream::binary | std::ofstream::trunc);
+    if (!file) throw std::runtime_error("cannot create " + filenames[batch_id]);
+  }
+  buffers.resize(Parallel::get_n_threads() * n_batches);
+  locks.resize(n_batches);
+  for (auto& lock : locks) omp_init_lock(&lock);
+}
+
+inline HcBatchFiles::~HcBatchFiles() {
+  for (auto& lock : locks) omp_destroy_lock(&lock);
+  for (const auto& filename : filenames) unlink(filename.c_str());
+}
+
+inline void HcBatchFiles::append(
+    const size_t batch_id, const Det& det, const double hc, const size_t parent) {
+  const size_t n_batches = filenames.size();
+  auto& buffer = buffers[omp_get_thread_num() * n_batches + batch_id];
+  buffer.dets.push_back(det);
+  buffer.hcs.push_back(hc);
+  buffer.parents.push_back(parent);
+  if (buffer.dets.size() >= BLOCK_SIZE) write_block(batch_id, buffer);
+}
+
+inline void HcBatchFiles::flush() {
+  const size_t n_batches = filenames.size();
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t i = 0; i < buffers.size(); i++) {
+    if (!buffers[i].dets.empty()) write_block(i % n_batches, buffers[i]);
+  }
+}
+
+inline void HcBatchFiles::write_block(const size_t batch_id, Buffer& buffer) {
+  const std::string& serialized_dets = hps::to_string(buffer.dets);
+  const std::string& serialized_hcs = hps::to_string(buffer.hcs);
+  const std::string& serialized_parents = hps::to_string(buffer.parents);
+  const size_t n_bytes[3] = {
+      serialized_dets.size(), serialized_hcs.size(), serialized_parents.size()};
+  omp_set_lock(&locks[batch_id]);
+  std::ofstream file(filenames[batch_id], std::ofstream::binary | std::ofstream::app);
+  file.write(reinterpret_cast<const char*>(n_bytes), sizeof(n_bytes));
+  file.write(serialized_dets.data(), n_bytes[0]);
+  file.write(serialized_hcs.data(), n_bytes[1]);
+  file.write(serialized_parents.data(), n_bytes[2]);
+  const bool failed = !file;
+#pragma omp atomic
+  n_bytes_written += sizeof(n_bytes) + n_bytes[0] + n_bytes[1] + n_bytes[2];
+  omp_unset_lock(&locks[batch_id]);
+  if (failed) throw std::runtime_error("cannot write " + filenames[batch_id]);
+  buffer.dets.clear();
+  buffer.hcs.clear();
+  buffer.parents.clear();
+}
+
+template <class Handler>
+void HcBatchFiles::for_each_block(const size_t batch_id, const Handler& handler) const {
+  std::ifstream file(filenames[batch_id], std::ifstream::binary);
+  size_t n_bytes[3];
+  std::string serialized;
+  while (file.read(reinterpret_cast<char*>(n_bytes), sizeof(n_bytes))) {
+    serialized.resize(n_bytes[0]);
+    file.read(&serialized[0], n_bytes[0]);
+    const auto& dets = hps::from_string<std::vector<Det>>(serialized);
+    serialized.resize(n_bytes[1]);
+    file.read(&serialized[0], n_bytes[1]);
+    const auto& hcs = hps::from_string<std::vector<double>>(serialized);
+    serialized.resize(n_bytes[2]);
+    file.read(&serialized[0], n_bytes[2]);
+    const auto& parents = hps::from_string<std::vector<size_t>>(serialized);
+    if (!file) throw std::runtime_error("truncated " + filenames[batch_id]);
+    handler(dets, hcs, parents);
+  }
+}
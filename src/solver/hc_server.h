@@ -4,11 +4,17 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "../config.h"
 #include "../parallel.h"
 #include "hamiltonian.h"
+#include "segment_file.h"
 
 template <class S>
 class HcServer {
@@ -26,24 +32,53 @@ class HcServer {
 
   Hamiltonian<S>& hamiltonian;
 
-  constexpr static int PORT = 2018;
+  unsigned port;
+
+  // Vectors pass through this file instead of the socket when it is set: the client writes c in
+  // place, the server replaces it with Hc and acknowledges over the socket. Only on the master.
+  std::string shm_path;
+
+  // Number of vectors the file holds, the largest block it can serve.
+  size_t shm_n_vecs;
+
+  SegmentFile shm;
+
+  // Commands are NUL padded to this many bytes, so that the requests can be pipelined.
+  constexpr static size_t CMD_SIZE = 32;
 
   void start_server();
 
-  std::vector<double> read_double_array(std::ofstream&) const;
+  // Multiply n_vecs vectors, given back to back, and return the results the same way. The
+  // legacy Hc command acks before the client sends the vector.
+  void serve_block(const size_t n_vecs, const bool ack_first, std::ofstream& log_file);
+
+  void read_bytes(char* data, const size_t n_bytes) const;
+
+  void send_bytes(const char* data, const size_t n_bytes) const;
+
+  static void broadcast(double* data, const size_t n_elems);
 };
 
 template <class S>
 void HcServer<S>::run() {
-  n = system.coefs.size();
+  n = system.coefs[0].size();
+  port = Config::get<unsigned>("hc_server_port", 2018);
+  shm_path = Config::get<std::string>("hc_server_shm", "");
+  shm_n_vecs = Config::get<size_t>("hc_server_shm_vectors", 1);
   if (Parallel::is_master()) {
+    if (!shm_path.empty()) {
+      std::vector<double> init(n * shm_n_vecs, 0.0);
+      std::copy(system.coefs[0].begin(), system.coefs[0].end(), init.begin());
+      const void* parts[] = {init.data()};
+      const size_t part_bytes[] = {sizeof(double) * init.size()};
+      size_t part_offsets[1];
+      shm = SegmentFile(shm_path, 1, parts, part_bytes, part_offsets);
+    }
     start_server();
   }
   Parallel::barrier();
 
-  char cmd_buffer[32];
-  memset(cmd_buffer, 0, sizeof(cmd_buffer));
-  std::vector<double> output(n);
+  char cmd_buffer[CMD_SIZE];
   std::string cmd;
 
   std::ofstream log_file;
@@ -54,42 +89,84 @@ void HcServer<S>::run() {
   while (true) {
     // Get command.
     if (Parallel::is_master()) {
-      read(new_socket, cmd_buffer, 32);
-      cmd = std::string(cmd_buffer);
-      memset(cmd_buffer, 0, sizeof(cmd_buffer));
+      read_bytes(cmd_buffer, CMD_SIZE);
+      cmd = std::string(cmd_buffer, strnlen(cmd_buffer, CMD_SIZE));
     }
     Parallel::barrier();
     fgpl::broadcast(cmd);
     log_file << cmd << std::endl;
     log_file.flush();
 
-    if (cmd == "getCoefs") {
+    double* shared = reinterpret_cast<double*>(shm.get_data());
+    if (cmd == "getCoefs" || cmd == "getDiag") {
       if (Parallel::is_master()) {
-        send(new_socket, system.coefs.data(), sizeof(double) * n, 0);
+        const auto& vec = cmd == "getCoefs" ? system.coefs[0] : hamiltonian.matrix.get_diag();
+        if (shared) {
+          std::copy(vec.begin(), vec.end(), shared);
+          send_bytes(ack, strlen(ack));
+        } else {
+          send_bytes(reinterpret_cast<const char*>(vec.data()), sizeof(double) * n);
+        }
       }
     } else if (cmd == "Hc") {
-      if (Parallel::is_master()) {
-        send(new_socket, ack, strlen(ack), 0);
-        output = read_double_array(log_file);
-      }
-      Parallel::barrier();
-      size_t n_cast = 0;
-      const size_t TRUNK_SIZE = 1 << 20;
-      while (n - n_cast > TRUNK_SIZE) {
-        MPI_Bcast(output.data() + n_cast, TRUNK_SIZE, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-        n_cast += TRUNK_SIZE;
-      }
-      MPI_Bcast(output.data() + n_cast, n - n_cast, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-      output = hamiltonian.matrix.mul(output);
-      if (Parallel::is_master()) {
-        send(new_socket, output.data(), sizeof(double) * n, 0);
-      }
+      serve_block(1, !shared, log_file);
+    } else if (cmd.compare(0, 8, "HcBlock ") == 0) {
+      serve_block(std::stoul(cmd.substr(8)), false, log_file);
     } else if (cmd == "exit") {
       return;
     }
   }
 }
 
+template <class S>
+void HcServer<S>::serve_block(
+    const size_t n_vecs, const bool ack_first, std::ofstream& log_file) {
+  if (!shm_path.empty() && n_vecs > shm_n_vecs) {
+    throw std::invalid_argument("block larger than hc_server_shm_vectors");
+  }
+  const auto& begin = std::chrono::high_resolution_clock::now();
+  const char* ack = "ACK";
+  double* shared = reinterpret_cast<double*>(shm.get_data());
+  std::vector<double> block(n * n_vecs);
+  if (Parallel::is_master()) {
+    if (shared) {
+      std::copy(shared, shared + block.size(), block.begin());
+    } else {
+      if (ack_first) send_bytes(ack, strlen(ack));
+      read_bytes(reinterpret_cast<char*>(block.data()), sizeof(double) * block.size());
+    }
+  }
+  broadcast(block.data(), block.size());
+  const auto& received = std::chrono::high_resolution_clock::now();
+
+  std::vector<std::vector<double>> vecs(n_vecs);
+  for (size_t k = 0; k < n_vecs; k++) {
+    vecs[k].assign(block.begin() + k * n, block.begin() + (k + 1) * n);
+  }
+  vecs = hamiltonian.matrix.mul(vecs);
+  const auto& multiplied = std::chrono::high_resolution_clock::now();
+
+  if (Parallel::is_master()) {
+    for (size_t k = 0; k < n_vecs; k++) {
+      std::copy(vecs[k].begin(), vecs[k].end(), block.begin() + k * n);
+    }
+    if (shared) {
+      std::copy(block.begin(), block.end(), shared);
+      send_bytes(ack, strlen(ack));
+    } else {
+      send_bytes(reinterpret_cast<const char*>(block.data()), sizeof(double) * block.size());
+    }
+  }
+  const auto& end = std::chrono::high_resolution_clock::now();
+  log_file << Util::str_printf(
+                  "%zu vectors: receive %.6fs, multiply %.6fs, send %.6fs",
+                  n_vecs,
+                  std::chrono::duration<double>(received - begin).count(),
+                  std::chrono::duration<double>(multiplied - received).count(),
+                  std::chrono::duration<double>(end - multiplied).count())
+           << std::endl;
+}
+
 template <class S>
 void HcServer<S>::start_server() {
   int server_fd;
@@ -103,16 +180,16 @@ void HcServer<S>::start_server() {
     exit(EXIT_FAILURE);
   }
 
-  // Forcefully attaching socket to the port 8080
+  // Forcefully attaching socket to the port
   if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
     perror("setsockopt");
     exit(EXIT_FAILURE);
   }
   address.sin_family = AF_INET;
   address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(PORT);
+  address.sin_port = htons(port);
 
-  // Forcefully attaching socket to the port 8080
+  // Forcefully attaching socket to the port
   if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
     perror("bind failed");
     exit(EXIT_FAILURE);
@@ -125,6 +202,7 @@ void HcServer<S>::start_server() {
 
   printf("Hc server ready\n");
   printf("%zu\n", n);
+  fflush(stdout);  // The client waits for these lines before connecting.
 
   if ((new_socket = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen)) < 0) {
     perror("accept");
@@ -133,14 +211,32 @@ void HcServer<S>::start_server() {
 }
 
 template <class S>
-std::vector<double> HcServer<S>::read_double_array(std::ofstream&) const {
-  long long total = sizeof(double) * n;
-  std::vector<double> result(n);
+void HcServer<S>::read_bytes(char* data, const size_t n_bytes) const {
+  size_t n_read = 0;
+  while (n_read < n_bytes) {
+    const ssize_t n_new = read(new_socket, data + n_read, n_bytes - n_read);
+    if (n_new <= 0) throw std::runtime_error("hc client disconnected");
+    n_read += n_new;
+  }
+}
 
-  long long n_read = read(new_socket, reinterpret_cast<char*>(result.data()), total);
-  while (n_read < total) {
-    n_read += read(new_socket, reinterpret_cast<char*>(result.data()) + n_read, total - n_read);
+template <class S>
+void HcServer<S>::send_bytes(const char* data, const size_t n_bytes) const {
+  size_t n_sent = 0;
+  while (n_sent < n_bytes) {
+    const ssize_t n_new = send(new_socket, data + n_sent, n_bytes - n_sent, 0);
+    if (n_new <= 0) throw std::runtime_error("hc client disconnected");
+    n_sent += n_new;
   }
+}
 
-  return result;
+template <class S>
+void HcServer<S>::broadcast(double* data, const size_t n_elems) {
+  size_t n_cast = 0;
+  const size_t TRUNK_SIZE = 1 << 20;
+  while (n_elems - n_cast > TRUNK_SIZE) {
+    MPI_Bcast(data + n_cast, TRUNK_SIZE, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    n_cast += TRUNK_SIZE;
+  }
+  MPI_Bcast(data + n_cast, n_elems - n_cast, MPI_DOUBLE, 0, MPI_COMM_WORLD);
 }
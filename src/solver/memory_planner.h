@@ -0,0 +1,132 @@
+#pragma once
+
+#include <mpi.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+#include "../config.h"
+#include "../parallel.h"
+#include "../util.h"
+
+// Bytes of the major structures of each proc, from which the memory left for the structures
+// still to be built on the fullest proc is planned. mem_total is that of the node, shared by its
+// procs.
+class MemoryPlanner {
+ public:
+  MemoryPlanner() {
+    mem_total = Config::get<double>("mem_total", Util::get_mem_total());
+    mem_total /= Parallel::get_n_node_procs();
+  }
+
+  // Memory of one proc.
+  size_t get_mem_total() const { return mem_total; }
+
+  // Bytes of a hash table per byte of its entries.
+  double get_hash_overhead() const { return hash_overhead; }
+
+  // Bytes per entry of an fgpl hash table of entries of entry_bytes each.
+  double get_hash_entry_bytes(const double entry_bytes) const {
+    return hash_overhead * entry_bytes;
+  }
+
+  // Local bytes of the structure, replacing the previous ones.
+  void set(const std::string& structure, const size_t n_bytes) {
+    for (auto& item : structures) {
+      if (item.first == structure) {
+        item.second = n_bytes;
+        return;
+      }
+    }
+    structures.push_back(std::make_pair(structure, n_bytes));
+  }
+
+  void unset(const std::string& structure) {
+    structures.erase(
+        std::remove_if(
+            structures.begin(),
+            structures.end(),
+            [&](const std::pair<std::string, size_t>& item) { return item.first == structure; }),
+        structures.end());
+  }
+
+  // Collective. Max over the procs of the local bytes of all the structures.
+  size_t get_n_bytes_used() const {
+    unsigned long long n_bytes = 0;
+    for (const auto& item : structures) n_bytes += item.second;
+    MPI_Allreduce(MPI_IN_PLACE, &n_bytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+    return n_bytes;
+  }
+
+  // Collective. Bytes left on the fullest proc below the usage fraction of its memory.
+  size_t get_n_bytes_left(const double usage) const {
+    const double n_bytes_left = mem_total * usage - get_n_bytes_used();
+    return n_bytes_left > 0.0 ? n_bytes_left : 0;
+  }
+
+  // Collective. Raise the overhead of the hash tables to the one measured for n_entries of
+  // entry_bytes each that took n_bytes on this proc. Only large tables are measured precisely
+  // enough, and memory the allocator reuses makes a table look smaller, never larger.
+  void measure_hash_overhead(
+      const size_t n_bytes, const size_t n_entries, const double entry_bytes) {
+    double overhead = 0.0;
+    if (n_entries >= MIN_MEASURED_ENTRIES) overhead = n_bytes / (n_entries * entry_bytes);
+    MPI_Allreduce(MPI_IN_PLACE, &overhead, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    if (overhead > MAX_HASH_OVERHEAD) overhead = MAX_HASH_OVERHEAD;
+    if (overhead > hash_overhead) hash_overhead = overhead;
+  }
+
+  // Collective. Warns if the structures with the predicted bytes of the structure on the fullest
+  // proc exceed its memory.
+  void check(const std::string& stage, const std::string& structure, const size_t n_bytes_next)
+      const {
+    size_t n_bytes_prev = 0;
+    for (const auto& item : structures) {
+      if (item.first == structure) n_bytes_prev = item.second;
+    }
+    unsigned long long n_bytes = 0;
+    for (const auto& item : structures) n_bytes += item.second;
+    n_bytes += n_bytes_next - n_bytes_prev;
+    MPI_Allreduce(MPI_IN_PLACE, &n_bytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+    if (n_bytes > mem_total && Parallel::is_master()) {
+      printf(
+          "Warning: %s may exceed mem_total: %.1fGB predicted of %.1fGB per proc.\n",
+          stage.c_str(),
+          n_bytes * 1.0e-9,
+          mem_total * 1.0e-9);
+    }
+  }
+
+  // Collective. Max over the procs of each structure.
+  void print() const {
+    std::vector<unsigned long long> n_bytes(structures.size());
+    for (size_t i = 0; i < structures.size(); i++) n_bytes[i] = structures[i].second;
+    MPI_Allreduce(
+        MPI_IN_PLACE,
+        n_bytes.data(),
+        n_bytes.size(),
+        MPI_UNSIGNED_LONG_LONG,
+        MPI_MAX,
+        MPI_COMM_WORLD);
+    if (!Parallel::is_master()) return;
+    printf("Memory per proc: %.1fGB\n", mem_total * 1.0e-9);
+    for (size_t i = 0; i < structures.size(); i++) {
+      printf("Memory %s: %.3fGB\n", structures[i].first.c_str(), n_bytes[i] * 1.0e-9);
+    }
+    printf("Hash table overhead: %.2f\n", hash_overhead);
+  }
+
+ private:
+  static constexpr size_t MIN_MEASURED_ENTRIES = 1 << 20;
+
+  static constexpr double MAX_HASH_OVERHEAD = 8.0;
+
+  size_t mem_total;
+
+  // Load factors stay below 1 / 2.5 unless measured otherwise.
+  double hash_overhead = 2.5;
+
+  std::vector<std::pair<std::string, size_t>> structures;
+};
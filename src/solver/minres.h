@@ -0,0 +1,97 @@
+#pragma once
+
+#include <eigen/Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Preconditioned MINRES for a symmetric, possibly indefinite system A x = b, with A only given
+// through its products with vectors and a positive diagonal preconditioner.
+class Minres {
+ public:
+  // Iterate until the residual in the norm of the preconditioner is below tolerance times that
+  // of b, or for max_iterations.
+  template <class MatVec>
+  Eigen::VectorXd solve(
+      const MatVec& mat_vec,
+      const Eigen::VectorXd& b,
+      const Eigen::VectorXd& preconditioner,
+      const double tolerance,
+      const size_t max_iterations);
+
+  bool converged = false;
+
+  size_t n_iterations = 0;
+
+  // Relative residual in the norm of the preconditioner.
+  double residual = 0.0;
+};
+
+template <class MatVec>
+Eigen::VectorXd Minres::solve(
+    const MatVec& mat_vec,
+    const Eigen::VectorXd& b,
+    const Eigen::VectorXd& preconditioner,
+    const double tolerance,
+    const size_t max_iterations) {
+  const size_t n = b.size();
+  Eigen::VectorXd x = Eigen::VectorXd::Zero(n);
+  Eigen::VectorXd r1 = b;
+  Eigen::VectorXd y = r1.cwiseQuotient(preconditioner);
+  const double beta1 = std::sqrt(r1.dot(y));
+  converged = beta1 == 0.0;
+  n_iterations = 0;
+  residual = 0.0;
+  if (converged) return x;
+
+  Eigen::VectorXd r2 = r1;
+  Eigen::VectorXd w = Eigen::VectorXd::Zero(n);
+  Eigen::VectorXd w1 = w;
+  Eigen::VectorXd w2 = w;
+  double beta = beta1;
+  double old_beta = 0.0;
+  double d_bar = 0.0;
+  double epsilon = 0.0;
+  double phi_bar = beta1;
+  double cs = -1.0;
+  double sn = 0.0;
+  while (n_iterations < max_iterations) {
+    n_iterations++;
+
+    // Lanczos step in the preconditioned space.
+    const Eigen::VectorXd v = y / beta;
+    y = mat_vec(v);
+    if (n_iterations >= 2) y -= (beta / old_beta) * r1;
+    const double alpha = v.dot(y);
+    y -= (alpha / beta) * r2;
+    r1.swap(r2);
+    r2 = y;
+    y = r2.cwiseQuotient(preconditioner);
+    old_beta = beta;
+    beta = std::sqrt(std::max(r2.dot(y), 0.0));
+
+    // Givens rotation of the tridiagonal system and update of the solution.
+    const double old_epsilon = epsilon;
+    const double delta = cs * d_bar + sn * alpha;
+    const double g_bar = sn * d_bar - cs * alpha;
+    epsilon = sn * beta;
+    d_bar = -cs * beta;
+    const double gamma =
+        std::max(std::hypot(g_bar, beta), std::numeric_limits<double>::epsilon());
+    cs = g_bar / gamma;
+    sn = beta / gamma;
+    const double phi = cs * phi_bar;
+    phi_bar = sn * phi_bar;
+    w1.swap(w2);
+    w2.swap(w);
+    w = (v - old_epsilon * w1 - delta * w2) / gamma;
+    x += phi * w;
+
+    residual = phi_bar / beta1;
+    if (residual < tolerance || beta == 0.0) {
+      converged = true;
+      break;
+    }
+  }
+  return x;
+}
@@ -0,0 +1,41 @@
+#include "minres.h"
+#include <gtest/gtest.h>
+#include <random>
+
+// Symmetric indefinite matrix with a dominant diagonal of both signs and small couplings.
+Eigen::MatrixXd get_indefinite_matrix(const int n) {
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> coupling(-0.1, 0.1);
+  Eigen::MatrixXd matrix(n, n);
+  for (int i = 0; i < n; i++) {
+    matrix(i, i) = (i % 3 == 0 ? -1.0 : 1.0) * (1.0 + i);
+    for (int j = 0; j < i; j++) matrix(i, j) = matrix(j, i) = coupling(rng);
+  }
+  return matrix;
+}
+
+TEST(MinresTest, MatchesDirectSolve) {
+  const int N = 200;
+  const Eigen::MatrixXd& matrix = get_indefinite_matrix(N);
+  const Eigen::VectorXd& b = Eigen::VectorXd::LinSpaced(N, -1.0, 2.0);
+  const Eigen::VectorXd& expected = matrix.householderQr().solve(b);
+
+  Minres minres;
+  const auto& mat_vec = [&](const Eigen::VectorXd& v) -> Eigen::VectorXd { return matrix * v; };
+  const Eigen::VectorXd& x =
+      minres.solve(mat_vec, b, matrix.diagonal().cwiseAbs(), 1.0e-12, 1000);
+  EXPECT_TRUE(minres.converged);
+  EXPECT_LT(minres.n_iterations, N);
+  EXPECT_LT((x - expected).norm(), 1.0e-9 * expected.norm());
+}
+
+TEST(MinresTest, ZeroRightHandSide) {
+  const Eigen::MatrixXd& matrix = get_indefinite_matrix(10);
+  Minres minres;
+  const auto& mat_vec = [&](const Eigen::VectorXd& v) -> Eigen::VectorXd { return matrix * v; };
+  const Eigen::VectorXd& x =
+      minres.solve(mat_vec, Eigen::VectorXd::Zero(10), Eigen::VectorXd::Ones(10), 1.0e-12, 100);
+  EXPECT_TRUE(minres.converged);
+  EXPECT_EQ(minres.n_iterations, 0);
+  EXPECT_EQ(x.norm(), 0.0);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// A file holding a copy of some arrays, mapped into memory and removed when destroyed.
+class SegmentFile {
+ public:
+  SegmentFile() {}
+
+  // Map an existing file copy on write, the file itself is kept. Not mapped if it fails.
+  explicit SegmentFile(const std::string& path);
+
+  // Write n_parts arrays back to back, each starting at a multiple of 8 bytes.
+  SegmentFile(
+      const std::string& path,
+      const size_t n_parts,
+      const void* const* parts,
+      const size_t* part_bytes,
+      size_t* part_offsets);
+
+  SegmentFile(const SegmentFile&) = delete;
+
+  SegmentFile& operator=(const SegmentFile&) = delete;
+
+  SegmentFile(SegmentFile&& rhs) noexcept { swap(rhs); }
+
+  SegmentFile& operator=(SegmentFile&& rhs) noexcept {
+    SegmentFile(std::move(rhs)).swap(*this);
+    return *this;
+  }
+
+  ~SegmentFile() { release(); }
+
+  bool is_mapped() const { return data != nullptr; }
+
+  char* get_data() const { return data; }
+
+  size_t get_n_bytes() const { return n_bytes; }
+
+  // Ask the kernel to start reading the segment in, for read-ahead before a sequential pass.
+  void prefetch() const {
+    if (data) madvise(data, n_bytes, MADV_WILLNEED);
+  }
+
+ private:
+  // Path of the file to remove on release, empty for files that are only mapped.
+  std::string path;
+
+  char* data = nullptr;
+
+  size_t n_bytes = 0;
+
+  void swap(SegmentFile& rhs) noexcept {
+    path.swap(rhs.path);
+    std::swap(data, rhs.data);
+    std::swap(n_bytes, rhs.n_bytes);
+  }
+
+  void release() {
+    if (data) munmap(data, n_bytes);
+    if (!path.empty()) unlink(path.c_str());
+    data = nullptr;
+    n_bytes = 0;
+    path.clear();
+  }
+};
+
+inline SegmentFile::SegmentFile(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  const off_t file_size = lseek(fd, 0, SEEK_END);
+  if (file_size <= 0) {
+    close(fd);
+    return;
+  }
+  void* mapped = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) return;
+  data = static_cast<char*>(mapped);
+  n_bytes = file_size;
+  madvise(data, n_bytes, MADV_SEQUENTIAL);
+}
+
+inline SegmentFile::SegmentFile(
+    const std::string& path,
+    const size_t n_parts,
+    const void* const* parts,
+    const size_t* part_bytes,
+    size_t* part_offsets)
+    : path(path) {
+  for (size_t i = 0; i < n_parts; i++) {
+    part_offsets[i] = n_bytes;
+    n_bytes += (part_bytes[i] + 7) / 8 * 8;
+  }
+
+  if (n_bytes == 0) {
+    this->path.clear();
+    return;
+  }
+
+  const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) throw std::runtime_error("cannot create segment file " + path);
+  for (size_t i = 0; i < n_parts; i++) {
+    const char* src = static_cast<const char*>(parts[i]);
+    size_t n_bytes_left = part_bytes[i];
+    off_t offset = part_offsets[i];
+    while (n_bytes_left > 0) {
+      const ssize_t n_written = pwrite(fd, src, n_bytes_left, offset);
+      if (n_written <= 0) {
+        close(fd);
+        throw std::runtime_error("cannot write segment file " + path);
+      }
+      src += n_written;
+      offset += n_written;
+      n_bytes_left -= n_written;
+    }
+  }
+  if (ftruncate(fd, n_bytes) != 0) {
+    close(fd);
+    throw std::runtime_error("cannot resize segment file " + path);
+  }
+
+  void* mapped = mmap(nullptr, n_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) throw std::runtime_error("cannot map segment file " + path);
+  data = static_cast<char*>(mapped);
+  madvise(data, n_bytes, MADV_SEQUENTIAL);
+}
@@ -9,25 +9,42 @@
 #include <hps/src/hps.h>
 #include <omp_hash_map/src/omp_hash_map.h>
 #include <omp_hash_map/src/omp_hash_set.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cmath>
 #include <cstdlib>
 #include <functional>
+#include <memory>
 #include <numeric>
 #include <queue>
-#include <random>
 
 #include "../config.h"
+#include "../counters.h"
+#include "../det/compressed_dets.h"
 #include "../det/det.h"
+#include "../det/det_filter.h"
+#include "../det/excitation_batch.h"
 #include "../math_vector.h"
 #include "../parallel.h"
+#include "../philox.h"
 #include "../result.h"
 #include "../timer.h"
 #include "../util.h"
+#include "checkpoint.h"
+#include "cost_range.h"
 #include "davidson.h"
+#include "device_davidson.h"
 #include "green.h"
 #include "hamiltonian.h"
+#include "hc_batch_files.h"
 #include "hc_server.h"
+#include "memory_planner.h"
+#include "sorted_hc_sums.h"
 #include "uncert_result.h"
+#include "wf_file.h"
+
+class SolverBench;
 
 template <class S>
 class Solver {
@@ -37,6 +54,9 @@ class Solver {
   void optimization_run();
 
  private:
+  // Times the stages on a saved wavefunction for shci_bench.
+  friend class SolverBench;
+
   S system;
 
   Hamiltonian<S> hamiltonian;
@@ -45,8 +65,33 @@ class Solver {
 
   fgpl::HashSet<Det, DetHasher> var_dets;
 
+  // Screens the PT dets before the lookups in var_dets.
+  DetFilter var_dets_filter;
+
+  // Diagonal elements of the var dets, from which those of the PT dets are updated.
+  std::vector<double> var_dets_diag;
+
+  // With pt_shard_var_dets, each proc keeps the var dets i with i % n_procs == proc_id during the
+  // PT, at i / n_procs, and var_dets only has those. The PT dets that are var dets of other procs
+  // are dropped by the procs of their hc sums, see mark_var_dets.
+  bool pt_sharded = false;
+
+  // Number of var dets of all the procs during the PT.
+  size_t n_var_dets_global = 0;
+
+  // With compress_var_dets, the var dets of the PT are var_dets_store, in its order, instead of
+  // system.dets and var_dets.
+  bool pt_compressed = false;
+
+  CompressedDets var_dets_store;
+
+  // The first var det of the wavefunction, HF, as the reference of the sorted hc sums.
+  Det pt_reference_det;
+
   size_t pt_mem_avail;
 
+  MemoryPlanner memory_planner;
+
   size_t var_iteration_global;
 
   double eps_var_min;
@@ -63,21 +108,72 @@ class Solver {
 
   size_t bytes_per_det;
 
+  // The checkpointed variation stage to resume, if any.
+  std::unique_ptr<Checkpoint::VarProgress> var_progress;
+
   void run_all_variations();
 
   void run_variation(const double eps_var, const bool until_converged = true);
 
+  // run_variation, resumed from var_progress if it was saved in this stage.
+  void run_variation_stage(const double eps_var, const bool until_converged = true);
+
+  // Collective. Saves the dets, coefs and eps_tried_prev of the stage to the checkpoint.
+  void save_var_checkpoint(const double eps_var, const bool until_converged, const bool done);
+
+  // Append new dets to the wavefunction with initial coefs, copying in parallel while one thread
+  // adds them to var_dets.
+  void append_var_dets(const std::vector<Det>& new_dets, const bool first_dets);
+
+  // Sort the dets after the first one alpha-major, i.e. by up and then dn half det, together with
+  // their coefs and eps_tried_prev, so that the rows of the dets sharing an alpha are close.
+  // Returns the previous position of each det. The hamiltonian is cleared since its det ids no
+  // longer apply.
+  std::vector<size_t> reorder_var_dets();
+
+  // Seconds per element of one multiplication with the hamiltonian.
+  double get_spmv_time_per_elem() const;
+
+  // Compare the rebuilt hamiltonian with it in the previous det order and with the timing of the
+  // previous one.
+  void print_reorder_stats(
+      const std::vector<size_t>& prev_ids, const double time_per_elem_prev) const;
+
   void run_all_perturbations();
 
   void run_perturbation(const double eps_var);
 
-  double get_energy_pt_dtm(const double eps_var, const unsigned i_state);
+  // The PT epsilons of eps_var from the config.
+  void set_eps_pt(const double eps_var);
+
+  // The var dets, their filter and diagonal elements and the memory available to the PT of the
+  // loaded wavefunction.
+  void setup_perturbation();
+
+  // PT of the N states from first_state, sharing the enumeration of the connections.
+  template <size_t N>
+  void run_perturbation_states(const double eps_var, const unsigned first_state);
 
-  UncertResult get_energy_pt_psto(
-      const double eps_var, const unsigned i_state, const double energy_pt_dtm);
+  template <size_t N>
+  std::array<double, N> get_energy_pt_dtm(const double eps_var, const unsigned first_state);
 
-  UncertResult get_energy_pt_sto(
-      const double eps_var, const unsigned i_state, const UncertResult& get_energy_pt_sto);
+  template <size_t N>
+  std::array<UncertResult, N> get_energy_pt_psto(
+      const double eps_var,
+      const unsigned first_state,
+      const std::array<double, N>& energy_pt_dtm);
+
+  // The dtm and psto corrections from one enumeration down to eps_pt_psto per psto batch, then
+  // the batches left after the psto converges at eps_pt_dtm only. Returns their sums.
+  template <size_t N>
+  std::array<UncertResult, N> get_energy_pt_dtm_psto(
+      const double eps_var, const unsigned first_state);
+
+  template <size_t N>
+  std::array<UncertResult, N> get_energy_pt_sto(
+      const double eps_var,
+      const unsigned first_state,
+      const std::array<UncertResult, N>& energy_pt_psto);
 
   bool load_variation_result(const std::string& filename);
 
@@ -87,14 +183,190 @@ class Solver {
 
   void print_dets_info() const;
 
+  // Collective. Sets the bytes of the integrals, the helpers and the structures of the var dets
+  // in the memory planner.
+  void account_var_memory();
+
+  // Collective. Measures the hash table overhead of the hc sums of a batch from the memory
+  // available on the node before it and after its n_pt_dets were synced.
+  void measure_hc_sums_memory(
+      const size_t mem_avail_begin, const size_t n_pt_dets, const size_t bytes_per_entry);
+
   std::string get_state_suffix(const unsigned i_state) const;
 
   std::string get_wf_filename(const double eps_var) const;
 
-  template <class C>
-  std::array<double, 2> mapreduce_sum(
+  // Checkpoint key of a PT stage of the N states from first_state.
+  std::string get_pt_checkpoint_key(
+      const std::string& stage,
+      const double eps_var,
+      const unsigned first_state,
+      const unsigned n_states_pass) const;
+
+  // Sums of the mapped values of each state and of their squares.
+  template <size_t N, class C>
+  std::array<std::array<double, 2>, N> mapreduce_sum(
       const fgpl::DistHashMap<Det, C, DetHasher>& map,
-      const std::function<double(const Det& det, const C& hc_sum)>& mapper) const;
+      const std::function<std::array<double, N>(const Det& det, const C& hc_sum)>& mapper) const;
+
+  // Collective. In the sharded PT, sets the var dets of this proc in the PT batches
+  // [batch_begin, batch_end) of n_batches as hc sums of parent -1, which reduce_hc_sums keeps, so
+  // that the procs of the hc sums skip the var dets. Returns their number on all the procs.
+  template <size_t M>
+  size_t mark_var_dets(
+      fgpl::DistHashMap<Det, MathVector<double, M>, DetHasher>& hc_sums,
+      const size_t n_batches,
+      const size_t batch_begin,
+      const size_t batch_end) const;
+
+  // Var det i of this proc during the PT.
+  Det get_var_det(const size_t i) const {
+    return pt_compressed ? var_dets_store.get(i) : system.dets[i];
+  }
+
+  size_t get_n_var_dets() const {
+    return pt_compressed ? var_dets_store.size() : system.get_n_dets();
+  }
+
+  bool has_var_det(const Det& det) const {
+    return pt_compressed ? var_dets_store.has(det) : var_dets.has(det);
+  }
+
+  template <size_t M>
+  static bool is_var_det_mark(const MathVector<double, M>& hc_sum) {
+    return hc_sum[M - 1] < 0.0;
+  }
+
+  // Calls handler(sample_id, i, i_local) for the sample ids start, start + step, ... of the var
+  // dets i = sample_dets[sample_id], dealt round robin to the procs, or in the sharded PT to the
+  // proc of det i, where it is get_var_det(i_local).
+  template <class Handler>
+  void for_each_sampled_var_det(
+      const std::vector<size_t>& sample_dets,
+      const size_t start,
+      const size_t step,
+      const Handler& handler) const;
+
+  // Number of PT dets above eps in 1 / 128 of the batches connected to 1 / 100 of the var dets.
+  template <size_t N>
+  size_t estimate_n_pt_dets(const unsigned first_state, const double eps);
+
+  // Coefs of var det i in the states of a pass, and the largest magnitude for the screening.
+  template <size_t N>
+  std::array<double, N> get_pass_coefs(
+      const size_t i, const unsigned first_state, double& max_abs_coef) const {
+    std::array<double, N> coefs;
+    max_abs_coef = 0.0;
+    for (unsigned s = 0; s < N; s++) {
+      coefs[s] = system.coefs[first_state + s][i];
+      max_abs_coef = std::max(max_abs_coef, std::abs(coefs[s]));
+    }
+    return coefs;
+  }
+
+  // H_ai * c_i of each state, zero below eps. Returns false if all of them are.
+  template <size_t N>
+  static bool get_screened_hcs(
+      const double h_ai,
+      const std::array<double, N>& coefs,
+      const double eps,
+      const int n_excite,
+      std::array<double, N>& hcs) {
+    bool has_hc = false;
+    for (unsigned s = 0; s < N; s++) {
+      hcs[s] = h_ai * coefs[s];
+      if (std::abs(hcs[s]) < eps) {
+        hcs[s] = 0.0;
+      } else {
+        has_hc = true;
+      }
+    }
+    if (!has_hc && n_excite == 1) Counters::add(Counters::SINGLE_REJECTIONS, 1);
+    return has_hc;
+  }
+
+  std::string get_states_label(const unsigned first_state, const unsigned n_states) const {
+    if (n_states == 1) return Util::str_printf("state %u", first_state);
+    return Util::str_printf("states %u-%u", first_state, first_state + n_states - 1);
+  }
+
+  // Appended to the PT outputs of passes over several states.
+  std::string get_pass_state_tag(const unsigned i_state, const unsigned n_states) const {
+    return n_states == 1 ? "" : Util::str_printf(" (state %u)", i_state);
+  }
+
+  // Sums the hc sums except for the last element, the index of a var det connected to the PT
+  // det, of which the lowest one is kept.
+  template <size_t N>
+  static void reduce_hc_sums(MathVector<double, N>& sum, const MathVector<double, N>& contrib) {
+    const double parent = std::min(sum[N - 1], contrib[N - 1]);
+    sum += contrib;
+    sum[N - 1] = parent;
+  }
+
+  // Estimated work of finding the connections of a det between the screening thresholds, in
+  // connections: a pass over the pairs of electrons plus about 1 / eps of them above eps with
+  // Hamiltonian elements of order 1 Ha. Only used for ranking the dets.
+  double get_connections_cost(const double eps_max, const double eps_min) const {
+    const double n_elecs = system.n_elecs;
+    return n_elecs * n_elecs + 1.0 / eps_min - 1.0 / eps_max;
+  }
+
+  // The var dets j, j + 5, ... of each of the 5 steps of a PT batch, distributed by the cost of
+  // their connections above eps, or in the sharded PT those of this proc ordered by it.
+  template <size_t N>
+  std::vector<CostRange> get_pt_var_dets_ranges(const unsigned first_state, const double eps) {
+    std::vector<CostRange> ranges;
+    const auto& cost = [&](const size_t i) {
+      double max_abs_coef;
+      static_cast<void>(get_pass_coefs<N>(i, first_state, max_abs_coef));
+      return get_connections_cost(eps_pt_max, eps / max_abs_coef);
+    };
+    for (size_t j = 0; j < 5; j++) ranges.emplace_back(j, get_n_var_dets(), 5, cost, pt_sharded);
+    return ranges;
+  }
+
+  // Call handler(k, det_a_batch_id) for each excitation k of the batch whose det is in the PT
+  // batches [batch_begin, batch_end) of n_batches and not a var det. All the dets are hashed
+  // first and their filter blocks fetched, so that the lookups do not wait on each other.
+  template <class Handler>
+  void for_each_pt_excitation(
+      ExcitationBatch& batch,
+      const size_t n_batches,
+      const size_t batch_begin,
+      const size_t batch_end,
+      const Handler& handler) const {
+    const DetHasher det_hasher;
+    const size_t n_excitations = batch.size();
+    batch.hashes.resize(n_excitations);
+    for (size_t k = 0; k < n_excitations; k++) {
+      const size_t det_a_hash = det_hasher(batch.dets[k]);
+      batch.hashes[k] = det_a_hash;
+      const size_t det_a_batch_id = Util::rehash(det_a_hash) % n_batches;
+      if (det_a_batch_id >= batch_begin && det_a_batch_id < batch_end) {
+        var_dets_filter.prefetch_hash(det_a_hash);
+      }
+    }
+    size_t n_var_det_hits = 0;
+    for (size_t k = 0; k < n_excitations; k++) {
+      const size_t det_a_batch_id = Util::rehash(batch.hashes[k]) % n_batches;
+      if (det_a_batch_id < batch_begin || det_a_batch_id >= batch_end) continue;
+      if (var_dets_filter.may_have_hash(batch.hashes[k]) && has_var_det(batch.dets[k])) {
+        n_var_det_hits++;
+        continue;
+      }
+      handler(k, det_a_batch_id);
+    }
+    Counters::add(Counters::VAR_DET_HITS, n_var_det_hits);
+  }
+
+  // H_aa of a PT det from the diagonal element of its parent var det. In the sharded PT, the
+  // parent may be on another proc, so it is computed in full.
+  double get_pt_diag(const Det& det_a, const size_t parent) const {
+    if (pt_sharded) return system.get_hamiltonian_elem(det_a, det_a, 0);
+    return system.get_hamiltonian_diag_from_parent(
+        det_a, get_var_det(parent), var_dets_diag[parent]);
+  }
 };
 
 template <class S>
@@ -127,7 +399,10 @@ void Solver<S>::run() {
     if (system.time_sym) throw std::invalid_argument("time sym hc server not implemented");
     const auto& wf_filename = get_wf_filename(eps_var_min);
     if (!load_variation_result(wf_filename)) throw std::runtime_error("failed to load wf");
-    hamiltonian.update(system);
+    if (!(Config::get<bool>("save_hamiltonian", false) &&
+          hamiltonian.load(system, wf_filename))) {
+      hamiltonian.update(system);
+    }
     HcServer<S> server(system, hamiltonian);
     server.run();
     return;
@@ -163,6 +438,10 @@ void Solver<S>::optimization_run() {
   std::setlocale(LC_ALL, "en_US.UTF-8");
 
   Config::set<bool>("force_var", true);
+  // The orbitals change between the variations.
+  if (Checkpoint::is_enabled()) {
+    throw std::invalid_argument("checkpoint_interval is not supported with optimization");
+  }
 
   unsigned natorb_iter = Config::get<unsigned>("optimization/natorb_iter", 1);
   unsigned optorb_iter = Config::get<unsigned>("optimization/optorb_iter", 20);
@@ -231,6 +510,12 @@ void Solver<S>::optimization_run() {
 
   std::string method = Config::get<std::string>("optimization/method", "app_newton");
 
+  // The later optorb iterations start from the dets of the previous one, whose connections are
+  // kept and only revalued for the rotated integrals, and only select for the last eps_var.
+  const bool revalue_hamiltonian = Config::get<bool>("optimization/revalue_hamiltonian", false);
+  std::vector<Det> kept_dets;
+  std::vector<std::vector<double>> kept_coefs;
+
   while (i_iter < natorb_iter + optorb_iter) {
     if (Parallel::is_master())
       std::cout << "\n== Iteration " << i_iter << ": optimized orbitals (" << method
@@ -245,7 +530,22 @@ void Solver<S>::optimization_run() {
     Result::put("energy_hf", system.energy_hf);
     Timer::end();
 
-    run_all_variations();
+    if (!kept_dets.empty()) {
+      const double eps_var = Config::get<std::vector<double>>("eps_vars").back();
+      Timer::start(Util::str_printf("eps_var=%#.2e", eps_var));
+      system.dets = std::move(kept_dets);
+      system.coefs = std::move(kept_coefs);
+      kept_dets.clear();
+      kept_coefs.clear();
+      hamiltonian.revalue(system);
+      Timer::checkpoint("revalue sparse hamiltonian");
+      for (const auto& det : system.dets) var_dets.set(det);
+      var_iteration_global = 0;
+      run_variation(eps_var);
+      Timer::end();
+    } else {
+      run_all_variations();
+    }
     
     energy_var = std::accumulate(system.energy_var.begin(), system.energy_var.end(), 0.) / system.n_states;
     diff_energy_var = energy_var - prev_energy_var;
@@ -289,9 +589,13 @@ void Solver<S>::optimization_run() {
 
     prev_energy_var = energy_var;
 
+    if (revalue_hamiltonian) {
+      kept_dets = system.dets;
+      kept_coefs = system.coefs;
+    }
     system.post_variation_optimization(hamiltonian.matrix, method);
 
-    hamiltonian.clear();
+    if (!revalue_hamiltonian) hamiltonian.clear();
     connections.clear();
     connections.shrink_to_fit();
 
@@ -316,33 +620,61 @@ void Solver<S>::run_all_variations() {
   var_iteration_global = 0;
   eps_var_min = eps_vars.back();
   const bool get_pair_contrib = Config::get<bool>("get_pair_contrib", false);
+  const bool float_hamiltonian_schedule = Config::get<bool>("float_hamiltonian_schedule", false);
+  const bool save_hamiltonian = Config::get<bool>("save_hamiltonian", false);
+  // Resume a checkpointed stage of these eps, skipping the stages before it.
+  Checkpoint::VarProgress progress;
+  if (Checkpoint::get("var", progress)) {
+    const auto& stage_eps_vars = progress.until_converged ? eps_vars : eps_vars_schedule;
+    if (std::find(stage_eps_vars.begin(), stage_eps_vars.end(), progress.eps_var) !=
+        stage_eps_vars.end()) {
+      var_progress.reset(new Checkpoint::VarProgress(progress));
+    }
+  }
   for (const double eps_var : eps_vars) {
+    if (var_progress && eps_var > var_progress->eps_var) {
+      eps_var_prev = eps_var;
+      continue;
+    }
     Timer::start(Util::str_printf("eps_var=%#.2e", eps_var));
     const auto& filename = get_wf_filename(eps_var);
+    Counters::reset();
     if (Config::get<bool>("force_var", false) || !load_variation_result(filename)) {
       // Perform extra scheduled eps.
       while (it_schedule != eps_vars_schedule.end() && *it_schedule >= eps_var_prev) it_schedule++;
       while (it_schedule != eps_vars_schedule.end() && *it_schedule > eps_var) {
         const double eps_var_extra = *it_schedule;
+        if (var_progress && eps_var_extra > var_progress->eps_var) {
+          it_schedule++;
+          continue;
+        }
         Timer::start(Util::str_printf("extra=%#.2e", eps_var_extra));
-        run_variation(eps_var_extra, false);
+        hamiltonian.set_float_values(float_hamiltonian_schedule);
+        run_variation_stage(eps_var_extra, false);
         Timer::end();
         it_schedule++;
       }
 
       Timer::start("main");
-      run_variation(eps_var);
+      hamiltonian.set_float_values(false);
+      run_variation_stage(eps_var);
       for (unsigned i_state = 0; i_state < system.n_states; i_state++) {
         Result::put<double>(
             Util::str_printf("energy_var%s/%#.2e", get_state_suffix(i_state).c_str(), eps_var),
             system.energy_var[i_state]);
       }
       Timer::end();
+      Counters::report(Util::str_printf("variation/%#.2e", eps_var));
       save_variation_result(filename);
+      if (save_hamiltonian) hamiltonian.save(system, filename);
     } else {
       eps_tried_prev.clear();
       var_dets.clear();
       for (const auto& det : system.dets) var_dets.set(det);
+      if (save_hamiltonian && eps_var == eps_vars.back()) {
+        hamiltonian.set_float_values(false);
+        hamiltonian.load(system, filename);
+      }
       //      hamiltonian.clear();
       for (unsigned i_state = 0; i_state < system.n_states; i_state++) {
         Result::put<double>(
@@ -362,15 +694,145 @@ void Solver<S>::run_all_variations() {
   eps_tried_prev.clear();
   eps_tried_prev.shrink_to_fit();
   var_dets.clear_and_shrink();
+  var_progress.reset();
+  if (Checkpoint::is_enabled()) {
+    Checkpoint::erase("var");
+    Checkpoint::write();
+    if (Parallel::is_master()) std::remove(Checkpoint::get_wf_filename().c_str());
+  }
+}
+
+template <class S>
+void Solver<S>::run_variation_stage(const double eps_var, const bool until_converged) {
+  if (var_progress && var_progress->eps_var == eps_var &&
+      var_progress->until_converged == until_converged) {
+    // All the dets of the stage, whatever wf_load_coef_min.
+    const std::string& wf_filename = Checkpoint::get_wf_filename();
+    if (!(WfFile::load(system, wf_filename) || WfFile::load_hps(system, wf_filename)) ||
+        system.get_n_dets() != var_progress->n_dets) {
+      throw std::runtime_error("cannot load the dets of the checkpoint, remove it to start over");
+    }
+    eps_tried_prev = var_progress->eps_tried_prev;
+    var_iteration_global = var_progress->var_iteration_global;
+    var_dets.clear();
+    for (const auto& det : system.dets) var_dets.set(det);
+    hamiltonian.clear();
+    const bool done = var_progress->done;
+    var_progress.reset();
+    if (done) return;
+  }
+  run_variation(eps_var, until_converged);
+}
+
+template <class S>
+void Solver<S>::save_var_checkpoint(
+    const double eps_var, const bool until_converged, const bool done) {
+  Timer::start("checkpoint");
+  const std::string& wf_filename = Checkpoint::get_wf_filename();
+  const std::string& tmp_filename = wf_filename + ".tmp";
+  save_variation_result(tmp_filename);
+  Parallel::barrier();
+  if (Parallel::is_master() && std::rename(tmp_filename.c_str(), wf_filename.c_str()) != 0) {
+    throw std::runtime_error("cannot write checkpoint " + wf_filename);
+  }
+  Checkpoint::VarProgress progress;
+  progress.eps_var = eps_var;
+  progress.until_converged = until_converged;
+  progress.done = done;
+  progress.n_dets = system.get_n_dets();
+  progress.var_iteration_global = var_iteration_global;
+  progress.eps_tried_prev = eps_tried_prev;
+  Checkpoint::put("var", progress);
+  Checkpoint::write();
+  Timer::end();
+}
+
+template <class S>
+void Solver<S>::append_var_dets(const std::vector<Det>& new_dets, const bool first_dets) {
+  const size_t n_dets_old = system.dets.size();
+  const size_t n_new_dets = new_dets.size();
+  system.dets.resize(n_dets_old + n_new_dets);
+  for (unsigned i_state = 0; i_state < system.n_states; i_state++) {
+    system.coefs[i_state].resize(n_dets_old + n_new_dets);
+  }
+  var_dets.reserve(var_dets.get_n_keys() + n_new_dets);
+#pragma omp parallel
+  {
+#pragma omp single nowait
+    for (const auto& det : new_dets) var_dets.set(det);
+
+#pragma omp for schedule(dynamic, 1024)
+    for (size_t k = 0; k < n_new_dets; k++) {
+      system.dets[n_dets_old + k] = new_dets[k];
+      // initialize with 1.0 first time adding dets, later with 0.0
+      for (unsigned i_state = 0; i_state < system.n_states; i_state++) {
+        system.coefs[i_state][n_dets_old + k] = (first_dets && i_state > 0) ? 1.0 : 1e-16;
+      }
+    }
+  }
+}
+
+template <class S>
+std::vector<size_t> Solver<S>::reorder_var_dets() {
+  const size_t n_dets = system.get_n_dets();
+  std::vector<size_t> order(n_dets);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin() + 1, order.end(), [&](const size_t a, const size_t b) {
+    return system.dets[a] < system.dets[b];
+  });
+
+  std::vector<Det> dets(n_dets);
+  std::vector<double> values(n_dets);
+#pragma omp parallel for schedule(static, 1024)
+  for (size_t i = 0; i < n_dets; i++) dets[i] = system.dets[order[i]];
+  system.dets.swap(dets);
+  Util::free(dets);
+  for (auto& state_coefs : system.coefs) {
+#pragma omp parallel for schedule(static, 1024)
+    for (size_t i = 0; i < n_dets; i++) values[i] = state_coefs[order[i]];
+    state_coefs.swap(values);
+  }
+#pragma omp parallel for schedule(static, 1024)
+  for (size_t i = 0; i < n_dets; i++) values[i] = eps_tried_prev[order[i]];
+  eps_tried_prev.swap(values);
+  hamiltonian.clear();
+  return order;
+}
+
+template <class S>
+double Solver<S>::get_spmv_time_per_elem() const {
+  const auto& matrix = hamiltonian.matrix;
+  const size_t n_elems = matrix.count_n_elems();
+  const std::vector<double> vec(matrix.count_n_rows(), 1.0);
+  const auto& begin = std::chrono::high_resolution_clock::now();
+  matrix.mul(vec);
+  const auto& end = std::chrono::high_resolution_clock::now();
+  return n_elems > 0 ? std::chrono::duration<double>(end - begin).count() / n_elems : 0.0;
+}
+
+template <class S>
+void Solver<S>::print_reorder_stats(
+    const std::vector<size_t>& prev_ids, const double time_per_elem_prev) const {
+  const auto& matrix = hamiltonian.matrix;
+  const double bandwidth_prev = matrix.get_mean_bandwidth(prev_ids);
+  const double bandwidth = matrix.get_mean_bandwidth();
+  const double time_per_elem = get_spmv_time_per_elem();
+  if (Parallel::is_master()) {
+    printf(
+        "Hamiltonian mean bandwidth before / after reordering: %.1f / %.1f\n",
+        bandwidth_prev,
+        bandwidth);
+    printf(
+        "Multiplication time before / after reordering: %.2f / %.2f ns per elem\n",
+        time_per_elem_prev * 1.0e9,
+        time_per_elem * 1.0e9);
+  }
 }
 
 template <class S>
 void Solver<S>::run_all_perturbations() {
   const auto& eps_vars = Config::get<std::vector<double>>("eps_vars");
-  bytes_per_det = N_CHUNKS * 16;  // 2 * 8 * N_CHKS
-#ifdef INF_ORBS
-  bytes_per_det += 128;  // 4 * 32. Assume 4 avg excitations beyond bit-rep CHUNKS per Half Det.
-#endif
+  bytes_per_det = sizeof(Det);
   for (const double eps_var : eps_vars) {
     Timer::start(Util::str_printf("eps_var=%#.2e", eps_var));
     run_perturbation(eps_var);
@@ -381,6 +843,16 @@ void Solver<S>::run_all_perturbations() {
 template <class S>
 void Solver<S>::run_variation(const double eps_var, const bool until_converged) {
   Davidson davidson(system.n_states);
+  const bool davidson_gpu = Config::get<bool>("davidson_gpu", false);
+  if (davidson_gpu && !Device::is_gpu()) {
+    throw std::invalid_argument("davidson_gpu needs a build with make GPU=1");
+  }
+  const size_t n_precond_dets = Config::get<size_t>("davidson_precond_dets", 0);
+  if (davidson_gpu && n_precond_dets > 0) {
+    throw std::invalid_argument("davidson_precond_dets is not supported with davidson_gpu");
+  }
+  davidson.set_n_precond_dets(n_precond_dets);
+  DeviceDavidson device_davidson(system.n_states);
   fgpl::DistHashSet<Det, DetHasher> dist_new_dets;
   size_t n_dets = system.get_n_dets();
   size_t n_dets_new = n_dets;
@@ -390,6 +862,7 @@ void Solver<S>::run_variation(const double eps_var, const bool until_converged)
   bool dets_converged = false;
   const bool get_pair_contrib = Config::get<bool>("get_pair_contrib", false);
   bool var_sd = Config::get<bool>("var_sd", get_pair_contrib);
+  const bool reorder_dets = Config::get<bool>("reorder_dets", false);
 
   const bool second_rejection = Config::get<bool>("second_rejection", false);
   system.energy_hf_1b = second_rejection ? system.get_e_hf_1b() : 0.;
@@ -402,28 +875,47 @@ void Solver<S>::run_variation(const double eps_var, const bool until_converged)
     // Random execution and broadcast.
     if (!dets_converged) {
       n_dets_new = n_dets;
+      const auto& get_eps_min = [&](const size_t i) {
+        const auto& det = system.dets[i];
+        double max_coef = system.coefs[0][i];
+        for (unsigned i_state = 1; i_state < system.n_states; i_state++) {
+          const double coef = system.coefs[i_state][i];
+          if (std::abs(coef) > std::abs(max_coef)) max_coef = coef;
+        }
+        double eps_min = eps_var / std::abs(max_coef);
+        if (i == 0 && var_sd) eps_min = 0.0;
+        if (system.time_sym && det.up != det.dn) eps_min *= Util::SQRT2;
+        return eps_min;
+      };
+      double busy_time = 0.0;
       for (size_t j = 0; j < 5; j++) {
-        fgpl::DistRange<size_t>(j, n_dets, 5).for_each([&](const size_t i) {
+        CostRange var_dets_range(j, n_dets, 5, [&](const size_t i) {
+          const double eps_min = get_eps_min(i);
+          if (eps_min >= eps_tried_prev[i]) return 0.0;
+          return get_connections_cost(eps_tried_prev[i], eps_min);
+        });
+        busy_time += var_dets_range.for_each([&](const size_t i) {
           const auto& det = system.dets[i];
-          double max_coef = system.coefs[0][i];
-          for (unsigned i_state = 1; i_state < system.n_states; i_state++) {
-            const double coef = system.coefs[i_state][i];
-            if (std::abs(coef) > std::abs(max_coef)) max_coef = coef;
-          }
-          double eps_min = eps_var / std::abs(max_coef);
-          if (i == 0 && var_sd) eps_min = 0.0;
-          if (system.time_sym && det.up != det.dn) eps_min *= Util::SQRT2;
+          const double eps_min = get_eps_min(i);
           if (eps_min >= eps_tried_prev[i]) return;
           Det connected_det_reg;
+          size_t n_var_det_hits = 0;
+          size_t n_single_rejections = 0;
           const auto& connected_det_handler = [&](const Det& connected_det, const int n_excite) {
             connected_det_reg = connected_det;
             if (system.time_sym && connected_det.up > connected_det.dn) {
               connected_det_reg.reverse_spin();
             }
-            if (var_dets.has(connected_det_reg)) return;
+            if (var_dets.has(connected_det_reg)) {
+              n_var_det_hits++;
+              return;
+            }
             if (n_excite == 1) {
               const double h_ai = system.get_hamiltonian_elem(det, connected_det, 1);
-              if (std::abs(h_ai) < eps_min) return;  // Filter out small single excitation.
+              if (std::abs(h_ai) < eps_min) {  // Filter out small single excitation.
+                n_single_rejections++;
+                return;
+              }
             }
             dist_new_dets.async_set(connected_det_reg);
           };
@@ -435,40 +927,79 @@ void Solver<S>::run_variation(const double eps_var, const bool until_converged)
 	    static_cast<void>(system.find_connected_dets(det, eps_tried_prev[i], eps_min, connected_det_handler));
             eps_tried_prev[i] = 1.000000001 * eps_min;
           }
+          Counters::add(Counters::VAR_DET_HITS, n_var_det_hits);
+          Counters::add(Counters::SINGLE_REJECTIONS, n_single_rejections);
         });
         dist_new_dets.sync();
-        n_dets_new += dist_new_dets.get_n_keys();
-        system.dets.reserve(n_dets_new);
-        for (auto& state_coefs : system.coefs) state_coefs.reserve(n_dets_new);
-        dist_new_dets.for_each_serial([&](const Det& connected_det, const size_t) {
-          var_dets.set(connected_det);
-          system.dets.push_back(connected_det);
-	  // initialize with 1.0 first time adding dets, later with 0.0
-          for (unsigned i_state = 0; i_state < system.n_states; i_state++) {
-            if (n_dets == 1 && i_state > 0)
-              system.coefs[i_state].push_back(1.0);
-            else 
-              system.coefs[i_state].push_back(1e-16);
-          }
-        });
+        std::vector<Det> new_dets;
+        new_dets.reserve(dist_new_dets.get_n_keys());
+        dist_new_dets.for_each_serial(
+            [&](const Det& connected_det, const size_t) { new_dets.push_back(connected_det); });
         dist_new_dets.clear();
+        n_dets_new += new_dets.size();
+        append_var_dets(new_dets, n_dets == 1);
         if (Parallel::is_master()) printf("%zu%% ", (j + 1) * 20);
       }
+      // The dets are not always found by the same procs, which only update their own ones.
+      if (Parallel::get_n_procs() > 1) {
+        MPI_Allreduce(
+            MPI_IN_PLACE, eps_tried_prev.data(), n_dets, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+      }
+      const double imbalance = CostRange::get_imbalance(busy_time);
 
       if (Parallel::is_master()) {
         printf("\nNumber of dets / new dets: %'zu / %'zu\n", n_dets_new, n_dets_new - n_dets);
+        printf("Load imbalance (max / avg proc time): %.2f\n", imbalance);
       }
       Timer::checkpoint("get next det list");
 
+      // The hamiltonian grows about linearly with the dets.
+      account_var_memory();
+      if (n_dets > 0) {
+        const double n_bytes_ham =
+            hamiltonian.matrix.count_n_bytes() / Parallel::get_n_procs() * 1.0;
+        memory_planner.check(
+            Util::str_printf("hamiltonian of %zu dets", n_dets_new),
+            "hamiltonian",
+            static_cast<size_t>(n_bytes_ham * n_dets_new / n_dets));
+      }
+
+      // Rebuilding the hamiltonian from scratch costs little more than extending it once the
+      // number of dets grows by half.
+      const bool reorder = reorder_dets && n_dets_new > n_dets * 1.5;
+      std::vector<size_t> prev_ids;
+      double time_per_elem_prev = 0.0;
+      if (reorder) {
+        time_per_elem_prev = get_spmv_time_per_elem();
+        eps_tried_prev.resize(n_dets_new, Util::INF);
+        prev_ids = reorder_var_dets();
+        Timer::checkpoint("reorder dets");
+      }
       hamiltonian.update(system);
+      if (reorder) print_reorder_stats(prev_ids, time_per_elem_prev);
+      if (davidson_gpu) {
+        device_davidson.upload(hamiltonian.matrix);
+        Timer::checkpoint("upload hamiltonian to device");
+      }
     }
 
     const double davidson_target_error =
         until_converged ? target_error / 500000 : target_error / 50;
-    davidson.diagonalize(
-        hamiltonian.matrix, system.coefs, davidson_target_error, Parallel::is_master());
-    const std::vector<double> energy_var_new = davidson.get_lowest_eigenvalues();
-    system.coefs = davidson.get_lowest_eigenvectors();
+    std::vector<double> energy_var_new;
+    bool davidson_converged;
+    if (davidson_gpu) {
+      device_davidson.diagonalize(
+          hamiltonian.matrix, system.coefs, davidson_target_error, Parallel::is_master());
+      energy_var_new = device_davidson.get_lowest_eigenvalues();
+      system.coefs = device_davidson.get_lowest_eigenvectors();
+      davidson_converged = device_davidson.converged;
+    } else {
+      davidson.diagonalize(
+          hamiltonian.matrix, system.coefs, davidson_target_error, Parallel::is_master());
+      energy_var_new = davidson.get_lowest_eigenvalues();
+      system.coefs = davidson.get_lowest_eigenvectors();
+      davidson_converged = davidson.converged;
+    }
     Timer::checkpoint("diagonalize sparse hamiltonian");
     var_iteration_global++;
     if (Parallel::is_master()) {
@@ -485,11 +1016,15 @@ void Solver<S>::run_variation(const double eps_var, const bool until_converged)
     if (n_dets_new < n_dets * 1.001) {
       dets_converged = true;
     }
-    if (dets_converged && davidson.converged) {
+    if (dets_converged && davidson_converged) {
       converged = true;
     }
     n_dets = n_dets_new;
     energy_var_prev = energy_var_new;
+    if (Checkpoint::is_due()) {
+      system.energy_var = energy_var_new;
+      save_var_checkpoint(eps_var, until_converged, converged || !until_converged);
+    }
     if (!until_converged) break;
     Timer::end();
     iteration++;
@@ -506,26 +1041,7 @@ void Solver<S>::run_variation(const double eps_var, const bool until_converged)
 
 template <class S>
 void Solver<S>::run_perturbation(const double eps_var) {
-  double eps_pt_dtm_min = 2.0e-6;
-  double eps_pt_psto_min = 1.0e-7;
-  double eps_pt_dtm_ratio = 1.0e-1;
-  double eps_pt_psto_ratio = 1.0e-2;
-  double eps_pt_ratio = 1.0e-3;
-
-  eps_pt_dtm_ratio = Config::get<double>("eps_pt_dtm_ratio", eps_pt_dtm_ratio);
-  eps_pt_psto_ratio = Config::get<double>("eps_pt_psto_ratio", eps_pt_psto_ratio);
-  eps_pt_ratio = Config::get<double>("eps_pt_ratio", eps_pt_ratio);
-
-  eps_pt_dtm = std::max(eps_pt_dtm_min, eps_pt_dtm_ratio*eps_var);
-  eps_pt_psto = std::max(eps_pt_psto_min, eps_pt_psto_ratio*eps_var);
-  eps_pt = eps_pt_ratio*eps_var; // no max here because we want eps_pt propto eps_var
-
-  eps_pt_dtm = Config::get<double>("eps_pt_dtm", eps_pt_dtm);
-  eps_pt_psto = Config::get<double>("eps_pt_psto", eps_pt_psto);
-  eps_pt = Config::get<double>("eps_pt", eps_pt);
-
-  if (eps_pt_psto < eps_pt) eps_pt_psto = eps_pt;
-  if (eps_pt_dtm < eps_pt_psto) eps_pt_dtm = eps_pt_psto;
+  set_eps_pt(eps_var);
 
   // If results for all states of current eps_var already exist, return.
   bool missing_pt = false;
@@ -555,52 +1071,164 @@ void Solver<S>::run_perturbation(const double eps_var) {
   if (!load_variation_result(var_filename)) {
     throw new std::runtime_error("cannot load variation results");
   }
+  setup_perturbation();
+
+  // States of a pass share one enumeration of the connections, at most 4 per pass.
+  unsigned n_states_per_pass = Config::get<unsigned>("n_states_per_pt_pass", 1);
+  if (n_states_per_pass == 0) n_states_per_pass = 1;
+  if (n_states_per_pass > 4) n_states_per_pass = 4;
+  for (unsigned first_state = 0; first_state < system.n_states; first_state += n_states_per_pass) {
+    switch (std::min(n_states_per_pass, system.n_states - first_state)) {
+      case 1:
+        run_perturbation_states<1>(eps_var, first_state);
+        break;
+      case 2:
+        run_perturbation_states<2>(eps_var, first_state);
+        break;
+      case 3:
+        run_perturbation_states<3>(eps_var, first_state);
+        break;
+      default:
+        run_perturbation_states<4>(eps_var, first_state);
+    }
+  }
+  var_dets_filter.clear();
+  var_dets_store.clear();
+  Util::free(var_dets_diag);
+  Checkpoint::erase(Util::str_printf("pt/%#.2e/", eps_var));
+  Checkpoint::write();
+}
+
+template <class S>
+void Solver<S>::set_eps_pt(const double eps_var) {
+  double eps_pt_dtm_min = 2.0e-6;
+  double eps_pt_psto_min = 1.0e-7;
+  double eps_pt_dtm_ratio = 1.0e-1;
+  double eps_pt_psto_ratio = 1.0e-2;
+  double eps_pt_ratio = 1.0e-3;
+
+  eps_pt_dtm_ratio = Config::get<double>("eps_pt_dtm_ratio", eps_pt_dtm_ratio);
+  eps_pt_psto_ratio = Config::get<double>("eps_pt_psto_ratio", eps_pt_psto_ratio);
+  eps_pt_ratio = Config::get<double>("eps_pt_ratio", eps_pt_ratio);
+
+  eps_pt_dtm = std::max(eps_pt_dtm_min, eps_pt_dtm_ratio*eps_var);
+  eps_pt_psto = std::max(eps_pt_psto_min, eps_pt_psto_ratio*eps_var);
+  eps_pt = eps_pt_ratio*eps_var; // no max here because we want eps_pt propto eps_var
+
+  eps_pt_dtm = Config::get<double>("eps_pt_dtm", eps_pt_dtm);
+  eps_pt_psto = Config::get<double>("eps_pt_psto", eps_pt_psto);
+  eps_pt = Config::get<double>("eps_pt", eps_pt);
+
+  if (eps_pt_psto < eps_pt) eps_pt_psto = eps_pt;
+  if (eps_pt_dtm < eps_pt_psto) eps_pt_dtm = eps_pt_psto;
+}
+
+template <class S>
+void Solver<S>::setup_perturbation() {
   system.update_diag_helper();
   if (system.time_sym) system.unpack_time_sym();
 
+  n_var_dets_global = system.get_n_dets();
+  pt_reference_det = system.dets[0];
+  pt_sharded = Config::get<bool>("pt_shard_var_dets", false);
+  if (pt_sharded) {
+    const size_t n_procs = Parallel::get_n_procs();
+    size_t n_local_dets = 0;
+    for (size_t i = Parallel::get_proc_id(); i < n_var_dets_global; i += n_procs) {
+      system.dets[n_local_dets] = system.dets[i];
+      for (auto& coefs : system.coefs) coefs[n_local_dets] = coefs[i];
+      n_local_dets++;
+    }
+    system.dets.resize(n_local_dets);
+    for (auto& coefs : system.coefs) coefs.resize(n_local_dets);
+    if (Parallel::is_master()) {
+      printf("Var dets per proc: %'zu of %'zu\n", n_local_dets, n_var_dets_global);
+    }
+  }
+
   // Perform multi stage PT.
   system.dets.shrink_to_fit();
   for (auto& coefs : system.coefs) coefs.shrink_to_fit();
   var_dets.clear_and_shrink();
-  var_dets.reserve(system.get_n_dets());
-  for (const auto& det : system.dets) var_dets.set(det);
-  size_t mem_total = Config::get<double>("mem_total", Util::get_mem_total());
-#ifdef INF_ORBS
-  mem_total *= 0.8;
-#endif
-  const size_t mem_var = system.get_n_dets() * (bytes_per_det * 3 + 8);
-  const double mem_left = mem_total * 0.7 - mem_var - system.helper_size;
-  assert(mem_left > 0);
+  var_dets_filter.build(system.dets);
+  pt_compressed = Config::get<bool>("compress_var_dets", false);
+  if (pt_compressed) {
+    // The coefs follow the sorted order of the store.
+    var_dets_store.build(system.dets);
+    for (auto& coefs : system.coefs) {
+      std::vector<double> coefs_sorted(coefs.size());
+      for (size_t i = 0; i < coefs.size(); i++) {
+        coefs_sorted[i] = coefs[var_dets_store.get_source_id(i)];
+      }
+      coefs.swap(coefs_sorted);
+    }
+    var_dets_store.free_source_ids();
+    Util::free(system.dets);
+    if (Parallel::is_master()) {
+      printf(
+          "Compressed var dets: %.1f bytes per det\n",
+          var_dets_store.get_n_bytes() * 1.0 / std::max<size_t>(var_dets_store.size(), 1));
+    }
+  } else {
+    var_dets.reserve(system.get_n_dets());
+    for (const auto& det : system.dets) var_dets.set(det);
+  }
+  if (!pt_sharded) {
+    var_dets_diag.resize(get_n_var_dets());
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (size_t i = 0; i < get_n_var_dets(); i++) {
+      const Det& det = get_var_det(i);
+      var_dets_diag[i] = system.get_hamiltonian_elem(det, det, 0);
+    }
+  }
+  account_var_memory();
+  memory_planner.set("var dets filter", var_dets_filter.get_n_bytes());
+  memory_planner.set("var dets diag", var_dets_diag.capacity() * sizeof(double));
+  const size_t mem_left = memory_planner.get_n_bytes_left(0.7);
+  if (mem_left == 0) {
+    throw std::runtime_error("no memory left for the PT after the var dets, raise mem_total");
+  }
   pt_mem_avail = mem_left;
   const size_t n_procs = Parallel::get_n_procs();
   if (n_procs >= 2) {
     pt_mem_avail = static_cast<size_t>(pt_mem_avail * 0.7 * n_procs);
   }
+  memory_planner.print();
   if (Parallel::is_master()) {
-    printf("Memory total: %.1fGB\n", mem_total * 1.0e-9);
-    printf("Helper size: %.1fGB\n", system.helper_size * 1.0e-9);
     printf("Bytes per det: %zu\n", bytes_per_det);
-    printf("Memory var: %.1fGB\n", mem_var * 1.0e-9);
     printf("Memory PT limit: %.1fGB\n", pt_mem_avail * 1.0e-9);
   }
-  for (unsigned i_state = 0; i_state < system.n_states; i_state++) {
+}
+
+template <class S>
+template <size_t N>
+void Solver<S>::run_perturbation_states(const double eps_var, const unsigned first_state) {
+  std::array<UncertResult, N> energy_pt_psto;
+  if (eps_pt_psto < eps_pt_dtm && Config::get<bool>("pt_fuse_dtm_psto", false)) {
+    energy_pt_psto = get_energy_pt_dtm_psto<N>(eps_var, first_state);
+  } else {
+    const auto& energy_pt_dtm = get_energy_pt_dtm<N>(eps_var, first_state);
+    energy_pt_psto = get_energy_pt_psto<N>(eps_var, first_state, energy_pt_dtm);
+  }
+  const auto& energy_pt = get_energy_pt_sto<N>(eps_var, first_state, energy_pt_psto);
+  for (unsigned s = 0; s < N; s++) {
+    const unsigned i_state = first_state + s;
     const auto& value_entry = Util::str_printf(
         "energy_total%s/%#.2e/%#.2e/value", get_state_suffix(i_state).c_str(), eps_var, eps_pt);
     const auto& uncert_entry = Util::str_printf(
         "energy_total%s/%#.2e/%#.2e/uncert", get_state_suffix(i_state).c_str(), eps_var, eps_pt);
-    const double energy_pt_dtm = get_energy_pt_dtm(eps_var, i_state);
-    const UncertResult energy_pt_psto = get_energy_pt_psto(eps_var, i_state, energy_pt_dtm);
-    const UncertResult energy_pt = get_energy_pt_sto(eps_var, i_state, energy_pt_psto);
     if (Parallel::is_master()) {
-      printf("Total energy: %s Ha (state %d)\n", energy_pt.to_string().c_str(), i_state);
+      printf("Total energy: %s Ha (state %d)\n", energy_pt[s].to_string().c_str(), i_state);
     }
-    Result::put(value_entry, energy_pt.value);
-    Result::put(uncert_entry, energy_pt.uncert);
+    Result::put(value_entry, energy_pt[s].value);
+    Result::put(uncert_entry, energy_pt[s].uncert);
   }
 }
 
 template <class S>
-double Solver<S>::get_energy_pt_dtm(const double eps_var, const unsigned i_state) {
+template <size_t N>
+std::array<double, N> Solver<S>::get_energy_pt_dtm(
+    const double eps_var, const unsigned first_state) {
 //We cannot return if eps_pt_dtm >= eps_var because: a) some c_i may go up in mag. during the last HCI iteration,
 //b) New dets may be added during last HCI iteration, c) if second_rejection=true then not all dets
 //that pass the usual HCI criterion will be included in the variational wavefn.
@@ -608,39 +1236,70 @@ double Solver<S>::get_energy_pt_dtm(const double eps_var, const unsigned i_state
   eps_pt_max=Util::INF;
 //if (eps_pt_dtm >= eps_pt_max) return system.energy_var;
 
-  Timer::start(Util::str_printf("dtm %#.2e (state %d)", eps_pt_dtm, i_state));
-  const size_t n_var_dets = system.get_n_dets();
+  const auto& checkpoint_key = get_pt_checkpoint_key("dtm", eps_var, first_state, N);
+  Checkpoint::PtProgress progress;
+  const bool resumed = Checkpoint::get(checkpoint_key, progress);
+  std::array<double, N> energy_pt_dtm_total;
+  if (resumed && progress.done) {
+    std::copy(progress.values.begin(), progress.values.end(), energy_pt_dtm_total.begin());
+    return energy_pt_dtm_total;
+  }
+
+  Timer::start(
+      Util::str_printf("dtm %#.2e (%s)", eps_pt_dtm, get_states_label(first_state, N).c_str()));
+  Counters::reset();
   size_t n_batches = Config::get<size_t>("n_batches_pt_dtm", 0);
-  fgpl::DistHashMap<Det, MathVector<double, 1>, DetHasher> hc_sums;
-  size_t bytes_per_entry = bytes_per_det + 8;
-  const DetHasher det_hasher;
+  fgpl::DistHashMap<Det, MathVector<double, N + 1>, DetHasher> hc_sums;
+  size_t bytes_per_entry = bytes_per_det + 8 * (N + 1);
+
+  // The sort engine accumulates into sorted_hc_sums instead of hc_sums.
+  const auto& engine = Config::get<std::string>("pt_dtm_engine", "hash");
+  if (!Util::str_equals_ci(engine, "hash") && !Util::str_equals_ci(engine, "sort")) {
+    throw std::invalid_argument("unknown pt_dtm_engine: " + engine);
+  }
+  const bool sort_engine = Util::str_equals_ci(engine, "sort");
+  const bool buffer_batches = Config::get<bool>("pt_dtm_buffer_batches", false);
+  // The buffered batches are in files of this run, so only finished stages are resumed.
+  if (resumed && !buffer_batches) n_batches = progress.n_batches;
+  if (N > 1 && (sort_engine || buffer_batches)) {
+    throw std::invalid_argument(
+        "pt_dtm_engine sort and pt_dtm_buffer_batches need n_states_per_pt_pass = 1");
+  }
+  // The sorted sums keep the parent for the diagonal elements, which may be on another proc.
+  if (pt_sharded && sort_engine) {
+    throw std::invalid_argument("pt_dtm_engine sort is not supported with pt_shard_var_dets");
+  }
+  SortedHcSums sorted_hc_sums;
+  sorted_hc_sums.set_reference(pt_reference_det);
+  const auto& add_hc = [&](const Det& det_a, const std::array<double, N>& hcs, const size_t parent) {
+    Counters::add(Counters::HC_SUMS_INSERTS, 1);
+    if (sort_engine) {
+      sorted_hc_sums.add(det_a, hcs[0], parent);
+    } else {
+      MathVector<double, N + 1> contrib;
+      for (unsigned s = 0; s < N; s++) contrib[s] = hcs[s];
+      contrib[N] = parent;
+      hc_sums.async_set(det_a, contrib, reduce_hc_sums<N + 1>);
+    }
+  };
+  const auto& sync_hc = [&]() {
+    if (sort_engine) {
+      sorted_hc_sums.sync();
+    } else {
+      hc_sums.sync(reduce_hc_sums<N + 1>);
+    }
+  };
 
   // Estimate best n batches.
   if (n_batches == 0) {
-    fgpl::DistRange<size_t>(50, n_var_dets, 100).for_each([&](const size_t i) {
-      const Det& det = system.dets[i];
-      const double coef = system.coefs[i_state][i];
-      const auto& pt_det_handler = [&](const Det& det_a, const int n_excite) {
-        if (var_dets.has(det_a)) return;
-        const size_t det_a_hash = det_hasher(det_a);
-        const size_t batch_hash = Util::rehash(det_a_hash);
-        if ((batch_hash & 127) != 0) return;  // For n a power of 2, "% n" = "& (n-1)"
-        if (n_excite == 1) {
-          const double h_ai = system.get_hamiltonian_elem(det, det_a, n_excite);
-          const double hc = h_ai * coef;
-          if (std::abs(hc) < eps_pt_dtm) return;  // Filter out small single excitation.
-        }
-        MathVector<double, 1> contrib;
-        hc_sums.async_set(det_a, contrib);
-      };
-      static_cast<void>(system.find_connected_dets(
-          det, eps_pt_max / std::abs(coef), eps_pt_dtm / std::abs(coef), pt_det_handler));
-    });
-    hc_sums.sync();
-    const size_t n_pt_dets = hc_sums.get_n_keys();
-    // 128 batches during estimation. 1 out of 100 var dets used. Hash table filling rate < 1 / 2.5
+    const size_t n_pt_dets = estimate_n_pt_dets<N>(first_state, eps_pt_dtm);
+    // 128 batches during estimation. 1 out of 100 var dets used. The sorted sums have no hash
+    // table, only the buffers of the sort.
+    const double mem_per_pt_det = sort_engine
+                                      ? SortedHcSums::get_n_bytes_per_entry()
+                                      : memory_planner.get_hash_entry_bytes(bytes_per_entry);
     n_batches =
-        static_cast<size_t>(ceil(2.5 * 128 * 100 * n_pt_dets * bytes_per_entry / pt_mem_avail));
+        static_cast<size_t>(ceil(128 * 100 * n_pt_dets * mem_per_pt_det / pt_mem_avail));
     if (n_batches == 0) n_batches = 1;
     size_t n_batches_node = n_batches;
     fgpl::broadcast(n_batches);
@@ -651,123 +1310,232 @@ double Solver<S>::get_energy_pt_dtm(const double eps_var, const unsigned i_state
       printf("Number of dtm batches: %zu\n", n_batches);
     }
     Timer::checkpoint("determine number of dtm batches");
-    hc_sums.clear();
   }
 
-  double energy_sum = 0.0;
-  double energy_sq_sum = 0.0;
+  std::array<double, N> energy_sum;
+  std::array<double, N> energy_sq_sum;
+  energy_sum.fill(0.0);
+  energy_sq_sum.fill(0.0);
   size_t n_pt_dets_sum = 0;
-  UncertResult energy_pt_dtm;
+  std::array<UncertResult, N> energy_pt_dtm;
+  size_t batch_id_begin = 0;
+  if (resumed && !buffer_batches) {
+    std::copy(progress.energy_sum.begin(), progress.energy_sum.end(), energy_sum.begin());
+    std::copy(progress.energy_sq_sum.begin(), progress.energy_sq_sum.end(), energy_sq_sum.begin());
+    n_pt_dets_sum = progress.n_pt_dets_sum;
+    batch_id_begin = progress.batch_id;
+  }
+
+  // Enumerate the connections once, keeping the first batch in memory and writing the
+  // contributions of the other batches to local files.
+  std::unique_ptr<HcBatchFiles> batch_files;
+  if (n_batches > 1 && buffer_batches) {
+    batch_files.reset(
+        new HcBatchFiles(Config::get<std::string>("pt_dtm_buffer_dir", "."), n_batches));
+  }
 
-  for (size_t batch_id = 0; batch_id < n_batches; batch_id++) {
+  const auto& var_dets_ranges = get_pt_var_dets_ranges<N>(first_state, eps_pt_dtm);
+  std::vector<ExcitationBatch> excitation_batches(Parallel::get_n_threads());
+  for (size_t batch_id = batch_id_begin; batch_id < n_batches; batch_id++) {
+    const size_t mem_avail_begin = Util::get_mem_avail();
     Timer::start(Util::str_printf("#%zu/%zu", batch_id + 1, n_batches));
+    const size_t n_var_marks = mark_var_dets(hc_sums, n_batches, batch_id, batch_id + 1);
 
-    for (size_t j = 0; j < 5; j++) {
-      fgpl::DistRange<size_t>(j, n_var_dets, 5).for_each([&](const size_t i) {
-        const Det& det = system.dets[i];
-        const double coef = system.coefs[i_state][i];
-        const auto& pt_det_handler = [&](const Det& det_a, const int n_excite) {
-          const size_t det_a_hash = det_hasher(det_a);
-          const size_t batch_hash = Util::rehash(det_a_hash);
-          if (batch_hash % n_batches != batch_id) return;
-          if (var_dets.has(det_a)) return;
-          const double h_ai = system.get_hamiltonian_elem(det, det_a, n_excite);
-          const double hc = h_ai * coef;
-          if (std::abs(hc) < eps_pt_dtm) return;  // Filter out small single excitation.
-          const MathVector<double, 1> contrib(hc);
-          hc_sums.async_set(det_a, contrib, fgpl::Reducer<MathVector<double, 1>>::sum);
-        };
-        static_cast<void>(system.find_connected_dets(
-            det, eps_pt_max / std::abs(coef), eps_pt_dtm / std::abs(coef), pt_det_handler));
-      });
-      hc_sums.sync(fgpl::Reducer<MathVector<double, 1>>::sum);
-      if (Parallel::is_master()) printf("%zu%% ", (j + 1) * 20);
+    if (!batch_files || batch_id == 0) {
+      double busy_time = 0.0;
+      for (size_t j = 0; j < 5; j++) {
+        busy_time += var_dets_ranges[j].for_each([&](const size_t i) {
+          const Det& det = get_var_det(i);
+          double max_abs_coef;
+          const auto& coefs = get_pass_coefs<N>(i, first_state, max_abs_coef);
+          const size_t batch_begin = batch_files ? 0 : batch_id;
+          const size_t batch_end = batch_files ? n_batches : batch_id + 1;
+          const auto& pt_batch_handler = [&](ExcitationBatch& batch) {
+            for_each_pt_excitation(
+                batch,
+                n_batches,
+                batch_begin,
+                batch_end,
+                [&](const size_t k, const size_t det_a_batch_id) {
+                  const Det& det_a = batch.dets[k];
+                  const double h_ai = system.get_hamiltonian_elem(det, det_a, batch.n_excites[k]);
+                  std::array<double, N> hcs;
+                  // Filter out small single excitation.
+                  if (!get_screened_hcs<N>(h_ai, coefs, eps_pt_dtm, batch.n_excites[k], hcs)) {
+                    return;
+                  }
+                  if (det_a_batch_id != batch_id) {
+                    batch_files->append(det_a_batch_id, det_a, hcs[0], i);
+                    return;
+                  }
+                  add_hc(det_a, hcs, i);
+                });
+          };
+          static_cast<void>(system.find_connected_dets_batched(
+              det,
+              eps_pt_max / max_abs_coef,
+              eps_pt_dtm / max_abs_coef,
+              excitation_batches[omp_get_thread_num()],
+              pt_batch_handler));
+        });
+        sync_hc();
+        if (Parallel::is_master()) printf("%zu%% ", (j + 1) * 20);
+      }
+      const double imbalance = CostRange::get_imbalance(busy_time);
+      if (Parallel::is_master()) printf("\nLoad imbalance (max / avg proc time): %.2f", imbalance);
+      if (batch_files) {
+        batch_files->flush();
+        if (Parallel::is_master()) {
+          printf("\nBuffered other batches: %.1fGB", batch_files->get_n_bytes_written() * 1.0e-9);
+        }
+      }
+    } else {
+      batch_files->for_each_block(
+          batch_id,
+          [&](const std::vector<Det>& dets,
+              const std::vector<double>& hcs,
+              const std::vector<size_t>& parents) {
+#pragma omp parallel for schedule(static)
+            for (size_t k = 0; k < dets.size(); k++) {
+              std::array<double, N> hcs_k;  // Batches are only buffered for single states.
+              hcs_k.fill(hcs[k]);
+              add_hc(dets[k], hcs_k, parents[k]);
+            }
+          });
+      sync_hc();
     }
-    const size_t n_pt_dets = hc_sums.get_n_keys();
+    const size_t n_pt_dets =
+        sort_engine ? sorted_hc_sums.get_n_keys() : hc_sums.get_n_keys() - n_var_marks;
     if (Parallel::is_master()) {
       printf("\nNumber of dtm pt dets: %'zu\n", n_pt_dets);
     }
     n_pt_dets_sum += n_pt_dets;
+    if (!sort_engine) {
+      measure_hc_sums_memory(mem_avail_begin, hc_sums.get_n_keys(), bytes_per_entry);
+    }
     Timer::checkpoint("create hc sums");
 
-    const auto& energy_pt_dtm_batch = mapreduce_sum<MathVector<double, 1>>(
-        hc_sums, [&](const Det& det_a, const MathVector<double, 1>& hc_sum) {
-          const double H_aa = system.get_hamiltonian_elem(det_a, det_a, 0);
-          const double contrib = hc_sum[0] * hc_sum[0] / (system.energy_var[i_state] - H_aa);
-          return contrib;
-        });
-    energy_sum += energy_pt_dtm_batch[0];
-    energy_sq_sum += energy_pt_dtm_batch[1];
-    energy_pt_dtm.value = energy_sum / (batch_id + 1) * n_batches;
-    if (batch_id == n_batches - 1) {
-      energy_pt_dtm.uncert = 0.0;
+    std::array<std::array<double, 2>, N> energy_pt_dtm_batch;
+    if (sort_engine) {
+      energy_pt_dtm_batch[0] = sorted_hc_sums.mapreduce_sum(
+          [&](const Det& det_a, const double hc_sum, const size_t parent) {
+            const double H_aa = get_pt_diag(det_a, parent);
+            return hc_sum * hc_sum / (system.energy_var[first_state] - H_aa);
+          });
     } else {
-      const double energy_avg = energy_sum / n_pt_dets_sum;
-      const double sample_stdev = sqrt(energy_sq_sum / n_pt_dets_sum - energy_avg * energy_avg);
-      energy_pt_dtm.uncert =
-          sample_stdev * sqrt(n_pt_dets_sum) / (batch_id + 1) * (n_batches - batch_id - 1);
+      energy_pt_dtm_batch = mapreduce_sum<N, MathVector<double, N + 1>>(
+          hc_sums, [&](const Det& det_a, const MathVector<double, N + 1>& hc_sum) {
+            const double H_aa = get_pt_diag(det_a, hc_sum[N]);
+            std::array<double, N> contribs;
+            for (unsigned s = 0; s < N; s++) {
+              contribs[s] = hc_sum[s] * hc_sum[s] / (system.energy_var[first_state + s] - H_aa);
+            }
+            return contribs;
+          });
     }
+    for (unsigned s = 0; s < N; s++) {
+      const unsigned i_state = first_state + s;
+      energy_sum[s] += energy_pt_dtm_batch[s][0];
+      energy_sq_sum[s] += energy_pt_dtm_batch[s][1];
+      energy_pt_dtm[s].value = energy_sum[s] / (batch_id + 1) * n_batches;
+      if (batch_id == n_batches - 1) {
+        energy_pt_dtm[s].uncert = 0.0;
+      } else {
+        const double energy_avg = energy_sum[s] / n_pt_dets_sum;
+        const double sample_stdev =
+            sqrt(energy_sq_sum[s] / n_pt_dets_sum - energy_avg * energy_avg);
+        energy_pt_dtm[s].uncert =
+            sample_stdev * sqrt(n_pt_dets_sum) / (batch_id + 1) * (n_batches - batch_id - 1);
+      }
 
-    if (Parallel::is_master()) {
-      printf("PT dtm batch correction: " ENERGY_FORMAT "\n", energy_pt_dtm_batch[0]);
-      printf("PT dtm correction (eps1= %.2e, eps_pt_dtm= %.2e):", eps_var, eps_pt_dtm);
-      printf(" %s Ha\n", energy_pt_dtm.to_string().c_str());
-      printf("PT dtm total energy (eps1= %.2e, eps_pt_dtm= %.2e):", eps_var, eps_pt_dtm);
-      printf(" %s Ha\n", (energy_pt_dtm + system.energy_var[i_state]).to_string().c_str());
-      printf("Correlation energy (eps1= %.2e, eps_pt_dtm= %.2e):", eps_var, eps_pt_dtm);
-      printf(
-          " %s Ha\n",
-          (energy_pt_dtm + system.energy_var[i_state] - system.energy_hf).to_string().c_str());
+      if (Parallel::is_master()) {
+        const auto& tag = get_pass_state_tag(i_state, N);
+        printf(
+            "PT dtm batch correction: " ENERGY_FORMAT "%s\n",
+            energy_pt_dtm_batch[s][0],
+            tag.c_str());
+        printf("PT dtm correction (eps1= %.2e, eps_pt_dtm= %.2e):", eps_var, eps_pt_dtm);
+        printf(" %s Ha%s\n", energy_pt_dtm[s].to_string().c_str(), tag.c_str());
+        printf("PT dtm total energy (eps1= %.2e, eps_pt_dtm= %.2e):", eps_var, eps_pt_dtm);
+        printf(
+            " %s Ha%s\n",
+            (energy_pt_dtm[s] + system.energy_var[i_state]).to_string().c_str(),
+            tag.c_str());
+        printf("Correlation energy (eps1= %.2e, eps_pt_dtm= %.2e):", eps_var, eps_pt_dtm);
+        printf(
+            " %s Ha%s\n",
+            (energy_pt_dtm[s] + system.energy_var[i_state] - system.energy_hf)
+                .to_string()
+                .c_str(),
+            tag.c_str());
+      }
     }
 
     hc_sums.clear();
+    sorted_hc_sums.clear();
+    if (!buffer_batches && batch_id + 1 < n_batches && Checkpoint::is_due()) {
+      progress.n_batches = n_batches;
+      progress.batch_id = batch_id + 1;
+      progress.n_pt_dets_sum = n_pt_dets_sum;
+      progress.energy_sum.assign(energy_sum.begin(), energy_sum.end());
+      progress.energy_sq_sum.assign(energy_sq_sum.begin(), energy_sq_sum.end());
+      Checkpoint::put(checkpoint_key, progress);
+      Checkpoint::write();
+    }
     Timer::end();  // batch
   }
 
   hc_sums.clear_and_shrink();
+  Counters::report(Util::str_printf(
+      "pt_dtm%s/%#.2e/%#.2e", get_state_suffix(first_state).c_str(), eps_var, eps_pt_dtm));
   Timer::end();  // dtm
-  return energy_pt_dtm.value + system.energy_var[i_state];
+  for (unsigned s = 0; s < N; s++) {
+    energy_pt_dtm_total[s] = energy_pt_dtm[s].value + system.energy_var[first_state + s];
+  }
+  progress.done = true;
+  progress.values.assign(energy_pt_dtm_total.begin(), energy_pt_dtm_total.end());
+  Checkpoint::put(checkpoint_key, progress);
+  Checkpoint::write();
+  return energy_pt_dtm_total;
 }
 
 template <class S>
-UncertResult Solver<S>::get_energy_pt_psto(
-    const double eps_var, const unsigned i_state, const double energy_pt_dtm) {
-  if (eps_pt_psto >= eps_pt_dtm) return UncertResult(energy_pt_dtm, 0.0);
+template <size_t N>
+std::array<UncertResult, N> Solver<S>::get_energy_pt_psto(
+    const double eps_var,
+    const unsigned first_state,
+    const std::array<double, N>& energy_pt_dtm) {
+  std::array<UncertResult, N> energy_pt;
+  for (unsigned s = 0; s < N; s++) energy_pt[s] = UncertResult(energy_pt_dtm[s], 0.0);
+  if (eps_pt_psto >= eps_pt_dtm) return energy_pt;
+
+  const auto& checkpoint_key = get_pt_checkpoint_key("psto", eps_var, first_state, N);
+  Checkpoint::PtProgress progress;
+  const bool resumed = Checkpoint::get(checkpoint_key, progress);
+  if (resumed && progress.done) {
+    for (unsigned s = 0; s < N; s++) {
+      energy_pt[s] = UncertResult(progress.values[s], progress.uncerts[s]);
+    }
+    return energy_pt;
+  }
 
-  Timer::start(Util::str_printf("psto %#.2e (state %d)", eps_pt_psto, i_state));
-  const size_t n_var_dets = system.get_n_dets();
+  Timer::start(Util::str_printf(
+      "psto %#.2e (%s)", eps_pt_psto, get_states_label(first_state, N).c_str()));
+  Counters::reset();
   size_t n_batches = Config::get<size_t>("n_batches_pt_psto", 0);
-  fgpl::DistHashMap<Det, MathVector<double, 2>, DetHasher> hc_sums;
-  const size_t bytes_per_entry = bytes_per_det + 16;
-  const DetHasher det_hasher;
+  if (resumed) n_batches = progress.n_batches;
+  // The sums of each state, then those of the terms above eps_pt_dtm, then the parent.
+  fgpl::DistHashMap<Det, MathVector<double, 2 * N + 1>, DetHasher> hc_sums;
+  const size_t bytes_per_entry = bytes_per_det + 8 * (2 * N + 1);
 
   // Estimate best n batches.
   if (n_batches == 0) {
-    fgpl::DistRange<size_t>(50, n_var_dets, 100).for_each([&](const size_t i) {
-      const Det& det = system.dets[i];
-      const double coef = system.coefs[i_state][i];
-      const auto& pt_det_handler = [&](const Det& det_a, const int n_excite) {
-        if (var_dets.has(det_a)) return;
-        const size_t det_a_hash = det_hasher(det_a);
-        const size_t batch_hash = Util::rehash(det_a_hash);
-        if ((batch_hash & 127) != 0) return;  // For n a power of 2, "% n" = "& (n-1)"
-        if (n_excite == 1) {
-          const double h_ai = system.get_hamiltonian_elem(det, det_a, n_excite);
-          const double hc = h_ai * coef;
-          if (std::abs(hc) < eps_pt_psto) return;  // Filter out small single excitation.
-        }
-        MathVector<double, 2> contrib;
-        hc_sums.async_set(det_a, contrib);
-      };
-      static_cast<void>(system.find_connected_dets(
-          det, eps_pt_max / std::abs(coef), eps_pt_psto / std::abs(coef), pt_det_handler));
-    });
-    hc_sums.sync();
-    const size_t n_pt_dets = hc_sums.get_n_keys();
+    const size_t n_pt_dets = estimate_n_pt_dets<N>(first_state, eps_pt_psto);
     const double mem_usage = Config::get<double>("pt_psto_mem_usage", 1.0);
-    // 128 batches during estimation. 1 out of 100 var dets used. Hash table filling rate < 1 / 2.5
+    // 128 batches during estimation. 1 out of 100 var dets used.
+    const double mem_per_pt_det = memory_planner.get_hash_entry_bytes(bytes_per_entry);
     n_batches = static_cast<size_t>(
-        ceil(2.5 * 128 * 100 * n_pt_dets * bytes_per_entry / (pt_mem_avail * mem_usage)));
+        ceil(128 * 100 * n_pt_dets * mem_per_pt_det / (pt_mem_avail * mem_usage)));
     if (n_batches < 16) n_batches = 16;
     size_t n_batches_node = n_batches;
     fgpl::broadcast(n_batches);
@@ -778,98 +1546,445 @@ UncertResult Solver<S>::get_energy_pt_psto(
       printf("Number of psto batches: %zu\n", n_batches);
     }
     Timer::checkpoint("determine number of psto batches");
-    hc_sums.clear();
   }
 
-  double energy_sum = 0.0;
-  double energy_sq_sum = 0.0;
+  std::array<double, N> energy_sum;
+  std::array<double, N> energy_sq_sum;
+  energy_sum.fill(0.0);
+  energy_sq_sum.fill(0.0);
   size_t n_pt_dets_sum = 0;
-  UncertResult energy_pt_psto;
+  std::array<UncertResult, N> energy_pt_psto;
+  size_t batch_id_begin = 0;
+  if (resumed) {
+    std::copy(progress.energy_sum.begin(), progress.energy_sum.end(), energy_sum.begin());
+    std::copy(progress.energy_sq_sum.begin(), progress.energy_sq_sum.end(), energy_sq_sum.begin());
+    n_pt_dets_sum = progress.n_pt_dets_sum;
+    batch_id_begin = progress.batch_id;
+  }
 
-  for (size_t batch_id = 0; batch_id < n_batches; batch_id++) {
+  const auto& var_dets_ranges = get_pt_var_dets_ranges<N>(first_state, eps_pt_psto);
+  std::vector<ExcitationBatch> excitation_batches(Parallel::get_n_threads());
+  for (size_t batch_id = batch_id_begin; batch_id < n_batches; batch_id++) {
+    const size_t mem_avail_begin = Util::get_mem_avail();
     Timer::start(Util::str_printf("#%zu/%zu", batch_id + 1, n_batches));
+    const size_t n_var_marks = mark_var_dets(hc_sums, n_batches, batch_id, batch_id + 1);
 
+    double busy_time = 0.0;
     for (size_t j = 0; j < 5; j++) {
-      fgpl::DistRange<size_t>(j, n_var_dets, 5).for_each([&](const size_t i) {
-        const Det& det = system.dets[i];
-        const double coef = system.coefs[i_state][i];
-        const auto& pt_det_handler = [&](const Det& det_a, const int n_excite) {
-          const size_t det_a_hash = det_hasher(det_a);
-          const size_t batch_hash = Util::rehash(det_a_hash);
-          if (batch_hash % n_batches != batch_id) return;
-          if (var_dets.has(det_a)) return;
-          const double h_ai = system.get_hamiltonian_elem(det, det_a, n_excite);
-          const double hc = h_ai * coef;
-          if (std::abs(hc) < eps_pt_psto) return;  // Filter out small single excitation.
-          MathVector<double, 2> contrib;
-          contrib[0] = hc;
-          if (std::abs(hc) >= eps_pt_dtm) contrib[1] = hc;
-          hc_sums.async_set(det_a, contrib, fgpl::Reducer<MathVector<double, 2>>::sum);
+      busy_time += var_dets_ranges[j].for_each([&](const size_t i) {
+        const Det& det = get_var_det(i);
+        double max_abs_coef;
+        const auto& coefs = get_pass_coefs<N>(i, first_state, max_abs_coef);
+        const auto& pt_batch_handler = [&](ExcitationBatch& batch) {
+          for_each_pt_excitation(
+              batch, n_batches, batch_id, batch_id + 1, [&](const size_t k, const size_t) {
+                const Det& det_a = batch.dets[k];
+                const double h_ai = system.get_hamiltonian_elem(det, det_a, batch.n_excites[k]);
+                std::array<double, N> hcs;
+                // Filter out small single excitation.
+                if (!get_screened_hcs<N>(h_ai, coefs, eps_pt_psto, batch.n_excites[k], hcs)) return;
+                MathVector<double, 2 * N + 1> contrib;
+                for (unsigned s = 0; s < N; s++) {
+                  contrib[s] = hcs[s];
+                  if (std::abs(hcs[s]) >= eps_pt_dtm) contrib[N + s] = hcs[s];
+                }
+                contrib[2 * N] = i;
+                Counters::add(Counters::HC_SUMS_INSERTS, 1);
+                hc_sums.async_set(det_a, contrib, reduce_hc_sums<2 * N + 1>);
+              });
         };
-        static_cast<void>(system.find_connected_dets(
-            det, eps_pt_max / std::abs(coef), eps_pt_psto / std::abs(coef), pt_det_handler));
+        static_cast<void>(system.find_connected_dets_batched(
+            det,
+            eps_pt_max / max_abs_coef,
+            eps_pt_psto / max_abs_coef,
+            excitation_batches[omp_get_thread_num()],
+            pt_batch_handler));
       });
-      hc_sums.sync(fgpl::Reducer<MathVector<double, 2>>::sum);
+      hc_sums.sync(reduce_hc_sums<2 * N + 1>);
       if (Parallel::is_master()) printf("%zu%% ", (j + 1) * 20);
     }
-    const size_t n_pt_dets = hc_sums.get_n_keys();
+    const double imbalance = CostRange::get_imbalance(busy_time);
+    const size_t n_pt_dets = hc_sums.get_n_keys() - n_var_marks;
     if (Parallel::is_master()) {
       printf("\nNumber of psto pt dets: %'zu\n", n_pt_dets);
+      printf("Load imbalance (max / avg proc time): %.2f\n", imbalance);
     }
     n_pt_dets_sum += n_pt_dets;
+    measure_hc_sums_memory(mem_avail_begin, hc_sums.get_n_keys(), bytes_per_entry);
     Timer::checkpoint("create hc sums");
 
-    const auto& energy_pt_psto_batch = mapreduce_sum<MathVector<double, 2>>(
-        hc_sums, [&](const Det& det_a, const MathVector<double, 2>& hc_sum) {
-          const double hc_sum_sq_diff = hc_sum[0] * hc_sum[0] - hc_sum[1] * hc_sum[1];
-          const double H_aa = system.get_hamiltonian_elem(det_a, det_a, 0);
-          const double contrib = hc_sum_sq_diff / (system.energy_var[i_state] - H_aa);
-          return contrib;
+    const auto& energy_pt_psto_batch = mapreduce_sum<N, MathVector<double, 2 * N + 1>>(
+        hc_sums, [&](const Det& det_a, const MathVector<double, 2 * N + 1>& hc_sum) {
+          const double H_aa = get_pt_diag(det_a, hc_sum[2 * N]);
+          std::array<double, N> contribs;
+          for (unsigned s = 0; s < N; s++) {
+            const double hc_sum_sq_diff = hc_sum[s] * hc_sum[s] - hc_sum[N + s] * hc_sum[N + s];
+            contribs[s] = hc_sum_sq_diff / (system.energy_var[first_state + s] - H_aa);
+          }
+          return contribs;
         });
-    energy_sum += energy_pt_psto_batch[0];
-    energy_sq_sum += energy_pt_psto_batch[1];
-    energy_pt_psto.value = energy_sum / (batch_id + 1) * n_batches;
-    if (batch_id == n_batches - 1) {
-      energy_pt_psto.uncert = 0.0;
+    bool uncert_converged = true;
+    bool uncert_converged_final = eps_pt_psto <= eps_pt;
+    for (unsigned s = 0; s < N; s++) {
+      energy_sum[s] += energy_pt_psto_batch[s][0];
+      energy_sq_sum[s] += energy_pt_psto_batch[s][1];
+      energy_pt_psto[s].value = energy_sum[s] / (batch_id + 1) * n_batches;
+      if (batch_id == n_batches - 1) {
+        energy_pt_psto[s].uncert = 0.0;
+      } else {
+        const double energy_avg = energy_sum[s] / n_pt_dets_sum;
+        const double sample_stdev =
+            sqrt(energy_sq_sum[s] / n_pt_dets_sum - energy_avg * energy_avg);
+        const double mean_stdev = sample_stdev / sqrt(n_pt_dets_sum);
+        energy_pt_psto[s].uncert =
+            mean_stdev * n_pt_dets_sum / (batch_id + 1) * (n_batches - batch_id - 1);
+        // energy_pt_psto.uncert = sample_stdev * sqrt(n_pt_dets_sum) / (batch_id + 1) * n_batches;
+      }
+      if (!(energy_pt_psto[s].uncert <= target_error * 0.5)) uncert_converged = false;
+      if (!(energy_pt_psto[s].uncert <= target_error)) uncert_converged_final = false;
+
+      if (Parallel::is_master()) {
+        const auto& tag = get_pass_state_tag(first_state + s, N);
+        printf(
+            "PT psto batch correction: " ENERGY_FORMAT "%s\n",
+            energy_pt_psto_batch[s][0],
+            tag.c_str());
+        printf("PT psto correction (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
+        printf(" %s Ha%s\n", energy_pt_psto[s].to_string().c_str(), tag.c_str());
+        printf("PT psto total energy (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
+        printf(
+            " %s Ha%s\n",
+            (energy_pt_psto[s] + energy_pt_dtm[s]).to_string().c_str(),
+            tag.c_str());
+        printf("Correlation energy (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
+        printf(
+            " %s Ha%s\n",
+            (energy_pt_psto[s] + energy_pt_dtm[s] - system.energy_hf).to_string().c_str(),
+            tag.c_str());
+      }
+    }
+
+    hc_sums.clear();
+    if (!uncert_converged && !uncert_converged_final && batch_id + 1 < n_batches &&
+        Checkpoint::is_due()) {
+      progress.n_batches = n_batches;
+      progress.batch_id = batch_id + 1;
+      progress.n_pt_dets_sum = n_pt_dets_sum;
+      progress.energy_sum.assign(energy_sum.begin(), energy_sum.end());
+      progress.energy_sq_sum.assign(energy_sq_sum.begin(), energy_sq_sum.end());
+      Checkpoint::put(checkpoint_key, progress);
+      Checkpoint::write();
+    }
+    Timer::end();  // batch
+
+    if (uncert_converged) break;
+    if (uncert_converged_final) break;
+  }
+
+  Counters::report(Util::str_printf(
+      "pt_psto%s/%#.2e/%#.2e", get_state_suffix(first_state).c_str(), eps_var, eps_pt_psto));
+  Timer::end();  // psto
+  progress.done = true;
+  progress.values.resize(N);
+  progress.uncerts.resize(N);
+  for (unsigned s = 0; s < N; s++) {
+    energy_pt[s] = energy_pt_psto[s] + energy_pt_dtm[s];
+    progress.values[s] = energy_pt[s].value;
+    progress.uncerts[s] = energy_pt[s].uncert;
+  }
+  Checkpoint::put(checkpoint_key, progress);
+  Checkpoint::write();
+  return energy_pt;
+}
+
+template <class S>
+template <size_t N>
+std::array<UncertResult, N> Solver<S>::get_energy_pt_dtm_psto(
+    const double eps_var, const unsigned first_state) {
+  eps_pt_max = Util::INF;
+
+  const auto& checkpoint_key = get_pt_checkpoint_key("dtm_psto", eps_var, first_state, N);
+  Checkpoint::PtProgress progress;
+  const bool resumed = Checkpoint::get(checkpoint_key, progress);
+  std::array<UncertResult, N> energy_pt;
+  if (resumed && progress.done) {
+    for (unsigned s = 0; s < N; s++) {
+      energy_pt[s] = UncertResult(progress.values[s], progress.uncerts[s]);
+    }
+    return energy_pt;
+  }
+
+  Timer::start(Util::str_printf(
+      "dtm %#.2e + psto %#.2e (%s)",
+      eps_pt_dtm,
+      eps_pt_psto,
+      get_states_label(first_state, N).c_str()));
+  Counters::reset();
+  size_t n_batches = Config::get<size_t>("n_batches_pt_psto", 0);
+  size_t n_batches_dtm = Config::get<size_t>("n_batches_pt_dtm", 0);
+  if (resumed) {
+    n_batches = progress.n_batches;
+    n_batches_dtm = progress.n_batches_dtm;
+  }
+  // The sums of each state, then those of the terms above eps_pt_dtm, then the parent.
+  fgpl::DistHashMap<Det, MathVector<double, 2 * N + 1>, DetHasher> hc_sums;
+  const size_t bytes_per_entry = bytes_per_det + 8 * (2 * N + 1);
+
+  // Estimate best n batches, the psto ones as for the psto alone and the dtm ones for the
+  // entries of the fused map.
+  if (n_batches == 0) {
+    const size_t n_pt_dets = estimate_n_pt_dets<N>(first_state, eps_pt_psto);
+    const double mem_usage = Config::get<double>("pt_psto_mem_usage", 1.0);
+    // 128 batches during estimation. 1 out of 100 var dets used.
+    const double mem_per_pt_det = memory_planner.get_hash_entry_bytes(bytes_per_entry);
+    n_batches = static_cast<size_t>(
+        ceil(128 * 100 * n_pt_dets * mem_per_pt_det / (pt_mem_avail * mem_usage)));
+    if (n_batches < 16) n_batches = 16;
+    size_t n_batches_node = n_batches;
+    fgpl::broadcast(n_batches);
+    if (n_batches_node > n_batches) {
+      printf("Warning: there may be insufficient memory on node id %d.\n", Parallel::get_proc_id());
+    }
+    if (Parallel::is_master()) {
+      printf("Number of psto batches: %zu\n", n_batches);
+    }
+    Timer::checkpoint("determine number of psto batches");
+  }
+  if (n_batches_dtm == 0) {
+    const size_t n_pt_dets = estimate_n_pt_dets<N>(first_state, eps_pt_dtm);
+    const double mem_per_pt_det = memory_planner.get_hash_entry_bytes(bytes_per_entry);
+    n_batches_dtm =
+        static_cast<size_t>(ceil(128 * 100 * n_pt_dets * mem_per_pt_det / pt_mem_avail));
+    if (n_batches_dtm == 0) n_batches_dtm = 1;
+    size_t n_batches_dtm_node = n_batches_dtm;
+    fgpl::broadcast(n_batches_dtm);
+    if (n_batches_dtm_node > n_batches_dtm) {
+      printf("Warning: there may be insufficient memory on node id %d.\n", Parallel::get_proc_id());
+    }
+    if (Parallel::is_master()) {
+      printf("Number of dtm batches: %zu\n", n_batches_dtm);
+    }
+    Timer::checkpoint("determine number of dtm batches");
+  }
+  // A dtm batch takes this many psto batches, so that it holds at most 1 / n_batches_dtm of the
+  // dtm dets.
+  const size_t n_psto_batches_per_dtm = std::max<size_t>(n_batches / n_batches_dtm, 1);
+
+  std::array<double, N> energy_dtm_sum;
+  std::array<double, N> energy_sum;
+  std::array<double, N> energy_sq_sum;
+  energy_dtm_sum.fill(0.0);
+  energy_sum.fill(0.0);
+  energy_sq_sum.fill(0.0);
+  size_t n_pt_dets_sum = 0;
+  std::array<UncertResult, N> energy_pt_psto;
+  bool psto_converged = false;
+
+  size_t batch_id = 0;
+  if (resumed) {
+    const auto& dtm_sum = progress.energy_dtm_sum;
+    std::copy(dtm_sum.begin(), dtm_sum.end(), energy_dtm_sum.begin());
+    std::copy(progress.energy_sum.begin(), progress.energy_sum.end(), energy_sum.begin());
+    std::copy(progress.energy_sq_sum.begin(), progress.energy_sq_sum.end(), energy_sq_sum.begin());
+    for (unsigned s = 0; s < N; s++) {
+      energy_pt_psto[s] = UncertResult(progress.values[s], progress.uncerts[s]);
+    }
+    n_pt_dets_sum = progress.n_pt_dets_sum;
+    psto_converged = progress.psto_converged;
+    batch_id = progress.batch_id;
+  }
+  const auto& var_dets_ranges = get_pt_var_dets_ranges<N>(first_state, eps_pt_psto);
+  std::vector<ExcitationBatch> excitation_batches(Parallel::get_n_threads());
+  while (batch_id < n_batches) {
+    // After the psto converges, the rest of the batches only contribute to the dtm.
+    const size_t batch_end =
+        psto_converged ? std::min(batch_id + n_psto_batches_per_dtm, n_batches) : batch_id + 1;
+    const double eps = psto_converged ? eps_pt_dtm : eps_pt_psto;
+    if (batch_end == batch_id + 1) {
+      Timer::start(Util::str_printf("#%zu/%zu", batch_id + 1, n_batches));
     } else {
-      const double energy_avg = energy_sum / n_pt_dets_sum;
-      const double sample_stdev = sqrt(energy_sq_sum / n_pt_dets_sum - energy_avg * energy_avg);
-      const double mean_stdev = sample_stdev / sqrt(n_pt_dets_sum);
-      energy_pt_psto.uncert =
-          mean_stdev * n_pt_dets_sum / (batch_id + 1) * (n_batches - batch_id - 1);
-      // energy_pt_psto.uncert = sample_stdev * sqrt(n_pt_dets_sum) / (batch_id + 1) * n_batches;
+      Timer::start(Util::str_printf("#%zu-%zu/%zu dtm", batch_id + 1, batch_end, n_batches));
     }
+    const size_t mem_avail_begin = Util::get_mem_avail();
+    const size_t n_var_marks = mark_var_dets(hc_sums, n_batches, batch_id, batch_end);
 
+    double busy_time = 0.0;
+    for (size_t j = 0; j < 5; j++) {
+      busy_time += var_dets_ranges[j].for_each([&](const size_t i) {
+        const Det& det = get_var_det(i);
+        double max_abs_coef;
+        const auto& coefs = get_pass_coefs<N>(i, first_state, max_abs_coef);
+        const auto& pt_batch_handler = [&](ExcitationBatch& batch) {
+          for_each_pt_excitation(
+              batch, n_batches, batch_id, batch_end, [&](const size_t k, const size_t) {
+                const Det& det_a = batch.dets[k];
+                const double h_ai = system.get_hamiltonian_elem(det, det_a, batch.n_excites[k]);
+                std::array<double, N> hcs;
+                // Filter out small single excitation.
+                if (!get_screened_hcs<N>(h_ai, coefs, eps, batch.n_excites[k], hcs)) return;
+                MathVector<double, 2 * N + 1> contrib;
+                for (unsigned s = 0; s < N; s++) {
+                  contrib[s] = hcs[s];
+                  if (std::abs(hcs[s]) >= eps_pt_dtm) contrib[N + s] = hcs[s];
+                }
+                contrib[2 * N] = i;
+                Counters::add(Counters::HC_SUMS_INSERTS, 1);
+                hc_sums.async_set(det_a, contrib, reduce_hc_sums<2 * N + 1>);
+              });
+        };
+        static_cast<void>(system.find_connected_dets_batched(
+            det,
+            eps_pt_max / max_abs_coef,
+            eps / max_abs_coef,
+            excitation_batches[omp_get_thread_num()],
+            pt_batch_handler));
+      });
+      hc_sums.sync(reduce_hc_sums<2 * N + 1>);
+      if (Parallel::is_master()) printf("%zu%% ", (j + 1) * 20);
+    }
+    const double imbalance = CostRange::get_imbalance(busy_time);
+    const size_t n_pt_dets = hc_sums.get_n_keys() - n_var_marks;
     if (Parallel::is_master()) {
-      printf("PT psto batch correction: " ENERGY_FORMAT "\n", energy_pt_psto_batch[0]);
-      printf("PT psto correction (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
-      printf(" %s Ha\n", energy_pt_psto.to_string().c_str());
-      printf("PT psto total energy (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
-      printf(" %s Ha\n", (energy_pt_psto + energy_pt_dtm).to_string().c_str());
-      printf("Correlation energy (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
-      printf(" %s Ha\n", (energy_pt_psto + energy_pt_dtm - system.energy_hf).to_string().c_str());
+      printf("\nNumber of %s pt dets: %'zu\n", psto_converged ? "dtm" : "psto", n_pt_dets);
+      printf("Load imbalance (max / avg proc time): %.2f\n", imbalance);
+    }
+    measure_hc_sums_memory(mem_avail_begin, hc_sums.get_n_keys(), bytes_per_entry);
+    Timer::checkpoint("create hc sums");
+
+    // The dtm terms of each state, then the psto ones, which are zero at eps_pt_dtm.
+    const auto& energy_pt_batch = mapreduce_sum<2 * N, MathVector<double, 2 * N + 1>>(
+        hc_sums, [&](const Det& det_a, const MathVector<double, 2 * N + 1>& hc_sum) {
+          const double H_aa = get_pt_diag(det_a, hc_sum[2 * N]);
+          std::array<double, 2 * N> contribs;
+          for (unsigned s = 0; s < N; s++) {
+            const double hc_sum_sq_dtm = hc_sum[N + s] * hc_sum[N + s];
+            const double energy_gap = system.energy_var[first_state + s] - H_aa;
+            contribs[s] = hc_sum_sq_dtm / energy_gap;
+            contribs[N + s] = (hc_sum[s] * hc_sum[s] - hc_sum_sq_dtm) / energy_gap;
+          }
+          return contribs;
+        });
+    for (unsigned s = 0; s < N; s++) energy_dtm_sum[s] += energy_pt_batch[s][0];
+
+    if (!psto_converged) {
+      n_pt_dets_sum += n_pt_dets;
+      bool uncert_converged = true;
+      bool uncert_converged_final = eps_pt_psto <= eps_pt;
+      for (unsigned s = 0; s < N; s++) {
+        energy_sum[s] += energy_pt_batch[N + s][0];
+        energy_sq_sum[s] += energy_pt_batch[N + s][1];
+        energy_pt_psto[s].value = energy_sum[s] / (batch_id + 1) * n_batches;
+        if (batch_id == n_batches - 1) {
+          energy_pt_psto[s].uncert = 0.0;
+        } else {
+          const double energy_avg = energy_sum[s] / n_pt_dets_sum;
+          const double sample_stdev =
+              sqrt(energy_sq_sum[s] / n_pt_dets_sum - energy_avg * energy_avg);
+          const double mean_stdev = sample_stdev / sqrt(n_pt_dets_sum);
+          energy_pt_psto[s].uncert =
+              mean_stdev * n_pt_dets_sum / (batch_id + 1) * (n_batches - batch_id - 1);
+        }
+        if (!(energy_pt_psto[s].uncert <= target_error * 0.5)) uncert_converged = false;
+        if (!(energy_pt_psto[s].uncert <= target_error)) uncert_converged_final = false;
+
+        if (Parallel::is_master()) {
+          const auto& tag = get_pass_state_tag(first_state + s, N);
+          printf(
+              "PT psto batch correction: " ENERGY_FORMAT "%s\n",
+              energy_pt_batch[N + s][0],
+              tag.c_str());
+          printf("PT psto correction (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
+          printf(" %s Ha%s\n", energy_pt_psto[s].to_string().c_str(), tag.c_str());
+        }
+      }
+      psto_converged = uncert_converged || uncert_converged_final;
+    }
+    if (Parallel::is_master()) {
+      for (unsigned s = 0; s < N; s++) {
+        printf(
+            "PT dtm batch correction: " ENERGY_FORMAT "%s\n",
+            energy_pt_batch[s][0],
+            get_pass_state_tag(first_state + s, N).c_str());
+      }
     }
 
     hc_sums.clear();
+    if (batch_end < n_batches && Checkpoint::is_due()) {
+      progress.n_batches = n_batches;
+      progress.n_batches_dtm = n_batches_dtm;
+      progress.batch_id = batch_end;
+      progress.n_pt_dets_sum = n_pt_dets_sum;
+      progress.psto_converged = psto_converged;
+      progress.energy_dtm_sum.assign(energy_dtm_sum.begin(), energy_dtm_sum.end());
+      progress.energy_sum.assign(energy_sum.begin(), energy_sum.end());
+      progress.energy_sq_sum.assign(energy_sq_sum.begin(), energy_sq_sum.end());
+      progress.values.resize(N);
+      progress.uncerts.resize(N);
+      for (unsigned s = 0; s < N; s++) {
+        progress.values[s] = energy_pt_psto[s].value;
+        progress.uncerts[s] = energy_pt_psto[s].uncert;
+      }
+      Checkpoint::put(checkpoint_key, progress);
+      Checkpoint::write();
+    }
     Timer::end();  // batch
-
-    if (energy_pt_psto.uncert <= target_error * 0.5) break;
-    if (eps_pt_psto <= eps_pt && energy_pt_psto.uncert <= target_error) break;
+    batch_id = batch_end;
   }
 
-  Timer::end();  // psto
-  return energy_pt_psto + energy_pt_dtm;
+  hc_sums.clear_and_shrink();
+  Counters::report(Util::str_printf(
+      "pt_dtm_psto%s/%#.2e/%#.2e", get_state_suffix(first_state).c_str(), eps_var, eps_pt_psto));
+  Timer::end();  // dtm + psto
+  progress.values.resize(N);
+  progress.uncerts.resize(N);
+  for (unsigned s = 0; s < N; s++) {
+    const unsigned i_state = first_state + s;
+    const double energy_pt_dtm = energy_dtm_sum[s] + system.energy_var[i_state];
+    energy_pt[s] = energy_pt_psto[s] + energy_pt_dtm;
+    if (Parallel::is_master()) {
+      const auto& tag = get_pass_state_tag(i_state, N);
+      printf("PT dtm correction (eps1= %.2e, eps_pt_dtm= %.2e):", eps_var, eps_pt_dtm);
+      printf(" " ENERGY_FORMAT "%s\n", energy_dtm_sum[s], tag.c_str());
+      printf("PT dtm total energy (eps1= %.2e, eps_pt_dtm= %.2e):", eps_var, eps_pt_dtm);
+      printf(" " ENERGY_FORMAT "%s\n", energy_pt_dtm, tag.c_str());
+      printf("PT psto total energy (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
+      printf(" %s Ha%s\n", energy_pt[s].to_string().c_str(), tag.c_str());
+      printf("Correlation energy (eps1= %.2e, eps_pt_psto= %.2e):", eps_var, eps_pt_psto);
+      printf(" %s Ha%s\n", (energy_pt[s] - system.energy_hf).to_string().c_str(), tag.c_str());
+    }
+    progress.values[s] = energy_pt[s].value;
+    progress.uncerts[s] = energy_pt[s].uncert;
+  }
+  progress.done = true;
+  Checkpoint::put(checkpoint_key, progress);
+  Checkpoint::write();
+  return energy_pt;
 }
 
 template <class S>
-UncertResult Solver<S>::get_energy_pt_sto(
-    const double eps_var, const unsigned i_state, const UncertResult& energy_pt_psto) {
+template <size_t N>
+std::array<UncertResult, N> Solver<S>::get_energy_pt_sto(
+    const double eps_var,
+    const unsigned first_state,
+    const std::array<UncertResult, N>& energy_pt_psto) {
   if (eps_pt >= eps_pt_psto) return energy_pt_psto;
 
+  const auto& checkpoint_key = get_pt_checkpoint_key("sto", eps_var, first_state, N);
+  Checkpoint::PtProgress progress;
+  const bool resumed = Checkpoint::get(checkpoint_key, progress);
+  std::array<UncertResult, N> energy_pt;
+  if (resumed && progress.done) {
+    for (unsigned s = 0; s < N; s++) {
+      energy_pt[s] = UncertResult(progress.values[s], progress.uncerts[s]);
+    }
+    return energy_pt;
+  }
+
   const size_t max_pt_iterations = Config::get<size_t>("max_pt_iterations", 100);
-  fgpl::DistHashMap<Det, MathVector<double, 5>, DetHasher> hc_sums;
-  const size_t bytes_per_entry = bytes_per_det + 40;
-  const size_t n_var_dets = system.get_n_dets();
+  // Five sums of each state, then the parent.
+  fgpl::DistHashMap<Det, MathVector<double, 5 * N + 1>, DetHasher> hc_sums;
+  const size_t bytes_per_entry = bytes_per_det + 8 * (5 * N + 1);
+  const size_t n_var_dets = n_var_dets_global;
   size_t n_batches = Config::get<size_t>("n_batches_pt_sto", 0);
   if (n_batches == 0) n_batches = 64;
   size_t n_dets_in_sample = Config::get<size_t>("n_dets_in_sample_pt_sto", 0);
@@ -881,62 +1996,83 @@ UncertResult Solver<S>::get_energy_pt_sto(
   size_t iteration = 0;
   const DetHasher det_hasher;
 
-  UncertResult energy_pt_sto;
-  std::vector<double> energy_pt_sto_loops;
+  std::array<UncertResult, N> energy_pt_sto;
+  std::array<std::vector<double>, N> energy_pt_sto_loops;
+  // The draws only depend on the seed and the iteration, so the loops resume where they stopped.
+  if (resumed) {
+    iteration = progress.batch_id;
+    std::copy(progress.loops.begin(), progress.loops.end(), energy_pt_sto_loops.begin());
+  }
 
-  // Contruct probs.
-  double sum_weights = 0.0;
-  for (size_t i = 0; i < n_var_dets; i++) {
-    sum_weights += std::abs(system.coefs[i_state][i]);
+  // Contruct probs, shared by the states of the pass. In the sharded PT, from the coefs of all
+  // the procs.
+  const size_t n_procs = pt_sharded ? Parallel::get_n_procs() : 1;
+  const size_t proc_id = pt_sharded ? Parallel::get_proc_id() : 0;
+  for (size_t i_local = 0; i_local < get_n_var_dets(); i_local++) {
+    const size_t i = i_local * n_procs + proc_id;
+    for (unsigned s = 0; s < N; s++) probs[i] += std::abs(system.coefs[first_state + s][i_local]);
   }
+  if (pt_sharded) {
+    MPI_Allreduce(MPI_IN_PLACE, probs.data(), n_var_dets, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  }
+  double sum_weights = 0.0;
+  for (size_t i = 0; i < n_var_dets; i++) sum_weights += probs[i];
   std::vector<double> cum_probs(n_var_dets);  // For sampling.
   for (size_t i = 0; i < n_var_dets; i++) {
-    probs[i] = std::abs(system.coefs[i_state][i]) / sum_weights;
+    probs[i] /= sum_weights;
     if (i > 0)
       cum_probs[i] = probs[i] + cum_probs[i - 1];
     else
       cum_probs[i] = probs[i];
   }
 
-  Timer::start(Util::str_printf("sto %#.2e (state %d)", eps_pt, i_state));
+  Timer::start(
+      Util::str_printf("sto %#.2e (%s)", eps_pt, get_states_label(first_state, N).c_str()));
+  Counters::reset();
 
   //const unsigned random_seed = Config::get<unsigned>("random_seed", time(nullptr));
   const unsigned random_seed = Config::get<unsigned>("random_seed", 347634253);
   if (Parallel::is_master()) printf("\nrandom_seed= %d\n", random_seed);
-  std::default_random_engine generator(random_seed);
-  std::uniform_real_distribution<double> unif_real_distr(0., 1.);
+  // Each draw is addressed by its index, the iteration and the stream, so every proc and thread
+  // gets the same numbers without sharing a generator.
+  const Philox philox(random_seed);
+  enum Stream : uint32_t { ESTIMATE_STREAM, SAMPLE_STREAM, BATCH_STREAM };
+  const auto& get_uniforms = [&](const size_t index, const size_t iteration, const Stream stream) {
+    return philox.get_uniforms({{static_cast<uint32_t>(index),
+                                 static_cast<uint32_t>(index >> 32),
+                                 static_cast<uint32_t>(iteration),
+                                 stream}});
+  };
 
   // Estimate best n_dets_in_sample.
   if (n_dets_in_sample == 0) {
     for (size_t i = 0; i < 1000; i++) {
-      const double rand_01 = unif_real_distr(generator);
+      const double rand_01 = get_uniforms(i, 0, ESTIMATE_STREAM)[0];
       const size_t sample_det_id =
           std::lower_bound(cum_probs.begin(), cum_probs.end(), rand_01) - cum_probs.begin();
       if (sample_dets_sto.count(sample_det_id) == 0) sample_dets_list.push_back(sample_det_id);
       sample_dets_sto[sample_det_id]++;
     }
-    fgpl::broadcast(sample_dets_sto);
-    fgpl::broadcast(sample_dets_list);
     size_t n_unique_dets_in_sample = sample_dets_list.size();
-    fgpl::DistRange<size_t>(0, n_unique_dets_in_sample).for_each([&](const size_t sample_id) {
-      const size_t i = sample_dets_list[sample_id];
-      const Det& det = system.dets[i];
-      const double coef = system.coefs[0][i];
+    for_each_sampled_var_det(sample_dets_list, 0, 1, [&](size_t, size_t, const size_t i_local) {
+      const Det& det = get_var_det(i_local);
+      double max_abs_coef;
+      static_cast<void>(get_pass_coefs<N>(i_local, first_state, max_abs_coef));
       const auto& pt_det_handler = [&](const Det& det_a, const int n_excite) {
-        if (var_dets.has(det_a)) return;
+        if (var_dets_filter.may_have(det_a) && has_var_det(det_a)) return;
         const size_t det_a_hash = det_hasher(det_a);
         const size_t batch_hash = Util::rehash(det_a_hash);
         if ((batch_hash & 127) != 0) return;  // For n a power of 2, "% n" = "& (n-1)"
         if (n_excite == 1) {
           const double h_ai = system.get_hamiltonian_elem(det, det_a, n_excite);
-          const double hc = h_ai * coef;
+          const double hc = h_ai * max_abs_coef;
           if (std::abs(hc) < eps_pt) return;  // Filter out small single excitation.
         }
-        MathVector<double, 5> contrib;
+        MathVector<double, 5 * N + 1> contrib;
         hc_sums.async_set(det_a, contrib);
       };
       static_cast<void>(system.find_connected_dets(
-          det, eps_pt_max / std::abs(coef), eps_pt / std::abs(coef), pt_det_handler));
+          det, eps_pt_max / max_abs_coef, eps_pt / max_abs_coef, pt_det_handler));
     });
     hc_sums.sync();
     const size_t n_pt_dets = hc_sums.get_n_keys();
@@ -956,7 +2092,7 @@ UncertResult Solver<S>::get_energy_pt_sto(
     n_unique_dets_in_sample = 0;
     while (n_unique_dets_in_sample < n_unique_target) {
       //const double rand_01 = (static_cast<double>(rand()) / (RAND_MAX));
-      const double rand_01 = unif_real_distr(generator);
+      const double rand_01 = get_uniforms(n_dets_in_sample, 1, ESTIMATE_STREAM)[0];
       const int sample_det_id =
           std::lower_bound(cum_probs.begin(), cum_probs.end(), rand_01) - cum_probs.begin();
       if (sample_dets_sto.count(sample_det_id) == 0) {
@@ -966,7 +2102,6 @@ UncertResult Solver<S>::get_energy_pt_sto(
       sample_dets_sto[sample_det_id]++;
     }
     sample_dets_sto.clear();
-    fgpl::broadcast(n_dets_in_sample);
     if (Parallel::is_master()) {
       printf("Number of dets chosen: %'zu\n", n_dets_in_sample);
     }
@@ -1003,44 +2138,59 @@ UncertResult Solver<S>::get_energy_pt_sto(
   std::vector<size_t> aliases;
   Util::setup_alias_arrays(probs, alias_probs, aliases);
 
-  std::uniform_int_distribution<size_t> unif_int_distr_n_var_dets(0, n_var_dets - 1);
-  std::uniform_int_distribution<size_t> unif_int_distr_n_batches(0, n_batches - 1);
+  const size_t n_threads = Parallel::get_n_threads();
+  const size_t n_sto_samples = n_dets_in_sample - n_dtm_dets;
+  const size_t min_pt_iterations = Config::get<size_t>("min_pt_iterations", 6);
+  const auto& loop_start_time = std::chrono::high_resolution_clock::now();
 
   while (iteration < max_pt_iterations) {
     Timer::start(Util::str_printf("#%zu", iteration + 1));
 
-    // Generate random sample
-    for (size_t i = 0; i < n_dets_in_sample - n_dtm_dets; i++) {
-      const size_t rand_01 = unif_int_distr_n_var_dets(generator);  // rand int in [0, n_var_dets - 1]
-      const double rand_02 = unif_real_distr(generator);  // rand real in [0., 1.)
-      size_t sample_det_id;
-      if (rand_02 < alias_probs[rand_01])
-        sample_det_id = rand_01;
-      else
-        sample_det_id = aliases[rand_01];
-
-      if (sample_dets_sto.count(sample_det_id) == 0) sample_dets_list.push_back(sample_det_id);
-      sample_dets_sto[sample_det_id]++;
+    // Generate random sample, each thread a part of it.
+    std::vector<std::unordered_map<size_t, unsigned>> thread_sample_dets(n_threads);
+#pragma omp parallel
+    {
+      auto& thread_sample_dets_sto = thread_sample_dets[omp_get_thread_num()];
+#pragma omp for schedule(static)
+      for (size_t i = 0; i < n_sto_samples; i++) {
+        const auto& rands = get_uniforms(i, iteration, SAMPLE_STREAM);
+        // rand int in [0, n_var_dets - 1]
+        const size_t rand_01 = std::min(static_cast<size_t>(rands[0] * n_var_dets), n_var_dets - 1);
+        const double rand_02 = rands[1];  // rand real in [0., 1.)
+        size_t sample_det_id;
+        if (rand_02 < alias_probs[rand_01])
+          sample_det_id = rand_01;
+        else
+          sample_det_id = aliases[rand_01];
+        thread_sample_dets_sto[sample_det_id]++;
+      }
+    }
+    for (const auto& thread_sample_dets_sto : thread_sample_dets) {
+      for (const auto& kv : thread_sample_dets_sto) sample_dets_sto[kv.first] += kv.second;
     }
-    fgpl::broadcast(sample_dets_sto);
-    fgpl::broadcast(sample_dets_list);
+    // Sorted so that the list does not depend on the number of threads.
+    const size_t n_listed_dtm_dets = sample_dets_list.size();
+    for (const auto& kv : sample_dets_sto) sample_dets_list.push_back(kv.first);
+    std::sort(sample_dets_list.begin() + n_listed_dtm_dets, sample_dets_list.end());
     if (Parallel::is_master()) {
       printf(
           "Number of unique variational determinants in sample: %'zu\n", sample_dets_list.size());
     }
 
     // Select random batch.
-    size_t batch_id = unif_int_distr_n_batches(generator);
-    fgpl::broadcast(batch_id);
-    const size_t n_unique_dets_in_sample = sample_dets_list.size();
+    const size_t batch_id = std::min(
+        static_cast<size_t>(get_uniforms(0, iteration, BATCH_STREAM)[0] * n_batches),
+        n_batches - 1);
     if (Parallel::is_master()) printf("Batch id: %zu / %zu\n", batch_id, n_batches);
 
     const double factor = 1. / (n_dets_in_sample - n_dtm_dets - 1.);
+    const size_t n_var_marks = mark_var_dets(hc_sums, n_batches, batch_id, batch_id + 1);
     for (size_t j = 0; j < 5; j++) {
-      fgpl::DistRange<size_t>(j, n_unique_dets_in_sample, 5).for_each([&](const size_t sample_id) {
-        const size_t i = sample_dets_list[sample_id];
-        const Det& det = system.dets[i];
-        const double coef = system.coefs[i_state][i];
+      const auto& sample_handler = [&](
+          const size_t sample_id, const size_t i, const size_t i_local) {
+        const Det& det = get_var_det(i_local);
+        double max_abs_coef;
+        const auto& coefs = get_pass_coefs<N>(i_local, first_state, max_abs_coef);
         const bool is_dtm_det = sample_id < n_dtm_dets;
         const double count = is_dtm_det ? 1. : static_cast<double>(sample_dets_sto[i]);  // w_i
         const double weight =
@@ -1049,95 +2199,259 @@ UncertResult Solver<S>::get_energy_pt_sto(
           const size_t det_a_hash = det_hasher(det_a);
           const size_t batch_hash = Util::rehash(det_a_hash);
           if (batch_hash % n_batches != batch_id) return;
-          if (var_dets.has(det_a)) return;
+          if (var_dets_filter.may_have(det_a) && has_var_det(det_a)) {
+            Counters::add(Counters::VAR_DET_HITS, 1);
+            return;
+          }
           const double h_ai = system.get_hamiltonian_elem(det, det_a, n_excite);
-          const double hc = h_ai * coef;
-          if (std::abs(hc) < eps_pt) return;  // Filter out small single excitation.
-
-          MathVector<double, 5> contrib;
-          contrib[0] = count * hc / weight;
-          if (std::abs(hc) > eps_pt_psto) contrib[1] = contrib[0];
-          if (!is_dtm_det) {
-            contrib[2] = count * hc / weight * sqrt(factor);
-            if (std::abs(hc) > eps_pt_psto)
-              contrib[3] = contrib[2];
-            else
-              contrib[4] = pow(count * hc / weight, 2) * (1. - weight / count + factor);
+          std::array<double, N> hcs;
+          // Filter out small single excitation.
+          if (!get_screened_hcs<N>(h_ai, coefs, eps_pt, n_excite, hcs)) return;
+
+          MathVector<double, 5 * N + 1> contrib;
+          for (unsigned s = 0; s < N; s++) {
+            const double hc = hcs[s];
+            if (hc == 0.0) continue;
+            const unsigned k = 5 * s;
+            contrib[k] = count * hc / weight;
+            if (std::abs(hc) > eps_pt_psto) contrib[k + 1] = contrib[k];
+            if (!is_dtm_det) {
+              contrib[k + 2] = count * hc / weight * sqrt(factor);
+              if (std::abs(hc) > eps_pt_psto)
+                contrib[k + 3] = contrib[k + 2];
+              else
+                contrib[k + 4] = pow(count * hc / weight, 2) * (1. - weight / count + factor);
+            }
           }
-          hc_sums.async_set(det_a, contrib, fgpl::Reducer<MathVector<double, 5>>::sum);
+          contrib[5 * N] = i;
+          Counters::add(Counters::HC_SUMS_INSERTS, 1);
+          hc_sums.async_set(det_a, contrib, reduce_hc_sums<5 * N + 1>);
         };
         static_cast<void>(system.find_connected_dets(
-            det, eps_pt_max / std::abs(coef), eps_pt / std::abs(coef), pt_det_handler));
-      });
-      hc_sums.sync(fgpl::Reducer<MathVector<double, 5>>::sum);
+            det, eps_pt_max / max_abs_coef, eps_pt / max_abs_coef, pt_det_handler));
+      };
+      for_each_sampled_var_det(sample_dets_list, j, 5, sample_handler);
+      hc_sums.sync(reduce_hc_sums<5 * N + 1>);
       if (Parallel::is_master()) printf("%zu%% ", (j + 1) * 20);
     }
-    const size_t n_pt_dets = hc_sums.get_n_keys();
+    const size_t n_pt_dets = hc_sums.get_n_keys() - n_var_marks;
     if (Parallel::is_master()) printf("\nNumber of sto pt dets: %'zu\n", n_pt_dets);
     sample_dets_sto.clear();
     sample_dets_list.resize(n_dtm_dets);
     Timer::checkpoint("create hc sums");
 
-    const double energy_pt_sto_loop = mapreduce_sum<MathVector<double, 5>>(
-        hc_sums, [&](const Det& det_a, const MathVector<double, 5>& hc_sum) {
-          const double h_aa = system.get_hamiltonian_elem(det_a, det_a, 0);
-          const double factor = static_cast<double>(n_batches) / (system.energy_var[i_state] - h_aa);
-          return (pow(hc_sum[0], 2) - pow(hc_sum[1], 2) + pow(hc_sum[2], 2) - pow(hc_sum[3], 2) -
-                  hc_sum[4]) *
-                 factor;
-        })[0];
-
-    energy_pt_sto_loops.push_back(energy_pt_sto_loop);
-    energy_pt_sto.value = Util::avg(energy_pt_sto_loops);
-    energy_pt_sto.uncert = Util::stdev(energy_pt_sto_loops) / sqrt(iteration + 1.0);
-    if (Parallel::is_master()) {
-      printf("PT sto loop correction: " ENERGY_FORMAT "\n", energy_pt_sto_loop);
-      printf("PT sto correction (eps1= %.2e, eps_pt= %.2e):", eps_var, eps_pt);
-      printf(" %s Ha\n", energy_pt_sto.to_string().c_str());
-      printf("PT sto total energy (eps1= %.2e, eps_pt= %.2e):", eps_var, eps_pt);
-      printf(" %s Ha\n", (energy_pt_sto + energy_pt_psto).to_string().c_str());
-      printf("Correlation energy (eps1= %.2e, eps_pt= %.2e):", eps_var, eps_pt);
-      printf(" %s Ha\n", (energy_pt_sto + energy_pt_psto - system.energy_hf).to_string().c_str());
+    const auto& energy_pt_sto_loop = mapreduce_sum<N, MathVector<double, 5 * N + 1>>(
+        hc_sums, [&](const Det& det_a, const MathVector<double, 5 * N + 1>& hc_sum) {
+          const double h_aa = get_pt_diag(det_a, hc_sum[5 * N]);
+          std::array<double, N> contribs;
+          for (unsigned s = 0; s < N; s++) {
+            const unsigned k = 5 * s;
+            const double factor =
+                static_cast<double>(n_batches) / (system.energy_var[first_state + s] - h_aa);
+            contribs[s] = (pow(hc_sum[k], 2) - pow(hc_sum[k + 1], 2) + pow(hc_sum[k + 2], 2) -
+                           pow(hc_sum[k + 3], 2) - hc_sum[k + 4]) *
+                          factor;
+          }
+          return contribs;
+        });
+
+    // Stop as soon as the stochastic or the total uncertainty of every state is small enough.
+    bool uncert_converged = iteration + 1 >= min_pt_iterations;
+    bool uncert_converged_total = iteration + 1 >= min_pt_iterations;
+    double n_iterations_target = min_pt_iterations;
+    for (unsigned s = 0; s < N; s++) {
+      energy_pt_sto_loops[s].push_back(energy_pt_sto_loop[s][0]);
+      energy_pt_sto[s].value = Util::avg(energy_pt_sto_loops[s]);
+      energy_pt_sto[s].uncert = Util::stdev(energy_pt_sto_loops[s]) / sqrt(iteration + 1.0);
+      if (!(energy_pt_sto[s].uncert <= target_error * 0.7)) uncert_converged = false;
+      if (!((energy_pt_sto[s] + energy_pt_psto[s]).uncert <= target_error)) {
+        uncert_converged_total = false;
+      }
+      // The uncertainty decreases as one over the square root of the iterations.
+      const double psto_uncert = energy_pt_psto[s].uncert;
+      const double sto_uncert_target = std::max(
+          target_error * 0.7,
+          sqrt(std::max(0.0, target_error * target_error - psto_uncert * psto_uncert)));
+      n_iterations_target = std::max(
+          n_iterations_target,
+          (iteration + 1) * pow(energy_pt_sto[s].uncert / sto_uncert_target, 2));
+      if (Parallel::is_master()) {
+        const auto& tag = get_pass_state_tag(first_state + s, N);
+        printf(
+            "PT sto loop correction: " ENERGY_FORMAT "%s\n",
+            energy_pt_sto_loop[s][0],
+            tag.c_str());
+        printf("PT sto correction (eps1= %.2e, eps_pt= %.2e):", eps_var, eps_pt);
+        printf(" %s Ha%s\n", energy_pt_sto[s].to_string().c_str(), tag.c_str());
+        printf("PT sto total energy (eps1= %.2e, eps_pt= %.2e):", eps_var, eps_pt);
+        printf(
+            " %s Ha%s\n",
+            (energy_pt_sto[s] + energy_pt_psto[s]).to_string().c_str(),
+            tag.c_str());
+        printf("Correlation energy (eps1= %.2e, eps_pt= %.2e):", eps_var, eps_pt);
+        printf(
+            " %s Ha%s\n",
+            (energy_pt_sto[s] + energy_pt_psto[s] - system.energy_hf).to_string().c_str(),
+            tag.c_str());
+      }
+    }
+
+    if (Parallel::is_master() && iteration > 0 && !uncert_converged && !uncert_converged_total) {
+      const double time_per_iteration =
+          std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - loop_start_time)
+              .count() /
+          (iteration + 1);
+      const double n_iterations_left =
+          std::min(std::ceil(n_iterations_target), static_cast<double>(max_pt_iterations)) -
+          (iteration + 1);
+      printf(
+          "Expected time to target: %.1fs (%.0f more iterations)\n",
+          n_iterations_left * time_per_iteration,
+          n_iterations_left);
     }
 
     hc_sums.clear();
-    Timer::end();
     iteration++;
-    if (iteration >= 6 && energy_pt_sto.uncert <= target_error * 0.7) {
-      break;
-    }
-    if (iteration >= 10 && (energy_pt_sto + energy_pt_psto).uncert <= target_error) {
-      break;
+    if (!uncert_converged && !uncert_converged_total && iteration < max_pt_iterations &&
+        Checkpoint::is_due()) {
+      progress.batch_id = iteration;
+      progress.loops.assign(energy_pt_sto_loops.begin(), energy_pt_sto_loops.end());
+      Checkpoint::put(checkpoint_key, progress);
+      Checkpoint::write();
     }
+    Timer::end();
+    if (uncert_converged) break;
+    if (uncert_converged_total) break;
   }
 
   hc_sums.clear_and_shrink();
+  Counters::report(Util::str_printf(
+      "pt_sto%s/%#.2e/%#.2e", get_state_suffix(first_state).c_str(), eps_var, eps_pt));
   Timer::end();
-  return energy_pt_sto + energy_pt_psto;
+  progress.done = true;
+  progress.values.resize(N);
+  progress.uncerts.resize(N);
+  for (unsigned s = 0; s < N; s++) {
+    energy_pt[s] = energy_pt_sto[s] + energy_pt_psto[s];
+    progress.values[s] = energy_pt[s].value;
+    progress.uncerts[s] = energy_pt[s].uncert;
+  }
+  Checkpoint::put(checkpoint_key, progress);
+  Checkpoint::write();
+  return energy_pt;
+}
+
+template <class S>
+template <size_t N>
+size_t Solver<S>::estimate_n_pt_dets(const unsigned first_state, const double eps) {
+  const size_t n_var_dets = get_n_var_dets();
+  const DetHasher det_hasher;
+  fgpl::DistHashSet<Det, DetHasher> pt_dets;
+  const auto& var_det_handler = [&](const size_t i) {
+    const Det& det = get_var_det(i);
+    double max_abs_coef;
+    static_cast<void>(get_pass_coefs<N>(i, first_state, max_abs_coef));
+    const auto& pt_det_handler = [&](const Det& det_a, const int n_excite) {
+      if (var_dets_filter.may_have(det_a) && has_var_det(det_a)) return;
+      const size_t det_a_hash = det_hasher(det_a);
+      const size_t batch_hash = Util::rehash(det_a_hash);
+      if ((batch_hash & 127) != 0) return;  // For n a power of 2, "% n" = "& (n-1)"
+      if (n_excite == 1) {
+        const double h_ai = system.get_hamiltonian_elem(det, det_a, n_excite);
+        const double hc = h_ai * max_abs_coef;
+        if (std::abs(hc) < eps) return;  // Filter out small single excitation.
+      }
+      pt_dets.async_set(det_a);
+    };
+    static_cast<void>(system.find_connected_dets(
+        det, eps_pt_max / max_abs_coef, eps / max_abs_coef, pt_det_handler));
+  };
+  // In the sharded PT, the var dets of other procs may be counted, which are few in comparison.
+  if (pt_sharded) {
+#pragma omp parallel for schedule(dynamic, 5)
+    for (size_t i = 50; i < n_var_dets; i += 100) var_det_handler(i);
+  } else {
+    fgpl::DistRange<size_t>(50, n_var_dets, 100).for_each(var_det_handler);
+  }
+  pt_dets.sync();
+  return pt_dets.get_n_keys();
 }
 
 template <class S>
-template <class C>
-std::array<double, 2> Solver<S>::mapreduce_sum(
+template <size_t N, class C>
+std::array<std::array<double, 2>, N> Solver<S>::mapreduce_sum(
     const fgpl::DistHashMap<Det, C, DetHasher>& map,
-    const std::function<double(const Det& det, const C& hc_sum)>& mapper) const {
+    const std::function<std::array<double, N>(const Det& det, const C& hc_sum)>& mapper) const {
   const int n_threads = omp_get_max_threads();
-  std::vector<double> res_sq_thread(n_threads, 0.0);
-  std::vector<double> res_thread(n_threads, 0.0);
+  std::vector<std::array<double, 2 * N>> res_thread(n_threads);
+  for (auto& res : res_thread) res.fill(0.0);
   map.for_each([&](const Det& key, const size_t, const C& value) {
+    if (is_var_det_mark(value)) return;
     const int thread_id = omp_get_thread_num();
-    const double mapped = mapper(key, value);
-    res_thread[thread_id] += mapped;
-    res_sq_thread[thread_id] += mapped * mapped;
+    const auto& mapped = mapper(key, value);
+    for (unsigned s = 0; s < N; s++) {
+      res_thread[thread_id][s * 2] += mapped[s];
+      res_thread[thread_id][s * 2 + 1] += mapped[s] * mapped[s];
+    }
   });
-  std::array<double, 2> res_local = {0.0, 0.0};
-  std::array<double, 2> res = {0.0, 0.0};
+  std::array<double, 2 * N> res_local;
+  std::array<double, 2 * N> res;
+  res_local.fill(0.0);
   for (int i = 0; i < n_threads; i++) {
-    res_local[0] += res_thread[i];
-    res_local[1] += res_sq_thread[i];
+    for (unsigned k = 0; k < 2 * N; k++) res_local[k] += res_thread[i][k];
+  }
+  MPI_Allreduce(&res_local, &res, 2 * N, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  std::array<std::array<double, 2>, N> res_states;
+  for (unsigned s = 0; s < N; s++) res_states[s] = {res[s * 2], res[s * 2 + 1]};
+  return res_states;
+}
+
+template <class S>
+template <size_t M>
+size_t Solver<S>::mark_var_dets(
+    fgpl::DistHashMap<Det, MathVector<double, M>, DetHasher>& hc_sums,
+    const size_t n_batches,
+    const size_t batch_begin,
+    const size_t batch_end) const {
+  if (!pt_sharded) return 0;
+  const DetHasher det_hasher;
+  MathVector<double, M> mark;
+  mark[M - 1] = -1.0;
+  unsigned long long n_marks = 0;
+#pragma omp parallel for schedule(static, 1024) reduction(+ : n_marks)
+  for (size_t i = 0; i < get_n_var_dets(); i++) {
+    const Det& det = get_var_det(i);
+    const size_t det_batch_id = Util::rehash(det_hasher(det)) % n_batches;
+    if (det_batch_id < batch_begin || det_batch_id >= batch_end) continue;
+    hc_sums.async_set(det, mark, reduce_hc_sums<M>);
+    n_marks++;
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &n_marks, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  return n_marks;
+}
+
+template <class S>
+template <class Handler>
+void Solver<S>::for_each_sampled_var_det(
+    const std::vector<size_t>& sample_dets,
+    const size_t start,
+    const size_t step,
+    const Handler& handler) const {
+  const size_t n_samples = sample_dets.size();
+  if (!pt_sharded) {
+    fgpl::DistRange<size_t>(start, n_samples, step).for_each([&](const size_t sample_id) {
+      const size_t i = sample_dets[sample_id];
+      handler(sample_id, i, i);
+    });
+    return;
+  }
+  const size_t n_procs = Parallel::get_n_procs();
+  const size_t proc_id = Parallel::get_proc_id();
+#pragma omp parallel for schedule(dynamic, 5)
+  for (size_t sample_id = start; sample_id < n_samples; sample_id += step) {
+    const size_t i = sample_dets[sample_id];
+    if (i % n_procs == proc_id) handler(sample_id, i, i / n_procs);
   }
-  MPI_Allreduce(&res_local, &res, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-  return res;
 }
 
 template <class S>
@@ -1146,27 +2460,11 @@ bool Solver<S>::load_variation_result(const std::string& filename) {
     printf("Try Loading Wavefunction %s\n", filename.c_str());
     fflush(stdout);
   }
-  std::string serialized;
-  const int TRUNK_SIZE = 1 << 20;
-  char buffer[TRUNK_SIZE];
-  MPI_File file;
-  int error;
-  error = MPI_File_open(
-      MPI_COMM_WORLD, filename.c_str(), MPI_MODE_RDONLY | MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
-  if (error) return false;
-  MPI_Offset size;
-  MPI_File_get_size(file, &size);
-  MPI_Status status;
-  while (size > TRUNK_SIZE) {
-    // Parallel File loading and tree distribution.
-    MPI_File_read_all(file, buffer, TRUNK_SIZE, MPI_CHAR, &status);
-    serialized.append(buffer, TRUNK_SIZE);
-    size -= TRUNK_SIZE;
-  }
-  MPI_File_read_all(file, buffer, size, MPI_CHAR, &status);
-  serialized.append(buffer, size);
-  MPI_File_close(&file);
-  hps::from_string(serialized, system);
+  // The sharded files are recognized by their magic word, the others are read whole.
+  const double coef_min = Config::get<double>("wf_load_coef_min", 0.0);
+  if (!WfFile::load(system, filename, coef_min) && !WfFile::load_hps(system, filename)) {
+    return false;
+  }
   if (Parallel::is_master()) {
     printf("Loaded %'zu dets from: %s\n", system.get_n_dets(), filename.c_str());
     print_dets_info();
@@ -1180,11 +2478,17 @@ bool Solver<S>::load_variation_result(const std::string& filename) {
 
 template <class S>
 void Solver<S>::save_variation_result(const std::string& filename) {
-  if (Parallel::is_master()) {
-    std::ofstream file(filename, std::ofstream::binary);
-    hps::to_stream(system, file);
-    printf("Variational results saved to: %s\n", filename.c_str());
+  const auto& wf_format = Config::get<std::string>("wf_format", "hps");
+  if (Util::str_equals_ci(wf_format, "sharded")) {
+    WfFile::save(system, filename, Config::get<bool>("wf_compress_dets", false));
+    if (Parallel::is_master()) printf("Variational results saved to: %s\n", filename.c_str());
+    return;
   }
+  if (!Util::str_equals_ci(wf_format, "hps")) {
+    throw std::invalid_argument("unknown wf_format: " + wf_format);
+  }
+  WfFile::save_hps(system, filename);
+  if (Parallel::is_master()) printf("Variational results saved to: %s\n", filename.c_str());
 }
 
 template <class S>
@@ -1260,6 +2564,29 @@ void Solver<S>::save_pair_contrib(const double eps_var) {
   contrib_file.close();
 }
 
+template <class S>
+void Solver<S>::account_var_memory() {
+  memory_planner.set("integrals", system.get_integrals_n_bytes(memory_planner.get_hash_overhead()));
+  memory_planner.set("helpers", system.helper_size);
+  size_t n_bytes_coefs = 0;
+  for (const auto& coefs : system.coefs) n_bytes_coefs += coefs.capacity() * sizeof(double);
+  memory_planner.set(
+      "var dets",
+      system.dets.capacity() * sizeof(Det) + var_dets_store.get_n_bytes() + n_bytes_coefs);
+  const double var_dets_entry_bytes = memory_planner.get_hash_entry_bytes(sizeof(Det));
+  memory_planner.set("var dets hash set", var_dets.get_n_keys() * var_dets_entry_bytes);
+  memory_planner.set("hamiltonian", hamiltonian.matrix.count_n_bytes() / Parallel::get_n_procs());
+}
+
+template <class S>
+void Solver<S>::measure_hc_sums_memory(
+    const size_t mem_avail_begin, const size_t n_pt_dets, const size_t bytes_per_entry) {
+  const size_t mem_avail = Util::get_mem_avail();
+  const size_t n_bytes = mem_avail_begin > mem_avail ? mem_avail_begin - mem_avail : 0;
+  const size_t n_node_entries = n_pt_dets * Parallel::get_n_node_procs() / Parallel::get_n_procs();
+  memory_planner.measure_hash_overhead(n_bytes, n_node_entries, bytes_per_entry);
+}
+
 template <class S>
 void Solver<S>::print_dets_info() const {
   if (system.time_sym) {
@@ -1377,5 +2704,22 @@ std::string Solver<S>::get_state_suffix(const unsigned i_state) const {
 
 template <class S>
 std::string Solver<S>::get_wf_filename(const double eps_var) const {
-  return Util::str_printf("wf_eps1_%#.2e.dat", eps_var);
+  return WfFile::get_filename(eps_var);
+}
+
+template <class S>
+std::string Solver<S>::get_pt_checkpoint_key(
+    const std::string& stage,
+    const double eps_var,
+    const unsigned first_state,
+    const unsigned n_states_pass) const {
+  return Util::str_printf(
+      "pt/%#.2e/%s%s/%u/%#.2e/%#.2e/%#.2e",
+      eps_var,
+      stage.c_str(),
+      get_state_suffix(first_state).c_str(),
+      n_states_pass,
+      eps_pt_dtm,
+      eps_pt_psto,
+      eps_pt);
 }
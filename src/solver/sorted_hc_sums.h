@@ -0,0 +1,362 @@
+#pragma once
+
+#include <hps/src/hps.h>
+#include <mpi.h>
+#include <omp.h>
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../counters.h"
+#include "../det/det.h"
+#include "../det/det_codec.h"
+#include "../parallel.h"
+#include "../util.h"
+
+// Sums of H_ai * c_i over the PT dets, as a sort-and-reduce alternative to a DistHashMap.
+// Contributions are appended to per thread blocks. sync() adds up the duplicates among them,
+// sends them to the owner procs with an all to all exchange, the dets encoded against the
+// reference det, and merges the received run into the sums. The sums are split into buckets by
+// hash value and sorted by det within each, so that each sync only sorts its run and merges it
+// bucket by bucket in parallel, and the reduced sums are packed without any hash table overhead.
+class SortedHcSums {
+ public:
+  SortedHcSums() : thread_blocks(Parallel::get_n_threads()), buckets(N_BUCKETS) {}
+
+  // Thread safe. parent is the index of a var det connected to det, the lowest one is kept.
+  void add(const Det& det, const double hc, const size_t parent) {
+    auto& blocks = thread_blocks[omp_get_thread_num()];
+    if (blocks.empty() || blocks.back().size() == BLOCK_SIZE) {
+      blocks.emplace_back();
+      blocks.back().reserve(BLOCK_SIZE);
+    }
+    blocks.back().push_back(Entry(det, hc, parent));
+  }
+
+  // Dets are sent as their differences from det, e.g. HF, instead of an empty det.
+  void set_reference(const Det& det) { codec = DetCodec(det); }
+
+  // Collective.
+  void sync();
+
+  // Total number of unique dets over all procs after sync.
+  size_t get_n_keys() const;
+
+  // Sum of mapper(det, hc_sum, parent) and of its squares over all procs, like Solver::mapreduce_sum.
+  template <class Mapper>
+  std::array<double, 2> mapreduce_sum(const Mapper& mapper) const;
+
+  void clear();
+
+  // Bytes per PT det at the peak of a batch, the merge of the run of its last step: the reduced
+  // sum, and a contribution of the run with its bucket and its position in the sort, since the
+  // contributions of one of the 5 steps are about as many as the dets of the batch.
+  static constexpr size_t get_n_bytes_per_entry() {
+    return sizeof(Entry) * 2 + sizeof(const Entry*) + sizeof(uint16_t);
+  }
+
+ private:
+  struct Entry {
+    Det det;
+
+    double hc = 0.0;
+
+    size_t parent = 0;
+
+    Entry() {}
+
+    Entry(const Det& det, const double hc, const size_t parent)
+        : det(det), hc(hc), parent(parent) {}
+  };
+
+  typedef std::vector<Entry> Block;
+
+  // Entries per block of the contributions, which are reserved in full so that they grow
+  // without copies or spare capacity.
+  static constexpr size_t BLOCK_SIZE = 1 << 12;
+
+  static constexpr unsigned BUCKET_BITS = 12;
+
+  static constexpr size_t N_BUCKETS = 1 << BUCKET_BITS;
+
+  std::vector<std::vector<Block>> thread_blocks;
+
+  DetCodec codec;
+
+  // Unique dets owned by this proc, by get_bucket and sorted by det within each bucket.
+  std::vector<Block> buckets;
+
+  // Decorrelated from the Util::rehash(hash) % n_batches of the PT batches.
+  static size_t get_owner(const size_t hash, const size_t n_procs) {
+    return (hash * 11400714819323198485ull >> 32) % n_procs;
+  }
+
+  // From the top bits of another multiplicative hash than get_owner, so that the dets of a proc
+  // spread over all the buckets.
+  static size_t get_bucket(const Det& det) {
+    const size_t hash = DetHasher()(det);
+    return (hash ^ (hash >> 29)) * 0xbf58476d1ce4e5b9ull >> (64 - BUCKET_BITS);
+  }
+
+  // Send the buffered entries to their owners and move the ones of this proc into runs.
+  void exchange(std::vector<Block>& runs);
+
+  // Add the entries of runs to the buckets of sums and free runs. The entries are ordered by
+  // bucket with per thread counts, then each bucket is sorted and merged into the one of sums.
+  static void merge(std::vector<Block>& runs, std::vector<Block>& sums);
+
+  // Append entry to sorted, adding it to the last one of the same det.
+  static void append_reduced(Block& sorted, const Entry& entry) {
+    if (!sorted.empty() && sorted.back().det == entry.det) {
+      sorted.back().hc += entry.hc;
+      sorted.back().parent = std::min(sorted.back().parent, entry.parent);
+    } else {
+      sorted.push_back(entry);
+    }
+  }
+};
+
+inline void SortedHcSums::sync() {
+  std::vector<Block> runs;
+  exchange(runs);
+  merge(runs, buckets);
+}
+
+inline size_t SortedHcSums::get_n_keys() const {
+  unsigned long long n_keys_local = 0;
+  for (const auto& bucket : buckets) n_keys_local += bucket.size();
+  unsigned long long n_keys = 0;
+  MPI_Allreduce(&n_keys_local, &n_keys, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  return n_keys;
+}
+
+template <class Mapper>
+std::array<double, 2> SortedHcSums::mapreduce_sum(const Mapper& mapper) const {
+  double sum = 0.0;
+  double sum_sq = 0.0;
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : sum, sum_sq)
+  for (size_t b = 0; b < N_BUCKETS; b++) {
+    for (const auto& entry : buckets[b]) {
+      const double mapped = mapper(entry.det, entry.hc, entry.parent);
+      sum += mapped;
+      sum_sq += mapped * mapped;
+    }
+  }
+  std::array<double, 2> res_local = {sum, sum_sq};
+  std::array<double, 2> res = {0.0, 0.0};
+  MPI_Allreduce(&res_local, &res, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  return res;
+}
+
+inline void SortedHcSums::clear() {
+  for (auto& blocks : thread_blocks) Util::free(blocks);
+  for (auto& bucket : buckets) Util::free(bucket);
+}
+
+inline void SortedHcSums::exchange(std::vector<Block>& runs) {
+  const size_t n_procs = Parallel::get_n_procs();
+  const size_t proc_id = Parallel::get_proc_id();
+  for (auto& blocks : thread_blocks) {
+    for (auto& block : blocks) runs.push_back(std::move(block));
+    Util::free(blocks);
+  }
+  if (n_procs == 1) return;
+
+  // Add up the contributions to the same det before sending them.
+  std::vector<Block> pending(N_BUCKETS);
+  merge(runs, pending);
+  std::vector<std::vector<unsigned>> owners(N_BUCKETS);
+#pragma omp parallel for schedule(dynamic, 16)
+  for (size_t b = 0; b < N_BUCKETS; b++) {
+    owners[b].reserve(pending[b].size());
+    for (const auto& entry : pending[b]) {
+      owners[b].push_back(get_owner(DetHasher()(entry.det), n_procs));
+    }
+  }
+
+  // Serialize the dets, sums and parents for each other owner, in parallel over the owners,
+  // as the number of entries and the sizes of the encoded dets and the serialized sums followed
+  // by the dets, the sums and the parents.
+  std::vector<std::string> send_bufs(n_procs);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t dest = 0; dest < n_procs; dest++) {
+    if (dest == proc_id) continue;
+    std::string encoded_dets;
+    std::vector<double> hcs;
+    std::vector<size_t> parents;
+    for (size_t b = 0; b < N_BUCKETS; b++) {
+      for (size_t k = 0; k < pending[b].size(); k++) {
+        if (owners[b][k] != dest) continue;
+        const Entry& entry = pending[b][k];
+        codec.encode(entry.det, encoded_dets);
+        hcs.push_back(entry.hc);
+        parents.push_back(entry.parent);
+      }
+    }
+    if (hcs.empty()) continue;
+    const std::string& serialized_hcs = hps::to_string(hcs);
+    const size_t n_bytes[3] = {hcs.size(), encoded_dets.size(), serialized_hcs.size()};
+    send_bufs[dest].assign(reinterpret_cast<const char*>(n_bytes), sizeof(n_bytes));
+    send_bufs[dest] += encoded_dets;
+    send_bufs[dest] += serialized_hcs;
+    send_bufs[dest] += hps::to_string(parents);
+  }
+  runs.emplace_back();
+  for (size_t b = 0; b < N_BUCKETS; b++) {
+    for (size_t k = 0; k < pending[b].size(); k++) {
+      if (owners[b][k] == proc_id) runs.back().push_back(pending[b][k]);
+    }
+    Util::free(pending[b]);
+  }
+  Util::free(owners);
+
+  // Counts may overflow ints, so exchange in rounds of at most TRUNK_SIZE bytes per pair.
+  const long long TRUNK_SIZE = INT_MAX / n_procs;
+  std::vector<long long> send_counts(n_procs);
+  std::vector<long long> recv_counts(n_procs);
+  long long max_count_local = 0;
+  for (size_t p = 0; p < n_procs; p++) {
+    send_counts[p] = send_bufs[p].size();
+    max_count_local = std::max(max_count_local, send_counts[p]);
+    Counters::add(Counters::HC_SUMS_BYTES_SENT, send_counts[p]);
+  }
+  MPI_Alltoall(
+      send_counts.data(), 1, MPI_LONG_LONG, recv_counts.data(), 1, MPI_LONG_LONG, MPI_COMM_WORLD);
+  long long max_count = 0;
+  MPI_Allreduce(&max_count_local, &max_count, 1, MPI_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+  std::vector<std::string> recv_bufs(n_procs);
+  for (size_t p = 0; p < n_procs; p++) recv_bufs[p].resize(recv_counts[p]);
+
+  const long long n_rounds = (max_count + TRUNK_SIZE - 1) / TRUNK_SIZE;
+  std::vector<int> round_send_counts(n_procs), round_send_displs(n_procs);
+  std::vector<int> round_recv_counts(n_procs), round_recv_displs(n_procs);
+  std::string round_send;
+  std::string round_recv;
+  for (long long round = 0; round < n_rounds; round++) {
+    const long long begin = round * TRUNK_SIZE;
+    int send_offset = 0;
+    int recv_offset = 0;
+    round_send.clear();
+    for (size_t p = 0; p < n_procs; p++) {
+      const long long n_send = std::max(0ll, std::min(TRUNK_SIZE, send_counts[p] - begin));
+      const long long n_recv = std::max(0ll, std::min(TRUNK_SIZE, recv_counts[p] - begin));
+      if (n_send > 0) round_send.append(send_bufs[p], begin, n_send);
+      round_send_counts[p] = n_send;
+      round_send_displs[p] = send_offset;
+      round_recv_counts[p] = n_recv;
+      round_recv_displs[p] = recv_offset;
+      send_offset += n_send;
+      recv_offset += n_recv;
+    }
+    round_recv.resize(recv_offset);
+    MPI_Alltoallv(
+        &round_send[0],
+        round_send_counts.data(),
+        round_send_displs.data(),
+        MPI_CHAR,
+        &round_recv[0],
+        round_recv_counts.data(),
+        round_recv_displs.data(),
+        MPI_CHAR,
+        MPI_COMM_WORLD);
+    for (size_t p = 0; p < n_procs; p++) {
+      if (round_recv_counts[p] == 0) continue;
+      std::copy(
+          round_recv.begin() + round_recv_displs[p],
+          round_recv.begin() + round_recv_displs[p] + round_recv_counts[p],
+          recv_bufs[p].begin() + begin);
+    }
+  }
+  Util::free(send_bufs);
+
+  for (size_t p = 0; p < n_procs; p++) {
+    if (recv_bufs[p].empty()) continue;
+    const std::string& received = recv_bufs[p];
+    size_t n_bytes[3];
+    std::copy(
+        received.begin(), received.begin() + sizeof(n_bytes), reinterpret_cast<char*>(n_bytes));
+    const std::string& encoded_dets = received.substr(sizeof(n_bytes), n_bytes[1]);
+    std::vector<Det> dets(n_bytes[0]);
+    size_t pos = 0;
+    for (auto& det : dets) det = codec.decode(encoded_dets, pos);
+    const size_t hcs_begin = sizeof(n_bytes) + n_bytes[1];
+    const auto& hcs = hps::from_string<std::vector<double>>(received.substr(hcs_begin, n_bytes[2]));
+    const auto& parents =
+        hps::from_string<std::vector<size_t>>(received.substr(hcs_begin + n_bytes[2]));
+    Util::free(recv_bufs[p]);
+    runs.emplace_back(dets.size());
+    Block& run = runs.back();
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < dets.size(); i++) run[i] = Entry(dets[i], hcs[i], parents[i]);
+  }
+}
+
+inline void SortedHcSums::merge(std::vector<Block>& runs, std::vector<Block>& sums) {
+  const size_t n_runs = runs.size();
+  size_t n_entries = 0;
+  for (const auto& run : runs) n_entries += run.size();
+
+  // Counting sort of the entries by bucket. The static schedules give each thread the same runs
+  // in both loops.
+  const size_t n_threads = Parallel::get_n_threads();
+  std::vector<std::vector<uint16_t>> run_buckets(n_runs);
+  std::vector<const Entry*> order(n_entries);
+  std::vector<size_t> bucket_offsets(n_threads * N_BUCKETS, 0);
+  std::vector<size_t> bucket_begins(N_BUCKETS + 1);
+#pragma omp parallel num_threads(n_threads)
+  {
+    size_t* offsets = &bucket_offsets[omp_get_thread_num() * N_BUCKETS];
+#pragma omp for schedule(static, 1)
+    for (size_t r = 0; r < n_runs; r++) {
+      run_buckets[r].resize(runs[r].size());
+      for (size_t k = 0; k < runs[r].size(); k++) {
+        run_buckets[r][k] = get_bucket(runs[r][k].det);
+        offsets[run_buckets[r][k]]++;
+      }
+    }
+#pragma omp single
+    {
+      size_t offset = 0;
+      for (size_t b = 0; b < N_BUCKETS; b++) {
+        bucket_begins[b] = offset;
+        for (size_t t = 0; t < n_threads; t++) {
+          const size_t n_in_bucket = bucket_offsets[t * N_BUCKETS + b];
+          bucket_offsets[t * N_BUCKETS + b] = offset;
+          offset += n_in_bucket;
+        }
+      }
+      bucket_begins[N_BUCKETS] = offset;
+    }
+#pragma omp for schedule(static, 1)
+    for (size_t r = 0; r < n_runs; r++) {
+      for (size_t k = 0; k < runs[r].size(); k++) order[offsets[run_buckets[r][k]]++] = &runs[r][k];
+      Util::free(run_buckets[r]);
+    }
+  }
+  Util::free(bucket_offsets);
+
+  // Sort each bucket of the entries by det and merge it with the one of the sums, adding up the
+  // entries of the same det.
+#pragma omp parallel for schedule(dynamic, 16)
+  for (size_t b = 0; b < N_BUCKETS; b++) {
+    const auto begin = order.begin() + bucket_begins[b];
+    const auto end = order.begin() + bucket_begins[b + 1];
+    if (begin == end) continue;
+    std::sort(begin, end, [](const Entry* x, const Entry* y) { return x->det < y->det; });
+    const Block& bucket = sums[b];
+    Block merged;
+    merged.reserve(bucket.size() + (end - begin));
+    size_t k = 0;
+    for (auto it = begin; it != end; it++) {
+      const Entry& entry = **it;
+      while (k < bucket.size() && bucket[k].det < entry.det) merged.push_back(bucket[k++]);
+      if (k < bucket.size() && bucket[k].det == entry.det) merged.push_back(bucket[k++]);
+      append_reduced(merged, entry);
+    }
+    merged.insert(merged.end(), bucket.begin() + k, bucket.end());
+    sums[b].swap(merged);
+  }
+  Util::free(runs);
+}
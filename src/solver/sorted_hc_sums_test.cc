@@ -0,0 +1,45 @@
+#include "sorted_hc_sums.h"
+#include <gtest/gtest.h>
+#include <cmath>
+#include <unordered_map>
+
+TEST(SortedHcSumsTest, MergesTheRunsOfEachSync) {
+  SortedHcSums sorted_hc_sums;
+  std::unordered_map<Det, double, DetHasher> expected_sums;
+  std::unordered_map<Det, size_t, DetHasher> expected_parents;
+  const auto& get_det = [](const size_t i) {
+    Det det;
+    det.up.set(i % 37).set(40 + i % 11);
+    det.dn.set(i % 13);
+    return det;
+  };
+  for (size_t step = 0; step < 3; step++) {
+    const size_t n_contribs = 10000 * (step + 1);
+    for (size_t i = 0; i < n_contribs; i++) {
+      const Det& det = get_det(i * 7 + step);
+      const size_t parent = (i * 31 + step) % 1000;
+      expected_sums[det] += 0.5 * (i % 5);
+      if (expected_parents.count(det) == 0 || parent < expected_parents[det]) {
+        expected_parents[det] = parent;
+      }
+    }
+#pragma omp parallel for schedule(dynamic, 64)
+    for (size_t i = 0; i < n_contribs; i++) {
+      sorted_hc_sums.add(get_det(i * 7 + step), 0.5 * (i % 5), (i * 31 + step) % 1000);
+    }
+    sorted_hc_sums.sync();
+  }
+  EXPECT_EQ(sorted_hc_sums.get_n_keys(), expected_sums.size());
+
+  // Each det maps to a value that only matches its expected sum and parent.
+  const auto& sum = sorted_hc_sums.mapreduce_sum(
+      [&](const Det& det, const double hc, const size_t parent) {
+        const bool matches = std::abs(hc - expected_sums.at(det)) < 1.0e-9 &&
+                             parent == expected_parents.at(det);
+        return matches ? 1.0 : 0.0;
+      });
+  EXPECT_DOUBLE_EQ(sum[0], static_cast<double>(expected_sums.size()));
+
+  sorted_hc_sums.clear();
+  EXPECT_EQ(sorted_hc_sums.get_n_keys(), 0u);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+// Intersection of two strictly increasing arrays a and b, produced in batches of the positions in
+// b of the common values. Sizes within GALLOP_RATIO of each other are merged without data
+// dependent branches, otherwise each element of the shorter array is located in the longer one by
+// exponential and then binary search.
+template <class T>
+class SortedIntersection {
+ public:
+  SortedIntersection(const T* a, const size_t n_a, const T* b, const size_t n_b)
+      : a(a), b(b), n_a(n_a), n_b(n_b) {}
+
+  // Write the positions in b of up to max_matches more common values in increasing order to
+  // b_positions and return how many there are, 0 once the intersection is done.
+  size_t next(size_t* b_positions, const size_t max_matches);
+
+ private:
+  static constexpr size_t GALLOP_RATIO = 16;
+
+  const T* a;
+
+  const T* b;
+
+  size_t n_a;
+
+  size_t n_b;
+
+  size_t i = 0;
+
+  size_t j = 0;
+
+  // Index of the first element >= value in arr[begin, n), searching from begin.
+  static size_t gallop(const T* arr, const size_t begin, const size_t n, const T& value);
+};
+
+template <class T>
+size_t SortedIntersection<T>::next(size_t* b_positions, const size_t max_matches) {
+  size_t n_matches = 0;
+  if (n_b >= n_a * GALLOP_RATIO) {
+    while (i < n_a && n_matches < max_matches) {
+      j = gallop(b, j, n_b, a[i]);
+      if (j == n_b) break;
+      if (b[j] == a[i]) b_positions[n_matches++] = j++;
+      i++;
+    }
+  } else if (n_a >= n_b * GALLOP_RATIO) {
+    while (j < n_b && n_matches < max_matches) {
+      i = gallop(a, i, n_a, b[j]);
+      if (i == n_a) break;
+      if (a[i] == b[j]) {
+        b_positions[n_matches++] = j;
+        i++;
+      }
+      j++;
+    }
+  } else {
+    while (i < n_a && j < n_b && n_matches < max_matches) {
+      const T x = a[i];
+      const T y = b[j];
+      b_positions[n_matches] = j;
+      n_matches += (x == y);
+      i += (x <= y);
+      j += (y <= x);
+    }
+  }
+  return n_matches;
+}
+
+template <class T>
+size_t SortedIntersection<T>::gallop(
+    const T* arr, const size_t begin, const size_t n, const T& value) {
+  size_t step = 1;
+  size_t low = begin;
+  while (low + step < n && arr[low + step] < value) {
+    low += step;
+    step *= 2;
+  }
+  const size_t high = std::min(low + step + 1, n);
+  return std::lower_bound(arr + low, arr + high, value) - arr;
+}
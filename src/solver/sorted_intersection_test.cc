@@ -0,0 +1,50 @@
+#include "sorted_intersection.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+// Strictly increasing values below n_values, each kept with the given probability.
+std::vector<size_t> get_random_sorted(std::mt19937& rng, const size_t n_values, const double p) {
+  std::bernoulli_distribution keep(p);
+  std::vector<size_t> res;
+  for (size_t value = 0; value < n_values; value++) {
+    if (keep(rng)) res.push_back(value);
+  }
+  return res;
+}
+
+TEST(SortedIntersectionTest, MatchesLinearMerge) {
+  std::mt19937 rng(5);
+  const double densities[] = {0.001, 0.02, 0.3, 0.9};
+  for (const double p_a : densities) {
+    for (const double p_b : densities) {
+      const auto& a = get_random_sorted(rng, 5000, p_a);
+      const auto& b = get_random_sorted(rng, 5000, p_b);
+      std::vector<size_t> expected;
+      size_t j = 0;
+      for (const size_t value : a) {
+        while (j < b.size() && b[j] < value) j++;
+        if (j < b.size() && b[j] == value) expected.push_back(j);
+      }
+
+      // Batches smaller than the intersection exercise resuming.
+      SortedIntersection<size_t> intersection(a.data(), a.size(), b.data(), b.size());
+      std::vector<size_t> positions;
+      size_t batch[7];
+      size_t n_matches;
+      while ((n_matches = intersection.next(batch, 7)) > 0) {
+        positions.insert(positions.end(), batch, batch + n_matches);
+      }
+      EXPECT_EQ(positions, expected);
+    }
+  }
+}
+
+TEST(SortedIntersectionTest, EmptyArrays) {
+  const std::vector<size_t> a = {1, 3, 5};
+  size_t batch[4];
+  SortedIntersection<size_t> empty_b(a.data(), a.size(), nullptr, 0);
+  EXPECT_EQ(empty_b.next(batch, 4), 0);
+  SortedIntersection<size_t> empty_a(nullptr, 0, a.data(), a.size());
+  EXPECT_EQ(empty_a.next(batch, 4), 0);
+}
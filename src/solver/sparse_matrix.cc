@@ -1,106 +1,907 @@
 #include "sparse_matrix.h"
 
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <type_traits>
 
+#include "../config.h"
+#include "../counters.h"
 #include "../util.h"
 
+// Number of local rows packed together into one chunk.
+constexpr size_t ROWS_PER_CHUNK = 1 << 12;
+
+// First word of the files written by save().
+constexpr uint64_t SAVED_MATRIX_MAGIC = 0x5348434948414d31ull;
+
+namespace {
+// Contiguous range of chunks of a thread, with similar numbers of elements for all threads.
+std::pair<size_t, size_t> get_thread_chunks(
+    const std::vector<size_t>& n_elems_before, const size_t thread_id, const size_t n_threads) {
+  const size_t n_chunks = n_elems_before.size() - 1;
+  const size_t n_elems = n_elems_before.back();
+  const auto& begin_ptr = std::lower_bound(
+      n_elems_before.begin(), n_elems_before.end(), n_elems * thread_id / n_threads);
+  const auto& end_ptr = std::lower_bound(
+      n_elems_before.begin(), n_elems_before.end(), n_elems * (thread_id + 1) / n_threads);
+  const size_t chunk_begin = thread_id == 0 ? 0 : begin_ptr - n_elems_before.begin();
+  const size_t chunk_end =
+      thread_id == n_threads - 1 ? n_chunks : end_ptr - n_elems_before.begin();
+  return std::make_pair(chunk_begin, chunk_end);
+}
+}  // namespace
+
 void SparseMatrix::append_elem(const size_t i, const size_t j, const double& elem) {
-  rows[i].append(j, elem);
+  if (!is_local_row(i)) return;
+  pending_rows[i / n_procs].append(j, elem);
   if (i == j) diag_local[i] = elem;
 }
 
 size_t SparseMatrix::count_n_elems() const {
   // TODO: Factor out raw parallel codes into a framework.
-  const int proc_id = Parallel::get_proc_id();
-  const int n_procs = Parallel::get_n_procs();
   unsigned long long n_elems_local = 0;
   unsigned long long n_elems = 0;
-  const size_t dim = rows.size();
-  for (size_t i = proc_id; i < dim; i += n_procs) {
-    n_elems_local += rows[i].size();
-  }
+  for (const auto& chunk : chunks) n_elems_local += chunk.n_elems;
+  for (const auto& row : pending_rows) n_elems_local += row.size();
   MPI_Allreduce(&n_elems_local, &n_elems, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
   n_elems = n_elems * 2 - dim;
-  return n_elems;  
+  return n_elems;
+}
+
+size_t SparseMatrix::count_n_bytes() const {
+  unsigned long long n_bytes_local = 0;
+  unsigned long long n_bytes = 0;
+  for (const auto& chunk : chunks) n_bytes_local += chunk.count_n_bytes();
+  for (const auto& row : pending_rows) {
+    n_bytes_local += row.size() * (sizeof(size_t) + sizeof(double)) + sizeof(SparseVector);
+  }
+  MPI_Allreduce(&n_bytes_local, &n_bytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  return n_bytes;
+}
+
+size_t SparseMatrix::count_n_bytes_on_disk() const {
+  unsigned long long n_bytes_local = 0;
+  unsigned long long n_bytes = 0;
+  for (const auto& chunk : chunks) n_bytes_local += chunk.segment.get_n_bytes();
+  n_bytes_local += saved_file.get_n_bytes();
+  MPI_Allreduce(&n_bytes_local, &n_bytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  return n_bytes;
+}
+
+double SparseMatrix::get_mean_bandwidth(const std::vector<size_t>& new_ids) const {
+  double sum_dist = 0.0;
+  double n_off_diag = 0.0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(+ : sum_dist, n_off_diag)
+  for (size_t chunk_id = 0; chunk_id < chunks.size(); chunk_id++) {
+    const auto& chunk = chunks[chunk_id];
+    size_t i = chunk_id * ROWS_PER_CHUNK * n_procs + proc_id;
+    for (size_t r = 0; r < chunk.n_rows; r++, i += n_procs) {
+      const size_t row = new_ids.empty() ? i : new_ids[i];
+      for (size_t k = chunk.offsets[r]; k < chunk.offsets[r + 1]; k++) {
+        size_t j = chunk.get_index(k);
+        if (j == i) continue;
+        if (!new_ids.empty()) j = new_ids[j];
+        sum_dist += j > row ? j - row : row - j;
+        n_off_diag += 1.0;
+      }
+    }
+  }
+  double sums_local[2] = {sum_dist, n_off_diag};
+  double sums[2];
+  MPI_Allreduce(sums_local, sums, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  return sums[1] > 0.0 ? sums[0] / sums[1] : 0.0;
 }
 
 std::vector<double> SparseMatrix::mul(const std::vector<double>& vec) const {
-  // TODO: Factor out raw parallel codes into a framework.
-  const int proc_id = Parallel::get_proc_id();
-  const int n_procs = Parallel::get_n_procs();
-  const size_t dim = rows.size();
   std::vector<double> res_local(dim, 0.0);
+  mul_local(vec.data(), 1, res_local);
+
+  const auto& res = reduce_sum(res_local);
+
+  return res;
+}
+
+std::vector<std::vector<double>> SparseMatrix::mul(
+    const std::vector<std::vector<double>>& vecs) const {
+  const size_t n_vecs = vecs.size();
+  if (n_vecs == 1) return std::vector<std::vector<double>>(1, mul(vecs[0]));
+
+  // Interleave the vectors so that each element of the matrix is loaded once for all of them.
+  std::vector<double> block(dim * n_vecs);
+#pragma omp parallel for
+  for (size_t j = 0; j < dim; j++) {
+    for (size_t s = 0; s < n_vecs; s++) block[j * n_vecs + s] = vecs[s][j];
+  }
+  std::vector<double> res_local(dim * n_vecs, 0.0);
+  mul_local(block.data(), n_vecs, res_local);
+  Util::free(block);
+  const auto& res_block = reduce_sum(res_local);
+  Util::free(res_local);
+
+  std::vector<std::vector<double>> res(n_vecs, std::vector<double>(dim));
+#pragma omp parallel for
+  for (size_t j = 0; j < dim; j++) {
+    for (size_t s = 0; s < n_vecs; s++) res[s][j] = res_block[j * n_vecs + s];
+  }
+  return res;
+}
+
+std::vector<std::vector<double>> SparseMatrix::mul_slices(
+    const std::vector<std::vector<double>>& slices) const {
+  const size_t n_vecs = slices.size();
+  const size_t n_local = get_slice_end() - get_slice_begin();
+
+  std::vector<double> block_local(n_local * n_vecs);
+#pragma omp parallel for
+  for (size_t j = 0; j < n_local; j++) {
+    for (size_t s = 0; s < n_vecs; s++) block_local[j * n_vecs + s] = slices[s][j];
+  }
+  std::vector<double> block(dim * n_vecs);
+  allgather_slices(block_local.data(), n_vecs, block.data());
+
+  std::vector<double> res_local(dim * n_vecs, 0.0);
+  mul_local(block.data(), n_vecs, res_local);
+  Util::free(block);
+  reduce_scatter_slices(res_local.data(), n_vecs, block_local.data());
+  Util::free(res_local);
+
+  std::vector<std::vector<double>> res(n_vecs, std::vector<double>(n_local));
+#pragma omp parallel for
+  for (size_t j = 0; j < n_local; j++) {
+    for (size_t s = 0; s < n_vecs; s++) res[s][j] = block_local[j * n_vecs + s];
+  }
+  return res;
+}
+
+std::vector<double> SparseMatrix::gather_slices(const std::vector<double>& slice) const {
+  std::vector<double> vec(dim);
+  allgather_slices(slice.data(), 1, vec.data());
+  return vec;
+}
+
+void SparseMatrix::allgather_slices(const double* local, const size_t n_vecs, double* full)
+    const {
+  const size_t n_local = (get_slice_end() - get_slice_begin()) * n_vecs;
+  if (dim * n_vecs <= INT_MAX) {
+    std::vector<int> counts(n_procs);
+    std::vector<int> displs(n_procs);
+    for (size_t p = 0; p < n_procs; p++) {
+      counts[p] = (get_slice_begin(p + 1) - get_slice_begin(p)) * n_vecs;
+      displs[p] = get_slice_begin(p) * n_vecs;
+    }
+    MPI_Allgatherv(
+        local,
+        n_local,
+        MPI_DOUBLE,
+        full,
+        counts.data(),
+        displs.data(),
+        MPI_DOUBLE,
+        MPI_COMM_WORLD);
+    return;
+  }
+
+  // MPI counts are ints, so large slices are broadcast by their owners in trunks.
+  const size_t TRUNK_SIZE = 1 << 27;
+  std::copy(local, local + n_local, full + get_slice_begin() * n_vecs);
+  for (size_t p = 0; p < n_procs; p++) {
+    const size_t end = get_slice_begin(p + 1) * n_vecs;
+    for (size_t k = get_slice_begin(p) * n_vecs; k < end; k += TRUNK_SIZE) {
+      MPI_Bcast(full + k, std::min(TRUNK_SIZE, end - k), MPI_DOUBLE, p, MPI_COMM_WORLD);
+    }
+  }
+}
+
+void SparseMatrix::reduce_scatter_slices(const double* full, const size_t n_vecs, double* local)
+    const {
+  if (dim * n_vecs <= INT_MAX) {
+    std::vector<int> counts(n_procs);
+    for (size_t p = 0; p < n_procs; p++) {
+      counts[p] = (get_slice_begin(p + 1) - get_slice_begin(p)) * n_vecs;
+    }
+    MPI_Reduce_scatter(
+        full, local, counts.data(), MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    return;
+  }
+
+  const size_t TRUNK_SIZE = 1 << 27;
+  for (size_t p = 0; p < n_procs; p++) {
+    const size_t begin = get_slice_begin(p) * n_vecs;
+    const size_t end = get_slice_begin(p + 1) * n_vecs;
+    for (size_t k = begin; k < end; k += TRUNK_SIZE) {
+      MPI_Reduce(
+          full + k,
+          local + (k - begin),
+          std::min(TRUNK_SIZE, end - k),
+          MPI_DOUBLE,
+          MPI_SUM,
+          p,
+          MPI_COMM_WORLD);
+    }
+  }
+}
+
+void SparseMatrix::mul_local(
+    const double* vec, const size_t n_vecs, std::vector<double>& res_local) const {
+  if (!pending_rows.empty()) throw std::runtime_error("sparse matrix is not packed");
+  size_t n_elems_local = 0;
+  for (const auto& chunk : chunks) n_elems_local += chunk.n_elems;
+  Counters::add(Counters::MATVEC_NONZEROS, n_elems_local * n_vecs);
+
+  // Fall back to atomics when the per-thread buffers do not fit into memory.
+  const size_t n_buffer_bytes = (Parallel::get_n_threads() - 1) * dim * n_vecs * sizeof(double);
+  if (spmv_kernel == SpmvKernel::BUFFERED && n_buffer_bytes < Util::get_mem_avail() / 2) {
+    mul_buffered(vec, n_vecs, res_local);
+  } else {
+    mul_atomic(vec, n_vecs, res_local);
+  }
+
+  if (direct_mul) direct_mul(vec, n_vecs, res_local);
+}
+
+void SparseMatrix::mul_atomic(
+    const double* vec, const size_t n_vecs, std::vector<double>& res_local) const {
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t chunk_id = 0; chunk_id < chunks.size(); chunk_id++) {
+    mul_chunk<true>(chunk_id, vec, n_vecs, res_local.data());
+  }
+}
+
+void SparseMatrix::mul_buffered(
+    const double* vec, const size_t n_vecs, std::vector<double>& res_local) const {
+  // Split the chunks into contiguous ranges with similar numbers of elements.
+  const size_t n_chunks = chunks.size();
+  std::vector<size_t> n_elems_before(n_chunks + 1, 0);
+  for (size_t chunk_id = 0; chunk_id < n_chunks; chunk_id++) {
+    n_elems_before[chunk_id + 1] = n_elems_before[chunk_id] + chunks[chunk_id].n_elems;
+  }
+  const size_t n_res = res_local.size();
+
+  // The rows only have their elements from the diagonal on, so a thread adds to the results from
+  // the first row of its chunks on, which it zeros again when they are summed.
+  const size_t n_threads_max = Parallel::get_n_threads();
+  if (thread_partials.size() < n_threads_max) thread_partials.resize(n_threads_max);
+  std::vector<size_t> touched_begins(thread_partials.size(), n_res);
+#pragma omp parallel
+  {
+    const size_t thread_id = omp_get_thread_num();
+    const size_t n_threads = omp_get_num_threads();
+    const auto& range = get_thread_chunks(n_elems_before, thread_id, n_threads);
+    const size_t chunk_begin = range.first;
+    const size_t chunk_end = range.second;
 
-#pragma omp parallel for schedule(static, 1)
-  for (size_t i = proc_id; i < dim; i += n_procs) {
-    const auto& row = rows[i];
+    // The master thread accumulates into the result directly.
+    double* res = res_local.data();
+    if (thread_id > 0 && chunk_begin < chunk_end) {
+      auto& partial = thread_partials[thread_id];
+      partial.resize(n_res, 0.0);
+      res = partial.data();
+      const size_t row_begin = chunk_begin * ROWS_PER_CHUNK * n_procs + proc_id;
+      touched_begins[thread_id] = std::min(n_res, row_begin * n_vecs);
+    }
+    for (size_t chunk_id = chunk_begin; chunk_id < chunk_end; chunk_id++) {
+      mul_chunk<false>(chunk_id, vec, n_vecs, res);
+    }
+
+#pragma omp barrier
+#pragma omp for schedule(static)
+    for (size_t j = 0; j < n_res; j++) {
+      double sum = 0.0;
+      for (size_t t = 1; t < n_threads; t++) {
+        if (j < touched_begins[t]) continue;
+        sum += thread_partials[t][j];
+        thread_partials[t][j] = 0.0;
+      }
+      res_local[j] += sum;
+    }
+  }
+}
+
+template <bool ATOMIC>
+void SparseMatrix::mul_chunk(
+    const size_t chunk_id, const double* vec, const size_t n_vecs, double* res) const {
+  const auto& chunk = chunks[chunk_id];
+  // Read ahead the chunk processed next by this thread in the usual order.
+  if (chunk_id + 1 < chunks.size()) chunks[chunk_id + 1].segment.prefetch();
+  if (chunk.wide_indices) {
+    mul_chunk<ATOMIC>(chunk_id, chunk.indices_64, vec, n_vecs, res);
+  } else {
+    mul_chunk<ATOMIC>(chunk_id, chunk.indices_32, vec, n_vecs, res);
+  }
+}
+
+template <bool ATOMIC, class Index>
+void SparseMatrix::mul_chunk(
+    const size_t chunk_id,
+    const Index* indices,
+    const double* vec,
+    const size_t n_vecs,
+    double* res) const {
+  const auto& chunk = chunks[chunk_id];
+  if (n_vecs == 1) {
+    if (chunk.float_values) {
+      mul_chunk_rows<ATOMIC>(chunk_id, indices, chunk.values_32, vec, res);
+    } else {
+      mul_chunk_rows<ATOMIC>(chunk_id, indices, chunk.values, vec, res);
+    }
+  } else if (n_vecs == 2) {
+    if (chunk.float_values) {
+      mul_chunk_rows_pair<ATOMIC>(chunk_id, indices, chunk.values_32, vec, res);
+    } else {
+      mul_chunk_rows_pair<ATOMIC>(chunk_id, indices, chunk.values, vec, res);
+    }
+  } else {
+    if (chunk.float_values) {
+      mul_chunk_rows_block<ATOMIC>(chunk_id, indices, chunk.values_32, vec, n_vecs, res);
+    } else {
+      mul_chunk_rows_block<ATOMIC>(chunk_id, indices, chunk.values, vec, n_vecs, res);
+    }
+  }
+}
+
+template <bool ATOMIC, class Index, class Value>
+void SparseMatrix::mul_chunk_rows(
+    const size_t chunk_id,
+    const Index* indices,
+    const Value* values,
+    const double* vec,
+    double* res) const {
+  const bool FLOAT_VALUES = std::is_same<Value, float>::value;
+  const auto& chunk = chunks[chunk_id];
+  const size_t n_rows = chunk.n_rows;
+  size_t i = chunk_id * ROWS_PER_CHUNK * n_procs + proc_id;
+  for (size_t r = 0; r < n_rows; r++, i += n_procs) {
+    const double vec_i = vec[i];
     double diff_i = 0.0;
-    for (size_t j_id = 0; j_id < row.size(); j_id++) {
-      const size_t j = row.get_index(j_id);
-      const double H_ij = row.get_value(j_id);
-      diff_i += H_ij * vec[j];
+    for (size_t k = chunk.offsets[r]; k < chunk.offsets[r + 1]; k++) {
+      const size_t j = indices[k];
       if (i != j) {
-        const double diff_j = H_ij * vec[i];
+        const double H_ij = values[k];
+        diff_i += H_ij * vec[j];
+        const double diff_j = H_ij * vec_i;
+        if (ATOMIC) {
 #pragma omp atomic
-        res_local[j] += diff_j;
+          res[j] += diff_j;
+        } else {
+          res[j] += diff_j;
+        }
+      } else {
+        diff_i += (FLOAT_VALUES ? diag[i] : values[k]) * vec_i;
       }
     }
+    if (ATOMIC) {
 #pragma omp atomic
-    res_local[i] += diff_i;
+      res[i] += diff_i;
+    } else {
+      res[i] += diff_i;
+    }
   }
+}
 
-  const auto& res = reduce_sum(res_local);
+template <bool ATOMIC, class Index, class Value>
+void SparseMatrix::mul_chunk_rows_pair(
+    const size_t chunk_id,
+    const Index* indices,
+    const Value* values,
+    const double* vec,
+    double* res) const {
+  const bool FLOAT_VALUES = std::is_same<Value, float>::value;
+  const auto& chunk = chunks[chunk_id];
+  const size_t n_rows = chunk.n_rows;
+  size_t i = chunk_id * ROWS_PER_CHUNK * n_procs + proc_id;
+  for (size_t r = 0; r < n_rows; r++, i += n_procs) {
+    const double vec_i_0 = vec[i * 2];
+    const double vec_i_1 = vec[i * 2 + 1];
+    double diff_i_0 = 0.0;
+    double diff_i_1 = 0.0;
+    for (size_t k = chunk.offsets[r]; k < chunk.offsets[r + 1]; k++) {
+      const size_t j = indices[k];
+      if (i != j) {
+        const double H_ij = values[k];
+        diff_i_0 += H_ij * vec[j * 2];
+        diff_i_1 += H_ij * vec[j * 2 + 1];
+        const double diff_j_0 = H_ij * vec_i_0;
+        const double diff_j_1 = H_ij * vec_i_1;
+        if (ATOMIC) {
+#pragma omp atomic
+          res[j * 2] += diff_j_0;
+#pragma omp atomic
+          res[j * 2 + 1] += diff_j_1;
+        } else {
+          res[j * 2] += diff_j_0;
+          res[j * 2 + 1] += diff_j_1;
+        }
+      } else {
+        const double H_ii = FLOAT_VALUES ? diag[i] : values[k];
+        diff_i_0 += H_ii * vec_i_0;
+        diff_i_1 += H_ii * vec_i_1;
+      }
+    }
+    if (ATOMIC) {
+#pragma omp atomic
+      res[i * 2] += diff_i_0;
+#pragma omp atomic
+      res[i * 2 + 1] += diff_i_1;
+    } else {
+      res[i * 2] += diff_i_0;
+      res[i * 2 + 1] += diff_i_1;
+    }
+  }
+}
 
-  return res;
+template <bool ATOMIC, class Index, class Value>
+void SparseMatrix::mul_chunk_rows_block(
+    const size_t chunk_id,
+    const Index* indices,
+    const Value* values,
+    const double* vec,
+    const size_t n_vecs,
+    double* res) const {
+  const bool FLOAT_VALUES = std::is_same<Value, float>::value;
+  const auto& chunk = chunks[chunk_id];
+  const size_t n_rows = chunk.n_rows;
+  std::vector<double> diff_i(n_vecs);
+  size_t i = chunk_id * ROWS_PER_CHUNK * n_procs + proc_id;
+  for (size_t r = 0; r < n_rows; r++, i += n_procs) {
+    const double* vec_i = vec + i * n_vecs;
+    std::fill(diff_i.begin(), diff_i.end(), 0.0);
+    for (size_t k = chunk.offsets[r]; k < chunk.offsets[r + 1]; k++) {
+      const size_t j = indices[k];
+      const double H_ij = (FLOAT_VALUES && i == j) ? diag[i] : values[k];
+      const double* vec_j = vec + j * n_vecs;
+      for (size_t s = 0; s < n_vecs; s++) diff_i[s] += H_ij * vec_j[s];
+      if (i != j) {
+        double* res_j = res + j * n_vecs;
+        for (size_t s = 0; s < n_vecs; s++) {
+          const double diff_j = H_ij * vec_i[s];
+          if (ATOMIC) {
+#pragma omp atomic
+            res_j[s] += diff_j;
+          } else {
+            res_j[s] += diff_j;
+          }
+        }
+      }
+    }
+    double* res_i = res + i * n_vecs;
+    for (size_t s = 0; s < n_vecs; s++) {
+      if (ATOMIC) {
+#pragma omp atomic
+        res_i[s] += diff_i[s];
+      } else {
+        res_i[s] += diff_i[s];
+      }
+    }
+  }
 }
 
 std::vector<std::complex<double>> SparseMatrix::mul(
     const std::vector<std::complex<double>>& vec) const {
-  const size_t dim = rows.size();
-  std::vector<std::complex<double>> res(dim);
-  std::vector<double> tmp(dim);
-  std::vector<double> vec_tmp(dim);
+  // A complex vector is laid out as its real and imaginary parts interleaved, so both are
+  // multiplied in one pass with the pair kernel and reduced together.
+  std::vector<double> res_local(dim * 2, 0.0);
+  mul_local(reinterpret_cast<const double*>(vec.data()), 2, res_local);
+  const auto& res_pair = reduce_sum(res_local);
+  Util::free(res_local);
 
-  // First calculate the real part.
-  for (size_t i = 0; i < dim; i++) {
-    vec_tmp[i] = vec[i].real();
-  }
-  tmp = mul(vec_tmp);
+  std::vector<std::complex<double>> res(dim);
+#pragma omp parallel for
   for (size_t i = 0; i < dim; i++) {
-    res[i] = tmp[i];
+    res[i] = std::complex<double>(res_pair[i * 2], res_pair[i * 2 + 1]);
   }
+  return res;
+}
 
-  // Calculate the imag part.
+void SparseMatrix::mul(
+    const std::vector<double>& input_real,
+    const std::vector<double>& input_imag,
+    std::vector<double>& output_real,
+    std::vector<double>& output_imag) const {
+  std::vector<double> pair(dim * 2);
+#pragma omp parallel for
   for (size_t i = 0; i < dim; i++) {
-    vec_tmp[i] = vec[i].imag();
+    pair[i * 2] = input_real[i];
+    pair[i * 2 + 1] = input_imag[i];
   }
-  tmp = mul(vec_tmp);
+  std::vector<double> res_local(dim * 2, 0.0);
+  mul_local(pair.data(), 2, res_local);
+  Util::free(pair);
+  const auto& res_pair = reduce_sum(res_local);
+  Util::free(res_local);
+
+  output_real.resize(dim);
+  output_imag.resize(dim);
 #pragma omp parallel for
   for (size_t i = 0; i < dim; i++) {
-    res[i] += tmp[i] * Util::I;
+    output_real[i] = res_pair[i * 2];
+    output_imag[i] = res_pair[i * 2 + 1];
   }
-
-  return res;
 }
 
 void SparseMatrix::set_dim(const size_t dim) {
-  rows.resize(dim);
+  this->dim = dim;
+  const std::string& kernel = Config::get<std::string>("spmv_kernel", "buffered");
+  if (Util::str_equals_ci(kernel, "buffered")) {
+    spmv_kernel = SpmvKernel::BUFFERED;
+  } else if (Util::str_equals_ci(kernel, "atomic")) {
+    spmv_kernel = SpmvKernel::ATOMIC;
+  } else {
+    throw std::invalid_argument("unknown spmv_kernel: " + kernel);
+  }
+  memory_budget = Config::get<double>("hamiltonian_memory_budget", 0.0) * 1.0e9;
+  spill_dir = Config::get<std::string>("hamiltonian_spill_dir", ".");
+  proc_id = Parallel::get_proc_id();
+  n_procs = Parallel::get_n_procs();
+  const size_t n_local_rows = dim > proc_id ? (dim - proc_id + n_procs - 1) / n_procs : 0;
+  pending_rows.resize(n_local_rows);
   diag_local.resize(dim, 0.0);
   diag.resize(dim, 0.0);
 }
 
+void SparseMatrix::pack() {
+  const size_t n_local_rows = pending_rows.size();
+  if (n_local_rows == 0) return;
+  const bool wide_indices = dim > UINT32_MAX;
+  const bool float_values = this->float_values;
+  const size_t n_chunks = (n_local_rows + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK;
+  chunks.resize(n_chunks);
+
+  // Each thread packs the chunks it multiplies in the buffered kernel, so that their pages are
+  // first touched on the NUMA node of that thread when the threads are bound.
+  std::vector<size_t> n_elems_before(n_chunks + 1, 0);
+  for (size_t chunk_id = 0; chunk_id < n_chunks; chunk_id++) {
+    size_t n_elems = chunks[chunk_id].n_elems;
+    const size_t row_begin = chunk_id * ROWS_PER_CHUNK;
+    const size_t row_end = std::min(row_begin + ROWS_PER_CHUNK, n_local_rows);
+    for (size_t k = row_begin; k < row_end; k++) n_elems += pending_rows[k].size();
+    n_elems_before[chunk_id + 1] = n_elems_before[chunk_id] + n_elems;
+  }
+#pragma omp parallel
+  {
+    const auto& range =
+        get_thread_chunks(n_elems_before, omp_get_thread_num(), omp_get_num_threads());
+    for (size_t chunk_id = range.first; chunk_id < range.second; chunk_id++) {
+      pack_chunk(chunk_id, wide_indices, float_values);
+    }
+  }
+
+  Util::free(pending_rows);
+  spill();
+}
+
+void SparseMatrix::pack_chunk(
+    const size_t chunk_id, const bool wide_indices, const bool float_values) {
+  auto& chunk = chunks[chunk_id];
+  const size_t row_begin = chunk_id * ROWS_PER_CHUNK;
+  const size_t row_end = std::min(row_begin + ROWS_PER_CHUNK, pending_rows.size());
+  const size_t n_rows = row_end - row_begin;
+  size_t n_new_elems = 0;
+  for (size_t k = row_begin; k < row_end; k++) n_new_elems += pending_rows[k].size();
+  if (n_new_elems == 0 && n_rows == chunk.n_rows && chunk.wide_indices == wide_indices &&
+      chunk.float_values == float_values) {
+    return;
+  }
+
+  // Old elements of each row come first, followed by the newly appended ones.
+  Chunk packed;
+  packed.wide_indices = wide_indices;
+  packed.float_values = float_values;
+  const size_t n_elems = chunk.n_elems + n_new_elems;
+  if (wide_indices) {
+    packed.indices_64_data.reserve(n_elems);
+  } else {
+    packed.indices_32_data.reserve(n_elems);
+  }
+  if (float_values) {
+    packed.values_32_data.reserve(n_elems);
+  } else {
+    packed.values_data.reserve(n_elems);
+  }
+  packed.offsets_data.resize(n_rows + 1, 0);
+  const auto& push = [&](const size_t j, const double H) {
+    if (wide_indices) {
+      packed.indices_64_data.push_back(j);
+    } else {
+      packed.indices_32_data.push_back(static_cast<uint32_t>(j));
+    }
+    if (float_values) {
+      packed.values_32_data.push_back(static_cast<float>(H));
+    } else {
+      packed.values_data.push_back(H);
+    }
+  };
+  size_t n_packed_elems = 0;
+  for (size_t r = 0; r < n_rows; r++) {
+    if (r < chunk.n_rows) {
+      for (size_t k = chunk.offsets[r]; k < chunk.offsets[r + 1]; k++) {
+        push(chunk.get_index(k), chunk.get_value(k));
+      }
+    }
+    auto& row = pending_rows[row_begin + r];
+    for (size_t k = 0; k < row.size(); k++) push(row.get_index(k), row.get_value(k));
+    n_packed_elems += row.size();
+    if (r < chunk.n_rows) n_packed_elems += chunk.offsets[r + 1] - chunk.offsets[r];
+    row.clear();
+    packed.offsets_data[r + 1] = n_packed_elems;
+  }
+  packed.update_views();
+  chunk = std::move(packed);
+}
+
+size_t SparseMatrix::Chunk::count_n_bytes() const {
+  return offsets_data.capacity() * sizeof(size_t) + indices_32_data.capacity() * sizeof(uint32_t) +
+         indices_64_data.capacity() * sizeof(size_t) + values_data.capacity() * sizeof(double) +
+         values_32_data.capacity() * sizeof(float);
+}
+
+void SparseMatrix::Chunk::update_views() {
+  n_rows = offsets_data.empty() ? 0 : offsets_data.size() - 1;
+  n_elems = offsets_data.empty() ? 0 : offsets_data.back();
+  offsets = offsets_data.data();
+  indices_32 = indices_32_data.data();
+  indices_64 = indices_64_data.data();
+  values = values_data.data();
+  values_32 = values_32_data.data();
+}
+
+void SparseMatrix::Chunk::spill(const std::string& path) {
+  const void* parts[] = {offsets_data.data(),
+                         indices_32_data.data(),
+                         indices_64_data.data(),
+                         values_data.data(),
+                         values_32_data.data()};
+  const size_t part_bytes[] = {offsets_data.size() * sizeof(size_t),
+                               indices_32_data.size() * sizeof(uint32_t),
+                               indices_64_data.size() * sizeof(size_t),
+                               values_data.size() * sizeof(double),
+                               values_32_data.size() * sizeof(float)};
+  size_t part_offsets[5];
+  segment = SegmentFile(path, 5, parts, part_bytes, part_offsets);
+  char* data = segment.get_data();
+  offsets = reinterpret_cast<size_t*>(data + part_offsets[0]);
+  indices_32 = reinterpret_cast<uint32_t*>(data + part_offsets[1]);
+  indices_64 = reinterpret_cast<size_t*>(data + part_offsets[2]);
+  values = reinterpret_cast<double*>(data + part_offsets[3]);
+  values_32 = reinterpret_cast<float*>(data + part_offsets[4]);
+  Util::free(offsets_data);
+  Util::free(indices_32_data);
+  Util::free(indices_64_data);
+  Util::free(values_data);
+  Util::free(values_32_data);
+}
+
+void SparseMatrix::spill() {
+  if (memory_budget == 0) return;
+  size_t n_bytes = 0;
+  std::vector<size_t> spill_ids;
+  for (size_t chunk_id = 0; chunk_id < chunks.size(); chunk_id++) {
+    if (chunks[chunk_id].is_spilled()) continue;
+    n_bytes += chunks[chunk_id].count_n_bytes();
+    if (n_bytes > memory_budget) spill_ids.push_back(chunk_id);
+  }
+
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t i = 0; i < spill_ids.size(); i++) {
+    const size_t chunk_id = spill_ids[i];
+    chunks[chunk_id].spill(
+        Util::str_printf("%s/hamiltonian_%zu_%zu.seg", spill_dir.c_str(), proc_id, chunk_id));
+  }
+}
+
 void SparseMatrix::clear() {
-  rows.clear();
-  rows.shrink_to_fit();
+  dim = 0;
+  direct_mul = nullptr;
+  Util::free(chunks);
+  saved_file = SegmentFile();
+  Util::free(pending_rows);
+  Util::free(thread_partials);
   diag_local.clear();
   diag_local.shrink_to_fit();
   diag.clear();
   diag.shrink_to_fit();
 }
 
-void SparseMatrix::sort_row(const size_t i) { rows[i].sort(); }
+void SparseMatrix::save(const std::string& filename, const size_t tag) const {
+  if (!pending_rows.empty()) throw std::runtime_error("sparse matrix is not packed");
+  const bool wide_indices = !chunks.empty() && chunks[0].wide_indices;
+  const bool float_values = !chunks.empty() && chunks[0].float_values;
+
+  // Header, rows and elements of each chunk, local diagonal, then the arrays of each chunk.
+  std::vector<uint64_t> header = {SAVED_MATRIX_MAGIC,
+                                  tag,
+                                  dim,
+                                  n_procs,
+                                  proc_id,
+                                  chunks.size(),
+                                  wide_indices,
+                                  float_values};
+  for (const auto& chunk : chunks) {
+    header.push_back(chunk.n_rows);
+    header.push_back(chunk.n_elems);
+  }
+  std::vector<double> diag_owned;
+  for (size_t i = proc_id; i < dim; i += n_procs) diag_owned.push_back(diag_local[i]);
+
+  std::ofstream file(filename, std::ofstream::binary);
+  const auto& write = [&](const void* data, const size_t n_bytes) {
+    const char zeros[8] = {0};
+    file.write(static_cast<const char*>(data), n_bytes);
+    if (n_bytes % 8 != 0) file.write(zeros, 8 - n_bytes % 8);
+  };
+  write(header.data(), header.size() * sizeof(uint64_t));
+  write(diag_owned.data(), diag_owned.size() * sizeof(double));
+  for (const auto& chunk : chunks) {
+    write(chunk.offsets, (chunk.n_rows + 1) * sizeof(size_t));
+    if (wide_indices) {
+      write(chunk.indices_64, chunk.n_elems * sizeof(size_t));
+    } else {
+      write(chunk.indices_32, chunk.n_elems * sizeof(uint32_t));
+    }
+    if (float_values) {
+      write(chunk.values_32, chunk.n_elems * sizeof(float));
+    } else {
+      write(chunk.values, chunk.n_elems * sizeof(double));
+    }
+  }
+  if (!file) throw std::runtime_error("cannot write sparse matrix to " + filename);
+}
+
+bool SparseMatrix::load(const std::string& filename, const size_t tag) {
+  clear();
+  SegmentFile file(filename);
+  const size_t n_words = file.get_n_bytes() / sizeof(uint64_t);
+  const uint64_t* words = reinterpret_cast<const uint64_t*>(file.get_data());
+  const size_t N_HEADER_WORDS = 8;
+  int valid = n_words >= N_HEADER_WORDS && words[0] == SAVED_MATRIX_MAGIC && words[1] == tag &&
+              words[3] == static_cast<size_t>(Parallel::get_n_procs()) &&
+              words[4] == static_cast<size_t>(Parallel::get_proc_id()) &&
+              n_words >= N_HEADER_WORDS + words[5] * 2;
+  if (valid) {
+    // Also check the file holds all the arrays listed in the header.
+    const size_t n_index_bytes = words[6] ? sizeof(size_t) : sizeof(uint32_t);
+    const size_t n_value_bytes = words[7] ? sizeof(float) : sizeof(double);
+    const size_t n_owned = words[2] > words[4] ? (words[2] - words[4] - 1) / words[3] + 1 : 0;
+    size_t n_words_expected = N_HEADER_WORDS + words[5] * 2 + n_owned;
+    for (size_t chunk_id = 0; chunk_id < words[5]; chunk_id++) {
+      const size_t n_rows = words[N_HEADER_WORDS + chunk_id * 2];
+      const size_t n_elems = words[N_HEADER_WORDS + chunk_id * 2 + 1];
+      n_words_expected += n_rows + 1 + (n_elems * n_index_bytes + 7) / 8 +
+                          (n_elems * n_value_bytes + 7) / 8;
+    }
+    valid = n_words == n_words_expected;
+  }
+  int all_valid = 0;
+  MPI_Allreduce(&valid, &all_valid, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+  if (!all_valid) return false;
+
+  set_dim(words[2]);
+  Util::free(pending_rows);
+  const size_t n_chunks = words[5];
+  const bool wide_indices = words[6];
+  const bool float_values = words[7];
+  const size_t* chunk_sizes = words + N_HEADER_WORDS;
+  const char* data = file.get_data();
+  size_t offset = (N_HEADER_WORDS + n_chunks * 2) * sizeof(uint64_t);
+  const auto& take = [&](const size_t n_bytes) {
+    char* ptr = const_cast<char*>(data) + offset;
+    offset += (n_bytes + 7) / 8 * 8;
+    return ptr;
+  };
+
+  const size_t n_local_rows = dim > proc_id ? (dim - proc_id + n_procs - 1) / n_procs : 0;
+  const double* diag_owned = reinterpret_cast<const double*>(take(n_local_rows * sizeof(double)));
+  for (size_t i = proc_id, k = 0; i < dim; i += n_procs, k++) diag_local[i] = diag_owned[k];
+  chunks.resize(n_chunks);
+  for (size_t chunk_id = 0; chunk_id < n_chunks; chunk_id++) {
+    auto& chunk = chunks[chunk_id];
+    chunk.wide_indices = wide_indices;
+    chunk.float_values = float_values;
+    chunk.n_rows = chunk_sizes[chunk_id * 2];
+    chunk.n_elems = chunk_sizes[chunk_id * 2 + 1];
+    chunk.offsets = reinterpret_cast<size_t*>(take((chunk.n_rows + 1) * sizeof(size_t)));
+    if (wide_indices) {
+      chunk.indices_64 = reinterpret_cast<size_t*>(take(chunk.n_elems * sizeof(size_t)));
+    } else {
+      chunk.indices_32 = reinterpret_cast<uint32_t*>(take(chunk.n_elems * sizeof(uint32_t)));
+    }
+    if (float_values) {
+      chunk.values_32 = reinterpret_cast<float*>(take(chunk.n_elems * sizeof(float)));
+    } else {
+      chunk.values = reinterpret_cast<double*>(take(chunk.n_elems * sizeof(double)));
+    }
+  }
+  saved_file = std::move(file);
+  this->float_values = float_values;
+  diag = reduce_sum(diag_local);
+  return true;
+}
+
+SparseRow SparseMatrix::get_row(const size_t i) const {
+  if (!is_local_row(i)) return SparseRow();
+  const size_t k = i / n_procs;
+  const size_t chunk_id = k / ROWS_PER_CHUNK;
+  const size_t r = k % ROWS_PER_CHUNK;
+  if (chunk_id >= chunks.size() || r >= chunks[chunk_id].n_rows) return SparseRow();
+  const auto& chunk = chunks[chunk_id];
+  const size_t begin = chunk.offsets[r];
+  const size_t n_elems = chunk.offsets[r + 1] - begin;
+  const uint32_t* indices_32 = chunk.wide_indices ? nullptr : chunk.indices_32 + begin;
+  const size_t* indices_64 = chunk.wide_indices ? chunk.indices_64 + begin : nullptr;
+  const double* values = chunk.float_values ? nullptr : chunk.values + begin;
+  const float* values_32 = chunk.float_values ? chunk.values_32 + begin : nullptr;
+  return SparseRow(indices_32, indices_64, values, values_32, n_elems);
+}
+
+void SparseMatrix::sort_row(const size_t i) {
+  const SparseRow row = get_row(i);
+  const size_t n_elems = row.size();
+  if (n_elems == 0) return;
+  std::vector<size_t> indices = row.get_connections();
+  std::vector<double> values(n_elems);
+  for (size_t k = 0; k < n_elems; k++) values[k] = row.get_value(k);
+  Util::sort_by_first<size_t, double>(indices, values);
 
-void SparseMatrix::cache_diag() { diag = reduce_sum(diag_local); }
+  const size_t local_id = i / n_procs;
+  auto& chunk = chunks[local_id / ROWS_PER_CHUNK];
+  const size_t begin = chunk.offsets[local_id % ROWS_PER_CHUNK];
+  for (size_t k = 0; k < n_elems; k++) {
+    if (chunk.wide_indices) {
+      chunk.indices_64[begin + k] = indices[k];
+    } else {
+      chunk.indices_32[begin + k] = static_cast<uint32_t>(indices[k]);
+    }
+    if (chunk.float_values) {
+      chunk.values_32[begin + k] = static_cast<float>(values[k]);
+    } else {
+      chunk.values[begin + k] = values[k];
+    }
+  }
+}
+
+void SparseMatrix::zero_out_row(const size_t i) {
+  if (!is_local_row(i)) return;
+  const size_t k = i / n_procs;
+  if (k < pending_rows.size()) pending_rows[k].clear();
+  const size_t chunk_id = k / ROWS_PER_CHUNK;
+  const size_t r = k % ROWS_PER_CHUNK;
+  if (chunk_id >= chunks.size() || r >= chunks[chunk_id].n_rows) return;
+  auto& chunk = chunks[chunk_id];
+  for (size_t j = chunk.offsets[r]; j < chunk.offsets[r + 1]; j++) {
+    if (chunk.float_values) {
+      chunk.values_32[j] = 0.0f;
+    } else {
+      chunk.values[j] = 0.0;
+    }
+  }
+}
+
+void SparseMatrix::revalue(const std::function<double(const size_t, const size_t)>& get_elem) {
+  pack();
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t chunk_id = 0; chunk_id < chunks.size(); chunk_id++) {
+    auto& chunk = chunks[chunk_id];
+    for (size_t r = 0; r < chunk.n_rows; r++) {
+      const size_t i = (chunk_id * ROWS_PER_CHUNK + r) * n_procs + proc_id;
+      for (size_t k = chunk.offsets[r]; k < chunk.offsets[r + 1]; k++) {
+        const size_t j = chunk.get_index(k);
+        const double elem = get_elem(i, j);
+        if (chunk.float_values) {
+          chunk.values_32[k] = static_cast<float>(elem);
+        } else {
+          chunk.values[k] = elem;
+        }
+        if (i == j) diag_local[i] = elem;
+      }
+    }
+  }
+  diag = reduce_sum(diag_local);
+}
+
+void SparseMatrix::cache_diag() {
+  pack();
+  diag = reduce_sum(diag_local);
+}
 
 std::vector<double> SparseMatrix::reduce_sum(const std::vector<double>& vec) const {
   const size_t dim = vec.size();
@@ -120,9 +921,7 @@ std::vector<double> SparseMatrix::reduce_sum(const std::vector<double>& vec) con
 }
 
 std::vector<std::vector<size_t>> SparseMatrix::get_connections() const {
-  std::vector<std::vector<size_t>> connections;
-  for (const auto& row : rows) {
-    connections.push_back(row.get_connections());
-  }
+  std::vector<std::vector<size_t>> connections(dim);
+  for (size_t i = 0; i < dim; i++) connections[i] = get_row(i).get_connections();
   return connections;
 }
@@ -2,12 +2,69 @@
 
 #include <climits>
 #include <complex>
+#include <cstdint>
+#include <functional>
+#include <string>
 #include <vector>
 #include "../parallel.h"
 #include "../timer.h"
 #include "../util.h"
+#include "segment_file.h"
 #include "sparse_vector.h"
 
+// Kernels for the symmetric matrix-vector multiplication.
+// ATOMIC scatters the transpose contributions with atomics.
+// BUFFERED accumulates them into per-thread buffers merged afterwards.
+enum class SpmvKernel { ATOMIC, BUFFERED };
+
+// Read-only view of one row of the packed storage.
+class SparseRow {
+ public:
+  SparseRow() {}
+
+  SparseRow(
+      const uint32_t* indices_32,
+      const size_t* indices_64,
+      const double* values,
+      const float* values_32,
+      const size_t n_elems)
+      : indices_32(indices_32),
+        indices_64(indices_64),
+        values(values),
+        values_32(values_32),
+        n_elems(n_elems) {}
+
+  size_t size() const { return n_elems; }
+
+  size_t get_index(const size_t i) const { return indices_32 ? indices_32[i] : indices_64[i]; }
+
+  double get_value(const size_t i) const { return values ? values[i] : values_32[i]; }
+
+  void print() const {
+    for (size_t i = 0; i < n_elems; i++) printf("%zu: %.12f\n", get_index(i), get_value(i));
+    printf("n elems: %zu\n", n_elems);
+  }
+
+  std::vector<size_t> get_connections() const {
+    std::vector<size_t> connections(n_elems);
+    for (size_t i = 0; i < n_elems; i++) connections[i] = get_index(i);
+    return connections;
+  }
+
+ private:
+  const uint32_t* indices_32 = nullptr;
+
+  const size_t* indices_64 = nullptr;
+
+  const double* values = nullptr;
+
+  const float* values_32 = nullptr;
+
+  size_t n_elems = 0;
+};
+
+// Rows are owned by processes in a round-robin way (row i lives on proc i % n_procs).
+// Elements are staged per row by append_elem and moved into compact CSR chunks by pack().
 class SparseMatrix {
  public:
   double get_diag(const size_t i) const { return diag[i]; }
@@ -17,41 +74,237 @@ class SparseMatrix {
   void cache_diag();
 
   size_t count_n_elems() const;
- 
-  size_t count_n_rows() const { return rows.size(); }
+
+  // Total bytes used by the matrix elements in memory over all procs.
+  size_t count_n_bytes() const;
+
+  // Total bytes of the matrix elements spilled to disk over all procs.
+  size_t count_n_bytes_on_disk() const;
+
+  size_t count_n_rows() const { return dim; }
+
+  // Mean |i - j| of the packed off-diagonal elements over all procs, with the rows and columns
+  // renumbered to new_ids[i] if given.
+  double get_mean_bandwidth(const std::vector<size_t>& new_ids = std::vector<size_t>()) const;
 
   std::vector<double> mul(const std::vector<double>& vec) const;
- 
+
   std::vector<std::complex<double>> mul(const std::vector<std::complex<double>>& vec) const;
 
+  // Multiply a block of vectors with one pass over the matrix and one reduction.
+  std::vector<std::vector<double>> mul(const std::vector<std::vector<double>>& vecs) const;
+
+  // Vectors can also be distributed: each proc owns the contiguous slice
+  // [get_slice_begin(), get_slice_end()) of every vector.
+  size_t get_slice_begin() const { return get_slice_begin(proc_id); }
+
+  size_t get_slice_end() const { return get_slice_begin(proc_id + 1); }
+
+  // Multiply a block of distributed vectors, given and returned as the local slices.
+  // The slices are gathered before the multiplication and the results reduce-scattered back.
+  std::vector<std::vector<double>> mul_slices(
+      const std::vector<std::vector<double>>& slices) const;
+
+  // Assemble the full vector from the local slices of all procs.
+  std::vector<double> gather_slices(const std::vector<double>& slice) const;
+
+  // Slices of a block of n_vecs interleaved vectors, gathered to / summed from all procs.
+  void allgather_slices(const double* local, const size_t n_vecs, double* full) const;
+
+  void reduce_scatter_slices(const double* full, const size_t n_vecs, double* local) const;
+
   void mul(
       const std::vector<double>& input_real,
       const std::vector<double>& input_imag,
       std::vector<double>& output_real,
       std::vector<double>& output_imag) const;
 
+  // Call set_dim before each round of appends, and pack after it.
+  // Elements of rows owned by other procs are dropped.
   void append_elem(const size_t i, const size_t j, const double& elem);
 
   void set_dim(const size_t dim);
 
+  // Store the elements in single precision from the next pack on. The diagonal is still taken
+  // from the double precision cache and the multiplications accumulate in double.
+  void set_float_values(const bool float_values) { this->float_values = float_values; }
+
+  bool has_float_values() const { return float_values; }
+
+  // Add the contributions of elements that are not stored, computed on the fly by direct_mul.
+  // It receives the interleaved block of vectors and accumulates into the local result.
+  void set_direct_mul(
+      const std::function<void(const double*, const size_t, std::vector<double>&)>& direct_mul) {
+    this->direct_mul = direct_mul;
+  }
+
+  bool has_direct_mul() const { return static_cast<bool>(direct_mul); }
+
+  void pack();
+
   void clear();
 
+  // Write the packed rows and the diagonal elements owned by this proc to filename, with a tag
+  // identifying what the matrix was built from.
+  void save(const std::string& filename, const size_t tag) const;
+
+  // Map the rows from a file written by save() with the same tag and number of procs.
+  // Collective, returns false and leaves the matrix empty unless every proc finds its file.
+  bool load(const std::string& filename, const size_t tag);
+
+  // Sort the packed elements of a row by column index.
   void sort_row(const size_t i);
 
-  void print_row(const size_t i) const { rows[i].print(); }
+  void print_row(const size_t i) const { get_row(i).print(); }
+
+  SparseRow get_row(const size_t i) const;
 
-  const SparseVector& get_row(const size_t i) const { return rows[i]; }
+  void zero_out_row(const size_t i);
 
-  void zero_out_row(size_t i) { rows[i].zero_out_vector(); };
+  // Replace each stored element (i, j) with get_elem(i, j), keeping the sparsity pattern, and
+  // recache the diagonal. Collective.
+  void revalue(const std::function<double(const size_t, const size_t)>& get_elem);
 
   std::vector<std::vector<size_t>> get_connections() const;
 
  private:
-  std::vector<SparseVector> rows;
-  
+  // Rows of a chunk are kept in the vectors, or in a segment file once spilled out of memory.
+  // The pointers view the arrays of whichever storage is in use.
+  struct Chunk {
+    bool wide_indices = false;
+
+    bool float_values = false;
+
+    size_t n_rows = 0;
+
+    size_t n_elems = 0;
+
+    size_t* offsets = nullptr;
+
+    uint32_t* indices_32 = nullptr;
+
+    size_t* indices_64 = nullptr;
+
+    double* values = nullptr;
+
+    float* values_32 = nullptr;
+
+    std::vector<size_t> offsets_data;
+
+    std::vector<uint32_t> indices_32_data;
+
+    std::vector<size_t> indices_64_data;
+
+    std::vector<double> values_data;
+
+    std::vector<float> values_32_data;
+
+    SegmentFile segment;
+
+    size_t get_index(const size_t k) const {
+      return wide_indices ? indices_64[k] : indices_32[k];
+    }
+
+    double get_value(const size_t k) const { return float_values ? values_32[k] : values[k]; }
+
+    bool is_spilled() const { return segment.is_mapped(); }
+
+    // Bytes of the vectors.
+    size_t count_n_bytes() const;
+
+    // Point the views to the vectors.
+    void update_views();
+
+    // Move the arrays into a segment file at path.
+    void spill(const std::string& path);
+  };
+
+  size_t dim = 0;
+
+  size_t proc_id = 0;
+
+  size_t n_procs = 1;
+
+  SpmvKernel spmv_kernel = SpmvKernel::BUFFERED;
+
+  bool float_values = false;
+
+  // Per proc bytes of the packed chunks kept in memory before spilling the rest to disk.
+  // Zero keeps everything in memory.
+  size_t memory_budget = 0;
+
+  std::string spill_dir;
+
+  std::vector<Chunk> chunks;
+
+  // File mapped by load(), viewed by the chunks until they are rebuilt.
+  SegmentFile saved_file;
+
+  std::vector<SparseVector> pending_rows;
+
   std::vector<double> diag_local;
 
+  std::function<void(const double*, const size_t, std::vector<double>&)> direct_mul;
+
   std::vector<double> diag;
 
+  // Results of the threads after the first in mul_buffered, kept between the multiplications
+  // and all zeros outside of them.
+  mutable std::vector<std::vector<double>> thread_partials;
+
+  bool is_local_row(const size_t i) const { return i % n_procs == proc_id; }
+
+  size_t get_slice_begin(const size_t p) const { return dim * p / n_procs; }
+
+  void pack_chunk(const size_t chunk_id, const bool wide_indices, const bool float_values);
+
+  // Spill the chunks beyond the memory budget to segment files.
+  void spill();
+
+  // Vectors of a block are interleaved, i.e. element j of vector s is at j * n_vecs + s.
+  void mul_local(const double* vec, const size_t n_vecs, std::vector<double>& res_local) const;
+
+  void mul_atomic(const double* vec, const size_t n_vecs, std::vector<double>& res_local) const;
+
+  void mul_buffered(const double* vec, const size_t n_vecs, std::vector<double>& res_local) const;
+
+  template <bool ATOMIC>
+  void mul_chunk(const size_t chunk_id, const double* vec, const size_t n_vecs, double* res) const;
+
+  template <bool ATOMIC, class Index>
+  void mul_chunk(
+      const size_t chunk_id,
+      const Index* indices,
+      const double* vec,
+      const size_t n_vecs,
+      double* res) const;
+
+  // Diagonal elements of single precision chunks are taken from diag.
+  template <bool ATOMIC, class Index, class Value>
+  void mul_chunk_rows(
+      const size_t chunk_id,
+      const Index* indices,
+      const Value* values,
+      const double* vec,
+      double* res) const;
+
+  // Two interleaved vectors, such as the real and imaginary parts of a complex one.
+  template <bool ATOMIC, class Index, class Value>
+  void mul_chunk_rows_pair(
+      const size_t chunk_id,
+      const Index* indices,
+      const Value* values,
+      const double* vec,
+      double* res) const;
+
+  template <bool ATOMIC, class Index, class Value>
+  void mul_chunk_rows_block(
+      const size_t chunk_id,
+      const Index* indices,
+      const Value* values,
+      const double* vec,
+      const size_t n_vecs,
+      double* res) const;
+
   std::vector<double> reduce_sum(const std::vector<double>& vec) const;
 };
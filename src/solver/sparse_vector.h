@@ -36,6 +36,11 @@ class SparseVector {
 
   std::vector<size_t> get_connections() const { return indices; }
 
+  void clear() {
+    Util::free(indices);
+    Util::free(values);
+  }
+
  private:  
   std::vector<size_t> indices;
 
@@ -0,0 +1,548 @@
+#pragma once
+
+#include <hps/src/hps.h>
+#include <mpi.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../det/det.h"
+#include "../parallel.h"
+#include "../util.h"
+
+// Sharded wavefunction files: a magic word, the size of the header, the header with the offsets
+// of the chunks of dets, then each chunk as its dets followed by its coefs of each state. All the
+// procs write their share of the chunks and read their share back, which they then exchange.
+// The dets are stored as plain words, or compressed as the orbitals that flip from the previous
+// det of the chunk, which also makes the files independent of N_CHUNKS.
+// S is a system with the public n_up, n_dn, dets, coefs, energy_hf and energy_var.
+// The hps files are the whole system serialized by hps, which writes each half det as N_CHUNKS
+// words, after a prefix with the N_CHUNKS of the dets.
+class WfFile {
+ public:
+  // Of the variation with eps_var, in either format.
+  static std::string get_filename(const double eps_var) {
+    return Util::str_printf("wf_eps1_%#.2e.dat", eps_var);
+  }
+
+  // Collective.
+  template <class S>
+  static void save(const S& system, const std::string& filename, const bool compress);
+
+  // Collective. Loads the dets with |c| of at least coef_min in some state, in their saved order,
+  // skipping the chunks below it. Returns false if the file is missing or in another format.
+  template <class S>
+  static bool load(S& system, const std::string& filename, const double coef_min = 0.0);
+
+  // Collective. Written by the master.
+  template <class S>
+  static void save_hps(const S& system, const std::string& filename);
+
+  // Collective. All the procs read the whole file. Returns false if it is missing, throws if its
+  // dets are of another N_CHUNKS. Files from before the prefix are read as dets of this build.
+  template <class S>
+  static bool load_hps(S& system, const std::string& filename);
+
+  // N_CHUNKS of the dets of filename in either format, for the builds with the extras of this
+  // one, read without MPI. 0 if it is missing or readable by the builds of any N_CHUNKS. The hps
+  // files without the prefix count as of this build.
+  static unsigned get_n_chunks(const std::string& filename);
+
+ private:
+  // The magic word and the size of the header.
+  static constexpr size_t PREFIX_SIZE = 16;
+
+  static constexpr size_t CHUNK_SIZE = 1 << 16;
+
+  // Bytes per MPI call, below the int counts.
+  static constexpr size_t MAX_IO_BYTES = 1 << 30;
+
+  struct Header {
+    unsigned n_up;
+
+    unsigned n_dn;
+
+    unsigned n_states;
+
+    double energy_hf;
+
+    std::vector<double> energy_var;
+
+    bool compressed;
+
+    // Bytes of a plain det, which must match this build without compression.
+    unsigned det_bytes;
+
+    size_t n_dets;
+
+    // Offsets from the end of the header, one past the last chunk included.
+    std::vector<size_t> chunk_offsets;
+
+    // Largest |c| over the states of each chunk.
+    std::vector<double> chunk_max_abs_coefs;
+
+    size_t get_n_chunks() const { return chunk_max_abs_coefs.size(); }
+
+    size_t get_chunk_n_dets(const size_t chunk_id) const {
+      const size_t n_left = n_dets - chunk_id * CHUNK_SIZE;
+      if (n_left < CHUNK_SIZE) return n_left;
+      return CHUNK_SIZE;
+    }
+
+    template <class B>
+    void serialize(B& buf) const {
+      buf << n_up << n_dn << n_states << energy_hf << energy_var << compressed << det_bytes
+          << n_dets << chunk_offsets << chunk_max_abs_coefs;
+    }
+
+    template <class B>
+    void parse(B& buf) {
+      buf >> n_up >> n_dn >> n_states >> energy_hf >> energy_var >> compressed >> det_bytes >>
+          n_dets >> chunk_offsets >> chunk_max_abs_coefs;
+    }
+  };
+
+  static const char* get_magic() { return "SHCIWFS1"; }
+
+  // Followed by N_CHUNKS and whether the half dets have extras, as two uint32_t.
+  static const char* get_hps_magic() { return "SHCIWFH1"; }
+
+  static std::string get_hps_prefix();
+
+  // Bytes of a plain det of a build of n_chunks with the extras of this one.
+  static unsigned get_det_bytes(const unsigned n_chunks) {
+    return sizeof(Det) - (N_CHUNKS - n_chunks) * 2 * sizeof(uint64_t);
+  }
+
+  static void append_varint(std::string& str, size_t value);
+
+  static size_t read_varint(const char*& ptr);
+
+  static void append_flips(std::string& str, const HalfDet& prev, const HalfDet& half_det);
+
+  static void read_flips(const char*& ptr, HalfDet& half_det);
+
+  static void encode_dets(
+      std::string& str, const Det* dets, const size_t n_dets, const bool compress);
+
+  static void decode_dets(
+      const char* ptr, Det* dets, const size_t n_dets, const bool compress);
+
+  static void write_at_all(
+      MPI_File file, const size_t offset, const char* data, const size_t n_bytes);
+
+  static void read_at(MPI_File file, const size_t offset, char* data, const size_t n_bytes);
+
+  static void broadcast_bytes(void* data, const size_t n_bytes, const int root);
+
+  static size_t get_io_count(const size_t n_bytes_left) {
+    if (n_bytes_left < MAX_IO_BYTES) return n_bytes_left;
+    return MAX_IO_BYTES;
+  }
+
+  // The share [begin, end) of proc_id of n items.
+  static size_t get_share_begin(const size_t n, const int proc_id) {
+    return n * proc_id / Parallel::get_n_procs();
+  }
+};
+
+template <class S>
+void WfFile::save(const S& system, const std::string& filename, const bool compress) {
+  const size_t n_states = system.coefs.size();
+  const size_t n_dets = system.dets.size();
+  const size_t n_chunks = (n_dets + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  const int proc_id = Parallel::get_proc_id();
+  const size_t chunk_begin = get_share_begin(n_chunks, proc_id);
+  const size_t chunk_end = get_share_begin(n_chunks, proc_id + 1);
+
+  Header header;
+  header.n_up = system.n_up;
+  header.n_dn = system.n_dn;
+  header.n_states = n_states;
+  header.energy_hf = system.energy_hf;
+  header.energy_var = system.energy_var;
+  header.compressed = compress;
+  header.det_bytes = sizeof(Det);
+  header.n_dets = n_dets;
+  header.chunk_max_abs_coefs.assign(n_chunks, 0.0);
+
+  // Encode the chunks of this proc.
+  std::vector<std::string> blocks(chunk_end - chunk_begin);
+  std::vector<unsigned long long> n_block_bytes(n_chunks, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t chunk_id = chunk_begin; chunk_id < chunk_end; chunk_id++) {
+    const size_t begin = chunk_id * CHUNK_SIZE;
+    const size_t n_chunk_dets = header.get_chunk_n_dets(chunk_id);
+    std::string& block = blocks[chunk_id - chunk_begin];
+    encode_dets(block, system.dets.data() + begin, n_chunk_dets, compress);
+    double max_abs_coef = 0.0;
+    for (size_t s = 0; s < n_states; s++) {
+      const double* coefs = system.coefs[s].data() + begin;
+      block.append(reinterpret_cast<const char*>(coefs), n_chunk_dets * sizeof(double));
+      for (size_t i = 0; i < n_chunk_dets; i++) {
+        max_abs_coef = std::max(max_abs_coef, std::abs(coefs[i]));
+      }
+    }
+    header.chunk_max_abs_coefs[chunk_id] = max_abs_coef;
+    n_block_bytes[chunk_id] = block.size();
+  }
+  MPI_Allreduce(
+      MPI_IN_PLACE,
+      n_block_bytes.data(),
+      n_chunks,
+      MPI_UNSIGNED_LONG_LONG,
+      MPI_SUM,
+      MPI_COMM_WORLD);
+  MPI_Allreduce(
+      MPI_IN_PLACE,
+      header.chunk_max_abs_coefs.data(),
+      n_chunks,
+      MPI_DOUBLE,
+      MPI_MAX,
+      MPI_COMM_WORLD);
+  header.chunk_offsets.assign(n_chunks + 1, 0);
+  for (size_t chunk_id = 0; chunk_id < n_chunks; chunk_id++) {
+    header.chunk_offsets[chunk_id + 1] = header.chunk_offsets[chunk_id] + n_block_bytes[chunk_id];
+  }
+
+  std::string prefix(get_magic(), 8);
+  const std::string& serialized_header = hps::to_string(header);
+  const uint64_t header_size = serialized_header.size();
+  prefix.append(reinterpret_cast<const char*>(&header_size), sizeof(header_size));
+  prefix.append(serialized_header);
+
+  MPI_File file;
+  const int error = MPI_File_open(
+      MPI_COMM_WORLD, filename.c_str(), MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &file);
+  if (error) throw std::runtime_error("cannot create " + filename);
+  MPI_File_set_size(file, 0);
+  write_at_all(file, 0, prefix.data(), Parallel::is_master() ? prefix.size() : 0);
+  std::string data;
+  for (const auto& block : blocks) data.append(block);
+  blocks.clear();
+  write_at_all(
+      file, prefix.size() + header.chunk_offsets[chunk_begin], data.data(), data.size());
+  MPI_File_close(&file);
+}
+
+template <class S>
+bool WfFile::load(S& system, const std::string& filename, const double coef_min) {
+  MPI_File file;
+  const int error =
+      MPI_File_open(MPI_COMM_WORLD, filename.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
+  if (error) return false;
+  MPI_Offset file_size;
+  MPI_File_get_size(file, &file_size);
+  char prefix[PREFIX_SIZE];
+  if (static_cast<size_t>(file_size) < PREFIX_SIZE) {
+    MPI_File_close(&file);
+    return false;
+  }
+  read_at(file, 0, prefix, PREFIX_SIZE);
+  if (std::memcmp(prefix, get_magic(), 8) != 0) {
+    MPI_File_close(&file);
+    return false;
+  }
+  uint64_t header_size;
+  std::memcpy(&header_size, prefix + 8, sizeof(header_size));
+  std::string serialized_header(header_size, '\0');
+  read_at(file, PREFIX_SIZE, &serialized_header[0], header_size);
+  const auto& header = hps::from_string<Header>(serialized_header);
+  const size_t data_begin = PREFIX_SIZE + header_size;
+  if (!header.compressed && header.det_bytes != sizeof(Det)) {
+    throw std::invalid_argument(
+        filename + " has dets of another N_CHUNKS, save it with wf_compress_dets");
+  }
+
+  // Read and decode the chunks of this proc among the ones above coef_min.
+  const size_t n_states = header.n_states;
+  std::vector<size_t> chunk_ids;
+  for (size_t chunk_id = 0; chunk_id < header.get_n_chunks(); chunk_id++) {
+    if (header.chunk_max_abs_coefs[chunk_id] >= coef_min) chunk_ids.push_back(chunk_id);
+  }
+  const int proc_id = Parallel::get_proc_id();
+  const size_t share_begin = get_share_begin(chunk_ids.size(), proc_id);
+  const size_t share_end = get_share_begin(chunk_ids.size(), proc_id + 1);
+  std::vector<std::string> blocks(share_end - share_begin);
+  for (size_t k = share_begin; k < share_end; k++) {
+    const size_t chunk_id = chunk_ids[k];
+    const size_t n_bytes = header.chunk_offsets[chunk_id + 1] - header.chunk_offsets[chunk_id];
+    std::string& block = blocks[k - share_begin];
+    block.resize(n_bytes);
+    read_at(file, data_begin + header.chunk_offsets[chunk_id], &block[0], n_bytes);
+  }
+  MPI_File_close(&file);
+
+  std::vector<std::vector<Det>> chunk_dets(blocks.size());
+  std::vector<std::vector<std::vector<double>>> chunk_coefs(blocks.size());
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t k = 0; k < blocks.size(); k++) {
+    const size_t n_chunk_dets = header.get_chunk_n_dets(chunk_ids[share_begin + k]);
+    const std::string& block = blocks[k];
+    std::vector<Det> dets(n_chunk_dets);
+    decode_dets(block.data(), dets.data(), n_chunk_dets, header.compressed);
+    const char* coefs_ptr = block.data() + block.size() - n_states * n_chunk_dets * sizeof(double);
+    std::vector<std::vector<double>> coefs(n_states, std::vector<double>(n_chunk_dets));
+    for (size_t s = 0; s < n_states; s++) {
+      std::memcpy(
+          coefs[s].data(),
+          coefs_ptr + s * n_chunk_dets * sizeof(double),
+          n_chunk_dets * sizeof(double));
+    }
+    size_t n_kept = 0;
+    for (size_t i = 0; i < n_chunk_dets; i++) {
+      double max_abs_coef = 0.0;
+      for (size_t s = 0; s < n_states; s++) {
+        max_abs_coef = std::max(max_abs_coef, std::abs(coefs[s][i]));
+      }
+      if (max_abs_coef < coef_min) continue;
+      dets[n_kept] = dets[i];
+      for (size_t s = 0; s < n_states; s++) coefs[s][n_kept] = coefs[s][i];
+      n_kept++;
+    }
+    dets.resize(n_kept);
+    for (auto& state_coefs : coefs) state_coefs.resize(n_kept);
+    chunk_dets[k] = std::move(dets);
+    chunk_coefs[k] = std::move(coefs);
+    blocks[k].clear();
+    blocks[k].shrink_to_fit();
+  }
+
+  // Gather the dets of all the procs in the saved order.
+  const int n_procs = Parallel::get_n_procs();
+  std::vector<unsigned long long> n_proc_dets(n_procs, 0);
+  for (const auto& dets : chunk_dets) n_proc_dets[proc_id] += dets.size();
+  MPI_Allreduce(
+      MPI_IN_PLACE, n_proc_dets.data(), n_procs, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  std::vector<size_t> proc_begins(n_procs + 1, 0);
+  for (int i = 0; i < n_procs; i++) proc_begins[i + 1] = proc_begins[i] + n_proc_dets[i];
+  const size_t n_dets = proc_begins[n_procs];
+  system.dets.clear();
+  system.dets.shrink_to_fit();
+  system.dets.resize(n_dets);
+  system.coefs.assign(n_states, std::vector<double>());
+  for (auto& coefs : system.coefs) coefs.resize(n_dets);
+  size_t pos = proc_begins[proc_id];
+  for (size_t k = 0; k < chunk_dets.size(); k++) {
+    std::copy(chunk_dets[k].begin(), chunk_dets[k].end(), system.dets.begin() + pos);
+    for (size_t s = 0; s < n_states; s++) {
+      std::copy(chunk_coefs[k][s].begin(), chunk_coefs[k][s].end(), system.coefs[s].begin() + pos);
+    }
+    pos += chunk_dets[k].size();
+  }
+  chunk_dets.clear();
+  chunk_coefs.clear();
+  for (int root = 0; root < n_procs; root++) {
+    const size_t begin = proc_begins[root];
+    const size_t n_root_dets = proc_begins[root + 1] - begin;
+    broadcast_bytes(system.dets.data() + begin, n_root_dets * sizeof(Det), root);
+    for (size_t s = 0; s < n_states; s++) {
+      broadcast_bytes(system.coefs[s].data() + begin, n_root_dets * sizeof(double), root);
+    }
+  }
+
+  system.n_up = header.n_up;
+  system.n_dn = header.n_dn;
+  system.energy_hf = header.energy_hf;
+  system.energy_var = header.energy_var;
+  return true;
+}
+
+template <class S>
+void WfFile::save_hps(const S& system, const std::string& filename) {
+  if (!Parallel::is_master()) return;
+  std::ofstream file(filename, std::ofstream::binary);
+  file << get_hps_prefix();
+  hps::to_stream(system, file);
+}
+
+template <class S>
+bool WfFile::load_hps(S& system, const std::string& filename) {
+  std::string serialized;
+  const int TRUNK_SIZE = 1 << 20;
+  char buffer[TRUNK_SIZE];
+  MPI_File file;
+  int error;
+  error = MPI_File_open(MPI_COMM_WORLD, filename.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
+  if (error) return false;
+  MPI_Offset size;
+  MPI_File_get_size(file, &size);
+  MPI_Status status;
+
+  // The prefix is checked before the rest is read, and kept if it is not one.
+  const std::string& prefix = get_hps_prefix();
+  const int n_prefix_bytes = std::min<MPI_Offset>(size, prefix.size());
+  MPI_File_read_all(file, buffer, n_prefix_bytes, MPI_CHAR, &status);
+  size -= n_prefix_bytes;
+  if (n_prefix_bytes == static_cast<int>(prefix.size()) &&
+      std::memcmp(buffer, get_hps_magic(), 8) == 0) {
+    if (std::memcmp(buffer, prefix.data(), prefix.size()) != 0) {
+      MPI_File_close(&file);
+      uint32_t layout[2];
+      std::memcpy(layout, buffer + 8, sizeof(layout));
+      throw std::invalid_argument(Util::str_printf(
+          "%s has dets of N_CHUNKS %u%s, this build has N_CHUNKS %u%s",
+          filename.c_str(),
+          layout[0],
+          layout[1] ? " with INF_ORBS" : "",
+          N_CHUNKS,
+          prefix[12] ? " with INF_ORBS" : ""));
+    }
+  } else {
+    serialized.append(buffer, n_prefix_bytes);
+  }
+  while (size > TRUNK_SIZE) {
+    // Parallel File loading and tree distribution.
+    MPI_File_read_all(file, buffer, TRUNK_SIZE, MPI_CHAR, &status);
+    serialized.append(buffer, TRUNK_SIZE);
+    size -= TRUNK_SIZE;
+  }
+  MPI_File_read_all(file, buffer, size, MPI_CHAR, &status);
+  serialized.append(buffer, size);
+  MPI_File_close(&file);
+  hps::from_string(serialized, system);
+  return true;
+}
+
+inline unsigned WfFile::get_n_chunks(const std::string& filename) {
+  std::ifstream file(filename, std::ifstream::binary);
+  if (!file) return 0;
+  char prefix[PREFIX_SIZE];
+  if (!file.read(prefix, PREFIX_SIZE)) return N_CHUNKS;
+  if (std::memcmp(prefix, get_hps_magic(), 8) == 0) {
+    uint32_t n_chunks;
+    std::memcpy(&n_chunks, prefix + 8, sizeof(n_chunks));
+    return n_chunks;
+  }
+  if (std::memcmp(prefix, get_magic(), 8) != 0) return N_CHUNKS;
+  uint64_t header_size;
+  std::memcpy(&header_size, prefix + 8, sizeof(header_size));
+  std::string serialized_header(header_size, '\0');
+  if (!file.read(&serialized_header[0], header_size)) return 0;
+  const auto& header = hps::from_string<Header>(serialized_header);
+  if (header.compressed) return 0;
+  for (unsigned n_chunks = 1; n_chunks <= 64; n_chunks++) {
+    if (get_det_bytes(n_chunks) == header.det_bytes) return n_chunks;
+  }
+  return 0;
+}
+
+inline std::string WfFile::get_hps_prefix() {
+  std::string prefix(get_hps_magic(), 8);
+  const uint32_t n_chunks = N_CHUNKS;
+#ifdef INF_ORBS
+  const uint32_t has_extras = 1;
+#else
+  const uint32_t has_extras = 0;
+#endif
+  prefix.append(reinterpret_cast<const char*>(&n_chunks), sizeof(n_chunks));
+  prefix.append(reinterpret_cast<const char*>(&has_extras), sizeof(has_extras));
+  return prefix;
+}
+
+inline void WfFile::append_varint(std::string& str, size_t value) {
+  while (value >= 0x80) {
+    str.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  str.push_back(static_cast<char>(value));
+}
+
+inline size_t WfFile::read_varint(const char*& ptr) {
+  size_t value = 0;
+  for (unsigned shift = 0;; shift += 7) {
+    const unsigned char byte = *ptr++;
+    value |= static_cast<size_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) return value;
+  }
+}
+
+// The number of flipped orbitals, then the gaps between them in increasing order.
+inline void WfFile::append_flips(std::string& str, const HalfDet& prev, const HalfDet& half_det) {
+  const auto& prev_orbs = prev.get_occupied_orbs();
+  const auto& orbs = half_det.get_occupied_orbs();
+  std::vector<unsigned> flips;
+  std::set_symmetric_difference(
+      prev_orbs.begin(), prev_orbs.end(), orbs.begin(), orbs.end(), std::back_inserter(flips));
+  append_varint(str, flips.size());
+  unsigned prev_flip = 0;
+  for (const unsigned orb : flips) {
+    append_varint(str, orb - prev_flip);
+    prev_flip = orb;
+  }
+}
+
+inline void WfFile::read_flips(const char*& ptr, HalfDet& half_det) {
+  const size_t n_flips = read_varint(ptr);
+  unsigned orb = 0;
+  for (size_t i = 0; i < n_flips; i++) {
+    orb += read_varint(ptr);
+    if (half_det.has(orb)) {
+      half_det.unset(orb);
+    } else {
+      half_det.set(orb);
+    }
+  }
+}
+
+inline void WfFile::encode_dets(
+    std::string& str, const Det* dets, const size_t n_dets, const bool compress) {
+  if (!compress) {
+    str.append(reinterpret_cast<const char*>(dets), n_dets * sizeof(Det));
+    return;
+  }
+  Det prev;
+  for (size_t i = 0; i < n_dets; i++) {
+    append_flips(str, prev.up, dets[i].up);
+    append_flips(str, prev.dn, dets[i].dn);
+    prev = dets[i];
+  }
+}
+
+inline void WfFile::decode_dets(
+    const char* ptr, Det* dets, const size_t n_dets, const bool compress) {
+  if (!compress) {
+    std::memcpy(dets, ptr, n_dets * sizeof(Det));
+    return;
+  }
+  Det det;
+  for (size_t i = 0; i < n_dets; i++) {
+    read_flips(ptr, det.up);
+    read_flips(ptr, det.dn);
+    dets[i] = det;
+  }
+}
+
+inline void WfFile::write_at_all(
+    MPI_File file, const size_t offset, const char* data, const size_t n_bytes) {
+  unsigned long long n_calls = (n_bytes + MAX_IO_BYTES - 1) / MAX_IO_BYTES;
+  MPI_Allreduce(MPI_IN_PLACE, &n_calls, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, MPI_COMM_WORLD);
+  MPI_Status status;
+  for (size_t i = 0; i < n_calls; i++) {
+    const size_t begin = i * MAX_IO_BYTES < n_bytes ? i * MAX_IO_BYTES : n_bytes;
+    const size_t count = get_io_count(n_bytes - begin);
+    MPI_File_write_at_all(
+        file, offset + begin, const_cast<char*>(data) + begin, count, MPI_CHAR, &status);
+  }
+}
+
+inline void WfFile::read_at(MPI_File file, const size_t offset, char* data, const size_t n_bytes) {
+  MPI_Status status;
+  for (size_t begin = 0; begin < n_bytes; begin += MAX_IO_BYTES) {
+    const size_t count = get_io_count(n_bytes - begin);
+    MPI_File_read_at(file, offset + begin, data + begin, count, MPI_CHAR, &status);
+  }
+}
+
+inline void WfFile::broadcast_bytes(void* data, const size_t n_bytes, const int root) {
+  char* ptr = static_cast<char*>(data);
+  for (size_t begin = 0; begin < n_bytes; begin += MAX_IO_BYTES) {
+    const size_t count = get_io_count(n_bytes - begin);
+    MPI_Bcast(ptr + begin, count, MPI_CHAR, root, MPI_COMM_WORLD);
+  }
+}
@@ -0,0 +1,172 @@
+#include "wf_file.h"
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+struct TestSystem {
+  unsigned n_up = 0;
+
+  unsigned n_dn = 0;
+
+  std::vector<Det> dets;
+
+  std::vector<std::vector<double>> coefs;
+
+  double energy_hf = 0.0;
+
+  std::vector<double> energy_var;
+
+  template <class B>
+  void serialize(B& buf) const {
+    buf << n_up << n_dn << dets << coefs << energy_hf << energy_var;
+  }
+
+  template <class B>
+  void parse(B& buf) {
+    buf >> n_up >> n_dn >> dets >> coefs >> energy_hf >> energy_var;
+  }
+};
+
+void flip(HalfDet& half_det, const unsigned orb) {
+  if (half_det.has(orb)) {
+    half_det.unset(orb);
+  } else {
+    half_det.set(orb);
+  }
+}
+
+// Several chunks of dets close to each other, with decaying coefs of two states.
+TestSystem get_test_system() {
+  TestSystem system;
+  system.n_up = system.n_dn = 6;
+  system.energy_hf = -1.5;
+  system.energy_var = {-1.75, -1.25};
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<unsigned> orb(0, N_CHUNKS * 64 - 1);
+  const size_t n_dets = 150000;
+  Det det;
+  for (unsigned i = 0; i < system.n_up; i++) det.up.set(i);
+  for (unsigned i = 0; i < system.n_dn; i++) det.dn.set(i);
+  system.coefs.assign(2, std::vector<double>(n_dets));
+  for (size_t i = 0; i < n_dets; i++) {
+    if (i % 3 == 0) flip(det.up, orb(rng));
+    flip(det.dn, orb(rng));
+    system.dets.push_back(det);
+    system.coefs[0][i] = 1.0 / (1.0 + i);
+    system.coefs[1][i] = (i % 2 == 0 ? -0.5 : 0.5) / (1.0 + i);
+  }
+  return system;
+}
+
+void expect_same_system(const TestSystem& expected, const TestSystem& system) {
+  EXPECT_EQ(system.n_up, expected.n_up);
+  EXPECT_EQ(system.n_dn, expected.n_dn);
+  EXPECT_EQ(system.energy_hf, expected.energy_hf);
+  EXPECT_EQ(system.energy_var, expected.energy_var);
+  ASSERT_EQ(system.dets.size(), expected.dets.size());
+  EXPECT_EQ(system.coefs, expected.coefs);
+  for (size_t i = 0; i < expected.dets.size(); i++) {
+    ASSERT_EQ(system.dets[i], expected.dets[i]) << i;
+  }
+}
+}  // namespace
+
+TEST(WfFileTest, PlainRoundTrip) {
+  const auto& expected = get_test_system();
+  const std::string filename = "wf_file_test_plain.dat";
+  WfFile::save(expected, filename, false);
+  TestSystem system;
+  EXPECT_TRUE(WfFile::load(system, filename));
+  expect_same_system(expected, system);
+  EXPECT_EQ(WfFile::get_n_chunks(filename), static_cast<unsigned>(N_CHUNKS));
+  std::remove(filename.c_str());
+}
+
+TEST(WfFileTest, CompressedRoundTrip) {
+  const auto& expected = get_test_system();
+  const std::string filename = "wf_file_test_compressed.dat";
+  WfFile::save(expected, filename, true);
+  TestSystem system;
+  EXPECT_TRUE(WfFile::load(system, filename));
+  expect_same_system(expected, system);
+  EXPECT_EQ(WfFile::get_n_chunks(filename), 0u);
+  std::remove(filename.c_str());
+}
+
+TEST(WfFileTest, LoadsTopDets) {
+  const auto& full = get_test_system();
+  const std::string filename = "wf_file_test_top.dat";
+  WfFile::save(full, filename, true);
+  TestSystem system;
+  EXPECT_TRUE(WfFile::load(system, filename, 1.0e-3));
+  TestSystem expected = full;
+  expected.dets.resize(1000);
+  for (auto& coefs : expected.coefs) coefs.resize(1000);
+  expect_same_system(expected, system);
+  std::remove(filename.c_str());
+}
+
+TEST(WfFileTest, RejectsOtherFormats) {
+  const std::string filename = "wf_file_test_other.dat";
+  FILE* file = fopen(filename.c_str(), "wb");
+  fputs("not a sharded wavefunction", file);
+  fclose(file);
+  TestSystem system;
+  EXPECT_FALSE(WfFile::load(system, filename));
+  EXPECT_FALSE(WfFile::load(system, "wf_file_test_missing.dat"));
+  std::remove(filename.c_str());
+}
+
+TEST(WfFileTest, HpsRoundTrip) {
+  const auto& expected = get_test_system();
+  const std::string filename = "wf_file_test_hps.dat";
+  WfFile::save_hps(expected, filename);
+  TestSystem system;
+  EXPECT_FALSE(WfFile::load(system, filename));
+  EXPECT_TRUE(WfFile::load_hps(system, filename));
+  expect_same_system(expected, system);
+  EXPECT_EQ(WfFile::get_n_chunks(filename), static_cast<unsigned>(N_CHUNKS));
+  EXPECT_FALSE(WfFile::load_hps(system, "wf_file_test_missing.dat"));
+  std::remove(filename.c_str());
+}
+
+TEST(WfFileTest, LoadsHpsFilesWithoutLayout) {
+  const auto& expected = get_test_system();
+  const std::string filename = "wf_file_test_hps_old.dat";
+  {
+    std::ofstream file(filename, std::ofstream::binary);
+    hps::to_stream(expected, file);
+  }
+  TestSystem system;
+  EXPECT_TRUE(WfFile::load_hps(system, filename));
+  expect_same_system(expected, system);
+  std::remove(filename.c_str());
+}
+
+TEST(WfFileTest, RejectsHpsFilesOfAnotherNChunks) {
+  const std::string filename = "wf_file_test_hps_other.dat";
+  WfFile::save_hps(get_test_system(), filename);
+  {
+    // As saved by the build of another N_CHUNKS, whose dets hps writes in as many words.
+    std::fstream file(filename, std::fstream::binary | std::fstream::in | std::fstream::out);
+    const uint32_t n_chunks = N_CHUNKS + 1;
+    file.seekp(8);
+    file.write(reinterpret_cast<const char*>(&n_chunks), sizeof(n_chunks));
+  }
+  EXPECT_EQ(WfFile::get_n_chunks(filename), static_cast<unsigned>(N_CHUNKS + 1));
+  TestSystem system;
+  try {
+    WfFile::load_hps(system, filename);
+    ADD_FAILURE() << "loaded dets of another N_CHUNKS";
+  } catch (const std::invalid_argument& error) {
+    EXPECT_NE(std::string(error.what()).find("N_CHUNKS"), std::string::npos) << error.what();
+  }
+  EXPECT_TRUE(system.dets.empty());
+  std::remove(filename.c_str());
+}
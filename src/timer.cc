@@ -1,5 +1,10 @@
 #include "timer.h"
 
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <json/single_include/nlohmann/json.hpp>
+#include "config.h"
 #include "parallel.h"
 #include "util.h"
 
@@ -17,6 +22,9 @@ Timer::Timer() {
   init_time = prev_time = now;
   is_master = Parallel::get_proc_id() == 0;
   init_mem = Util::get_mem_avail();
+  prev_cpu_time = get_cpu_time();
+  prev_mem = 0.0;
+  nodes.resize(1);
   if (is_master) {
     printf("Timing format: [DIFF/SECTION/TOTAL]\n");
   }
@@ -27,6 +35,10 @@ void Timer::start(const std::string& event) {
   const auto& now = std::chrono::high_resolution_clock::now();
   auto& instance = get_instance();
   instance.start_times.push_back(std::make_pair(event, now));
+  const size_t parent = instance.start_nodes.empty() ? 0 : instance.start_nodes.back();
+  instance.start_nodes.push_back(instance.get_child(parent, event));
+  instance.start_cpu_times.push_back(get_cpu_time());
+  instance.start_mems.push_back(instance.get_mem_used());
   if (instance.is_master) {
     printf("\nBEG OF ");
     instance.print_status();
@@ -34,6 +46,8 @@ void Timer::start(const std::string& event) {
     instance.print_time();
   }
   instance.prev_time = now;
+  instance.prev_cpu_time = instance.start_cpu_times.back();
+  instance.prev_mem = instance.start_mems.back();
 }
 
 void Timer::checkpoint(const std::string& event) {
@@ -45,7 +59,16 @@ void Timer::checkpoint(const std::string& event) {
     instance.print_mem();
     instance.print_time();
   }
+  const size_t parent = instance.start_nodes.empty() ? 0 : instance.start_nodes.back();
+  instance.add_to_node(
+      instance.get_child(parent, event),
+      instance.prev_time,
+      now,
+      instance.prev_cpu_time,
+      instance.prev_mem);
   instance.prev_time = now;
+  instance.prev_cpu_time = get_cpu_time();
+  instance.prev_mem = instance.get_mem_used();
 }
 
 void Timer::end() {
@@ -58,8 +81,20 @@ void Timer::end() {
     instance.print_mem();
     instance.print_time();
   }
+  instance.add_to_node(
+      instance.start_nodes.back(),
+      instance.start_times.back().second,
+      now,
+      instance.start_cpu_times.back(),
+      instance.start_mems.back());
   instance.start_times.pop_back();
+  instance.start_nodes.pop_back();
+  instance.start_cpu_times.pop_back();
+  instance.start_mems.pop_back();
+  if (instance.start_nodes.empty()) instance.write_profile();
   instance.prev_time = now;
+  instance.prev_cpu_time = get_cpu_time();
+  instance.prev_mem = instance.get_mem_used();
 }
 
 void Timer::print_status() const {
@@ -93,3 +128,74 @@ double Timer::get_duration(
     const std::chrono::high_resolution_clock::time_point end) const {
   return (std::chrono::duration_cast<std::chrono::duration<double>>(end - start)).count();
 }
+
+size_t Timer::get_child(const size_t node_id, const std::string& name) {
+  for (const size_t child_id : nodes[node_id].children) {
+    if (nodes[child_id].name == name) return child_id;
+  }
+  nodes.push_back(Node());
+  nodes.back().name = name;
+  nodes[node_id].children.push_back(nodes.size() - 1);
+  return nodes.size() - 1;
+}
+
+void Timer::add_to_node(
+    const size_t node_id,
+    const std::chrono::high_resolution_clock::time_point start,
+    const std::chrono::high_resolution_clock::time_point end,
+    const double cpu_start,
+    const double mem_start) {
+  auto& node = nodes[node_id];
+  node.n_calls++;
+  node.wall_time += get_duration(start, end);
+  node.cpu_time += get_cpu_time() - cpu_start;
+  node.mem_delta += get_mem_used() - mem_start;
+}
+
+void Timer::write_profile() const {
+  const auto& filename = Config::get<std::string>("profile_file", "");
+  if (filename.empty()) return;
+
+  // The events are collective, so every proc has the same tree.
+  const size_t n_nodes = nodes.size();
+  std::vector<double> values(n_nodes * 3);
+  for (size_t i = 0; i < n_nodes; i++) {
+    values[i * 3] = nodes[i].wall_time;
+    values[i * 3 + 1] = nodes[i].cpu_time;
+    values[i * 3 + 2] = nodes[i].mem_delta;
+  }
+  std::vector<double> maxs(n_nodes * 3);
+  std::vector<double> mins(n_nodes * 3);
+  MPI_Allreduce(values.data(), maxs.data(), n_nodes * 3, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  MPI_Allreduce(values.data(), mins.data(), n_nodes * 3, MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD);
+  if (!is_master) return;
+
+  // Times in seconds and memory in GB.
+  const char* keys[] = {"wall", "cpu", "mem_delta"};
+  const double scales[] = {1.0, 1.0, 1.0e-9};
+  const std::function<nlohmann::json(const size_t)> to_json = [&](const size_t node_id) {
+    const auto& node = nodes[node_id];
+    nlohmann::json res;
+    res["name"] = node.name;
+    res["calls"] = node.n_calls;
+    for (size_t k = 0; k < 3; k++) {
+      res[keys[k]]["max"] = maxs[node_id * 3 + k] * scales[k];
+      res[keys[k]]["min"] = mins[node_id * 3 + k] * scales[k];
+    }
+    for (const size_t child_id : node.children) res["events"].push_back(to_json(child_id));
+    return res;
+  };
+  nlohmann::json profile;
+  profile["n_procs"] = Parallel::get_n_procs();
+  profile["n_threads"] = Parallel::get_n_threads();
+  profile["total"] = get_duration(init_time, std::chrono::high_resolution_clock::now());
+  for (const size_t child_id : nodes[0].children) profile["events"].push_back(to_json(child_id));
+  std::ofstream profile_file(filename);
+  profile_file << profile.dump(2) << std::endl;
+}
+
+double Timer::get_cpu_time() { return static_cast<double>(std::clock()) / CLOCKS_PER_SEC; }
+
+double Timer::get_mem_used() const {
+  return static_cast<double>(init_mem) - static_cast<double>(Util::get_mem_avail());
+}
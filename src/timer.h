@@ -18,8 +18,42 @@ class Timer {
   static void end();
 
  private:
+  // Totals over the calls of the events with the same path, checkpoints included, as a tree in
+  // the order the events first happened.
+  struct Node {
+    std::string name;
+
+    std::vector<size_t> children;
+
+    size_t n_calls = 0;
+
+    double wall_time = 0.0;
+
+    double cpu_time = 0.0;
+
+    // Change of the memory used on this proc, in bytes.
+    double mem_delta = 0.0;
+  };
+
   Timer();
 
+  // Child of the node with the name, created if it is new.
+  size_t get_child(const size_t node_id, const std::string& name);
+
+  void add_to_node(
+      const size_t node_id,
+      const std::chrono::high_resolution_clock::time_point start,
+      const std::chrono::high_resolution_clock::time_point end,
+      const double cpu_start,
+      const double mem_start);
+
+  // Collective. Writes the tree with the max and min over the procs to profile_file, if set.
+  void write_profile() const;
+
+  static double get_cpu_time();
+
+  double get_mem_used() const;
+
   void print_status() const;
 
   void print_mem() const;
@@ -36,6 +70,20 @@ class Timer {
 
   std::vector<std::pair<std::string, std::chrono::high_resolution_clock::time_point>> start_times;
 
+  // Node, CPU time and memory used at the start of each open event.
+  std::vector<size_t> start_nodes;
+
+  std::vector<double> start_cpu_times;
+
+  std::vector<double> start_mems;
+
+  double prev_cpu_time;
+
+  double prev_mem;
+
+  // nodes[0] is the root.
+  std::vector<Node> nodes;
+
   size_t init_mem;
 
   bool is_master;
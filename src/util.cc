@@ -121,10 +121,6 @@ namespace Util{
     return hash;
   }
   
-  int ctz(unsigned long long x) { return __builtin_ctzll(x); }
-  
-  int popcnt(unsigned long long x) { return __builtin_popcountll(x); }
-  
   void setup_alias_arrays(
       const std::vector<double>& old_probs,
       std::vector<double>& new_probs,
@@ -195,4 +191,9 @@ namespace Util{
   size_t get_mem_total() { return get_mem_info("MemTotal") * 1000; }
   
   size_t get_mem_avail() { return get_mem_info("MemAvailable") * 1000; }
+
+  void first_touch(double* data, const size_t n) {
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < n; i++) data[i] = 0.0;
+  }
 }
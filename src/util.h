@@ -5,6 +5,7 @@
 #include <complex>
 #include <cstdio>
 #include <memory>
+#include <streambuf>
 #include <string>
 #include <utility>
 #include <vector>
@@ -31,9 +32,10 @@ namespace Util {
 
    size_t rehash(const size_t a);
 
-   int ctz(unsigned long long x);
+   // Inline, they sit in the innermost loops of the det operations.
+   inline int ctz(unsigned long long x) { return __builtin_ctzll(x); }
 
-   int popcnt(unsigned long long x);
+   inline int popcnt(unsigned long long x) { return __builtin_popcountll(x); }
 
    void setup_alias_arrays(const std::vector<double>& old_probs, std::vector<double>& new_probs, std::vector<size_t>& aliases);
 
@@ -41,6 +43,10 @@ namespace Util {
 
    size_t get_mem_avail();
 
+   // Zero the n values in the order of the static OpenMP schedules, so that with bound threads
+   // each page lands on the NUMA node of the thread working on it. For uninitialized storage.
+   void first_touch(double* data, const size_t n);
+
   template <class T>
    void free(T& t);
 
@@ -58,6 +64,28 @@ namespace Util {
   constexpr  double SQRT2 = 1.4142135623730951;
 
   constexpr  double SQRT2_INV = 0.7071067811865475;
+
+  // Output stream buffer that only keeps the FNV-1a hash of the bytes written to it.
+  class HashBuf : public std::streambuf {
+   public:
+    size_t get_hash() const { return hash; }
+
+   protected:
+    int_type overflow(int_type c) override {
+      if (c != traits_type::eof()) add(static_cast<unsigned char>(c));
+      return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+      for (std::streamsize i = 0; i < n; i++) add(static_cast<unsigned char>(s[i]));
+      return n;
+    }
+
+   private:
+    size_t hash = 14695981039346656037ull;
+
+    void add(const unsigned char c) { hash = (hash ^ c) * 1099511628211ull; }
+  };
 };
 
 template <typename... Args>